@@ -0,0 +1,96 @@
+#!/usr/bin/env bash
+#
+# Move pgs between op shards while a client checks that every op is
+# acked in order and reads back what it wrote.
+#
+
+source $CEPH_ROOT/qa/standalone/ceph-helpers.sh
+
+function run() {
+    local dir=$1
+    shift
+
+    export CEPH_MON="127.0.0.1:7232" # git grep '\<7232\>' : there must be only one
+    export CEPH_ARGS
+    CEPH_ARGS+="--fsid=$(uuidgen) --auth-supported=none "
+    CEPH_ARGS+="--mon-host=$CEPH_MON "
+    local funcs=${@:-$(set | sed -n -e 's/^\(TEST_[0-9a-z_]*\) .*/\1/p')}
+    for func in $funcs ; do
+        setup $dir || return 1
+        $func $dir || return 1
+        teardown $dir || return 1
+    done
+}
+
+function move_pg_shard() {
+    local pgid=$1
+    local shard=$2
+
+    CEPH_ARGS='' ceph --format=json --admin-daemon $(get_asok_path osd.0) \
+        move_pg_shard $pgid $shard
+}
+
+function TEST_move_pg_shard_under_load() {
+    local dir=$1
+    local poolname=test
+    local num_pgs=8
+    local num_shards=4
+
+    run_mon $dir a || return 1
+    run_mgr $dir x || return 1
+    # a long interval and a high threshold keep the balancer out of the
+    # way; it only has to be on for pgs to be movable
+    run_osd $dir 0 --osd_op_num_shards=$num_shards \
+        --osd_op_num_threads_per_shard=2 \
+        --osd_op_shard_rebalance_interval=3600 \
+        --osd_op_shard_rebalance_threshold=100 || return 1
+    create_pool $poolname $num_pgs $num_pgs || return 1
+    ceph osd pool set $poolname size 1 --yes-i-really-mean-it || return 1
+    wait_for_clean || return 1
+    local poolid=$(ceph osd dump --format=json | \
+        jq '.pools[] | select(.pool_name == "'$poolname'") | .pool')
+
+    # balancing is turned on by the first tick
+    local pgid=$poolid.0
+    for ((i = 0; i < 30; i++)); do
+        move_pg_shard $pgid 0 > /dev/null 2>&1 && break
+        sleep 1
+    done
+    move_pg_shard $pgid 0 || return 1
+
+    # few objects so every pg sees a steady stream of ordered ops
+    ceph_test_rados --pool $poolname --max-ops 4000 --objects 16 \
+        --max-in-flight 64 --size 65536 \
+        --min-stride-size 1024 --max-stride-size 16384 \
+        --op read 100 --op write 100 --op append 50 --op delete 10 \
+        > $dir/test_rados.log 2>&1 &
+    local pid=$!
+
+    local moves=0
+    while kill -0 $pid 2> /dev/null ; do
+        for ((ps = 0; ps < num_pgs; ps++)); do
+            local shard=$((RANDOM % num_shards))
+            if move_pg_shard $poolid.$(printf %x $ps) $shard | \
+                    jq -e '.moved' > /dev/null ; then
+                moves=$((moves + 1))
+            fi
+        done
+    done
+    if ! wait $pid ; then
+        tail -50 $dir/test_rados.log
+        return 1
+    fi
+    echo "moved pgs between shards $moves times"
+    test $moves -gt 0 || return 1
+
+    local counted=$(CEPH_ARGS='' ceph --format=json \
+        --admin-daemon $(get_asok_path osd.0) perf dump osd | \
+        jq '.osd.pg_shard_moves')
+    test $counted -ge $moves || return 1
+}
+
+main osd-shard-move "$@"
+
+# Local Variables:
+# compile-command: "make -j4 && ../qa/run-standalone.sh osd-shard-move.sh"
+# End:
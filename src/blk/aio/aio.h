@@ -103,6 +103,12 @@ struct io_queue_t {
   virtual int submit_batch(aio_iter begin, aio_iter end, uint16_t aios_size,
 			   void *priv, int *retries) = 0;
   virtual int get_next_completed(int timeout_ms, aio_t **paio, int max) = 0;
+  /// get a buffer the queue can do IO against cheaply (e.g. registered with
+  /// the kernel); -ENOBUFS if all of them are in use, -EOPNOTSUPP if it
+  /// has none that fits
+  virtual int get_io_buffer(unsigned len, ceph::buffer::ptr *out) {
+    return -EOPNOTSUPP;
+  }
 };
 
 struct aio_queue_t final : public io_queue_t {
@@ -70,7 +70,13 @@ KernelDevice::KernelDevice(CephContext* cct, aio_callback_t cb, void *cbpriv, ai
   unsigned int iodepth = cct->_conf->bdev_aio_max_queue_depth;
 
   if (use_ioring && ioring_queue_t::supported()) {
-    io_queue = std::make_unique<ioring_queue_t>(iodepth);
+    io_queue = std::make_unique<ioring_queue_t>(
+      iodepth,
+      cct->_conf.get_val<bool>("bdev_ioring_hipri"),
+      cct->_conf.get_val<bool>("bdev_ioring_sqthread_poll"),
+      cct->_conf.get_val<uint64_t>("bdev_ioring_sqthread_idle_ms"),
+      cct->_conf.get_val<uint64_t>("bdev_ioring_fixed_buffers"),
+      cct->_conf.get_val<Option::size_t>("bdev_ioring_fixed_buffer_size"));
   } else {
     static bool once;
     if (use_ioring && !once) {
@@ -240,6 +246,7 @@ int KernelDevice::open(const string& p)
     goto out_fail;
   }
   _discard_start();
+  _init_logger();
 
   // round size down to an even block
   size &= ~(block_size - 1);
@@ -287,6 +294,7 @@ void KernelDevice::close()
   dout(1) << __func__ << dendl;
   _aio_stop();
   _discard_stop();
+  _shutdown_logger();
 
   if (vdo_fd >= 0) {
     VOID_TEMP_FAILURE_RETRY(::close(vdo_fd));
@@ -305,6 +313,28 @@ void KernelDevice::close()
   path.clear();
 }
 
+void KernelDevice::_init_logger()
+{
+  // one per device of a store (block, block.db, block.wal)
+  string name = "bdev-" + path.substr(path.find_last_of('/') + 1);
+  PerfCountersBuilder b(cct, name, l_bdev_first, l_bdev_last);
+  b.add_u64_counter(l_bdev_read_fixed, "read_fixed",
+		    "Reads done through a buffer registered with io_uring");
+  b.add_u64_counter(l_bdev_read_fixed_exhausted, "read_fixed_exhausted",
+		    "Reads that found all registered io_uring buffers in use");
+  b.add_u64_counter(l_bdev_write_fixed, "write_fixed",
+		    "Writes done through a buffer registered with io_uring");
+  logger = b.create_perf_counters();
+  cct->get_perfcounters_collection()->add(logger);
+}
+
+void KernelDevice::_shutdown_logger()
+{
+  cct->get_perfcounters_collection()->remove(logger);
+  delete logger;
+  logger = nullptr;
+}
+
 int KernelDevice::collect_metadata(const string& prefix, map<string,string> *pm) const
 {
   (*pm)[prefix + "support_discard"] = stringify((int)(bool)support_discard);
@@ -913,6 +943,29 @@ int KernelDevice::write(
   return _sync_write(off, bl, buffered, write_hint);
 }
 
+/*
+ * A write payload that isn't aligned has to be copied before it can go to
+ * the device anyway.  If it fits, copy it into a buffer registered with
+ * the queue instead of a fresh one, so that it is written with WRITE_FIXED
+ * and the kernel doesn't need to map the pages.
+ */
+bool KernelDevice::_copy_to_io_buffer(bufferlist& bl)
+{
+  if (!aio || !dio || bl.length() == 0 ||
+      bl.is_aligned_size_and_memory(block_size, block_size)) {
+    return false;
+  }
+  bufferptr p;
+  if (io_queue->get_io_buffer(bl.length(), &p) < 0) {
+    return false;
+  }
+  bl.begin().copy(bl.length(), p.c_str());
+  bl.clear();
+  bl.append(std::move(p));
+  logger->inc(l_bdev_write_fixed);
+  return true;
+}
+
 int KernelDevice::aio_write(
   uint64_t off,
   bufferlist &bl,
@@ -931,7 +984,9 @@ int KernelDevice::aio_write(
     return 0;
   }
 
-  if ((!buffered || bl.get_num_buffers() >= IOV_MAX) &&
+  if (!buffered && _copy_to_io_buffer(bl)) {
+    dout(20) << __func__ << " copied buffer to a registered one" << dendl;
+  } else if ((!buffered || bl.get_num_buffers() >= IOV_MAX) &&
       bl.rebuild_aligned_size_and_memory(block_size, block_size, IOV_MAX)) {
     dout(20) << __func__ << " rebuilding buffer to be aligned" << dendl;
   }
@@ -1087,12 +1142,25 @@ int KernelDevice::aio_read(
     ioc->pending_aios.push_back(aio_t(ioc, fd_directs[WRITE_LIFE_NOT_SET]));
     ++ioc->num_pending;
     aio_t& aio = ioc->pending_aios.back();
-    bufferptr p = ceph::buffer::create_small_page_aligned(len);
-    aio.bl.append(std::move(p));
+    // prefer reading into a buffer pre-registered with the kernel.  it is
+    // handed to the caller as is and returns to the queue's pool once the
+    // last reference to it goes away; while the pool is used up (e.g. by
+    // buffers held in the cache) reads go through regular buffers.
+    bufferptr p;
+    int fr = io_queue->get_io_buffer(len, &p);
+    if (fr == 0) {
+      logger->inc(l_bdev_read_fixed);
+    } else {
+      if (fr == -ENOBUFS) {
+	logger->inc(l_bdev_read_fixed_exhausted);
+      }
+      p = ceph::buffer::create_small_page_aligned(len);
+    }
+    aio.bl.append(p);
     aio.bl.prepare_iov(&aio.iov);
     aio.preadv(off, len);
     dout(30) << aio << dendl;
-    pbl->append(aio.bl);
+    pbl->append(std::move(p));
     dout(5) << __func__ << " 0x" << std::hex << off << "~" << len
 	    << std::dec << " aio " << &aio << dendl;
   } else
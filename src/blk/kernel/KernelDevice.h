@@ -21,12 +21,21 @@
 #include "include/interval_set.h"
 #include "common/Thread.h"
 #include "include/utime.h"
+#include "common/perf_counters.h"
 
 #include "aio/aio.h"
 #include "BlockDevice.h"
 
 #define RW_IO_MAX (INT_MAX & CEPH_PAGE_MASK)
 
+enum {
+  l_bdev_first = 732800,
+  l_bdev_read_fixed,
+  l_bdev_read_fixed_exhausted,
+  l_bdev_write_fixed,
+  l_bdev_last,
+};
+
 
 class KernelDevice : public BlockDevice {
   std::vector<int> fd_directs, fd_buffereds;
@@ -46,6 +55,7 @@ class KernelDevice : public BlockDevice {
   ceph::mutex flush_mutex = ceph::make_mutex("KernelDevice::flush_mutex");
 
   std::unique_ptr<io_queue_t> io_queue;
+  PerfCounters *logger = nullptr;
   aio_callback_t discard_callback;
   void *discard_callback_priv;
   bool aio_stop;
@@ -85,6 +95,9 @@ class KernelDevice : public BlockDevice {
   int _aio_start();
   void _aio_stop();
 
+  void _init_logger();
+  void _shutdown_logger();
+
   int _discard_start();
   void _discard_stop();
 
@@ -92,6 +105,7 @@ class KernelDevice : public BlockDevice {
   void _aio_log_finish(IOContext *ioc, uint64_t offset, uint64_t length);
 
   int _sync_write(uint64_t off, ceph::buffer::list& bl, bool buffered, int write_hint);
+  bool _copy_to_io_buffer(ceph::buffer::list& bl);
 
   int _lock();
 
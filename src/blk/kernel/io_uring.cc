@@ -7,18 +7,93 @@
 
 #include "liburing.h"
 #include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+#include "common/deleter.h"
+
+/*
+ * A set of equally sized, page aligned buffers registered with the ring
+ * (io_uring_register_buffers). IO against them is issued with
+ * READ_FIXED/WRITE_FIXED so the kernel doesn't have to pin and map the
+ * user pages on every request. Buffers are handed out as bufferptrs whose
+ * deleter puts them back into the free list; the pool is refcounted so
+ * outstanding buffers keep it alive after the queue is shut down. Read
+ * buffers are passed on to the caller and only come back once it drops
+ * them, so the pool may run dry; callers then use regular buffers.
+ */
+struct ioring_buffer_pool {
+  char *base = nullptr;
+  unsigned buf_size = 0;
+  unsigned count = 0;
+  std::mutex lock;
+  std::vector<unsigned> free_list;
+
+  ioring_buffer_pool(unsigned count_, unsigned buf_size_)
+    : buf_size(buf_size_), count(count_) {
+    void *p = nullptr;
+    if (::posix_memalign(&p, CEPH_PAGE_SIZE, (size_t)count * buf_size) == 0) {
+      base = static_cast<char*>(p);
+      free_list.reserve(count);
+      for (unsigned i = count; i > 0; --i) {
+	free_list.push_back(i - 1);
+      }
+    }
+  }
+  ~ioring_buffer_pool() {
+    ::free(base);
+  }
 
-/* Options */
+  std::vector<struct iovec> get_iovecs() const {
+    std::vector<struct iovec> iov(count);
+    for (unsigned i = 0; i < count; ++i) {
+      iov[i].iov_base = base + (size_t)i * buf_size;
+      iov[i].iov_len = buf_size;
+    }
+    return iov;
+  }
 
-static bool hipri = false;      /* use IO polling */
-static bool sq_thread = false;  /* use kernel submission/poller thread */
+  /// index of the registered buffer containing [p, p+len) or -1
+  int find(const void *p, size_t len) const {
+    const char *c = static_cast<const char*>(p);
+    if (c < base || c >= base + (size_t)count * buf_size) {
+      return -1;
+    }
+    size_t idx = (c - base) / buf_size;
+    if (c + len > base + (idx + 1) * buf_size) {
+      return -1;
+    }
+    return idx;
+  }
+};
 
 struct ioring_data {
   struct io_uring io_uring;
   pthread_mutex_t cq_mutex;
-  pthread_mutex_t sq_mutex;
   int epoll_fd = -1;
   std::map<int, int> fixed_fds_map;
+  std::shared_ptr<ioring_buffer_pool> buffers;
+  bool iopoll = false;  ///< completions have to be polled for
+
+  /// a caller's batch, until whoever is submitting has submitted it
+  struct pending_batch {
+    std::list<aio_t>::iterator beg, end;
+    void *priv;
+    int r = 0;
+    bool done = false;
+  };
+  std::mutex pending_lock;
+  std::condition_variable pending_cond;
+  std::vector<pending_batch*> pending;
+  bool submitting = false;
+
+  std::atomic<unsigned> inflight = {0};
+  /// signalled when IOs are submitted to a ring that is polled
+  std::mutex inflight_lock;
+  std::condition_variable inflight_cond;
 };
 
 static int ioring_get_cqe(struct ioring_data *d, unsigned int max,
@@ -39,6 +114,7 @@ static int ioring_get_cqe(struct ioring_data *d, unsigned int max,
       break;
   }
   io_uring_cq_advance(ring, nr);
+  d->inflight -= nr;
 
   return nr;
 }
@@ -59,44 +135,70 @@ static void init_sqe(struct ioring_data *d, struct io_uring_sqe *sqe,
 
   ceph_assert(fixed_fd != -1);
 
-  if (io->iocb.aio_lio_opcode == IO_CMD_PWRITEV)
-    io_uring_prep_writev(sqe, fixed_fd, &io->iov[0],
-			 io->iov.size(), io->offset);
-  else if (io->iocb.aio_lio_opcode == IO_CMD_PREADV)
-    io_uring_prep_readv(sqe, fixed_fd, &io->iov[0],
-			io->iov.size(), io->offset);
-  else
+  int buf_index = -1;
+  if (d->buffers && io->iov.size() == 1) {
+    buf_index = d->buffers->find(io->iov[0].iov_base, io->iov[0].iov_len);
+  }
+
+  if (io->iocb.aio_lio_opcode == IO_CMD_PWRITEV) {
+    if (buf_index >= 0)
+      io_uring_prep_write_fixed(sqe, fixed_fd, io->iov[0].iov_base,
+				io->iov[0].iov_len, io->offset, buf_index);
+    else
+      io_uring_prep_writev(sqe, fixed_fd, &io->iov[0],
+			   io->iov.size(), io->offset);
+  } else if (io->iocb.aio_lio_opcode == IO_CMD_PREADV) {
+    if (buf_index >= 0)
+      io_uring_prep_read_fixed(sqe, fixed_fd, io->iov[0].iov_base,
+			       io->iov[0].iov_len, io->offset, buf_index);
+    else
+      io_uring_prep_readv(sqe, fixed_fd, &io->iov[0],
+			  io->iov.size(), io->offset);
+  } else
     ceph_assert(0);
 
   io_uring_sqe_set_data(sqe, io);
   io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
 }
 
+/*
+ * Put [beg, end) into the SQ ring. If the ring is full, what's been
+ * queued so far is submitted to make room and we back off a bit, the
+ * same way aio_queue_t does on EAGAIN.
+ */
 static int ioring_queue(struct ioring_data *d, void *priv,
-			list<aio_t>::iterator beg, list<aio_t>::iterator end)
+			list<aio_t>::iterator beg, list<aio_t>::iterator end,
+			int *retries)
 {
   struct io_uring *ring = &d->io_uring;
-  struct aio_t *io = nullptr;
+  int attempts = 16;
+  int delay = 125;
 
   ceph_assert(beg != end);
 
-  do {
+  while (beg != end) {
     struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
-    if (!sqe)
-      break;
-
-    io = &*beg;
+    if (!sqe) {
+      int r = io_uring_submit(ring);
+      if (r < 0)
+	return r;
+      if (r == 0) {
+	if (--attempts < 0)
+	  return -EAGAIN;
+	(*retries)++;
+	usleep(delay);
+	delay *= 2;
+      }
+      continue;
+    }
+
+    struct aio_t *io = &*beg;
     io->priv = priv;
-
     init_sqe(d, sqe, io);
-
-  } while (++beg != end);
-
-  if (!io)
-    /* Queue is full, go and reap something first */
-    return 0;
-
-  return io_uring_submit(ring);
+    ++d->inflight;
+    ++beg;
+  }
+  return 0;
 }
 
 static void build_fixed_fds_map(struct ioring_data *d,
@@ -108,9 +210,17 @@ static void build_fixed_fds_map(struct ioring_data *d,
   }
 }
 
-ioring_queue_t::ioring_queue_t(unsigned iodepth_) :
+ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool hipri_, bool sq_thread_,
+			       unsigned sq_thread_idle_ms_,
+			       unsigned fixed_buffers_,
+			       unsigned fixed_buffer_size_) :
   d(make_unique<ioring_data>()),
-  iodepth(iodepth_)
+  iodepth(iodepth_),
+  hipri(hipri_),
+  sq_thread(sq_thread_),
+  sq_thread_idle_ms(sq_thread_idle_ms_),
+  fixed_buffers(fixed_buffers_),
+  fixed_buffer_size(p2roundup(fixed_buffer_size_, (unsigned)CEPH_PAGE_SIZE))
 {
 }
 
@@ -118,22 +228,50 @@ ioring_queue_t::~ioring_queue_t()
 {
 }
 
+static void register_buffers(struct ioring_data *d, unsigned count,
+			     unsigned size)
+{
+  if (!count || !size)
+    return;
+  auto pool = std::make_shared<ioring_buffer_pool>(count, size);
+  if (!pool->base)
+    return;
+  auto iov = pool->get_iovecs();
+  // this needs RLIMIT_MEMLOCK to cover the pool; if it doesn't we just
+  // carry on with regular buffers
+  if (io_uring_register_buffers(&d->io_uring, iov.data(), iov.size()) < 0)
+    return;
+  d->buffers = std::move(pool);
+}
+
 int ioring_queue_t::init(std::vector<int> &fds)
 {
-  unsigned flags = 0;
+  struct io_uring_params params;
 
   pthread_mutex_init(&d->cq_mutex, NULL);
-  pthread_mutex_init(&d->sq_mutex, NULL);
 
+  memset(&params, 0, sizeof(params));
   if (hipri)
-    flags |= IORING_SETUP_IOPOLL;
-  if (sq_thread)
-    flags |= IORING_SETUP_SQPOLL;
+    params.flags |= IORING_SETUP_IOPOLL;
+  if (sq_thread) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = sq_thread_idle_ms;
+  }
 
-  int ret = io_uring_queue_init(iodepth, &d->io_uring, flags);
+  int ret = io_uring_queue_init_params(iodepth, &d->io_uring, &params);
+  if (ret < 0 && sq_thread) {
+    // SQPOLL needs CAP_SYS_ADMIN on older kernels, don't fail because of it
+    sq_thread = false;
+    params.flags &= ~IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = 0;
+    ret = io_uring_queue_init_params(iodepth, &d->io_uring, &params);
+  }
   if (ret < 0)
     return ret;
 
+  // with SQPOLL the kernel thread reaps polled completions for us
+  d->iopoll = hipri && !sq_thread;
+
   ret = io_uring_register_files(&d->io_uring,
 			  &fds[0], fds.size());
   if (ret < 0) {
@@ -142,6 +280,7 @@ int ioring_queue_t::init(std::vector<int> &fds)
   }
 
   build_fixed_fds_map(d.get(), fds);
+  register_buffers(d.get(), fixed_buffers, fixed_buffer_size);
 
   d->epoll_fd = epoll_create1(0);
   if (d->epoll_fd < 0) {
@@ -162,6 +301,7 @@ int ioring_queue_t::init(std::vector<int> &fds)
 close_epoll_fd:
   close(d->epoll_fd);
 close_ring_fd:
+  d->buffers.reset();
   io_uring_queue_exit(&d->io_uring);
 
   return ret;
@@ -172,21 +312,99 @@ void ioring_queue_t::shutdown()
   d->fixed_fds_map.clear();
   close(d->epoll_fd);
   d->epoll_fd = -1;
+  // buffers still referenced by bufferptrs stay allocated until released
+  d->buffers.reset();
   io_uring_queue_exit(&d->io_uring);
 }
 
+/*
+ * Put the IOs of all batches into the SQ ring and enter the kernel once,
+ * setting the result of each batch. If a batch cannot be queued, neither
+ * it nor the batches after it are submitted and all of them fail. IOs of
+ * that batch which made it into the ring are submitted nonetheless, as
+ * there is no way to take them back; KernelDevice treats any submission
+ * error as fatal anyway.
+ */
+static void ioring_submit(struct ioring_data *d,
+			  std::vector<ioring_data::pending_batch*> &batches,
+			  int *retries)
+{
+  int r = 0;
+  auto p = batches.begin();
+  for (; p != batches.end(); ++p) {
+    r = ioring_queue(d, (*p)->priv, (*p)->beg, (*p)->end, retries);
+    if (r < 0)
+      break;
+  }
+  int s = io_uring_submit(&d->io_uring);
+  for (auto q = batches.begin(); q != batches.end(); ++q) {
+    if (q < p)
+      (*q)->r = s < 0 ? s : 0;
+    else
+      (*q)->r = r;
+  }
+  if (d->iopoll && s > 0) {
+    std::lock_guard l(d->inflight_lock);
+    d->inflight_cond.notify_all();
+  }
+}
+
+/*
+ * Submission is flat-combined: every caller appends its batch to the
+ * pending list and one of them at a time takes all pending batches,
+ * filling the SQ ring with them and entering the kernel once.
+ * Concurrent submitters thus share a single io_uring_enter() rather
+ * than serializing on a mutex, one syscall each. Every caller returns
+ * only once its own batch has been submitted (or has failed).
+ */
 int ioring_queue_t::submit_batch(aio_iter beg, aio_iter end,
                                  uint16_t aios_size, void *priv,
                                  int *retries)
 {
-  (void)aios_size;
-  (void)retries;
+  ioring_data::pending_batch batch;
+  batch.beg = beg;
+  batch.end = end;
+  batch.priv = priv;
+
+  std::unique_lock l(d->pending_lock);
+  d->pending.push_back(&batch);
+  while (!batch.done) {
+    if (d->submitting) {
+      d->pending_cond.wait(l);
+      continue;
+    }
+    d->submitting = true;
+    std::vector<ioring_data::pending_batch*> batches;
+    batches.swap(d->pending);
+    l.unlock();
+    ioring_submit(d.get(), batches, retries);
+    l.lock();
+    for (auto b : batches) {
+      b->done = true;
+    }
+    d->submitting = false;
+    d->pending_cond.notify_all();
+  }
 
-  pthread_mutex_lock(&d->sq_mutex);
-  int rc = ioring_queue(d.get(), priv, beg, end);
-  pthread_mutex_unlock(&d->sq_mutex);
+  return batch.r < 0 ? batch.r : aios_size;
+}
 
-  return rc;
+/*
+ * With IORING_SETUP_IOPOLL the device doesn't raise interrupts, the
+ * completions only show up when someone asks the kernel to poll for them.
+ */
+static int ioring_poll_cqe(struct ioring_data *d, int timeout_ms)
+{
+  if (d->inflight == 0) {
+    // nothing to poll for until submit_batch() queues something
+    std::unique_lock l(d->inflight_lock);
+    if (!d->inflight_cond.wait_for(l, std::chrono::milliseconds(timeout_ms),
+				   [d] { return d->inflight > 0; }))
+      return 0;
+  }
+  int r = syscall(__NR_io_uring_enter, d->io_uring.ring_fd, 0, 1,
+		  IORING_ENTER_GETEVENTS, NULL, 0);
+  return r < 0 ? -errno : 1;
 }
 
 int ioring_queue_t::get_next_completed(int timeout_ms, aio_t **paio, int max)
@@ -197,10 +415,17 @@ get_cqe:
   pthread_mutex_unlock(&d->cq_mutex);
 
   if (events == 0) {
-    struct epoll_event ev;
-    int ret = epoll_wait(d->epoll_fd, &ev, 1, timeout_ms);
+    int ret;
+    if (d->iopoll) {
+      ret = ioring_poll_cqe(d.get(), timeout_ms);
+    } else {
+      struct epoll_event ev;
+      ret = epoll_wait(d->epoll_fd, &ev, 1, timeout_ms);
+      if (ret < 0)
+	ret = -errno;
+    }
     if (ret < 0)
-      events = -errno;
+      events = ret;
     else if (ret > 0)
       /* Time to reap */
       goto get_cqe;
@@ -209,6 +434,30 @@ get_cqe:
   return events;
 }
 
+int ioring_queue_t::get_io_buffer(unsigned len, ceph::buffer::ptr *out)
+{
+  auto pool = d->buffers;
+  if (!pool || len > pool->buf_size)
+    return -EOPNOTSUPP;
+
+  unsigned idx;
+  {
+    std::lock_guard l(pool->lock);
+    if (pool->free_list.empty())
+      return -ENOBUFS;
+    idx = pool->free_list.back();
+    pool->free_list.pop_back();
+  }
+  char *p = pool->base + (size_t)idx * pool->buf_size;
+  *out = ceph::buffer::ptr(ceph::buffer::claim_buffer(
+    len, p,
+    make_deleter([pool, idx] {
+      std::lock_guard l(pool->lock);
+      pool->free_list.push_back(idx);
+    })));
+  return 0;
+}
+
 bool ioring_queue_t::supported()
 {
   struct io_uring ring;
@@ -224,7 +473,10 @@ bool ioring_queue_t::supported()
 
 struct ioring_data {};
 
-ioring_queue_t::ioring_queue_t(unsigned iodepth_)
+ioring_queue_t::ioring_queue_t(unsigned iodepth_, bool hipri_, bool sq_thread_,
+			       unsigned sq_thread_idle_ms_,
+			       unsigned fixed_buffers_,
+			       unsigned fixed_buffer_size_)
 {
   ceph_assert(0);
 }
@@ -256,6 +508,11 @@ int ioring_queue_t::get_next_completed(int timeout_ms, aio_t **paio, int max)
   ceph_assert(0);
 }
 
+int ioring_queue_t::get_io_buffer(unsigned len, ceph::buffer::ptr *out)
+{
+  ceph_assert(0);
+}
+
 bool ioring_queue_t::supported()
 {
   return false;
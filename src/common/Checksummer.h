@@ -7,6 +7,7 @@
 #include "include/buffer.h"
 #include "include/byteorder.h"
 #include "include/ceph_assert.h"
+#include "include/crc32c.h"
 
 #include "xxHash/xxhash.h"
 
@@ -90,6 +91,17 @@ public:
       ) {
       return p.crc32c(len, init_value);
     }
+    static void calc_many(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      const char *data,
+      size_t blocks,
+      init_value_t *out
+      ) {
+      ceph_crc32c_multi(init_value, (const unsigned char*)data, len, blocks,
+			out);
+    }
   };
 
   struct crc32c_16 {
@@ -111,6 +123,20 @@ public:
       ) {
       return p.crc32c(len, init_value) & 0xffff;
     }
+    static void calc_many(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      const char *data,
+      size_t blocks,
+      init_value_t *out
+      ) {
+      ceph_crc32c_multi(init_value, (const unsigned char*)data, len, blocks,
+			out);
+      for (size_t i = 0; i < blocks; ++i) {
+	out[i] &= 0xffff;
+      }
+    }
   };
 
   struct crc32c_8 {
@@ -132,6 +158,20 @@ public:
       ) {
       return p.crc32c(len, init_value) & 0xff;
     }
+    static void calc_many(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      const char *data,
+      size_t blocks,
+      init_value_t *out
+      ) {
+      ceph_crc32c_multi(init_value, (const unsigned char*)data, len, blocks,
+			out);
+      for (size_t i = 0; i < blocks; ++i) {
+	out[i] &= 0xff;
+      }
+    }
   };
 
   struct xxhash32 {
@@ -161,6 +201,18 @@ public:
       }
       return XXH32_digest(state);
     }
+    static void calc_many(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      const char *data,
+      size_t blocks,
+      init_value_t *out
+      ) {
+      for (size_t i = 0; i < blocks; ++i, data += len) {
+	out[i] = XXH32(data, len, init_value);
+      }
+    }
   };
 
   struct xxhash64 {
@@ -190,8 +242,54 @@ public:
       }
       return XXH64_digest(state);
     }
+    static void calc_many(
+      state_t state,
+      init_value_t init_value,
+      size_t len,
+      const char *data,
+      size_t blocks,
+      init_value_t *out
+      ) {
+      for (size_t i = 0; i < blocks; ++i, data += len) {
+	out[i] = XXH64(data, len, init_value);
+      }
+    }
   };
 
+  /// most blocks checksummed by a single calc_batch() call
+  static constexpr size_t MAX_BATCH = 16;
+
+  /**
+   * checksum up to MAX_BATCH of the blocks at p
+   *
+   * Blocks that lie in one contiguous buffer are handed to
+   * Alg::calc_many() together so that it can work on several of them at
+   * once; a block that straddles two buffers goes through Alg::calc().
+   *
+   * @return number of blocks done, between 1 and min(blocks, MAX_BATCH)
+   */
+  template<class Alg>
+  static size_t calc_batch(
+    typename Alg::state_t state,
+    typename Alg::init_value_t init_value,
+    size_t csum_block_size,
+    size_t blocks,
+    ceph::buffer::list::const_iterator& p,
+    typename Alg::init_value_t *out) {
+    blocks = std::min(blocks, MAX_BATCH);
+    const char *data;
+    auto q = p;
+    size_t n = q.get_ptr_and_advance(blocks * csum_block_size, &data) /
+      csum_block_size;
+    if (n == 0) {
+      out[0] = Alg::calc(state, init_value, csum_block_size, p);
+      return 1;
+    }
+    Alg::calc_many(state, init_value, csum_block_size, data, n, out);
+    p += n * csum_block_size;
+    return n;
+  }
+
   template<class Alg>
   static int calculate(
     size_t csum_block_size,
@@ -225,9 +323,15 @@ public:
     typename Alg::value_t *pv =
       reinterpret_cast<typename Alg::value_t*>(csum_data->c_str());
     pv += offset / csum_block_size;
-    while (blocks--) {
-      *pv = Alg::calc(state, init_value, csum_block_size, p);
-      ++pv;
+    typename Alg::init_value_t v[MAX_BATCH];
+    while (blocks > 0) {
+      size_t n = calc_batch<Alg>(state, init_value, csum_block_size, blocks,
+				 p, v);
+      for (size_t i = 0; i < n; ++i) {
+	*pv = v[i];
+	++pv;
+      }
+      blocks -= n;
     }
     Alg::fini(&state);
     return 0;
@@ -253,18 +357,22 @@ public:
       reinterpret_cast<const typename Alg::value_t*>(csum_data.c_str());
     pv += offset / csum_block_size;
     size_t pos = offset;
+    typename Alg::init_value_t v[MAX_BATCH];
     while (length > 0) {
-      typename Alg::init_value_t v = Alg::calc(state, -1, csum_block_size, p);
-      if (*pv != v) {
-	if (bad_csum) {
-	  *bad_csum = v;
+      size_t n = calc_batch<Alg>(state, -1, csum_block_size,
+				 length / csum_block_size, p, v);
+      for (size_t i = 0; i < n; ++i) {
+	if (*pv != v[i]) {
+	  if (bad_csum) {
+	    *bad_csum = v[i];
+	  }
+	  Alg::fini(&state);
+	  return pos;
 	}
-	Alg::fini(&state);
-	return pos;
+	++pv;
+	pos += csum_block_size;
+	length -= csum_block_size;
       }
-      ++pv;
-      pos += csum_block_size;
-      length -= csum_block_size;
     }
     Alg::fini(&state);
     return -1;  // no errors
@@ -77,6 +77,23 @@ static ceph::spinlock debug_lock;
     return buffer_missed_crc;
   }
 
+  // bytes memcpy'd into or out of buffers.  these are counted on every
+  // copy, so they are sharded by thread like the mempool stats.
+  static mempool::shard_t buffer_copied_bytes[mempool::num_shards];
+
+  static inline void note_copied_bytes(unsigned l) {
+    size_t me = (size_t)pthread_self();
+    size_t i = (me >> 3) & (mempool::num_shards - 1);
+    buffer_copied_bytes[i].bytes += l;
+  }
+  uint64_t buffer::get_copied_bytes() {
+    uint64_t r = 0;
+    for (auto& s : buffer_copied_bytes) {
+      r += s.bytes;
+    }
+    return r;
+  }
+
   /*
    * raw_combined is always placed within a single allocation along
    * with the data buffer.  the data goes at the beginning, and
@@ -280,6 +297,7 @@ static ceph::spinlock debug_lock;
   ceph::unique_leakable_ptr<buffer::raw> buffer::copy(const char *c, unsigned len) {
     auto r = buffer::create_aligned(len, sizeof(size_t));
     memcpy(r->get_data(), c, len);
+    note_copied_bytes(len);
     return r;
   }
 
@@ -546,6 +564,7 @@ static ceph::spinlock debug_lock;
         throw end_of_buffer();
     char* src =  _raw->get_data() + _off + o;
     maybe_inline_memcpy(dest, src, l, 8);
+    note_copied_bytes(l);
   }
 
   unsigned buffer::ptr::wasted() const
@@ -589,6 +608,7 @@ static ceph::spinlock debug_lock;
     ceph_assert(l <= unused_tail_length());
     char* c = _raw->get_data() + _off + _len;
     maybe_inline_memcpy(c, p, l, 32);
+    note_copied_bytes(l);
     _len += l;
     return _len + _off;
   }
@@ -613,6 +633,7 @@ static ceph::spinlock debug_lock;
     if (crc_reset)
         _raw->invalidate_crc();
     maybe_inline_memcpy(dest, src, l, 64);
+    note_copied_bytes(l);
   }
 
   void buffer::ptr::zero(bool crc_reset)
@@ -828,6 +849,7 @@ static ceph::spinlock debug_lock;
       if (len < howmuch)
 	howmuch = len;
       dest.append(c_str + p_off, howmuch);
+      note_copied_bytes(howmuch);
 
       len -= howmuch;
       *this += howmuch;
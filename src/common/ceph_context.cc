@@ -893,6 +893,9 @@ void CephContext::_enable_perf_counter()
   PerfCountersBuilder plb(this, "cct", l_cct_first, l_cct_last);
   plb.add_u64(l_cct_total_workers, "total_workers", "Total workers");
   plb.add_u64(l_cct_unhealthy_workers, "unhealthy_workers", "Unhealthy workers");
+  plb.add_u64_counter(l_cct_buffer_copied_bytes, "buffer_copied_bytes",
+		      "Bytes copied into or out of buffers", NULL, 0,
+		      unit_t(UNIT_BYTES));
   _cct_perf = plb.create_perf_counters();
   _perf_counters_collection->add(_cct_perf);
 
@@ -944,6 +947,7 @@ void CephContext::_refresh_perf_values()
   if (_cct_perf) {
     _cct_perf->set(l_cct_total_workers, _heartbeat_map->get_total_workers());
     _cct_perf->set(l_cct_unhealthy_workers, _heartbeat_map->get_unhealthy_workers());
+    _cct_perf->set(l_cct_buffer_copied_bytes, ceph::buffer::get_copied_bytes());
   }
   unsigned l = l_mempool_first + 1;
   for (unsigned i = 0; i < mempool::num_pools; ++i) {
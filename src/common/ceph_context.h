@@ -363,6 +363,7 @@ private:
     l_cct_first,
     l_cct_total_workers,
     l_cct_unhealthy_workers,
+    l_cct_buffer_copied_bytes,
     l_cct_last
   };
   enum {
@@ -8,6 +8,7 @@
 #include "arch/ppc.h"
 #include "common/sctp_crc32.h"
 #include "common/crc32c_intel_fast.h"
+#include "common/crc32c_intel_multi.h"
 #include "common/crc32c_aarch64.h"
 #include "common/crc32c_ppc.h"
 
@@ -52,6 +53,33 @@ ceph_crc32c_func_t ceph_choose_crc32(void)
  */
 ceph_crc32c_func_t ceph_crc32c_func = ceph_choose_crc32();
 
+/*
+ * one block after the other with whatever single buffer version we
+ * have chosen above.
+ */
+static void ceph_crc32c_multi_generic(uint32_t crc, unsigned char const *data,
+				      unsigned block_len, unsigned nblocks,
+				      uint32_t *out)
+{
+  for (unsigned i = 0; i < nblocks; ++i) {
+    out[i] = ceph_crc32c_func(crc, data + (size_t)i * block_len, block_len);
+  }
+}
+
+ceph_crc32c_multi_func_t ceph_choose_crc32_multi(void)
+{
+  ceph_arch_probe();
+
+#if defined(__x86_64__) && defined(HAVE_INTEL_SSE4_2)
+  if (ceph_arch_intel_sse42) {
+    return ceph_crc32c_intel_multi;
+  }
+#endif
+  return ceph_crc32c_multi_generic;
+}
+
+ceph_crc32c_multi_func_t ceph_crc32c_multi_func = ceph_choose_crc32_multi();
+
 
 /*
  * Look: http://crcutil.googlecode.com/files/crc-doc.1.0.pdf
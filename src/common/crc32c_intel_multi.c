@@ -0,0 +1,63 @@
+#include <string.h>
+#include <nmmintrin.h>
+
+#include "acconfig.h"
+#include "include/int_types.h"
+#include "include/crc32c.h"
+#include "common/crc32c_intel_multi.h"
+
+/*
+ * crc32 has a latency of three cycles but a throughput of one per cycle,
+ * so a single stream leaves most of the unit idle.  The fast version
+ * splits one buffer in three and stitches the parts back together with
+ * pclmul; when we have a run of independent blocks of the same size
+ * there is nothing to stitch, we simply feed LANES blocks at once.
+ */
+#define LANES 4
+
+static inline uint64_t load64(unsigned char const *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+void ceph_crc32c_intel_multi(uint32_t crc, unsigned char const *buffer,
+			     unsigned block_len, unsigned nblocks,
+			     uint32_t *out)
+{
+	unsigned words = block_len / 8;
+	unsigned tail = block_len % 8;
+	unsigned i, j, k;
+
+	for (i = 0; i + LANES <= nblocks; i += LANES) {
+		unsigned char const *p[LANES];
+		uint64_t c[LANES];
+		for (k = 0; k < LANES; k++) {
+			p[k] = buffer + (size_t)(i + k) * block_len;
+			c[k] = crc;
+		}
+		for (j = 0; j < words; j++) {
+			c[0] = _mm_crc32_u64(c[0], load64(p[0]));
+			c[1] = _mm_crc32_u64(c[1], load64(p[1]));
+			c[2] = _mm_crc32_u64(c[2], load64(p[2]));
+			c[3] = _mm_crc32_u64(c[3], load64(p[3]));
+			p[0] += 8;
+			p[1] += 8;
+			p[2] += 8;
+			p[3] += 8;
+		}
+		for (k = 0; k < LANES; k++) {
+			uint32_t v = (uint32_t)c[k];
+			for (j = 0; j < tail; j++) {
+				v = _mm_crc32_u8(v, p[k][j]);
+			}
+			out[i + k] = v;
+		}
+	}
+	/* what does not fill all the lanes goes the usual way */
+	for (; i < nblocks; i++) {
+		out[i] = ceph_crc32c_func(crc, buffer + (size_t)i * block_len,
+					  block_len);
+	}
+}
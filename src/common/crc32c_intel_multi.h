@@ -0,0 +1,30 @@
+#ifndef CEPH_COMMON_CRC32C_INTEL_MULTI_H
+#define CEPH_COMMON_CRC32C_INTEL_MULTI_H
+
+#include "acconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__x86_64__) && defined(HAVE_INTEL_SSE4_2)
+
+extern void ceph_crc32c_intel_multi(uint32_t crc, unsigned char const *buffer,
+				    unsigned block_len, unsigned nblocks,
+				    uint32_t *out);
+
+#else
+
+static inline void ceph_crc32c_intel_multi(uint32_t crc, unsigned char const *buffer,
+					   unsigned block_len, unsigned nblocks,
+					   uint32_t *out)
+{
+}
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
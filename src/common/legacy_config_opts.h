@@ -984,7 +984,7 @@ OPTION(bluestore_extent_map_shard_target_size_slop, OPT_DOUBLE)
 OPTION(bluestore_extent_map_inline_shard_prealloc_size, OPT_U32)
 OPTION(bluestore_cache_trim_interval, OPT_DOUBLE)
 OPTION(bluestore_cache_trim_max_skip_pinned, OPT_U32) // skip this many onodes pinned in cache before we give up
-OPTION(bluestore_cache_type, OPT_STR)   // lru, 2q
+OPTION(bluestore_cache_type, OPT_STR)   // lru, 2q, arc
 OPTION(bluestore_2q_cache_kin_ratio, OPT_DOUBLE)    // kin page slot size / max page slot size
 OPTION(bluestore_2q_cache_kout_ratio, OPT_DOUBLE)   // number of kout page slot / total number of page slot
 OPTION(bluestore_cache_size, OPT_U64)
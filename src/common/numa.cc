@@ -6,6 +6,7 @@
 #include <cstring>
 #include <errno.h>
 #include <iostream>
+#include <vector>
 
 #include "include/stringify.h"
 #include "common/safe_io.h"
@@ -156,6 +157,63 @@ static int easy_readdir(const std::string& dir, std::set<std::string> *out)
   return 0;
 }
 
+int get_numa_nodes(std::set<int> *nodes)
+{
+  std::set<std::string> ls;
+  int r = easy_readdir("/sys/devices/system/node", &ls);
+  if (r < 0) {
+    return r;
+  }
+  nodes->clear();
+  for (auto& i : ls) {
+    if (i.compare(0, 4, "node") != 0 || i.size() == 4 ||
+	!isdigit(i[4])) {
+      continue;
+    }
+    int node = atoi(i.c_str() + 4);
+    cpu_set_t cpu_set;
+    size_t cpu_set_size = 0;
+    if (get_numa_node_cpu_set(node, &cpu_set_size, &cpu_set) == 0 &&
+	CPU_COUNT(&cpu_set) > 0) {
+      nodes->insert(node);
+    }
+  }
+  return 0;
+}
+
+static std::vector<int> build_cpu_numa_map()
+{
+  std::vector<int> r;
+  std::set<int> nodes;
+  if (get_numa_nodes(&nodes) < 0) {
+    return r;
+  }
+  for (auto node : nodes) {
+    cpu_set_t cpu_set;
+    size_t cpu_set_size = 0;
+    if (get_numa_node_cpu_set(node, &cpu_set_size, &cpu_set) < 0) {
+      continue;
+    }
+    for (auto cpu : cpu_set_to_set(cpu_set_size, &cpu_set)) {
+      if (r.size() <= (size_t)cpu) {
+	r.resize(cpu + 1, -1);
+      }
+      r[cpu] = node;
+    }
+  }
+  return r;
+}
+
+int get_current_numa_node()
+{
+  static const std::vector<int> cpu_node = build_cpu_numa_map();
+  int cpu = sched_getcpu();
+  if (cpu < 0 || (size_t)cpu >= cpu_node.size()) {
+    return -1;
+  }
+  return cpu_node[cpu];
+}
+
 int set_cpu_affinity_all_threads(size_t cpu_set_size, cpu_set_t *cpu_set)
 {
   // first set my affinity
@@ -221,4 +279,14 @@ int set_cpu_affinity_all_threads(size_t cpu_set_size,
   return -ENOTSUP;
 }
 
+int get_numa_nodes(std::set<int> *nodes)
+{
+  return -ENOTSUP;
+}
+
+int get_current_numa_node()
+{
+  return -1;
+}
+
 #endif
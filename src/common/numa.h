@@ -22,3 +22,9 @@ int get_numa_node_cpu_set(int node,
 
 int set_cpu_affinity_all_threads(size_t cpu_set_size,
 				 cpu_set_t *cpu_set);
+
+/// numa nodes with cpus attached, from /sys/devices/system/node
+int get_numa_nodes(std::set<int> *nodes);
+
+/// numa node of the cpu the calling thread runs on (-1 if unknown)
+int get_current_numa_node();
@@ -2507,6 +2507,13 @@ std::vector<Option> get_global_options() {
     .set_description("set affinity to a numa node (-1 for none)")
     .add_see_also("osd_numa_auto_affinity"),
 
+    Option("osd_numa_shard_affinity", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_flag(Option::FLAG_STARTUP)
+    .set_description("spread op shards across numa nodes when the OSD as a whole is not bound to one")
+    .set_long_description("Each op shard is assigned a numa node round-robin; its worker threads are bound to that node's CPUs and the object store cache shards holding the same PGs are tagged with it. Cache memory is then allocated node-locally by first touch. This needs osd_op_num_shards to divide osd_num_cache_shards.")
+    .add_see_also({"osd_numa_node", "osd_numa_auto_affinity", "osd_num_cache_shards"}),
+
     Option("osd_smart_report_timeout", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
     .set_default(5)
     .set_description("Timeout (in seconds) for smarctl to run, default is set to 5"),
@@ -2910,6 +2917,33 @@ std::vector<Option> get_global_options() {
     .set_flag(Option::FLAG_STARTUP)
     .set_description("The number of cache shards to use in the object store."),
 
+    Option("osd_op_shard_steal_min_queue", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Queue depth at which idle threads of other op shards help with a shard's work")
+    .set_long_description("PGs are hashed to a fixed op shard, so a few busy PGs can keep one shard saturated while the others idle. When this is non-zero, a thread that finds its own shard empty takes queued items from the shard with the longest queue, provided it holds at least this many items and is on the same NUMA node (see osd_numa_shard_affinity). The item is processed exactly as one of that shard's own threads would, so per-PG ordering is unchanged. 0 disables stealing.")
+    .add_see_also("osd_op_num_shards")
+    .add_see_also("osd_op_num_threads_per_shard"),
+
+    Option("osd_op_shard_rebalance_interval", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Seconds between passes that move busy PGs to less loaded op shards")
+    .set_long_description("The OSD measures how long the op shard threads spend on each PG. Every interval, if the busiest shard exceeds the average by osd_op_shard_rebalance_threshold, up to osd_op_shard_rebalance_max_moves PGs are moved from it to the least loaded shard. A PG is only moved while nothing of it is queued or running, so ordering is unaffected; busy PGs are retried on the next pass. Moves do not survive an OSD restart. 0 disables rebalancing along with the per-PG queue and time accounting it needs. See the dump_op_shard_load admin socket command.")
+    .add_see_also({"osd_op_shard_rebalance_threshold", "osd_op_shard_rebalance_max_moves", "osd_op_num_shards"}),
+
+    Option("osd_op_shard_rebalance_threshold", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(.25)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("How far above the average load the busiest op shard must be to move PGs off it")
+    .add_see_also("osd_op_shard_rebalance_interval"),
+
+    Option("osd_op_shard_rebalance_max_moves", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(2)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Maximum number of PGs moved between op shards per rebalance pass")
+    .add_see_also("osd_op_shard_rebalance_interval"),
+
     Option("osd_op_num_threads_per_shard", Option::TYPE_INT, Option::LEVEL_ADVANCED)
     .set_default(0)
     .set_flag(Option::FLAG_STARTUP)
@@ -3030,6 +3064,12 @@ std::vector<Option> get_global_options() {
     .set_default(false)
     .set_description(""),
 
+    Option("osd_ec_stripe_cache_size", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("bytes of recently written stripes the OSD keeps in memory for its erasure-coded PGs")
+    .set_long_description("Partial stripe overwrites of pools with allow_ec_overwrites have to read the rest of the stripe from the shards before they can recompute the parity. When this is nonzero, the primary keeps the stripes written by completed overwrites, least recently written first out, and later overwrites of those stripes (e.g. the next small sequential write into the same stripe) are served from memory instead of reading them. This is a budget for the whole OSD: each erasure-coded PG on it may keep an equal share, this value divided by the number of such PGs. The cache is dropped on every interval change. The ec_cache_bytes perf counter shows how much is kept. 0 disables it."),
+
     // Only use clone_overlap for recovery if there are fewer than
     // osd_recover_clone_overlap_limit entries in the overlap set
     Option("osd_recover_clone_overlap_limit", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
@@ -3348,6 +3388,19 @@ std::vector<Option> get_global_options() {
     .set_default(7_day)
     .set_description("Deep scrub each PG (i.e., verify data checksums) at least this often"),
 
+    Option("osd_deep_scrub_incremental", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Only read the data of objects modified since the last deep scrub")
+    .set_long_description("A deep scrub that finds no errors records the PG version it started at. When this is set, the next periodic deep scrub in the same interval only reads and checksums the data of objects whose version is newer; the data digest recorded in the object info is reported for the others, and omap is still scanned. Every osd_deep_scrub_full_interval, after errors, after a change of the acting set, and for requested or repair scrubs, all data is read.")
+    .add_see_also({"osd_deep_scrub_full_interval", "osd_deep_scrub_interval"}),
+
+    Option("osd_deep_scrub_full_interval", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(28_day)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("With incremental deep scrub, read all object data at least this often")
+    .add_see_also("osd_deep_scrub_incremental"),
+
     Option("osd_deep_scrub_randomize_ratio", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
     .set_default(0.15)
     .set_description("Scrubs will randomly become deep scrubs at this rate (0.15 -> 15% of scrubs are deep)")
@@ -3357,6 +3410,27 @@ std::vector<Option> get_global_options() {
     .set_default(512_K)
     .set_description("Number of bytes to read from an object at a time during deep scrub"),
 
+    Option("osd_deep_scrub_read_ahead", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Number of objects of a deep scrub chunk to read and checksum ahead on the scrub read threads")
+    .set_long_description("When non-zero, the object data of each deep scrub chunk is read and crc32c'd on dedicated scrub read threads, this many objects at a time, while the PG works through the chunk. Op threads then only pick up finished digests and requeue the scrub once the data it needs has been read, instead of blocking on the reads. 0 reads the data synchronously on the op thread.")
+    .add_see_also({"osd_deep_scrub_read_threads", "osd_scrub_read_bytes_per_sec", "osd_deep_scrub_stride"}),
+
+    Option("osd_deep_scrub_read_threads", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(2)
+    .set_min(1)
+    .set_flag(Option::FLAG_STARTUP)
+    .set_description("Number of threads reading deep scrub data ahead")
+    .add_see_also("osd_deep_scrub_read_ahead"),
+
+    Option("osd_scrub_read_bytes_per_sec", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Maximum rate at which all deep scrubs of an OSD read object data ahead, 0 for no limit")
+    .set_long_description("Token bucket shared by all PGs of the OSD. When set together with osd_deep_scrub_read_ahead it replaces osd_scrub_sleep as the scrub pacing mechanism, so scrubs are no longer put to sleep between chunks.")
+    .add_see_also({"osd_deep_scrub_read_ahead", "osd_scrub_sleep"}),
+
     Option("osd_deep_scrub_keys", Option::TYPE_INT, Option::LEVEL_ADVANCED)
     .set_default(1024)
     .set_description("Number of keys to read from an object at a time during deep scrub"),
@@ -3726,6 +3800,15 @@ std::vector<Option> get_global_options() {
     .set_default(false)
     .set_description(""),
 
+    Option("memdb_index", Option::TYPE_STR, Option::LEVEL_ADVANCED)
+    .set_default("map")
+    .set_enum_allowed({"map", "skiplist"})
+    .set_description("Ordered index used by the in-memory key/value store")
+    .set_long_description("'map' keeps keys in a std::map behind a single "
+                          "lock.  'skiplist' uses a multi-version skiplist: "
+                          "reads and iterators run without the lock and see a "
+                          "consistent snapshot, writes are still serialized."),
+
     Option("rocksdb_log_to_ceph_log", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
     .set_default(true)
     .set_description(""),
@@ -3771,6 +3854,40 @@ std::vector<Option> get_global_options() {
     .set_default(1048576)
     .set_description("The number of keys required to invoke DeleteRange when deleting muliple keys."),
 
+    Option("rocksdb_tombstone_compact", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_description("Compact key ranges that accumulate many deletions")
+    .set_long_description("Deletes issued through transactions are tracked per prefix and per key range (see rocksdb_tombstone_compact_key_bytes). Once a range has seen rocksdb_tombstone_compact_trigger deletions, it is queued for a targeted compaction in the background so that iteration over it stops stepping over tombstones. Tracking adds a map update to every set and delete, so it is off by default; the \"rocksdb tombstone stats\" admin socket command is only available when it is on.")
+    .add_see_also("rocksdb_tombstone_compact_trigger"),
+
+    Option("rocksdb_tombstone_compact_trigger", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(16384)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Number of deletions in a key range that triggers its compaction")
+    .set_long_description("A range delete counts as rocksdb_delete_range_threshold deletions. 0 keeps tracking deletions but never triggers a compaction.")
+    .add_see_also("rocksdb_delete_range_threshold"),
+
+    Option("rocksdb_tombstone_compact_interval", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(60)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Minimum time between deletion-triggered compactions (seconds)"),
+
+    Option("rocksdb_tombstone_compact_key_bytes", Option::TYPE_UINT, Option::LEVEL_DEV)
+    .set_default(16)
+    .set_description("Leading key bytes that identify a key range for deletion tracking")
+    .set_long_description("The default covers the pool and object id of bluestore omap keys, i.e. deletions are tracked per object."),
+
+    Option("rocksdb_tombstone_compact_max_ranges", Option::TYPE_UINT, Option::LEVEL_DEV)
+    .set_default(1024)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Maximum number of key ranges tracked for deletion-triggered compaction"),
+
+    Option("rocksdb_iterator_readahead", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(2_M)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Readahead size for iterators that are expected to scan sequentially")
+    .set_long_description("Applied only to iterators created with ITERATOR_READAHEAD (e.g. long omap listings); 0 lets rocksdb pick its own auto-readahead."),
+
     Option("rocksdb_bloom_bits_per_key", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
     .set_default(20)
     .set_description("Number of bits per key to use for RocksDB's bloom filters.")
@@ -4126,6 +4243,17 @@ std::vector<Option> get_global_options() {
     .set_default(false)
     .set_description(""),
 
+    Option("bluefs_wal_envelope_mode", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_description("Write RocksDB WAL files as self-describing, checksummed envelopes")
+    .set_long_description("Each flush of a WAL file is written as a separate block-aligned envelope carrying its own length, sequence and crc.  The file size is then not logged on every fsync; on mount the valid tail is found by scanning the envelopes.  This saves a BlueFS log write per commit.  Applies to WAL files opened after the option is set.  WAL files written in this mode cannot be read by older releases.")
+    .add_see_also("bluefs_wal_envelope_prealloc"),
+
+    Option("bluefs_wal_envelope_prealloc", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(64_M)
+    .set_description("Space preallocated for a WAL file in envelope mode, and the step it grows by")
+    .add_see_also("bluefs_wal_envelope_mode"),
+
     Option("bluefs_allocator", Option::TYPE_STR, Option::LEVEL_DEV)
     .set_default("hybrid")
     .set_enum_allowed({"bitmap", "stupid", "avl", "hybrid"})
@@ -4377,6 +4505,19 @@ std::vector<Option> get_global_options() {
     .set_description("Compression ratio required to store compressed data")
     .set_long_description("If we compress data and get less than this we discard the result and store the original uncompressed data."),
 
+    Option("bluestore_compression_threads", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_description("Number of threads that help compress the blobs of a write")
+    .set_long_description("A large write is split into several blobs which are compressed one after the other on the thread that runs the transaction. With compression threads the blobs of a write are compressed in parallel while that thread waits for them, which shortens the time it is kept from other work. 0 compresses inline. Takes effect on mount.")
+    .add_see_also("bluestore_compression_algorithm"),
+
+    Option("bluestore_compression_adaptive_skip", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Number of blobs to store uncompressed once compression stops paying off")
+    .set_long_description("BlueStore keeps a moving average of the compression ratio of the blobs written to each collection. While that average is worse than the required ratio, this many blobs are written without attempting compression before the next one is tried again. 0 always tries to compress.")
+    .add_see_also("bluestore_compression_required_ratio"),
+
     Option("bluestore_extent_map_shard_max_size", Option::TYPE_SIZE, Option::LEVEL_DEV)
     .set_default(1200)
     .set_description("Max size (bytes) for a single extent map shard before splitting"),
@@ -4407,8 +4548,9 @@ std::vector<Option> get_global_options() {
 
     Option("bluestore_cache_type", Option::TYPE_STR, Option::LEVEL_DEV)
     .set_default("2q")
-    .set_enum_allowed({"2q", "lru"})
-    .set_description("Cache replacement algorithm"),
+    .set_enum_allowed({"2q", "lru", "arc"})
+    .set_description("Cache replacement algorithm")
+    .set_long_description("Replacement policy of the BlueStore buffer cache. 'arc' (Adaptive Replacement Cache) balances recency and frequency on its own and keeps a hot working set resident across large sequential scans."),
 
     Option("bluestore_2q_cache_kin_ratio", Option::TYPE_FLOAT, Option::LEVEL_DEV)
     .set_default(.5)
@@ -4454,6 +4596,13 @@ std::vector<Option> get_global_options() {
     .add_see_also("bluestore_cache_autotune")
     .set_description("The number of seconds to wait between rebalances when cache autotune is enabled."),
 
+    Option("bluestore_onode_compact", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_flag(Option::FLAG_STARTUP)
+    .add_see_also("bluestore_cache_meta_ratio")
+    .set_description("Keep extent maps of idle cached onodes in their encoded form")
+    .set_long_description("When an onode is no longer in use its clean extents are dropped and only the encoded extent map is kept; it is decoded again on next access. Extents whose blobs have cached data are kept. This trades some CPU for fitting more onodes in the same meta cache, which helps with many small objects."),
+
     Option("bluestore_alloc_stats_dump_interval", Option::TYPE_FLOAT, Option::LEVEL_DEV)
       .set_default(3600 * 24)
       .set_description("The period (in second) for logging allocation statistics."),
@@ -4517,10 +4666,12 @@ std::vector<Option> get_global_options() {
     .set_default("m(3) O(3,0-13) L")
     .set_description("Definition of column families and their sharding")
     .set_long_description("Space separated list of elements: column_def [ '=' rocksdb_options ]. "
-			  "column_def := column_name [ '(' shard_count [ ',' hash_begin '-' [ hash_end ] ] ')' ]. "
-			  "Example: 'I=write_buffer_size=1048576 O(6) m(7,10-)'. "
+			  "column_def := column_name [ '(' shard_count [ ',' hash_begin '-' [ hash_end [ '.' hash_bits ] ] ] ')' ]. "
+			  "Example: 'I=write_buffer_size=1048576 O(6) m(7,10-) p(4,0-8.5)'. "
 			  "Interval [hash_begin..hash_end) defines characters to use for hash calculation. "
+			  "hash_bits adds that many leading bits of the character at hash_end. "
 			  "Recommended hash ranges: O(0-13) P(0-8) m(0-16). "
+			  "PG aligned: p(0-8.N) and O(0-9.N), N being at most log2 of the smallest pg_num. "
 			  "Sharding of S,T,C,M,B prefixes is inadvised"),
 
     Option("bluestore_fsck_on_mount", Option::TYPE_BOOL, Option::LEVEL_DEV)
@@ -4555,6 +4706,19 @@ std::vector<Option> get_global_options() {
     .set_default(false)
     .set_description("Try to submit metadata transaction to rocksdb in queuing thread context"),
 
+    Option("bluestore_kv_sync_pipeline", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_flag(Option::FLAG_STARTUP)
+    .set_description("Prepare the next kv_sync batch while the previous one is being committed")
+    .set_long_description("kv_sync_thread only flushes the device and applies queued transactions; the synchronous db commit is done by a separate bstore_kv_commit thread. This overlaps preparing a batch with the commit of the previous one."),
+
+    Option("bluestore_kv_sync_group_commit_ratio", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(.5)
+    .set_flag(Option::FLAG_STARTUP)
+    .set_description("Fraction of the average batch size to wait for before preparing a batch while another one is committing")
+    .set_long_description("With bluestore_kv_sync_pipeline, a new batch is started as soon as this many transactions (relative to the recent average batch size) are queued, or when the commit stage goes idle. 0 starts the next batch right away.")
+    .add_see_also("bluestore_kv_sync_pipeline"),
+
     Option("bluestore_fsck_read_bytes_cap", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
     .set_default(64_M)
     .set_flag(Option::FLAG_RUNTIME)
@@ -4564,6 +4728,12 @@ std::vector<Option> get_global_options() {
       .set_default(2)
       .set_description("Number of additional threads to perform quick-fix (shallow fsck) command"),
 
+    Option("bluestore_fsck_threads", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+      .set_default(1)
+      .set_description("Number of threads checking objects during regular and deep fsck")
+      .set_long_description("With more than one thread the object keyspace is split into ranges that are checked in parallel. Repair always runs single-threaded.")
+      .add_see_also("bluestore_fsck_quick_fix_threads"),
+
     Option("bluestore_throttle_bytes", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
     .set_default(64_M)
     .set_flag(Option::FLAG_RUNTIME)
@@ -4608,6 +4778,21 @@ std::vector<Option> get_global_options() {
     .set_description("Default bluestore_deferred_batch_ops for non-rotational (solid state) media")
     .add_see_also("bluestore_deferred_batch_ops"),
 
+    Option("bluestore_deferred_elevator", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Submit deferred writes of all sequencers as one offset-sorted batch")
+    .set_long_description("When enabled, pending deferred writes from every idle sequencer are gathered, sorted by device offset and merged where adjacent before being submitted together, instead of being submitted one sequencer at a time. This reduces seeking on rotational media.")
+    .add_see_also("bluestore_deferred_batch_window"),
+
+    Option("bluestore_deferred_batch_window", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Submit queued deferred writes after they have waited this many seconds")
+    .set_long_description("Bounds the time deferred writes are held to build a larger batch.  Zero disables the window, leaving submission to bluestore_deferred_batch_ops and bluestore_max_defer_interval.")
+    .add_see_also("bluestore_deferred_batch_ops")
+    .add_see_also("bluestore_max_defer_interval"),
+
     Option("bluestore_nid_prealloc", Option::TYPE_INT, Option::LEVEL_DEV)
     .set_default(1024)
     .set_description("Number of unique object ids to preallocate at a time"),
@@ -4626,6 +4811,13 @@ std::vector<Option> get_global_options() {
     .set_flag(Option::FLAG_RUNTIME)
     .set_description("Cache read results by default (unless hinted NOCACHE or WONTNEED)"),
 
+    Option("bluestore_cache_cold_reads", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_flag(Option::FLAG_STARTUP)
+    .add_see_also("bluestore_default_buffered_read")
+    .set_description("Cache results of NOCACHE or DONTNEED reads at the cold end of the cache")
+    .set_long_description("Background readers such as scrub and backfill hint their reads NOCACHE or DONTNEED. By default their data is not cached at all; with this set it is inserted at the cold end of the buffer cache, so a nearby re-read can still hit it while the hot working set stays in place. Either way such reads do not promote cached buffers and onodes they load are kept at the cold end of the onode cache."),
+
     Option("bluestore_default_buffered_write", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
     .set_default(false)
     .set_flag(Option::FLAG_RUNTIME)
@@ -4719,6 +4911,12 @@ std::vector<Option> get_global_options() {
     .set_default(true)
     .set_description("Enable health indication on lack of per-pool omap"),
 
+    Option("bluestore_omap_per_pg", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_description("Lay out omap data of new objects per placement group")
+    .set_long_description("Per-pg omap keys start with the pool and the object's bit-reversed hash, so every PG's omap is one contiguous key range. Combined with a PG aligned sharding of the 'p' column family (see bluestore_rocksdb_cfs) a PG's omap stays within one column family, and removing or moving a PG leaves its tombstones in one place. Existing objects keep their layout until converted by fsck repair or quick-fix.")
+    .add_see_also("bluestore_rocksdb_cfs"),
+
     Option("bluestore_log_op_age", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
     .set_default(5)
     .set_description("log operation if it's slower than this age (seconds)"),
@@ -4727,6 +4925,25 @@ std::vector<Option> get_global_options() {
     .set_default(5)
     .set_description("log omap iteration operation if it's slower than this age (seconds)"),
 
+    Option("bluestore_omap_readahead_threshold", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(64)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Switch an omap iterator to readahead after this many consecutive next() calls")
+    .set_long_description("Short omap lookups keep using plain iterators so they don't pay for readahead they never consume. Set to 0 to disable.")
+    .add_see_also("rocksdb_iterator_readahead"),
+
+    Option("bluestore_omap_tombstone_stats", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(true)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Count deletion tombstones skipped by omap iterators")
+    .set_long_description("Reported as the omap_tombstones_skipped perf counter. Requires rocksdb perf context counting to be enabled for the iterating thread, which is done on demand."),
+
+    Option("bluestore_onode_prefetch_queue", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(1024)
+    .set_flag(Option::FLAG_RUNTIME)
+    .set_description("Maximum number of objects waiting to have their onodes prefetched")
+    .set_long_description("Scrub and backfill list objects and then visit them one by one. The listed objects' onodes are loaded into the cache ahead of use, in key order and in batches, by a background thread. Requests beyond this many queued objects are dropped. Set to 0 to disable prefetching."),
+
     Option("bluestore_log_collection_list_age", Option::TYPE_FLOAT, Option::LEVEL_ADVANCED)
     .set_default(60)
     .set_description("log collection list operation if it's slower than this age (seconds)"),
@@ -4761,6 +4978,38 @@ std::vector<Option> get_global_options() {
     .set_default(64_M)
     .set_description("Maximum RAM hybrid allocator should use before enabling bitmap supplement"),
 
+    Option("bluestore_allocator_cache_shards", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_flag(Option::FLAG_STARTUP)
+    .set_description("Number of per-thread extent cache shards in front of the main allocator (0 disables the cache)")
+    .set_long_description("When enabled, small allocations are served from a per-thread cache of "
+			  "free extents without taking the allocator lock. The cache is refilled "
+			  "from and returned to the allocator in batches. Space parked in the "
+			  "cache is free but not visible to the allocator itself, see "
+			  "'bluestore allocator cache stats'.")
+    .add_see_also({"bluestore_allocator_cache_slots",
+                   "bluestore_allocator_cache_refill_size",
+                   "bluestore_allocator_cache_max_request"}),
+
+    Option("bluestore_allocator_cache_slots", Option::TYPE_UINT, Option::LEVEL_DEV)
+    .set_default(32)
+    .set_flag(Option::FLAG_STARTUP)
+    .set_description("Maximum number of free extents each allocator cache shard holds")
+    .add_see_also("bluestore_allocator_cache_shards"),
+
+    Option("bluestore_allocator_cache_refill_size", Option::TYPE_SIZE, Option::LEVEL_DEV)
+    .set_default(1_M)
+    .set_flag(Option::FLAG_STARTUP)
+    .set_description("Amount of space an allocator cache shard takes from the allocator at once, "
+		     "also the longest released extent kept in the cache")
+    .add_see_also("bluestore_allocator_cache_shards"),
+
+    Option("bluestore_allocator_cache_max_request", Option::TYPE_SIZE, Option::LEVEL_DEV)
+    .set_default(64_K)
+    .set_flag(Option::FLAG_STARTUP)
+    .set_description("Allocation requests larger than this bypass the allocator cache")
+    .add_see_also("bluestore_allocator_cache_shards"),
+
     Option("bluestore_volume_selection_policy", Option::TYPE_STR, Option::LEVEL_DEV)
     .set_default("use_some_extra")
     .set_enum_allowed({ "rocksdb_original", "use_some_extra" })
@@ -4781,6 +5030,32 @@ std::vector<Option> get_global_options() {
     .set_default(false)
     .set_description("Enables Linux io_uring API instead of libaio"),
 
+    Option("bdev_ioring_hipri", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_description("Use polled IO completions with io_uring")
+    .set_long_description("Completions are reaped by polling the device rather than waiting for interrupts. Requires a block device and driver with polling support (e.g. NVMe with poll queues)."),
+
+    Option("bdev_ioring_sqthread_poll", Option::TYPE_BOOL, Option::LEVEL_ADVANCED)
+    .set_default(false)
+    .set_description("Offload io_uring submission to a kernel polling thread")
+    .set_long_description("A kernel thread polls the submission queue so submitting IO doesn't need a syscall. Falls back to regular submission if the kernel refuses to set it up (older kernels require CAP_SYS_ADMIN)."),
+
+    Option("bdev_ioring_sqthread_idle_ms", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(1000)
+    .set_description("Idle time after which the io_uring submission polling thread goes to sleep")
+    .add_see_also("bdev_ioring_sqthread_poll"),
+
+    Option("bdev_ioring_fixed_buffers", Option::TYPE_UINT, Option::LEVEL_ADVANCED)
+    .set_default(0)
+    .set_description("Number of buffers to register with io_uring (0 disables)")
+    .set_long_description("Reads are done into buffers registered with the ring up front so the kernel doesn't have to map user pages for every IO, and the buffers are handed to the reader without copying. A buffer stays in use for as long as the data read into it is referenced, including by the cache. Unaligned write payloads, which have to be copied anyway, are copied into them too. If all of them are in use (counted as read_fixed_exhausted) or registration fails (e.g. RLIMIT_MEMLOCK is too low) regular buffers are used.")
+    .add_see_also("bdev_ioring_fixed_buffer_size"),
+
+    Option("bdev_ioring_fixed_buffer_size", Option::TYPE_SIZE, Option::LEVEL_ADVANCED)
+    .set_default(64_K)
+    .set_description("Size of each buffer registered with io_uring")
+    .add_see_also("bdev_ioring_fixed_buffers"),
+
     // -----------------------------------------
     // kstore
 
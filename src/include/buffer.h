@@ -117,6 +117,9 @@ struct error_code;
   int get_missed_crc();
   /// enable/disable tracking of cached crcs
   void track_cached_crc(bool b);
+  /// count of bytes memcpy'd by the buffer copy primitives (copy_in,
+  /// copy_out, append of raw data, iterator copies, rebuilds)
+  uint64_t get_copied_bytes();
 
   /*
    * an abstract raw buffer.  with a reference count.
@@ -250,6 +250,9 @@
 /* nasm can also build the isa-l:avx512 */
 #cmakedefine HAVE_NASM_X64_AVX512
 
+/* compiler can build sse 4.2 code (crc32 instruction) */
+#cmakedefine HAVE_INTEL_SSE4_2
+
 /* Define if isa-l is compiled for arm64 */
 #cmakedefine HAVE_ARMV8_SIMD
 
@@ -17,6 +17,18 @@ extern ceph_crc32c_func_t ceph_crc32c_func;
 
 extern ceph_crc32c_func_t ceph_choose_crc32(void);
 
+typedef void (*ceph_crc32c_multi_func_t)(uint32_t crc, unsigned char const *data,
+					 unsigned block_len, unsigned nblocks,
+					 uint32_t *out);
+
+/*
+ * the chosen implementation for a run of equally sized blocks, see
+ * ceph_crc32c_multi()
+ */
+extern ceph_crc32c_multi_func_t ceph_crc32c_multi_func;
+
+extern ceph_crc32c_multi_func_t ceph_choose_crc32_multi(void);
+
 /**
  * calculate crc32c for data that is entirely 0 (ZERO)
  *
@@ -50,6 +62,26 @@ static inline uint32_t ceph_crc32c(uint32_t crc, unsigned char const *data, unsi
   return ceph_crc32c_func(crc, data, length);
 }
 
+/**
+ * calculate crc32c of each of nblocks consecutive blocks
+ *
+ * Every block starts from the same initial value; this is the same as
+ * calling ceph_crc32c() on each of them but lets the implementation
+ * work on several blocks at once.
+ *
+ * @param crc initial value of each block
+ * @param data pointer to the first block
+ * @param block_len length of each block
+ * @param nblocks number of blocks
+ * @param out nblocks crc values
+ */
+static inline void ceph_crc32c_multi(uint32_t crc, unsigned char const *data,
+				     unsigned block_len, unsigned nblocks,
+				     uint32_t *out)
+{
+  ceph_crc32c_multi_func(crc, data, block_len, nblocks, out);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,6 +4,7 @@
 #define KEY_VALUE_DB_H
 
 #include "include/buffer.h"
+#include <optional>
 #include <ostream>
 #include <set>
 #include <map>
@@ -130,6 +131,11 @@ public:
       const ceph::buffer::list  &value     ///< [in] value to be merged into key
     ) { ceph_abort_msg("Not implemented"); }
 
+    /// bytes the backend will log for this transaction, 0 if unknown
+    virtual size_t get_size_bytes() const {
+      return 0;
+    }
+
     virtual ~TransactionImpl() {}
   };
   typedef std::shared_ptr< TransactionImpl > Transaction;
@@ -214,6 +220,10 @@ public:
     virtual int seek_to_last() = 0;
     virtual int prev() = 0;
     virtual std::pair<std::string, std::string> raw_key() = 0;
+    /// deleted entries stepped over so far (see ITERATOR_TOMBSTONE_STATS)
+    virtual uint64_t tombstones_skipped() {
+      return 0;
+    }
     virtual ceph::buffer::ptr value_as_ptr() {
       ceph::buffer::list bl = value();
       if (bl.length() == 1) {
@@ -258,6 +268,9 @@ public:
     virtual size_t value_size() {
       return 0;
     }
+    virtual uint64_t tombstones_skipped() {
+      return 0;
+    }
     virtual ~WholeSpaceIteratorImpl() { }
   };
   typedef std::shared_ptr< WholeSpaceIteratorImpl > WholeSpaceIterator;
@@ -310,15 +323,35 @@ private:
     int status() override {
       return generic_iter->status();
     }
+    uint64_t tombstones_skipped() override {
+      return generic_iter->tombstones_skipped();
+    }
   };
+protected:
+  static Iterator make_prefix_iterator(const std::string &prefix,
+				       WholeSpaceIterator iter) {
+    return std::make_shared<PrefixIteratorImpl>(prefix, iter);
+  }
 public:
   typedef uint32_t IteratorOpts;
   static const uint32_t ITERATOR_NOCACHE = 1;
+  /// read ahead on the assumption that most of the range will be walked
+  static const uint32_t ITERATOR_READAHEAD = 2;
+  /// count deleted entries stepped over, see tombstones_skipped()
+  static const uint32_t ITERATOR_TOMBSTONE_STATS = 4;
+
+  /// keys (without the prefix) the iterator will never step outside of;
+  /// lets the backend skip data and tombstones beyond them
+  struct IteratorBounds {
+    std::optional<std::string> lower_bound;
+    std::optional<std::string> upper_bound;
+  };
+
   virtual WholeSpaceIterator get_wholespace_iterator(IteratorOpts opts = 0) = 0;
-  virtual Iterator get_iterator(const std::string &prefix, IteratorOpts opts = 0) {
-    return std::make_shared<PrefixIteratorImpl>(
-      prefix,
-      get_wholespace_iterator(opts));
+  virtual Iterator get_iterator(const std::string &prefix,
+				IteratorOpts opts = 0,
+				IteratorBounds bounds = IteratorBounds()) {
+    return make_prefix_iterator(prefix, get_wholespace_iterator(opts));
   }
 
   virtual uint64_t get_estimated_size(std::map<std::string,uint64_t> &extra) = 0;
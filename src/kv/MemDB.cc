@@ -96,6 +96,17 @@ void MemDB::_save()
     return;
   }
   bufferlist bl;
+  if (m_skiplist) {
+    MemDBSkipList::ReadGuard g(m_skiplist.get());
+    for (auto n = m_skiplist->first(); n; n = MemDBSkipList::next(n)) {
+      auto v = MemDBSkipList::get_value(n, g.seq);
+      if (v) {
+	dout(10) << __func__ << " Key:"<< n->key << dendl;
+	encode(n->key, bl);
+	encode(v->value, bl);
+      }
+    }
+  }
   mdb_iter_t iter = m_map.begin();
   while (iter != m_map.end()) {
     dout(10) << __func__ << " Key:"<< iter->first << dendl;
@@ -134,6 +145,9 @@ int MemDB::_load()
 
   ssize_t file_size = st.st_size;
   ssize_t bytes_done = 0;
+  if (m_skiplist) {
+    m_skiplist->begin_write();
+  }
   while (bytes_done < file_size) {
     string key;
     bufferptr datap;
@@ -142,8 +156,15 @@ int MemDB::_load()
     bytes_done += ceph::decode_file(fd, datap);
 
     dout(10) << __func__ << " Key:"<< key << dendl;
-    m_map[key] = datap;
     m_total_bytes += datap.length();
+    if (m_skiplist) {
+      m_skiplist->put(key, std::move(datap));
+    } else {
+      m_map[key] = datap;
+    }
+  }
+  if (m_skiplist) {
+    m_skiplist->publish();
   }
   VOID_TEMP_FAILURE_RETRY(::close(fd));
   return 0;
@@ -153,6 +174,11 @@ int MemDB::_init(bool create)
 {
   int r;
   dout(1) << __func__ << dendl;
+  if (m_cct->_conf.get_val<std::string>("memdb_index") == "skiplist") {
+    m_skiplist.reset(new MemDBSkipList);
+  } else {
+    m_skiplist.reset();
+  }
   if (create) {
     if (fs::exists(m_db_path)) {
       r = 0; // ignore EEXIST
@@ -232,6 +258,23 @@ int MemDB::submit_transaction(KeyValueDB::Transaction t)
   MDBTransactionImpl* mt =  static_cast<MDBTransactionImpl*>(t.get());
 
   dtrace << __func__ << " " << mt->get_ops().size() << dendl;
+  if (m_skiplist) {
+    // the whole transaction becomes visible at once
+    std::lock_guard<std::mutex> l(m_lock);
+    m_skiplist->begin_write();
+    for (auto& op : mt->get_ops()) {
+      ms_op_t sl_op = op.second;
+      if (op.first == MDBTransactionImpl::WRITE) {
+	_sl_setkey(sl_op);
+      } else if (op.first == MDBTransactionImpl::MERGE) {
+	_sl_merge(sl_op);
+      } else {
+	ceph_assert(op.first == MDBTransactionImpl::DELETE);
+	_sl_rmkey(sl_op);
+      }
+    }
+    m_skiplist->publish();
+  } else {
   for(auto& op : mt->get_ops()) {
     if(op.first == MDBTransactionImpl::WRITE) {
       ms_op_t set_op = op.second;
@@ -245,6 +288,7 @@ int MemDB::submit_transaction(KeyValueDB::Transaction t)
       _rmkey(rm_op);
     }
   }
+  }
 
   utime_t lat = ceph_clock_now() - start;
   logger->inc(l_memdb_txns);
@@ -409,6 +453,80 @@ int MemDB::_merge(ms_op_t &op)
   return 0;
 }
 
+/*
+ * Skiplist variants; caller holds m_lock and has started a write.
+ */
+int MemDB::_sl_setkey(ms_op_t &op)
+{
+  std::string key = make_key(op.first.first, op.first.second);
+  bufferlist bl = op.second;
+
+  m_total_bytes += bl.length();
+  auto old = m_skiplist->get_latest(key);
+  if (old) {
+    ceph_assert(m_total_bytes >= old->value.length());
+    m_total_bytes -= old->value.length();
+  }
+  m_skiplist->put(key, bufferptr(bl.c_str(), bl.length()));
+  return 0;
+}
+
+int MemDB::_sl_rmkey(ms_op_t &op)
+{
+  std::string key = make_key(op.first.first, op.first.second);
+
+  auto old = m_skiplist->get_latest(key);
+  if (!old) {
+    return 0;
+  }
+  ceph_assert(m_total_bytes >= old->value.length());
+  m_total_bytes -= old->value.length();
+  m_skiplist->remove(key);
+  return 1;
+}
+
+int MemDB::_sl_merge(ms_op_t &op)
+{
+  std::string prefix = op.first.first;
+  std::string key = make_key(op.first.first, op.first.second);
+  bufferlist bl = op.second;
+  int64_t bytes_adjusted = bl.length();
+
+  std::shared_ptr<MergeOperator> mop = _find_merge_op(prefix);
+  ceph_assert(mop);
+
+  std::string new_val;
+  auto old = m_skiplist->get_latest(key);
+  if (!old) {
+    mop->merge_nonexistent(bl.c_str(), bl.length(), &new_val);
+  } else {
+    mop->merge(old->value.c_str(), old->value.length(),
+	       bl.c_str(), bl.length(), &new_val);
+    bytes_adjusted -= old->value.length();
+  }
+  m_skiplist->put(key, bufferptr(new_val.c_str(), new_val.length()));
+
+  ceph_assert((int64_t)m_total_bytes + bytes_adjusted >= 0);
+  m_total_bytes += bytes_adjusted;
+  return 0;
+}
+
+bool MemDB::_sl_get(const MemDBSkipList::ReadGuard &g, const string &prefix,
+		    const string &k, bufferlist *out)
+{
+  string key = make_key(prefix, k);
+  auto n = m_skiplist->seek_ge(key);
+  if (!n || n->key != key) {
+    return false;
+  }
+  auto v = MemDBSkipList::get_value(n, g.seq);
+  if (!v) {
+    return false;
+  }
+  out->push_back(bufferptr(v->value.c_str(), v->value.length()));
+  return true;
+}
+
 /*
  * Caller take btree lock.
  */
@@ -427,6 +545,10 @@ bool MemDB::_get(const string &prefix, const string &k, bufferlist *out)
 
 bool MemDB::_get_locked(const string &prefix, const string &k, bufferlist *out)
 {
+  if (m_skiplist) {
+    MemDBSkipList::ReadGuard g(m_skiplist.get());
+    return _sl_get(g, prefix, k, out);
+  }
   std::lock_guard<std::mutex> l(m_lock);
   return _get(prefix, k, out);
 }
@@ -456,10 +578,20 @@ int MemDB::get(const string &prefix, const std::set<string> &keys,
 {
   utime_t start = ceph_clock_now();
 
-  for (const auto& i : keys) {
-    bufferlist bl;
-    if (_get_locked(prefix, i, &bl))
-      out->insert(make_pair(i, bl));
+  if (m_skiplist) {
+    // one snapshot for all keys
+    MemDBSkipList::ReadGuard g(m_skiplist.get());
+    for (const auto& i : keys) {
+      bufferlist bl;
+      if (_sl_get(g, prefix, i, &bl))
+	out->insert(make_pair(i, bl));
+    }
+  } else {
+    for (const auto& i : keys) {
+      bufferlist bl;
+      if (_get_locked(prefix, i, &bl))
+	out->insert(make_pair(i, bl));
+    }
   }
 
   utime_t lat = ceph_clock_now() - start;
@@ -659,3 +791,101 @@ int MemDB::MDBWholeSpaceIteratorImpl::lower_bound(const std::string &prefix,
   }
   return -1;
 }
+
+int MemDB::MDBSkipListIteratorImpl::skip_forward()
+{
+  while (m_cur &&
+	 !(m_cur_v = MemDBSkipList::get_value(m_cur, m_guard.seq))) {
+    m_cur = MemDBSkipList::next(m_cur);
+  }
+  return m_cur ? 0 : -1;
+}
+
+int MemDB::MDBSkipListIteratorImpl::skip_backward()
+{
+  while (m_cur &&
+	 !(m_cur_v = MemDBSkipList::get_value(m_cur, m_guard.seq))) {
+    m_cur = m_list->seek_lt(m_cur->key);
+  }
+  return m_cur ? 0 : -1;
+}
+
+int MemDB::MDBSkipListIteratorImpl::seek_to_first(const std::string &k)
+{
+  m_cur = k.empty() ? m_list->first() : m_list->seek_ge(k);
+  return skip_forward();
+}
+
+int MemDB::MDBSkipListIteratorImpl::seek_to_last(const std::string &k)
+{
+  if (k.empty()) {
+    m_cur = m_list->last();
+  } else {
+    // last key within prefix k
+    string limit = k;
+    limit.push_back(KEY_DELIM + 1);
+    m_cur = m_list->seek_lt(limit);
+  }
+  return skip_backward();
+}
+
+int MemDB::MDBSkipListIteratorImpl::upper_bound(const std::string &prefix,
+						const std::string &after)
+{
+  m_cur = m_list->seek_gt(make_key(prefix, after));
+  return skip_forward();
+}
+
+int MemDB::MDBSkipListIteratorImpl::lower_bound(const std::string &prefix,
+						const std::string &to)
+{
+  m_cur = m_list->seek_ge(make_key(prefix, to));
+  return skip_forward();
+}
+
+int MemDB::MDBSkipListIteratorImpl::next()
+{
+  if (!m_cur) {
+    return -1;
+  }
+  m_cur = MemDBSkipList::next(m_cur);
+  return skip_forward();
+}
+
+int MemDB::MDBSkipListIteratorImpl::prev()
+{
+  if (!m_cur) {
+    return -1;
+  }
+  m_cur = m_list->seek_lt(m_cur->key);
+  return skip_backward();
+}
+
+string MemDB::MDBSkipListIteratorImpl::key()
+{
+  string prefix, key;
+  split_key(m_cur->key, &prefix, &key);
+  return key;
+}
+
+std::pair<string,string> MemDB::MDBSkipListIteratorImpl::raw_key()
+{
+  string prefix, key;
+  split_key(m_cur->key, &prefix, &key);
+  return { prefix, key };
+}
+
+bool MemDB::MDBSkipListIteratorImpl::raw_key_is_prefixed(
+    const string &prefix)
+{
+  return m_cur->key.size() > prefix.size() &&
+    m_cur->key[prefix.size()] == KEY_DELIM &&
+    m_cur->key.compare(0, prefix.size(), prefix) == 0;
+}
+
+bufferlist MemDB::MDBSkipListIteratorImpl::value()
+{
+  bufferlist bl;
+  bl.append(m_cur_v->value.c_str(), m_cur_v->value.length());
+  return bl;
+}
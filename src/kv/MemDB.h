@@ -19,6 +19,7 @@
 #include "include/encoding.h"
 #include "include/btree_map.h"
 #include "KeyValueDB.h"
+#include "MemDBSkipList.h"
 #include "osd/osd_types.h"
 
 #define KEY_DELIM '\0' 
@@ -45,6 +46,9 @@ class MemDB : public KeyValueDB
   bool m_using_btree;
 
   mdb_map_t m_map;
+  /// used instead of m_map if memdb_index = skiplist; readers don't
+  /// take m_lock then, writers still do
+  std::unique_ptr<MemDBSkipList> m_skiplist;
 
   CephContext *m_cct;
   PerfCounters *logger;
@@ -125,6 +129,11 @@ private:
   int _merge(ms_op_t &op);
   int _setkey(ms_op_t &op);
   int _rmkey(ms_op_t &op);
+  int _sl_merge(ms_op_t &op);
+  int _sl_setkey(ms_op_t &op);
+  int _sl_rmkey(ms_op_t &op);
+  bool _sl_get(const MemDBSkipList::ReadGuard &g, const std::string &prefix,
+	       const std::string &k, ceph::bufferlist *out);
 
 public:
 
@@ -198,6 +207,42 @@ public:
     ~MDBWholeSpaceIteratorImpl() override;
   };
 
+  /// snapshot iterator over the skiplist index; never blocks writers
+  class MDBSkipListIteratorImpl : public KeyValueDB::WholeSpaceIteratorImpl {
+    const MemDBSkipList *m_list;
+    MemDBSkipList::ReadGuard m_guard;
+    const MemDBSkipList::Node *m_cur = nullptr;
+    const MemDBSkipList::Version *m_cur_v = nullptr;
+
+    int skip_forward();
+    int skip_backward();
+
+  public:
+    explicit MDBSkipListIteratorImpl(const MemDBSkipList *list)
+      : m_list(list), m_guard(list) {}
+
+    int seek_to_first(const std::string &k) override;
+    int seek_to_last(const std::string &k) override;
+
+    int seek_to_first() override { return seek_to_first(std::string()); };
+    int seek_to_last() override { return seek_to_last(std::string()); };
+
+    int upper_bound(const std::string &prefix, const std::string &after) override;
+    int lower_bound(const std::string &prefix, const std::string &to) override;
+    bool valid() override {
+      return m_cur != nullptr;
+    }
+
+    int next() override;
+    int prev() override;
+    int status() override { return 0; };
+
+    std::string key() override;
+    std::pair<std::string,std::string> raw_key() override;
+    bool raw_key_is_prefixed(const std::string &prefix) override;
+    ceph::bufferlist value() override;
+  };
+
   uint64_t get_estimated_size(std::map<std::string,uint64_t> &extra) override {
       std::lock_guard<std::mutex> l(m_lock);
       return m_allocated_bytes;
@@ -213,6 +258,9 @@ public:
   }
 
   WholeSpaceIterator get_wholespace_iterator(IteratorOpts opts = 0) override {
+    if (m_skiplist) {
+      return std::make_shared<MDBSkipListIteratorImpl>(m_skiplist.get());
+    }
     return std::shared_ptr<KeyValueDB::WholeSpaceIteratorImpl>(
       new MDBWholeSpaceIteratorImpl(&m_map, &m_lock, &iterator_seq_no, m_using_btree));
   }
@@ -0,0 +1,348 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ordered in-memory index for MemDB with lock-free readers
+ */
+
+#include <new>
+
+#include "MemDBSkipList.h"
+#include "include/ceph_assert.h"
+
+MemDBSkipList::Node* MemDBSkipList::Node::create(const std::string& key,
+						 int height)
+{
+  ceph_assert(height >= 1 && height <= MAX_HEIGHT);
+  void *mem = ::operator new(
+    sizeof(Node) + sizeof(std::atomic<Node*>) * (height - 1));
+  Node *n = new (mem) Node(key, height);
+  for (int i = 0; i < height; ++i) {
+    new (&n->next[i]) std::atomic<Node*>(nullptr);
+  }
+  return n;
+}
+
+void MemDBSkipList::Node::destroy(Node* n)
+{
+  n->~Node();
+  ::operator delete(n);
+}
+
+MemDBSkipList::ReadGuard::ReadGuard(const MemDBSkipList* l)
+  : list(l)
+{
+  // register in the current epoch; if the writer moved on meanwhile it
+  // may not have seen us, so try again
+  while (true) {
+    uint64_t e = list->epoch.load();
+    list->readers[e & 1]++;
+    if (list->epoch.load() == e) {
+      slot = e & 1;
+      break;
+    }
+    list->readers[e & 1]--;
+  }
+  seq = list->visible_seq.load();
+}
+
+MemDBSkipList::ReadGuard::~ReadGuard()
+{
+  if (list) {
+    list->readers[slot]--;
+  }
+}
+
+MemDBSkipList::MemDBSkipList()
+  : head(Node::create(std::string(), MAX_HEIGHT))
+{
+  readers[0] = 0;
+  readers[1] = 0;
+}
+
+MemDBSkipList::~MemDBSkipList()
+{
+  ceph_assert(readers[0] == 0 && readers[1] == 0);
+  Node *n = head;
+  while (n) {
+    Node *next = n->get_next(0);
+    Version *v = n->versions.load();
+    while (v) {
+      Version *older = v->next.load();
+      delete v;
+      v = older;
+    }
+    Node::destroy(n);
+    n = next;
+  }
+  reclaim(0);
+  reclaim(1);
+}
+
+const MemDBSkipList::Node* MemDBSkipList::last() const
+{
+  const Node *x = head;
+  int level = MAX_HEIGHT - 1;
+  while (true) {
+    const Node *nx = x->get_next(level);
+    if (nx) {
+      x = nx;
+    } else if (level == 0) {
+      return x == head ? nullptr : x;
+    } else {
+      --level;
+    }
+  }
+}
+
+MemDBSkipList::Node* MemDBSkipList::find_ge(const std::string& k,
+					    Node** prev) const
+{
+  Node *x = head;
+  int level = MAX_HEIGHT - 1;
+  while (true) {
+    Node *nx = x->get_next(level);
+    if (nx && nx->key < k) {
+      x = nx;
+    } else {
+      if (prev) {
+	prev[level] = x;
+      }
+      if (level == 0) {
+	return nx;
+      }
+      --level;
+    }
+  }
+}
+
+const MemDBSkipList::Node* MemDBSkipList::seek_ge(const std::string& k) const
+{
+  return find_ge(k, nullptr);
+}
+
+const MemDBSkipList::Node* MemDBSkipList::seek_gt(const std::string& k) const
+{
+  const Node *x = head;
+  int level = MAX_HEIGHT - 1;
+  while (true) {
+    const Node *nx = x->get_next(level);
+    if (nx && nx->key <= k) {
+      x = nx;
+    } else if (level == 0) {
+      return nx;
+    } else {
+      --level;
+    }
+  }
+}
+
+const MemDBSkipList::Node* MemDBSkipList::seek_lt(const std::string& k) const
+{
+  const Node *x = head;
+  int level = MAX_HEIGHT - 1;
+  while (true) {
+    const Node *nx = x->get_next(level);
+    if (nx && nx->key < k) {
+      x = nx;
+    } else if (level == 0) {
+      return x == head ? nullptr : x;
+    } else {
+      --level;
+    }
+  }
+}
+
+const MemDBSkipList::Version* MemDBSkipList::get_version(const Node* n,
+							 uint64_t seq)
+{
+  const Version *v = n->versions.load(std::memory_order_acquire);
+  while (v && v->seq > seq) {
+    v = v->next.load(std::memory_order_acquire);
+  }
+  return v;
+}
+
+uint64_t MemDBSkipList::begin_write()
+{
+  write_seq = visible_seq.load() + 1;
+  update_horizon();
+  return write_seq;
+}
+
+const MemDBSkipList::Version* MemDBSkipList::get_latest(
+  const std::string& key) const
+{
+  const Node *n = find_ge(key, nullptr);
+  if (!n || n->key != key) {
+    return nullptr;
+  }
+  const Version *v = n->versions.load(std::memory_order_relaxed);
+  return v && !v->deleted ? v : nullptr;
+}
+
+void MemDBSkipList::put(const std::string& key, ceph::bufferptr&& value)
+{
+  add_version(key, new Version(write_seq, false, std::move(value)));
+}
+
+void MemDBSkipList::remove(const std::string& key)
+{
+  add_version(key, new Version(write_seq, true, ceph::bufferptr()));
+}
+
+void MemDBSkipList::publish()
+{
+  visible_seq.store(write_seq);
+
+  // every reader sees these as deleted by now; drop their nodes unless
+  // the key has been written again
+  while (!tombstones.empty() && tombstones.front().first <= horizon) {
+    unlink(tombstones.front().second);
+    tombstones.pop_front();
+  }
+}
+
+int MemDBSkipList::random_height()
+{
+  // xorshift; one in four nodes goes up a level
+  int height = 1;
+  while (height < MAX_HEIGHT) {
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 7;
+    rand_state ^= rand_state << 17;
+    if ((rand_state & 3) != 0) {
+      break;
+    }
+    ++height;
+  }
+  return height;
+}
+
+void MemDBSkipList::add_version(const std::string& key, Version* v)
+{
+  Node *prev[MAX_HEIGHT];
+  Node *n = find_ge(key, prev);
+  if (n && n->key == key) {
+    Version *cur = n->versions.load(std::memory_order_relaxed);
+    bool was_live = cur && !cur->deleted;
+    if (v->deleted && !was_live) {
+      delete v;
+      return;
+    }
+    index_bytes += sizeof(Version);
+    if (cur && cur->seq == v->seq) {
+      // overwritten within this transaction; nobody can have read it
+      v->next.store(cur->next.load(std::memory_order_relaxed),
+		    std::memory_order_relaxed);
+      n->versions.store(v, std::memory_order_release);
+      retire(cur);
+    } else {
+      v->next.store(cur, std::memory_order_relaxed);
+      n->versions.store(v, std::memory_order_release);
+    }
+    if (was_live && v->deleted) {
+      --num_keys;
+    } else if (!was_live && !v->deleted) {
+      ++num_keys;
+    }
+    trim(n);
+  } else {
+    if (v->deleted) {
+      delete v;
+      return;
+    }
+    int height = random_height();
+    n = Node::create(key, height);
+    n->versions.store(v, std::memory_order_relaxed);
+    for (int i = 0; i < height; ++i) {
+      n->next[i].store(prev[i]->get_next(i), std::memory_order_relaxed);
+    }
+    // publish bottom up so that a reader that finds n at some level can
+    // always continue below it
+    for (int i = 0; i < height; ++i) {
+      prev[i]->next[i].store(n, std::memory_order_release);
+    }
+    ++num_keys;
+    index_bytes += sizeof(Node) + sizeof(std::atomic<Node*>) * (height - 1) +
+      key.size() + sizeof(Version);
+  }
+  if (v->deleted) {
+    tombstones.emplace_back(v->seq, key);
+  }
+}
+
+void MemDBSkipList::trim(Node* n)
+{
+  // keep what is newer than the horizon plus the newest version at or
+  // below it; no reader can get past that one
+  Version *v = n->versions.load(std::memory_order_relaxed);
+  while (v && v->seq > horizon) {
+    v = v->next.load(std::memory_order_relaxed);
+  }
+  if (!v) {
+    return;
+  }
+  Version *old = v->next.exchange(nullptr, std::memory_order_release);
+  while (old) {
+    Version *older = old->next.load(std::memory_order_relaxed);
+    retire(old);
+    old = older;
+  }
+}
+
+void MemDBSkipList::unlink(const std::string& key)
+{
+  Node *prev[MAX_HEIGHT];
+  Node *n = find_ge(key, prev);
+  if (!n || n->key != key) {
+    return;
+  }
+  Version *v = n->versions.load(std::memory_order_relaxed);
+  if (!v || !v->deleted || v->seq > horizon) {
+    return;
+  }
+  for (int i = n->height - 1; i >= 0; --i) {
+    prev[i]->next[i].store(n->get_next(i), std::memory_order_release);
+  }
+  while (v) {
+    Version *older = v->next.load(std::memory_order_relaxed);
+    retire(v);
+    v = older;
+  }
+  index_bytes -= sizeof(Node) + sizeof(std::atomic<Node*>) * (n->height - 1) +
+    n->key.size();
+  retired_nodes[epoch.load() & 1].push_back(n);
+}
+
+void MemDBSkipList::retire(Version* v)
+{
+  index_bytes -= sizeof(Version);
+  retired_versions[epoch.load() & 1].push_back(v);
+}
+
+void MemDBSkipList::update_horizon()
+{
+  uint64_t e = epoch.load();
+  unsigned prev = (e + 1) & 1;  // slot of epoch e - 1
+  if (readers[prev].load() == 0) {
+    // whatever was unlinked in epoch e - 1 is out of reach now
+    reclaim(prev);
+    epoch_start_seq[prev] = visible_seq.load();
+    epoch.store(++e);
+    prev = (e + 1) & 1;
+  }
+  horizon = readers[prev].load() ? epoch_start_seq[prev] :
+    epoch_start_seq[e & 1];
+}
+
+void MemDBSkipList::reclaim(unsigned slot)
+{
+  for (auto v : retired_versions[slot]) {
+    delete v;
+  }
+  retired_versions[slot].clear();
+  for (auto n : retired_nodes[slot]) {
+    Node::destroy(n);
+  }
+  retired_nodes[slot].clear();
+}
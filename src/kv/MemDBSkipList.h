@@ -0,0 +1,152 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ordered in-memory index for MemDB with lock-free readers
+ */
+
+#ifndef CEPH_KV_MEMDBSKIPLIST_H
+#define CEPH_KV_MEMDBSKIPLIST_H
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "include/buffer.h"
+
+/**
+ * Multi-version skiplist keyed by MemDB's raw (prefix + key) strings.
+ *
+ * Readers never take a lock: they pin the current epoch (see ReadGuard),
+ * read at the sequence that was last published, and walk nodes and
+ * version chains through acquire loads.  Writers are serialized by the
+ * caller; every write of a transaction is tagged with the same sequence,
+ * and publish() makes the whole transaction visible at once.
+ *
+ * Each key keeps a chain of versions, newest first.  Versions that no
+ * pinned reader can see any more are unlinked, and keys whose newest
+ * version is an old tombstone are removed from the list.  Unlinked
+ * memory is only freed once every reader that could still hold a
+ * pointer to it has dropped its pin.
+ */
+class MemDBSkipList {
+public:
+  static constexpr int MAX_HEIGHT = 12;
+
+  struct Version {
+    uint64_t seq;
+    bool deleted;
+    ceph::bufferptr value;
+    std::atomic<Version*> next{nullptr};  ///< older version
+
+    Version(uint64_t seq, bool deleted, ceph::bufferptr&& value)
+      : seq(seq), deleted(deleted), value(std::move(value)) {}
+  };
+
+  struct Node {
+    const std::string key;
+    std::atomic<Version*> versions{nullptr};
+    const int height;
+    std::atomic<Node*> next[1];  ///< really next[height]
+
+    static Node* create(const std::string& key, int height);
+    static void destroy(Node* n);
+
+    Node* get_next(int level) const {
+      return next[level].load(std::memory_order_acquire);
+    }
+  private:
+    Node(const std::string& key, int height) : key(key), height(height) {}
+  };
+
+  /// pins the current epoch and a read sequence for as long as it lives
+  class ReadGuard {
+    const MemDBSkipList* list = nullptr;
+    unsigned slot = 0;
+  public:
+    uint64_t seq = 0;
+
+    ReadGuard() = default;
+    explicit ReadGuard(const MemDBSkipList* l);
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+    ~ReadGuard();
+  };
+
+  MemDBSkipList();
+  ~MemDBSkipList();
+
+  // readers; need a ReadGuard
+  const Node* first() const {
+    return head->get_next(0);
+  }
+  const Node* last() const;
+  /// first node with key >= k
+  const Node* seek_ge(const std::string& k) const;
+  /// first node with key > k
+  const Node* seek_gt(const std::string& k) const;
+  /// last node with key < k
+  const Node* seek_lt(const std::string& k) const;
+  static const Node* next(const Node* n) {
+    return n->get_next(0);
+  }
+  /// version of n that a reader at seq sees, nullptr if none
+  static const Version* get_version(const Node* n, uint64_t seq);
+  /// same, but nullptr for deleted keys as well
+  static const Version* get_value(const Node* n, uint64_t seq) {
+    auto v = get_version(n, seq);
+    return v && !v->deleted ? v : nullptr;
+  }
+
+  // writers; the caller serializes these
+  uint64_t begin_write();
+  /// newest value of key, including this transaction's writes
+  const Version* get_latest(const std::string& key) const;
+  void put(const std::string& key, ceph::bufferptr&& value);
+  void remove(const std::string& key);
+  void publish();
+
+  uint64_t get_seq() const {
+    return visible_seq.load();
+  }
+  uint64_t get_num_keys() const {
+    return num_keys;
+  }
+  /// bytes held by nodes and versions (values are not included)
+  uint64_t get_index_bytes() const {
+    return index_bytes;
+  }
+
+private:
+  Node* head;
+  std::atomic<uint64_t> visible_seq{0};
+
+  // epoch based reclamation; readers register in the slot of the epoch
+  // they entered in, memory unlinked in epoch e is freed once no reader
+  // of epoch e is left
+  mutable std::atomic<uint64_t> epoch{0};
+  mutable std::atomic<uint64_t> readers[2];
+
+  // writer state
+  uint64_t write_seq = 0;
+  uint64_t horizon = 0;  ///< oldest seq a pinned reader may be reading at
+  uint64_t epoch_start_seq[2] = {0, 0};
+  std::vector<Version*> retired_versions[2];
+  std::vector<Node*> retired_nodes[2];
+  /// (seq, key) of deletions, oldest first, to drop their nodes later
+  std::deque<std::pair<uint64_t, std::string>> tombstones;
+  uint64_t num_keys = 0;
+  uint64_t index_bytes = 0;
+  uint64_t rand_state = 0xdeadbeef;
+
+  int random_height();
+  Node* find_ge(const std::string& k, Node** prev) const;
+  void add_version(const std::string& key, Version* v);
+  void trim(Node* n);
+  void unlink(const std::string& key);
+  void retire(Version* v);
+  void update_horizon();
+  void reclaim(unsigned slot);
+};
+
+#endif
@@ -26,6 +26,7 @@ namespace fs = std::experimental::filesystem;
 #include "rocksdb/utilities/convenience.h"
 #include "rocksdb/merge_operator.h"
 
+#include "common/admin_socket.h"
 #include "common/perf_counters.h"
 #include "common/PriorityCache.h"
 #include "include/common_fwd.h"
@@ -79,6 +80,49 @@ static rocksdb::SliceParts prepare_sliceparts(const bufferlist &bl,
   return rocksdb::SliceParts(slices->data(), slices->size());
 }
 
+class RocksDBStore::SocketHook : public AdminSocketHook {
+  RocksDBStore* db;
+public:
+  static RocksDBStore::SocketHook* create(RocksDBStore* db)
+  {
+    RocksDBStore::SocketHook* hook = nullptr;
+    AdminSocket* admin_socket = db->cct->get_admin_socket();
+    if (admin_socket) {
+      hook = new RocksDBStore::SocketHook(db);
+      int r = admin_socket->register_command(
+	"rocksdb tombstone stats",
+	hook,
+	"Dump deletions tracked per prefix and key range, and the "
+	"compactions they triggered");
+      if (r != 0) {
+	ldout(db->cct, 1) << __func__ << " cannot register SocketHook" << dendl;
+	delete hook;
+	hook = nullptr;
+      }
+    }
+    return hook;
+  }
+
+  ~SocketHook() {
+    AdminSocket* admin_socket = db->cct->get_admin_socket();
+    admin_socket->unregister_commands(this);
+  }
+private:
+  SocketHook(RocksDBStore* db) :
+    db(db) {}
+  int call(std::string_view command, const cmdmap_t& cmdmap,
+	   Formatter *f,
+	   std::ostream& errss,
+	   bufferlist& out) override {
+    if (command == "rocksdb tombstone stats") {
+      db->dump_tombstone_stats(f);
+    } else {
+      errss << "Invalid command" << std::endl;
+      return -ENOSYS;
+    }
+    return 0;
+  }
+};
 
 //
 // One of these for the default rocksdb column family, routing each prefix
@@ -511,18 +555,22 @@ int RocksDBStore::load_rocksdb_options(bool create_if_missing, rocksdb::Options&
 }
 
 void RocksDBStore::add_column_family(const std::string& cf_name, uint32_t hash_l, uint32_t hash_h,
-				     size_t shard_idx, rocksdb::ColumnFamilyHandle *handle) {
+				     uint32_t hash_bits, size_t shard_idx,
+				     rocksdb::ColumnFamilyHandle *handle) {
   dout(10) << __func__ << " column_name=" << cf_name << " shard_idx=" << shard_idx <<
-    " hash_l=" << hash_l << " hash_h=" << hash_h << " handle=" << (void*) handle << dendl;
+    " hash_l=" << hash_l << " hash_h=" << hash_h << " hash_bits=" << hash_bits <<
+    " handle=" << (void*) handle << dendl;
   bool exists = cf_handles.count(cf_name) > 0;
   auto& column = cf_handles[cf_name];
   if (exists) {
     ceph_assert(hash_l == column.hash_l);
     ceph_assert(hash_h == column.hash_h);
+    ceph_assert(hash_bits == column.hash_bits);
   } else {
-    ceph_assert(hash_l < hash_h);
+    ceph_assert(hash_l < hash_h || (hash_l == hash_h && hash_bits > 0));
     column.hash_l = hash_l;
     column.hash_h = hash_h;
+    column.hash_bits = hash_bits;
   }
   if (column.handles.size() <= shard_idx)
     column.handles.resize(shard_idx + 1);
@@ -534,7 +582,34 @@ bool RocksDBStore::is_column_family(const std::string& prefix) {
   return cf_handles.count(prefix);
 }
 
+/**
+ * Hash of key characters [hash_l, hash_h), followed by the leading
+ * hash_bits bits of the characters after them. Bits let shard boundaries
+ * follow a bit-reversed hash, e.g. that of an object in its PG.
+ */
+static uint32_t get_shard_hash(uint32_t hash_l, uint32_t hash_h,
+			       uint32_t hash_bits,
+			       const char* key, size_t keylen)
+{
+  uint32_t l = std::min<uint32_t>(hash_l, keylen);
+  if (hash_bits == 0) {
+    uint32_t h = std::min<uint32_t>(hash_h, keylen);
+    return ceph_str_hash_rjenkins(key + l, h - l);
+  }
+  uint64_t end = (uint64_t)hash_h + (hash_bits + 7) / 8;
+  uint32_t h = std::min<uint64_t>(end, keylen);
+  std::string buf(key + l, h - l);
+  if (h == end && hash_bits % 8) {
+    buf.back() &= (char)(0xff << (8 - hash_bits % 8));
+  }
+  return ceph_str_hash_rjenkins(buf.data(), buf.size());
+}
+
 rocksdb::ColumnFamilyHandle *RocksDBStore::get_cf_handle(const std::string& prefix, const std::string& key) {
+  return get_cf_handle(prefix, key.data(), key.size());
+}
+
+rocksdb::ColumnFamilyHandle *RocksDBStore::get_cf_handle(const std::string& prefix, const char* key, size_t keylen) {
   auto iter = cf_handles.find(prefix);
   if (iter == cf_handles.end()) {
     return nullptr;
@@ -542,28 +617,36 @@ rocksdb::ColumnFamilyHandle *RocksDBStore::get_cf_handle(const std::string& pref
     if (iter->second.handles.size() == 1) {
       return iter->second.handles[0];
     } else {
-      uint32_t hash_l = std::min<uint32_t>(iter->second.hash_l, key.size());
-      uint32_t hash_h = std::min<uint32_t>(iter->second.hash_h, key.size());
-      uint32_t hash = ceph_str_hash_rjenkins(&key[hash_l], hash_h - hash_l);
+      uint32_t hash = get_shard_hash(iter->second.hash_l, iter->second.hash_h,
+				     iter->second.hash_bits, key, keylen);
       return iter->second.handles[hash % iter->second.handles.size()];
     }
   }
 }
 
-rocksdb::ColumnFamilyHandle *RocksDBStore::get_cf_handle(const std::string& prefix, const char* key, size_t keylen) {
+/**
+ * Returns the only shard that keys within bounds can live in, or nullptr
+ * if the bounds do not pin down the bytes that the shard hash is taken
+ * from (or prefix is not sharded).
+ */
+rocksdb::ColumnFamilyHandle *RocksDBStore::get_cf_handle(
+  const std::string& prefix,
+  const IteratorBounds& bounds) {
+  if (!bounds.lower_bound || !bounds.upper_bound) {
+    return nullptr;
+  }
   auto iter = cf_handles.find(prefix);
-  if (iter == cf_handles.end()) {
+  if (iter == cf_handles.end() || iter->second.handles.size() == 1) {
+    return nullptr;
+  }
+  const std::string& lower = *bounds.lower_bound;
+  const std::string& upper = *bounds.upper_bound;
+  uint32_t hash_h = iter->second.hash_h + (iter->second.hash_bits + 7) / 8;
+  if (lower.size() < hash_h || upper.size() < hash_h ||
+      lower.compare(0, hash_h, upper, 0, hash_h) != 0) {
     return nullptr;
-  } else {
-    if (iter->second.handles.size() == 1) {
-      return iter->second.handles[0];
-    } else {
-      uint32_t hash_l = std::min<uint32_t>(iter->second.hash_l, keylen);
-      uint32_t hash_h = std::min<uint32_t>(iter->second.hash_h, keylen);
-      uint32_t hash = ceph_str_hash_rjenkins(&key[hash_l], hash_h - hash_l);
-      return iter->second.handles[hash % iter->second.handles.size()];
-    }
   }
+  return get_cf_handle(prefix, lower);
 }
 
 /**
@@ -572,7 +655,8 @@ rocksdb::ColumnFamilyHandle *RocksDBStore::get_cf_handle(const std::string& pref
  * column_def := column_name '(' shard_count ')'
  * column_def := column_name '(' shard_count ',' hash_begin '-' ')'
  * column_def := column_name '(' shard_count ',' hash_begin '-' hash_end ')'
- * I=write_buffer_size=1048576 O(6) m(7,10-) prefix(4,0-10)=disable_auto_compactions=true,max_bytes_for_level_base=1048576
+ * column_def := column_name '(' shard_count ',' hash_begin '-' hash_end '.' hash_bits ')'
+ * I=write_buffer_size=1048576 O(6) m(7,10-) p(4,0-8.5) prefix(4,0-10)=disable_auto_compactions=true,max_bytes_for_level_base=1048576
  */
 bool RocksDBStore::parse_sharding_def(const std::string_view text_def_in,
 				     std::vector<ColumnFamily>& sharding_def,
@@ -598,6 +682,7 @@ bool RocksDBStore::parse_sharding_def(const std::string_view text_def_in,
     size_t shard_cnt = 1;
     uint32_t l_bound = 0;
     uint32_t h_bound = std::numeric_limits<uint32_t>::max();
+    uint32_t h_bits = 0;
 
     std::string_view column_def;
     size_t spos = text_def.find(' ');
@@ -646,6 +731,21 @@ bool RocksDBStore::parse_sharding_def(const std::string_view text_def_in,
 	  h_bound = std::numeric_limits<uint32_t>::max();
 	}
 	nptr = endptr;
+	if (*nptr == '.') {
+	  if (h_bound == std::numeric_limits<uint32_t>::max()) {
+	    *error_position = nptr;
+	    *error_msg = "hash bits need hash end";
+	    break;
+	  }
+	  nptr++;
+	  h_bits = strtol(nptr, &endptr, 10);
+	  if (nptr == endptr || h_bits == 0 || h_bits > 64) {
+	    *error_position = nptr;
+	    *error_msg = "expecting integer 1..64";
+	    break;
+	  }
+	  nptr = endptr;
+	}
       }
       if (*nptr != ')') {
 	*error_position = nptr;
@@ -655,7 +755,8 @@ bool RocksDBStore::parse_sharding_def(const std::string_view text_def_in,
     } else {
       name = column_def;
     }
-    sharding_def.emplace_back(std::string(name), shard_cnt, std::string(options), l_bound, h_bound);
+    sharding_def.emplace_back(std::string(name), shard_cnt, std::string(options), l_bound, h_bound,
+			      h_bits);
   }
   return *error_position == nullptr;
 }
@@ -706,7 +807,7 @@ int RocksDBStore::create_shards(const rocksdb::Options& opt,
 	return -EINVAL;
       }
       // store the new CF handle
-      add_column_family(p.name, p.hash_l, p.hash_h, idx, cf);
+      add_column_family(p.name, p.hash_l, p.hash_h, p.hash_bits, idx, cf);
     }
   }
   return 0;
@@ -839,6 +940,9 @@ std::ostream& operator<<(std::ostream& out, const RocksDBStore::ColumnFamily& cf
   if (cf.hash_h != std::numeric_limits<uint32_t>::max()) {
     out << cf.hash_h;
   }
+  if (cf.hash_bits) {
+    out << "." << cf.hash_bits;
+  }
   out << ",";
   out << cf.options;
   out << ")";
@@ -926,6 +1030,7 @@ int RocksDBStore::do_open(ostream &out,
 	add_column_family(existing_cfs_shard[i].second.name,
 			  existing_cfs_shard[i].second.hash_l,
 			  existing_cfs_shard[i].second.hash_h,
+			  existing_cfs_shard[i].second.hash_bits,
 			  existing_cfs_shard[i].first,
 			  handles[i]);
       }
@@ -947,6 +1052,7 @@ int RocksDBStore::do_open(ostream &out,
 	  add_column_family(missing_cfs_shard[i].second.name,
 			    missing_cfs_shard[i].second.hash_l,
 			    missing_cfs_shard[i].second.hash_h,
+			    missing_cfs_shard[i].second.hash_bits,
 			    missing_cfs_shard[i].first,
 			    cf);
 	}
@@ -970,9 +1076,25 @@ int RocksDBStore::do_open(ostream &out,
   plb.add_time_avg(l_rocksdb_write_delay_time, "rocksdb_write_delay_time", "Rocksdb write delay time");
   plb.add_time_avg(l_rocksdb_write_pre_and_post_process_time, 
       "rocksdb_write_pre_and_post_time", "total time spent on writing a record, excluding write process");
+  plb.add_u64_counter(l_rocksdb_tombstone_compact, "tombstone_compact",
+		      "Compactions triggered by deletions in a key range");
+  plb.add_time_avg(l_rocksdb_tombstone_compact_lat, "tombstone_compact_lat",
+		   "Average duration of a deletion-triggered compaction");
+  plb.add_u64(l_rocksdb_tombstone_compact_queue_len, "tombstone_compact_queue_len",
+	      "Length of deletion-triggered compaction queue");
+  plb.add_u64(l_rocksdb_tombstone_ranges, "tombstone_ranges",
+	      "Key ranges with deletions tracked for compaction");
   logger = plb.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
 
+  if (!open_readonly &&
+      cct->_conf.get_val<bool>("rocksdb_tombstone_compact")) {
+    deletion_range_key_bytes = cct->_conf.get_val<uint64_t>(
+      "rocksdb_tombstone_compact_key_bytes");
+    track_deletions = true;
+    asok_hook = SocketHook::create(this);
+  }
+
   if (compact_on_mount) {
     derr << "Compacting rocksdb store..." << dendl;
     compact();
@@ -1015,6 +1137,18 @@ void RocksDBStore::close()
     compact_queue_lock.unlock();
   }
 
+  delete asok_hook;
+  asok_hook = nullptr;
+  track_deletions = false;
+  {
+    std::lock_guard l(deletion_lock);
+    cf_deletions.clear();
+    hot_ranges.clear();
+    hot_ranges_by_heat.clear();
+  }
+  tombstone_compact_queue.clear();
+  tombstone_compact_history.clear();
+
   if (logger) {
     cct->get_perfcounters_collection()->remove(logger);
     delete logger;
@@ -1275,6 +1409,9 @@ int RocksDBStore::submit_common(rocksdb::WriteOptions& woptions, KeyValueDB::Tra
   *_dout << " Rocksdb transaction: " << bat_txc.seen.str() << dendl;
   
   rocksdb::Status s = db->Write(woptions, &_t->bat);
+  if (s.ok() && !_t->cf_deletions.empty()) {
+    note_deletions(_t->cf_deletions, _t->range_deletions);
+  }
   if (!s.ok()) {
     RocksWBHandler rocks_txc(*this);
     _t->bat.Iterate(&rocks_txc);
@@ -1338,6 +1475,47 @@ RocksDBStore::RocksDBTransactionImpl::RocksDBTransactionImpl(RocksDBStore *_db)
   db = _db;
 }
 
+void RocksDBStore::RocksDBTransactionImpl::note_put(const string &prefix)
+{
+  if (db->track_deletions) {
+    cf_deletions[prefix].puts++;
+  }
+}
+
+void RocksDBStore::RocksDBTransactionImpl::note_delete(const string &prefix,
+						       const string &k)
+{
+  if (db->track_deletions) {
+    cf_deletions[prefix].deletes++;
+    range_deletions[{prefix, k.substr(0, db->deletion_range_key_bytes)}]
+      .note_delete(k);
+  }
+}
+
+void RocksDBStore::RocksDBTransactionImpl::note_deletes(
+  const string &prefix,
+  const deletion_stats_t &deleted)
+{
+  if (db->track_deletions && deleted.deletes) {
+    cf_deletions[prefix].deletes += deleted.deletes;
+    range_deletions[{prefix,
+		     deleted.first.substr(0, db->deletion_range_key_bytes)}]
+      .merge(deleted);
+  }
+}
+
+void RocksDBStore::RocksDBTransactionImpl::note_range_delete(
+  const string &prefix,
+  const string &start,
+  const string &end)
+{
+  if (db->track_deletions) {
+    cf_deletions[prefix].range_deletes++;
+    range_deletions[{prefix, start.substr(0, db->deletion_range_key_bytes)}]
+      .note_range_delete(start, end);
+  }
+}
+
 void RocksDBStore::RocksDBTransactionImpl::put_bat(
   rocksdb::WriteBatch& bat,
   rocksdb::ColumnFamilyHandle *cf,
@@ -1371,6 +1549,7 @@ void RocksDBStore::RocksDBTransactionImpl::set(
     string key = combine_strings(prefix, k);
     put_bat(bat, db->default_cf, key, to_set_bl);
   }
+  note_put(prefix);
 }
 
 void RocksDBStore::RocksDBTransactionImpl::set(
@@ -1387,6 +1566,7 @@ void RocksDBStore::RocksDBTransactionImpl::set(
     combine_strings(prefix, k, keylen, &key);
     put_bat(bat, cf, key, to_set_bl);
   }
+  note_put(prefix);
 }
 
 void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
@@ -1398,6 +1578,7 @@ void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
   } else {
     bat.Delete(db->default_cf, combine_strings(prefix, k));
   }
+  note_delete(prefix, k);
 }
 
 void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
@@ -1412,6 +1593,9 @@ void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
     combine_strings(prefix, k, keylen, &key);
     bat.Delete(db->default_cf, rocksdb::Slice(key));
   }
+  if (db->track_deletions) {
+    note_delete(prefix, string(k, keylen));
+  }
 }
 
 void RocksDBStore::RocksDBTransactionImpl::rm_single_key(const string &prefix,
@@ -1423,6 +1607,7 @@ void RocksDBStore::RocksDBTransactionImpl::rm_single_key(const string &prefix,
   } else {
     bat.SingleDelete(db->default_cf, combine_strings(prefix, k));
   }
+  note_delete(prefix, k);
 }
 
 void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix)
@@ -1432,8 +1617,14 @@ void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix
     uint64_t cnt = db->delete_range_threshold;
     bat.SetSavePoint();
     auto it = db->get_iterator(prefix);
+    // deletions are only noted once we know whether this turns into a
+    // range delete
+    deletion_stats_t deleted;
     for (it->seek_to_first(); it->valid() && (--cnt) != 0; it->next()) {
       bat.Delete(db->default_cf, combine_strings(prefix, it->key()));
+      if (db->track_deletions) {
+	deleted.note_delete(it->key());
+      }
     }
     if (cnt == 0) {
 	bat.RollbackToSavePoint();
@@ -1442,8 +1633,10 @@ void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix
 	bat.DeleteRange(db->default_cf,
                         combine_strings(prefix, string()),
                         combine_strings(endprefix, string()));
+	note_range_delete(prefix, string(), "\xff\xff\xff\xff");
     } else {
       bat.PopSavePoint();
+      note_deletes(prefix, deleted);
     }
   } else {
     ceph_assert(p_iter->second.handles.size() >= 1);
@@ -1451,15 +1644,21 @@ void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix
       uint64_t cnt = db->delete_range_threshold;
       bat.SetSavePoint();
       auto it = db->new_shard_iterator(cf);
+      deletion_stats_t deleted;
       for (it->SeekToFirst(); it->Valid() && (--cnt) != 0; it->Next()) {
 	bat.Delete(cf, it->key());
+	if (db->track_deletions) {
+	  deleted.note_delete(it->key().ToString());
+	}
       }
       if (cnt == 0) {
 	bat.RollbackToSavePoint();
 	string endprefix = "\xff\xff\xff\xff";  // FIXME: this is cheating...
 	bat.DeleteRange(cf, string(), endprefix);
+	note_range_delete(prefix, string(), endprefix);
       } else {
 	bat.PopSavePoint();
+	note_deletes(prefix, deleted);
       }
     }
   }
@@ -1474,18 +1673,24 @@ void RocksDBStore::RocksDBTransactionImpl::rm_range_keys(const string &prefix,
     uint64_t cnt = db->delete_range_threshold;
     bat.SetSavePoint();
     auto it = db->get_iterator(prefix);
+    deletion_stats_t deleted;
     for (it->lower_bound(start);
 	 it->valid() && db->comparator->Compare(it->key(), end) < 0 && (--cnt) != 0;
 	 it->next()) {
       bat.Delete(db->default_cf, combine_strings(prefix, it->key()));
+      if (db->track_deletions) {
+	deleted.note_delete(it->key());
+      }
     }
     if (cnt == 0) {
       bat.RollbackToSavePoint();
       bat.DeleteRange(db->default_cf,
 		      rocksdb::Slice(combine_strings(prefix, start)),
 		      rocksdb::Slice(combine_strings(prefix, end)));
+      note_range_delete(prefix, start, end);
     } else {
       bat.PopSavePoint();
+      note_deletes(prefix, deleted);
     }
   } else {
     ceph_assert(p_iter->second.handles.size() >= 1);
@@ -1494,16 +1699,22 @@ void RocksDBStore::RocksDBTransactionImpl::rm_range_keys(const string &prefix,
       bat.SetSavePoint();
       rocksdb::Iterator* it = db->new_shard_iterator(cf);
       ceph_assert(it != nullptr);
+      deletion_stats_t deleted;
       for (it->Seek(start);
 	   it->Valid() && db->comparator->Compare(it->key(), end) < 0 && (--cnt) != 0;
 	   it->Next()) {
 	bat.Delete(cf, it->key());
+	if (db->track_deletions) {
+	  deleted.note_delete(it->key().ToString());
+	}
       }
       if (cnt == 0) {
 	bat.RollbackToSavePoint();
 	bat.DeleteRange(cf, rocksdb::Slice(start), rocksdb::Slice(end));
+	note_range_delete(prefix, start, end);
       } else {
 	bat.PopSavePoint();
+	note_deletes(prefix, deleted);
       }
       delete it;
     }
@@ -1555,35 +1766,43 @@ int RocksDBStore::get(
     const std::set<string> &keys,
     std::map<string, bufferlist> *out)
 {
-  rocksdb::PinnableSlice value;
   utime_t start = ceph_clock_now();
-  if (cf_handles.count(prefix) > 0) {
+  if (!keys.empty()) {
+    // look all keys up in one batch; MultiGet shares the memtable/sst
+    // lookups and issues the block reads of a column family together
+    size_t n = keys.size();
+    std::vector<rocksdb::ColumnFamilyHandle*> cfs(n);
+    std::vector<std::string> combined;
+    std::vector<rocksdb::Slice> slices(n);
+    std::vector<rocksdb::PinnableSlice> values(n);
+    std::vector<rocksdb::Status> statuses(n);
+    bool is_cf = cf_handles.count(prefix) > 0;
+    if (!is_cf) {
+      combined.reserve(n);
+    }
+    size_t i = 0;
     for (auto& key : keys) {
-      auto cf_handle = get_cf_handle(prefix, key);
-      auto status = db->Get(rocksdb::ReadOptions(),
-			    cf_handle,
-			    rocksdb::Slice(key),
-			    &value);
-      if (status.ok()) {
-	(*out)[key].append(value.data(), value.size());
-      } else if (status.IsIOError()) {
-	ceph_abort_msg(status.getState());
+      if (is_cf) {
+	cfs[i] = get_cf_handle(prefix, key);
+	slices[i] = rocksdb::Slice(key);
+      } else {
+	cfs[i] = default_cf;
+	combined.push_back(combine_strings(prefix, key));
+	slices[i] = rocksdb::Slice(combined.back());
       }
-      value.Reset();
+      ++i;
     }
-  } else {
+    db->MultiGet(rocksdb::ReadOptions(), n, cfs.data(), slices.data(),
+		 values.data(), statuses.data(), false);
+    i = 0;
     for (auto& key : keys) {
-      string k = combine_strings(prefix, key);
-      auto status = db->Get(rocksdb::ReadOptions(),
-			    default_cf,
-			    rocksdb::Slice(k),
-			    &value);
+      auto& status = statuses[i];
       if (status.ok()) {
-	(*out)[key].append(value.data(), value.size());
+	(*out)[key].append(values[i].data(), values[i].size());
       } else if (status.IsIOError()) {
 	ceph_abort_msg(status.getState());
       }
-      value.Reset();
+      ++i;
     }
   }
   utime_t lat = ceph_clock_now() - start;
@@ -1720,6 +1939,30 @@ void RocksDBStore::compact_thread_entry()
       l.lock();
       continue;
     }
+    if (!tombstone_compact_queue.empty()) {
+      // these are ours, not the user's: keep them spaced out so that they
+      // don't compete with client io
+      if (ceph::mono_clock::now() < next_tombstone_compact) {
+	compact_queue_cond.wait_until(l, next_tombstone_compact);
+	continue;
+      }
+      auto c = std::move(tombstone_compact_queue.front());
+      tombstone_compact_queue.pop_front();
+      logger->set(l_rocksdb_tombstone_compact_queue_len,
+		  tombstone_compact_queue.size());
+      l.unlock();
+      compact_tombstones(c);
+      l.lock();
+      auto interval = cct->_conf.get_val<double>(
+	"rocksdb_tombstone_compact_interval");
+      next_tombstone_compact = ceph::mono_clock::now() +
+	ceph::make_timespan(interval);
+      tombstone_compact_history.emplace_front(std::move(c));
+      if (tombstone_compact_history.size() > TOMBSTONE_COMPACT_HISTORY) {
+	tombstone_compact_history.pop_back();
+      }
+      continue;
+    }
     dout(10) << __func__ << " waiting" << dendl;
     compact_queue_cond.wait(l);
   }
@@ -1768,6 +2011,228 @@ void RocksDBStore::compact_range_async(const string& start, const string& end)
     compact_thread.create("rstore_compact");
   }
 }
+void RocksDBStore::deletion_stats_t::note_delete(const string& key)
+{
+  if (!deletes && !range_deletes) {
+    first = last = key;
+  } else if (key < first) {
+    first = key;
+  } else if (key > last) {
+    last = key;
+  }
+  deletes++;
+}
+
+void RocksDBStore::deletion_stats_t::note_range_delete(const string& start,
+						       const string& end)
+{
+  if (!deletes && !range_deletes) {
+    first = start;
+    last = end;
+  } else {
+    first = std::min(first, start);
+    last = std::max(last, end);
+  }
+  range_deletes++;
+}
+
+void RocksDBStore::deletion_stats_t::merge(const deletion_stats_t& o)
+{
+  if (o.deletes || o.range_deletes) {
+    if (!deletes && !range_deletes) {
+      first = o.first;
+      last = o.last;
+    } else {
+      first = std::min(first, o.first);
+      last = std::max(last, o.last);
+    }
+  }
+  puts += o.puts;
+  deletes += o.deletes;
+  range_deletes += o.range_deletes;
+}
+
+void RocksDBStore::deletion_stats_t::dump(Formatter *f) const
+{
+  f->dump_unsigned("puts", puts);
+  f->dump_unsigned("deletes", deletes);
+  f->dump_unsigned("range_deletes", range_deletes);
+}
+
+void RocksDBStore::tombstone_compaction_t::dump(Formatter *f) const
+{
+  f->dump_string("prefix", prefix);
+  f->dump_string("start", pretty_binary_string(start));
+  f->dump_string("end", pretty_binary_string(end));
+  f->dump_string("reason", reason);
+  f->dump_stream("queued") << queued;
+  if (started != utime_t()) {
+    f->dump_stream("started") << started;
+    f->dump_float("duration", duration);
+  }
+}
+
+void RocksDBStore::note_deletions(
+  const map<string, deletion_stats_t>& cfs,
+  const map<deletion_range_t, deletion_stats_t>& ranges)
+{
+  uint64_t trigger = cct->_conf.get_val<uint64_t>(
+    "rocksdb_tombstone_compact_trigger");
+  uint64_t max_ranges = cct->_conf.get_val<uint64_t>(
+    "rocksdb_tombstone_compact_max_ranges");
+  vector<tombstone_compaction_t> ready;
+  {
+    std::lock_guard l(deletion_lock);
+    for (auto& [prefix, stats] : cfs) {
+      cf_deletions[prefix].merge(stats);
+    }
+    for (auto& [range, stats] : ranges) {
+      auto p = hot_ranges.find(range);
+      if (p == hot_ranges.end()) {
+	if (hot_ranges.size() >= max_ranges) {
+	  _trim_hot_ranges(max_ranges);
+	}
+	p = hot_ranges.emplace(range, deletion_stats_t()).first;
+      } else {
+	hot_ranges_by_heat.erase({p->second.heat(), range});
+      }
+      p->second.merge(stats);
+      // we only issue a range delete once delete_range_threshold keys
+      // would otherwise be deleted one by one
+      uint64_t weight = p->second.deletes +
+	p->second.range_deletes * delete_range_threshold;
+      if (trigger == 0 || weight < trigger) {
+	hot_ranges_by_heat.emplace(p->second.heat(), range);
+	continue;
+      }
+      auto& cf = cf_deletions[range.first];
+      tombstone_compaction_t c;
+      c.prefix = range.first;
+      c.start = p->second.first;
+      c.end = p->second.last;
+      std::ostringstream reason;
+      reason << p->second.deletes << " deletes, "
+	     << p->second.range_deletes << " range deletes since last compaction"
+	     << " (trigger " << trigger << "); prefix '" << range.first
+	     << "' deletion density " << cf.density();
+      c.reason = reason.str();
+      c.queued = ceph_clock_now();
+      ready.emplace_back(std::move(c));
+      hot_ranges.erase(p);
+    }
+    logger->set(l_rocksdb_tombstone_ranges, hot_ranges.size());
+  }
+  if (!ready.empty()) {
+    queue_tombstone_compactions(ready);
+  }
+}
+
+void RocksDBStore::_trim_hot_ranges(size_t max_ranges)
+{
+  // forget the coldest ranges; they can be picked up again if deletes
+  // keep coming
+  while (hot_ranges.size() >= max_ranges && !hot_ranges_by_heat.empty()) {
+    auto coldest = hot_ranges_by_heat.begin();
+    auto& range = coldest->second;
+    dout(20) << __func__ << " dropping " << range.first << " "
+	     << pretty_binary_string(range.second) << dendl;
+    hot_ranges.erase(range);
+    hot_ranges_by_heat.erase(coldest);
+  }
+}
+
+void RocksDBStore::queue_tombstone_compactions(
+  vector<tombstone_compaction_t>& cs)
+{
+  std::lock_guard l(compact_queue_lock);
+  for (auto& c : cs) {
+    dout(10) << __func__ << " " << c.prefix << " "
+	     << pretty_binary_string(c.start) << " to "
+	     << pretty_binary_string(c.end) << ": " << c.reason << dendl;
+    auto p = tombstone_compact_queue.begin();
+    for (; p != tombstone_compact_queue.end(); ++p) {
+      if (p->prefix == c.prefix && c.start <= p->end && p->start <= c.end) {
+	// overlaps a range that is still waiting; widen that one
+	p->start = std::min(p->start, c.start);
+	p->end = std::max(p->end, c.end);
+	p->reason = c.reason;
+	break;
+      }
+    }
+    if (p == tombstone_compact_queue.end()) {
+      tombstone_compact_queue.emplace_back(std::move(c));
+    }
+  }
+  logger->set(l_rocksdb_tombstone_compact_queue_len,
+	      tombstone_compact_queue.size());
+  compact_queue_cond.notify_all();
+  if (!compact_thread.is_started()) {
+    compact_thread.create("rstore_compact");
+  }
+}
+
+void RocksDBStore::compact_tombstones(tombstone_compaction_t& c)
+{
+  dout(5) << __func__ << " " << c.prefix << " "
+	  << pretty_binary_string(c.start) << " to "
+	  << pretty_binary_string(c.end) << ": " << c.reason << dendl;
+  rocksdb::CompactRangeOptions options;
+  // don't hold up automatic compactions, and don't fan out
+  options.exclusive_manual_compaction = false;
+  options.max_subcompactions = 1;
+  c.started = ceph_clock_now();
+  compact_range(options,
+		combine_strings(c.prefix, c.start),
+		combine_strings(c.prefix, c.end));
+  c.duration = ceph_clock_now() - c.started;
+  logger->inc(l_rocksdb_tombstone_compact);
+  logger->tinc(l_rocksdb_tombstone_compact_lat, c.duration);
+  dout(5) << __func__ << " done in " << c.duration << dendl;
+}
+
+void RocksDBStore::dump_tombstone_stats(Formatter *f)
+{
+  f->open_object_section("tombstone_stats");
+  {
+    std::lock_guard l(deletion_lock);
+    f->open_array_section("prefixes");
+    for (auto& [prefix, stats] : cf_deletions) {
+      f->open_object_section("prefix");
+      f->dump_string("prefix", prefix);
+      stats.dump(f);
+      f->dump_float("deletion_density", stats.density());
+      f->close_section();
+    }
+    f->close_section();
+    f->open_array_section("hot_ranges");
+    for (auto& [range, stats] : hot_ranges) {
+      f->open_object_section("range");
+      f->dump_string("prefix", range.first);
+      f->dump_string("start", pretty_binary_string(stats.first));
+      f->dump_string("end", pretty_binary_string(stats.last));
+      stats.dump(f);
+      f->close_section();
+    }
+    f->close_section();
+  }
+  std::lock_guard l(compact_queue_lock);
+  f->open_array_section("queued");
+  for (auto& c : tombstone_compact_queue) {
+    f->open_object_section("compaction");
+    c.dump(f);
+    f->close_section();
+  }
+  f->close_section();
+  f->open_array_section("compacted");
+  for (auto& c : tombstone_compact_history) {
+    f->open_object_section("compaction");
+    c.dump(f);
+    f->close_section();
+  }
+  f->close_section();
+  f->close_section();
+}
+
 bool RocksDBStore::check_omap_dir(string &omap_dir)
 {
   rocksdb::Options options;
@@ -1781,7 +2246,12 @@ bool RocksDBStore::check_omap_dir(string &omap_dir)
 
 void RocksDBStore::compact_range(const string& start, const string& end)
 {
-  rocksdb::CompactRangeOptions options;
+  compact_range(rocksdb::CompactRangeOptions(), start, end);
+}
+
+void RocksDBStore::compact_range(const rocksdb::CompactRangeOptions& options,
+				 const string& start, const string& end)
+{
   rocksdb::Slice cstart(start);
   rocksdb::Slice cend(end);
   string prefix_start, key_start;
@@ -1823,18 +2293,40 @@ void RocksDBStore::compact_range(const string& start, const string& end)
   }
 }
 
+RocksDBStore::RocksDBWholeSpaceIteratorImpl::RocksDBWholeSpaceIteratorImpl(
+  const RocksDBStore* db,
+  IteratorOpts opts,
+  const std::string& prefix,
+  const IteratorBounds& bounds)
+  : stats(opts & ITERATOR_TOMBSTONE_STATS)
+{
+  rocksdb::ReadOptions options = db->get_iterator_options(opts);
+  if (bounds.lower_bound) {
+    lower_bound_key = combine_strings(prefix, *bounds.lower_bound);
+    lower_bound_slice = rocksdb::Slice(lower_bound_key);
+    options.iterate_lower_bound = &lower_bound_slice;
+  }
+  if (bounds.upper_bound) {
+    upper_bound_key = combine_strings(prefix, *bounds.upper_bound);
+    upper_bound_slice = rocksdb::Slice(upper_bound_key);
+    options.iterate_upper_bound = &upper_bound_slice;
+  }
+  dbiter = db->db->NewIterator(options, db->default_cf);
+}
 RocksDBStore::RocksDBWholeSpaceIteratorImpl::~RocksDBWholeSpaceIteratorImpl()
 {
   delete dbiter;
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_first()
 {
+  auto sc = stats.scope();
   dbiter->SeekToFirst();
   ceph_assert(!dbiter->status().IsIOError());
   return dbiter->status().ok() ? 0 : -1;
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_first(const string &prefix)
 {
+  auto sc = stats.scope();
   rocksdb::Slice slice_prefix(prefix);
   dbiter->Seek(slice_prefix);
   ceph_assert(!dbiter->status().IsIOError());
@@ -1842,12 +2334,14 @@ int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_first(const string &pre
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_last()
 {
+  auto sc = stats.scope();
   dbiter->SeekToLast();
   ceph_assert(!dbiter->status().IsIOError());
   return dbiter->status().ok() ? 0 : -1;
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::seek_to_last(const string &prefix)
 {
+  auto sc = stats.scope();
   string limit = past_prefix(prefix);
   rocksdb::Slice slice_limit(limit);
   dbiter->Seek(slice_limit);
@@ -1871,6 +2365,7 @@ int RocksDBStore::RocksDBWholeSpaceIteratorImpl::upper_bound(const string &prefi
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::lower_bound(const string &prefix, const string &to)
 {
+  auto sc = stats.scope();
   string bound = combine_strings(prefix, to);
   rocksdb::Slice slice_bound(bound);
   dbiter->Seek(slice_bound);
@@ -1882,6 +2377,7 @@ bool RocksDBStore::RocksDBWholeSpaceIteratorImpl::valid()
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::next()
 {
+  auto sc = stats.scope();
   if (valid()) {
     dbiter->Next();
   }
@@ -1890,6 +2386,7 @@ int RocksDBStore::RocksDBWholeSpaceIteratorImpl::next()
 }
 int RocksDBStore::RocksDBWholeSpaceIteratorImpl::prev()
 {
+  auto sc = stats.scope();
   if (valid()) {
     dbiter->Prev();
   }
@@ -1952,23 +2449,53 @@ string RocksDBStore::past_prefix(const string &prefix)
   return limit;
 }
 
+static rocksdb::Slice make_slice(const std::optional<std::string>& bound)
+{
+  if (bound) {
+    return rocksdb::Slice(*bound);
+  }
+  return rocksdb::Slice();
+}
+
 class CFIteratorImpl : public KeyValueDB::IteratorImpl {
 protected:
   string prefix;
   rocksdb::Iterator *dbiter;
+  const KeyValueDB::IteratorBounds bounds;
+  const rocksdb::Slice iterate_lower_bound;
+  const rocksdb::Slice iterate_upper_bound;
+  RocksDBStore::IteratorStats stats;
 public:
-  explicit CFIteratorImpl(const std::string& p,
-				 rocksdb::Iterator *iter)
-    : prefix(p), dbiter(iter) { }
+  explicit CFIteratorImpl(const RocksDBStore* db,
+			  const std::string& p,
+			  rocksdb::ColumnFamilyHandle* cf,
+			  KeyValueDB::IteratorOpts opts,
+			  KeyValueDB::IteratorBounds bounds_)
+    : prefix(p), bounds(std::move(bounds_)),
+      iterate_lower_bound(make_slice(bounds.lower_bound)),
+      iterate_upper_bound(make_slice(bounds.upper_bound)),
+      stats(opts & KeyValueDB::ITERATOR_TOMBSTONE_STATS)
+  {
+    auto options = db->get_iterator_options(opts);
+    if (bounds.lower_bound) {
+      options.iterate_lower_bound = &iterate_lower_bound;
+    }
+    if (bounds.upper_bound) {
+      options.iterate_upper_bound = &iterate_upper_bound;
+    }
+    dbiter = db->db->NewIterator(options, cf);
+  }
   ~CFIteratorImpl() {
     delete dbiter;
   }
 
   int seek_to_first() override {
+    auto sc = stats.scope();
     dbiter->SeekToFirst();
     return dbiter->status().ok() ? 0 : -1;
   }
   int seek_to_last() override {
+    auto sc = stats.scope();
     dbiter->SeekToLast();
     return dbiter->status().ok() ? 0 : -1;
   }
@@ -1980,17 +2507,20 @@ public:
     return dbiter->status().ok() ? 0 : -1;
   }
   int lower_bound(const string &to) override {
+    auto sc = stats.scope();
     rocksdb::Slice slice_bound(to);
     dbiter->Seek(slice_bound);
     return dbiter->status().ok() ? 0 : -1;
   }
   int next() override {
+    auto sc = stats.scope();
     if (valid()) {
       dbiter->Next();
     }
     return dbiter->status().ok() ? 0 : -1;
   }
   int prev() override {
+    auto sc = stats.scope();
     if (valid()) {
       dbiter->Prev();
     }
@@ -2015,6 +2545,9 @@ public:
   int status() override {
     return dbiter->status().ok() ? 0 : -1;
   }
+  uint64_t tombstones_skipped() override {
+    return stats.get();
+  }
 };
 
 
@@ -2491,16 +3024,33 @@ private:
   const RocksDBStore* db;
   KeyLess keyless;
   string prefix;
+  const KeyValueDB::IteratorBounds bounds;
+  const rocksdb::Slice iterate_lower_bound;
+  const rocksdb::Slice iterate_upper_bound;
+  RocksDBStore::IteratorStats stats;
   std::vector<rocksdb::Iterator*> iters;
 public:
   explicit ShardMergeIteratorImpl(const RocksDBStore* db,
 				  const std::string& prefix,
-				  const std::vector<rocksdb::ColumnFamilyHandle*>& shards)
-    : db(db), keyless(db->comparator), prefix(prefix)
+				  const std::vector<rocksdb::ColumnFamilyHandle*>& shards,
+				  KeyValueDB::IteratorOpts opts = 0,
+				  KeyValueDB::IteratorBounds bounds_ = {})
+    : db(db), keyless(db->comparator), prefix(prefix),
+      bounds(std::move(bounds_)),
+      iterate_lower_bound(make_slice(bounds.lower_bound)),
+      iterate_upper_bound(make_slice(bounds.upper_bound)),
+      stats(opts & KeyValueDB::ITERATOR_TOMBSTONE_STATS)
   {
+    auto options = db->get_iterator_options(opts);
+    if (bounds.lower_bound) {
+      options.iterate_lower_bound = &iterate_lower_bound;
+    }
+    if (bounds.upper_bound) {
+      options.iterate_upper_bound = &iterate_upper_bound;
+    }
     iters.reserve(shards.size());
     for (auto& s : shards) {
-      iters.push_back(db->db->NewIterator(rocksdb::ReadOptions(), s));
+      iters.push_back(db->db->NewIterator(options, s));
     }
   }
   ~ShardMergeIteratorImpl() {
@@ -2509,6 +3059,7 @@ public:
     }
   }
   int seek_to_first() override {
+    auto sc = stats.scope();
     for (auto& it : iters) {
       it->SeekToFirst();
       if (!it->status().ok()) {
@@ -2520,6 +3071,7 @@ public:
     return 0;
   }
   int seek_to_last() override {
+    auto sc = stats.scope();
     for (auto& it : iters) {
       it->SeekToLast();
       if (!it->status().ok()) {
@@ -2549,6 +3101,7 @@ public:
     return 0;
   }
   int upper_bound(const string &after) override {
+    auto sc = stats.scope();
     rocksdb::Slice slice_bound(after);
     for (auto& it : iters) {
       it->Seek(slice_bound);
@@ -2563,6 +3116,7 @@ public:
     return 0;
   }
   int lower_bound(const string &to) override {
+    auto sc = stats.scope();
     rocksdb::Slice slice_bound(to);
     for (auto& it : iters) {
       it->Seek(slice_bound);
@@ -2574,6 +3128,7 @@ public:
     return 0;
   }
   int next() override {
+    auto sc = stats.scope();
     int r = -1;
     if (iters[0]->Valid()) {
       iters[0]->Next();
@@ -2604,6 +3159,7 @@ public:
   // 3. go next() on all iterators except (2)
   // 4. sort
   int prev() override {
+    auto sc = stats.scope();
     std::vector<rocksdb::Iterator*> prev_done;
     //1
     for (auto it: iters) {
@@ -2669,22 +3225,58 @@ public:
   int status() override {
     return iters[0]->status().ok() ? 0 : -1;
   }
+  uint64_t tombstones_skipped() override {
+    return stats.get();
+  }
 };
 
-KeyValueDB::Iterator RocksDBStore::get_iterator(const std::string& prefix, IteratorOpts opts)
+rocksdb::ReadOptions RocksDBStore::get_iterator_options(IteratorOpts opts) const
+{
+  rocksdb::ReadOptions options = rocksdb::ReadOptions();
+  if (opts & ITERATOR_NOCACHE) {
+    options.fill_cache = false;
+  }
+  if (opts & ITERATOR_READAHEAD) {
+    options.readahead_size =
+      cct->_conf.get_val<Option::size_t>("rocksdb_iterator_readahead");
+  }
+  return options;
+}
+
+KeyValueDB::Iterator RocksDBStore::get_iterator(const std::string& prefix,
+						IteratorOpts opts,
+						IteratorBounds bounds)
 {
   auto cf_it = cf_handles.find(prefix);
   if (cf_it != cf_handles.end()) {
+    rocksdb::ColumnFamilyHandle* cf = nullptr;
     if (cf_it->second.handles.size() == 1) {
+      cf = cf_it->second.handles[0];
+    } else {
+      // all keys within the bounds may hash to a single shard
+      cf = get_cf_handle(prefix, bounds);
+    }
+    if (cf) {
       return std::make_shared<CFIteratorImpl>(
+        this,
         prefix,
-        db->NewIterator(rocksdb::ReadOptions(), cf_it->second.handles[0]));
+        cf,
+        opts,
+        std::move(bounds));
     } else {
       return std::make_shared<ShardMergeIteratorImpl>(
         this,
         prefix,
-        cf_it->second.handles);
-    }
+        cf_it->second.handles,
+        opts,
+        std::move(bounds));
+    }
+  } else if (bounds.lower_bound || bounds.upper_bound ||
+	     (opts & (ITERATOR_READAHEAD | ITERATOR_TOMBSTONE_STATS))) {
+    return make_prefix_iterator(
+      prefix,
+      std::make_shared<RocksDBWholeSpaceIteratorImpl>(
+	this, opts, prefix, bounds));
   } else {
     return KeyValueDB::get_iterator(prefix, opts);
   }
@@ -2899,7 +3491,8 @@ int RocksDBStore::prepare_for_reshard(const std::string& new_sharding,
       for (const auto& nsd : new_sharding_def) {
 	if (nsd.name == base_name) {
 	  if (shard_idx < nsd.shard_cnt) {
-	    add_column_family(base_name, nsd.hash_l, nsd.hash_h, shard_idx, cf);
+	    add_column_family(base_name, nsd.hash_l, nsd.hash_h, nsd.hash_bits,
+			      shard_idx, cf);
 	  } else {
 	    //ignore columns with index larger then shard count
 	  }
@@ -43,6 +43,10 @@ enum {
   l_rocksdb_write_memtable_time,
   l_rocksdb_write_delay_time,
   l_rocksdb_write_pre_and_post_process_time,
+  l_rocksdb_tombstone_compact,
+  l_rocksdb_tombstone_compact_lat,
+  l_rocksdb_tombstone_compact_queue_len,
+  l_rocksdb_tombstone_ranges,
   l_rocksdb_last,
 };
 
@@ -84,6 +88,7 @@ class RocksDBStore : public KeyValueDB {
   uint64_t cache_size = 0;
   bool set_cache_flag = false;
   friend class ShardMergeIteratorImpl;
+  friend class CFIteratorImpl;
   friend class WholeMergeIteratorImpl;
   /*
    *  See RocksDB's definition of a column family(CF) and how to use it.
@@ -97,9 +102,11 @@ public:
     string options;   //< configure option string for this CF
     uint32_t hash_l;  //< first character to take for hash calc.
     uint32_t hash_h;  //< last character to take for hash calc.
+    uint32_t hash_bits; //< leading bits past hash_h to take for hash calc.
     ColumnFamily(const string &name, size_t shard_cnt, const string &options,
-		 uint32_t hash_l, uint32_t hash_h)
-      : name(name), shard_cnt(shard_cnt), options(options), hash_l(hash_l), hash_h(hash_h) {}
+		 uint32_t hash_l, uint32_t hash_h, uint32_t hash_bits = 0)
+      : name(name), shard_cnt(shard_cnt), options(options), hash_l(hash_l), hash_h(hash_h),
+	hash_bits(hash_bits) {}
   };
 private:
   friend std::ostream& operator<<(std::ostream& out, const ColumnFamily& cf);
@@ -111,16 +118,20 @@ private:
   struct prefix_shards {
     uint32_t hash_l;  //< first character to take for hash calc.
     uint32_t hash_h;  //< last character to take for hash calc.
+    uint32_t hash_bits; //< leading bits past hash_h to take for hash calc.
     std::vector<rocksdb::ColumnFamilyHandle *> handles;
   };
   std::unordered_map<std::string, prefix_shards> cf_handles;
   std::unordered_map<uint32_t, std::string> cf_ids_to_prefix;
 
   void add_column_family(const std::string& cf_name, uint32_t hash_l, uint32_t hash_h,
-			 size_t shard_idx, rocksdb::ColumnFamilyHandle *handle);
+			 uint32_t hash_bits, size_t shard_idx,
+			 rocksdb::ColumnFamilyHandle *handle);
   bool is_column_family(const std::string& prefix);
   rocksdb::ColumnFamilyHandle *get_cf_handle(const std::string& prefix, const std::string& key);
   rocksdb::ColumnFamilyHandle *get_cf_handle(const std::string& prefix, const char* key, size_t keylen);
+  rocksdb::ColumnFamilyHandle *get_cf_handle(const std::string& prefix,
+					     const IteratorBounds& bounds);
 
   int submit_common(rocksdb::WriteOptions& woptions, KeyValueDB::Transaction t);
   int install_cf_mergeop(const std::string &cf_name, rocksdb::ColumnFamilyOptions *cf_opt);
@@ -169,7 +180,67 @@ private:
 
   void compact_thread_entry();
 
+  // compactions triggered by accumulated deletions
+  /// puts and deletions seen by a transaction, or accumulated for a range
+  struct deletion_stats_t {
+    uint64_t puts = 0;
+    uint64_t deletes = 0;        ///< point and single deletes
+    uint64_t range_deletes = 0;
+    std::string first, last;     ///< span of deleted keys (ranges only)
+
+    void note_delete(const std::string& key);
+    void note_range_delete(const std::string& start, const std::string& end);
+    void merge(const deletion_stats_t& o);
+    double density() const {
+      uint64_t total = puts + deletes;
+      return total ? (double)deletes / total : 0.0;
+    }
+    uint64_t heat() const {
+      return deletes + range_deletes;
+    }
+    void dump(ceph::Formatter *f) const;
+  };
+  /// (prefix, leading key bytes) identifying a tracked key range
+  using deletion_range_t = std::pair<std::string, std::string>;
+
+  struct tombstone_compaction_t {
+    std::string prefix;
+    std::string start, end;      ///< deleted key span, inclusive
+    std::string reason;
+    utime_t queued;
+    utime_t started;
+    utime_t duration;
+    void dump(ceph::Formatter *f) const;
+  };
+  static constexpr size_t TOMBSTONE_COMPACT_HISTORY = 32;
+
+  bool track_deletions = false;
+  uint32_t deletion_range_key_bytes = 0;
+  ceph::mutex deletion_lock = ceph::make_mutex("RocksDBStore::deletion_lock");
+  /// per prefix totals since open
+  std::map<std::string, deletion_stats_t> cf_deletions;
+  /// deletions in a range since it was last compacted
+  std::map<deletion_range_t, deletion_stats_t> hot_ranges;
+  /// hot_ranges by heat, coldest first
+  std::set<std::pair<uint64_t, deletion_range_t>> hot_ranges_by_heat;
+  // protected by compact_queue_lock
+  std::list<tombstone_compaction_t> tombstone_compact_queue;
+  std::list<tombstone_compaction_t> tombstone_compact_history;
+  ceph::mono_time next_tombstone_compact;
+
+  class SocketHook;
+  SocketHook *asok_hook = nullptr;
+
+  void note_deletions(const std::map<std::string, deletion_stats_t>& cfs,
+		      const std::map<deletion_range_t, deletion_stats_t>& ranges);
+  void _trim_hot_ranges(size_t max_ranges);
+  void queue_tombstone_compactions(std::vector<tombstone_compaction_t>& cs);
+  void compact_tombstones(tombstone_compaction_t& c);
+  void dump_tombstone_stats(ceph::Formatter *f);
+
   void compact_range(const std::string& start, const std::string& end);
+  void compact_range(const rocksdb::CompactRangeOptions& options,
+		     const std::string& start, const std::string& end);
   void compact_range_async(const std::string& start, const std::string& end);
   int tryInterpret(const std::string& key, const std::string& val,
 		   rocksdb::Options& opt);
@@ -265,8 +336,20 @@ public:
     rocksdb::WriteBatch bat;
     RocksDBStore *db;
 
+    /// puts/deletes per prefix and deletes per key range, for
+    /// tombstone-triggered compaction
+    std::map<std::string, deletion_stats_t> cf_deletions;
+    std::map<deletion_range_t, deletion_stats_t> range_deletions;
+
     explicit RocksDBTransactionImpl(RocksDBStore *_db);
   private:
+    void note_put(const std::string &prefix);
+    void note_delete(const std::string &prefix, const std::string &k);
+    void note_deletes(const std::string &prefix,
+		      const deletion_stats_t &deleted);
+    void note_range_delete(const std::string &prefix,
+			   const std::string &start,
+			   const std::string &end);
     void put_bat(
       rocksdb::WriteBatch& bat,
       rocksdb::ColumnFamilyHandle *cf,
@@ -303,6 +386,9 @@ public:
       const std::string& prefix,
       const std::string& k,
       const ceph::bufferlist &bl) override;
+    size_t get_size_bytes() const override {
+      return bat.GetDataSize();
+    }
   };
 
   KeyValueDB::Transaction get_transaction() override {
@@ -328,13 +414,65 @@ public:
     ceph::bufferlist *out) override;
 
 
+  /// counts the tombstones rocksdb steps over while an iterator moves
+  class IteratorStats {
+    bool enabled;
+    uint64_t skipped = 0;
+  public:
+    explicit IteratorStats(bool enabled) : enabled(enabled) {}
+
+    class Scope {
+      IteratorStats *stats;
+      rocksdb::PerfLevel level = rocksdb::PerfLevel::kDisable;
+      uint64_t start = 0;
+    public:
+      Scope(const Scope&) = delete;
+      explicit Scope(IteratorStats *s) : stats(s) {
+	if (stats->enabled) {
+	  level = rocksdb::GetPerfLevel();
+	  if (level < rocksdb::PerfLevel::kEnableCount) {
+	    rocksdb::SetPerfLevel(rocksdb::PerfLevel::kEnableCount);
+	  }
+	  start = rocksdb::get_perf_context()->internal_delete_skipped_count;
+	}
+      }
+      ~Scope() {
+	if (stats->enabled) {
+	  uint64_t end =
+	    rocksdb::get_perf_context()->internal_delete_skipped_count;
+	  // someone may have reset the context under us
+	  stats->skipped += end >= start ? end - start : end;
+	  if (level < rocksdb::PerfLevel::kEnableCount) {
+	    rocksdb::SetPerfLevel(level);
+	  }
+	}
+      }
+    };
+    Scope scope() {
+      return Scope(this);
+    }
+    uint64_t get() const {
+      return skipped;
+    }
+  };
+
+  rocksdb::ReadOptions get_iterator_options(IteratorOpts opts) const;
+
   class RocksDBWholeSpaceIteratorImpl :
     public KeyValueDB::WholeSpaceIteratorImpl {
   protected:
     rocksdb::Iterator *dbiter;
+    std::string lower_bound_key, upper_bound_key;
+    rocksdb::Slice lower_bound_slice, upper_bound_slice;
+    IteratorStats stats{false};
   public:
     explicit RocksDBWholeSpaceIteratorImpl(rocksdb::Iterator *iter) :
       dbiter(iter) { }
+    /// iterator over the default cf, limited to bounds within prefix
+    RocksDBWholeSpaceIteratorImpl(const RocksDBStore* db,
+				  IteratorOpts opts,
+				  const std::string& prefix,
+				  const IteratorBounds& bounds);
     //virtual ~RocksDBWholeSpaceIteratorImpl() { }
     ~RocksDBWholeSpaceIteratorImpl() override;
 
@@ -355,9 +493,14 @@ public:
     int status() override;
     size_t key_size() override;
     size_t value_size() override;
+    uint64_t tombstones_skipped() override {
+      return stats.get();
+    }
   };
 
-  Iterator get_iterator(const std::string& prefix, IteratorOpts opts = 0) override;
+  Iterator get_iterator(const std::string& prefix,
+			IteratorOpts opts = 0,
+			IteratorBounds bounds = IteratorBounds()) override;
 private:
   /// this iterator spans single cf
   rocksdb::Iterator* new_shard_iterator(rocksdb::ColumnFamilyHandle* cf);
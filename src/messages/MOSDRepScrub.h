@@ -24,7 +24,7 @@
 
 class MOSDRepScrub : public MOSDFastDispatchOp {
 public:
-  static constexpr int HEAD_VERSION = 9;
+  static constexpr int HEAD_VERSION = 10;
   static constexpr int COMPAT_VERSION = 6;
 
   spg_t pgid;             // PG to scrub
@@ -38,6 +38,7 @@ public:
   bool allow_preemption = false;
   int32_t priority = 0;
   bool high_priority = false;
+  eversion_t deep_since; // don't read data of objects not modified since
 
   epoch_t get_map_epoch() const override {
     return map_epoch;
@@ -84,6 +85,7 @@ public:
 	<< ",start:" << start << ",end:" << end
         << ",chunky:" << chunky
         << ",deep:" << deep
+        << ",deep_since:" << deep_since
         << ",version:" << header.version
 	<< ",allow_preemption:" << (int)allow_preemption
 	<< ",priority=" << priority
@@ -107,6 +109,7 @@ public:
     encode(allow_preemption, payload);
     encode(priority, payload);
     encode(high_priority, payload);
+    encode(deep_since, payload);
   }
   void decode_payload() override {
     using ceph::decode;
@@ -136,6 +139,9 @@ public:
       decode(priority, p);
       decode(high_priority, p);
     }
+    if (header.version >= 10) {
+      decode(deep_since, p);
+    }
   }
 };
 
@@ -265,6 +265,11 @@ public:
   }
 
   virtual void set_cache_shards(unsigned num) { }
+  /**
+   * tell the store which numa node serves each OSD op shard, so cache
+   * shards holding the same PGs can follow (-1 for unbound shards)
+   */
+  virtual void set_cache_numa_nodes(const std::vector<int>& op_shard_nodes) { }
 
   /**
    * Returns 0 if the hobject is valid, -error otherwise
@@ -458,7 +463,9 @@ public:
    * @param offset location offset of first byte to be read
    * @param len number of bytes to be read
    * @param bl output ceph::buffer::list
-   * @param op_flags is CEPH_OSD_OP_FLAG_*
+   * @param op_flags is CEPH_OSD_OP_FLAG_*; FADVISE_DONTNEED or
+   *   FADVISE_NOCACHE mark a background read (scrub, backfill) which should
+   *   not displace cached data
    * @returns number of bytes read on success, or negative error code on failure.
    */
    virtual int read(
@@ -505,7 +512,9 @@ public:
    * @param oid oid of object
    * @param m intervals to be read
    * @param bl output ceph::buffer::list
-   * @param op_flags is CEPH_OSD_OP_FLAG_*
+   * @param op_flags is CEPH_OSD_OP_FLAG_*; FADVISE_DONTNEED or
+   *   FADVISE_NOCACHE mark a background read (scrub, backfill) which should
+   *   not displace cached data
    * @returns number of bytes read on success, or negative error code on failure.
    */
    virtual int readv(
@@ -682,6 +691,18 @@ public:
     return collection_list(c, start, end, max, ls, next);
   }
 
+  /**
+   * hint that the objects in ls are about to be accessed one by one,
+   * e.g. right after listing them for scrub or backfill
+   *
+   * The store may load their metadata ahead of time.
+   *
+   * @param c collection
+   * @param ls objects, in the order they will be accessed
+   */
+  virtual void prefetch_objects(CollectionHandle &c,
+				const std::vector<ghobject_t>& ls) {}
+
   /// OMAP
   /// Get omap contents
   virtual int omap_get(
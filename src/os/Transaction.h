@@ -158,6 +158,7 @@ public:
   // Transaction hint type
   enum {
     COLL_HINT_EXPECTED_NUM_OBJECTS = 1,
+    COLL_HINT_REMOVING = 2,  ///< all objects and the collection will be removed
   };
 
   struct Op {
@@ -10,6 +10,8 @@
 #include "common/perf_counters.h"
 #include "Allocator.h"
 #include "include/ceph_assert.h"
+#include "include/crc32c.h"
+#include "include/random.h"
 #include "common/admin_socket.h"
 
 #define dout_context cct
@@ -646,6 +648,13 @@ int BlueFS::mount()
             << dendl;
   }
 
+  // files written in envelope mode do not log their size
+  for (auto& p : file_map) {
+    if (p.second->fnode.envelope_nonce) {
+      _scan_envelope(p.second.get());
+    }
+  }
+
   // set up the log for future writes
   log_writer = _create_writer(_get_file(1));
   ceph_assert(log_writer->file->fnode.ino == 1);
@@ -1697,6 +1706,116 @@ void BlueFS::_drop_link(FileRef file)
   }
 }
 
+int BlueFS::_read_disk(bluefs_fnode_t& fnode,
+			uint64_t off, uint64_t len, char *out)
+{
+  while (len > 0) {
+    uint64_t x_off = 0;
+    auto p = fnode.seek(off, &x_off);
+    if (p == fnode.extents.end()) {
+      return -ERANGE;
+    }
+    uint64_t l = std::min(p->length - x_off, len);
+    int r = bdev[p->bdev]->read_random(p->offset + x_off, l, out,
+				       cct->_conf->bluefs_buffered_io);
+    if (r < 0) {
+      return r;
+    }
+    off += l;
+    len -= l;
+    out += l;
+  }
+  return 0;
+}
+
+int64_t BlueFS::_read_envelope(File *f, uint64_t off, uint64_t len,
+			       char *out)
+{
+  int64_t ret = 0;
+  auto p = f->envelope_index.upper_bound(off);
+  if (len == 0 || p == f->envelope_index.begin()) {
+    return 0;
+  }
+  --p;
+  while (len > 0 && p != f->envelope_index.end()) {
+    auto next = std::next(p);
+    uint64_t end = next == f->envelope_index.end() ?
+      f->fnode.size : next->first;
+    if (off >= end) {
+      break;
+    }
+    uint64_t l = std::min(end - off, len);
+    dout(20) << __func__ << " 0x" << std::hex << off << "~" << l
+	     << " from envelope at 0x" << p->second << std::dec << dendl;
+    int r = _read_disk(f->fnode,
+		       p->second + sizeof(bluefs_wal_envelope_t) + off - p->first,
+		       l, out);
+    ceph_assert(r == 0);
+    off += l;
+    len -= l;
+    out += l;
+    ret += l;
+    p = next;
+  }
+  return ret;
+}
+
+/*
+ * Rebuild the envelope index and the size of a file written in envelope
+ * mode.  Envelopes are walked from the start of the file and the first
+ * one whose magic, nonce, seq or crc does not match ends the file: it is
+ * either a torn write or stale data from a previous incarnation.
+ */
+void BlueFS::_scan_envelope(File *f)
+{
+  const uint64_t nonce = f->fnode.envelope_nonce;
+  const uint64_t allocated = f->fnode.get_allocated();
+  const uint64_t hdr_len = sizeof(bluefs_wal_envelope_t);
+  uint64_t pos = 0, size = 0, seq = 0;
+  f->envelope_index.clear();
+  ceph::bufferptr hbp(ceph::buffer::create_small_page_aligned(super.block_size));
+  while (pos + super.block_size <= allocated) {
+    if (_read_disk(f->fnode, pos, super.block_size, hbp.c_str()) < 0) {
+      break;
+    }
+    auto hdr = reinterpret_cast<const bluefs_wal_envelope_t*>(hbp.c_str());
+    if (hdr->magic != bluefs_wal_envelope_t::MAGIC ||
+	hdr->nonce != nonce ||
+	hdr->seq != seq) {
+      break;
+    }
+    uint64_t length = hdr->length;
+    uint64_t disk_len = bluefs_wal_envelope_t::disk_length(length,
+							   super.block_size);
+    if (pos + disk_len > allocated) {
+      break;
+    }
+    ceph::bufferptr bp(ceph::buffer::create_small_page_aligned(disk_len));
+    if (_read_disk(f->fnode, pos, disk_len, bp.c_str()) < 0) {
+      break;
+    }
+    auto e = reinterpret_cast<bluefs_wal_envelope_t*>(bp.c_str());
+    uint32_t crc = e->crc;
+    e->crc = 0;
+    if (crc != ceph_crc32c(-1, (const unsigned char*)bp.c_str(),
+			   hdr_len + length)) {
+      dout(10) << __func__ << " ino " << f->fnode.ino << " bad crc at 0x"
+	       << std::hex << pos << std::dec << " seq " << seq << dendl;
+      break;
+    }
+    f->envelope_index[size] = pos;
+    size += length;
+    pos += disk_len;
+    ++seq;
+  }
+  dout(10) << __func__ << " ino " << f->fnode.ino << " " << seq
+	   << " envelopes, size 0x" << std::hex << f->fnode.size
+	   << " -> 0x" << size << std::dec << dendl;
+  vselector->sub_usage(f->vselector_hint, f->fnode.size);
+  f->fnode.size = size;
+  vselector->add_usage(f->vselector_hint, f->fnode.size);
+}
+
 int64_t BlueFS::_read_random(
   FileReader *h,         ///< [in] read from here
   uint64_t off,          ///< [in] offset
@@ -1724,6 +1843,12 @@ int64_t BlueFS::_read_random(
   logger->inc(l_bluefs_read_random_count, 1);
   logger->inc(l_bluefs_read_random_bytes, len);
 
+  if (h->file->fnode.envelope_nonce) {
+    ret = _read_envelope(h->file.get(), off, len, out);
+    --h->file->num_reading;
+    return ret;
+  }
+
   std::shared_lock s_lock(h->lock);
   buf->bl.reassign_to_mempool(mempool::mempool_bluefs_file_reader);
   while (len > 0) {
@@ -1820,6 +1945,28 @@ int64_t BlueFS::_read(
     outbl->clear();
 
   int64_t ret = 0;
+  if (h->file->fnode.envelope_nonce) {
+    // no prefetch for envelope files; they are only read back on recovery
+    if (outbl || out) {
+      char *p = out;
+      ceph::bufferptr bp;
+      if (outbl) {
+	bp = ceph::buffer::create(len);
+	p = bp.c_str();
+      }
+      ret = _read_envelope(h->file.get(), off, len, p);
+      if (outbl) {
+	bp.set_length(ret);
+	outbl->append(std::move(bp));
+      }
+      if (out && outbl) {
+	memcpy(out, p, ret);
+      }
+      buf->pos = off + ret;
+    }
+    --h->file->num_reading;
+    return ret;
+  }
   std::shared_lock s_lock(h->lock);
   while (len > 0) {
     size_t left;
@@ -2505,19 +2652,80 @@ ceph::bufferlist BlueFS::FileWriter::flush_buffer(
   return bl;
 }
 
-int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
+ceph::bufferlist BlueFS::FileWriter::flush_envelope(
+  const uint64_t seq,
+  const bluefs_super_t& super)
 {
+  ceph::bufferlist data;
+  buffer.splice(0, buffer.length(), &data);
+  const uint64_t disk_len =
+    bluefs_wal_envelope_t::disk_length(data.length(), super.block_size);
+  // build the whole envelope in one aligned buffer so the device does
+  // not need to rebuild it
+  ceph::bufferptr bp(ceph::buffer::create_small_page_aligned(disk_len));
+  auto hdr = reinterpret_cast<bluefs_wal_envelope_t*>(bp.c_str());
+  hdr->magic = bluefs_wal_envelope_t::MAGIC;
+  hdr->crc = 0;
+  hdr->nonce = file->fnode.envelope_nonce;
+  hdr->seq = seq;
+  hdr->length = data.length();
+  hdr->reserved = 0;
+  char *payload = bp.c_str() + sizeof(bluefs_wal_envelope_t);
+  data.begin().copy(data.length(), payload);
+  memset(payload + data.length(), 0,
+	 disk_len - sizeof(bluefs_wal_envelope_t) - data.length());
+  hdr->crc = ceph_crc32c(-1, (const unsigned char*)bp.c_str(),
+			 sizeof(bluefs_wal_envelope_t) + data.length());
+  ceph::bufferlist bl;
+  bl.append(std::move(bp));
+  return bl;
+}
+
+void BlueFS::_mark_dirty(File *f)
+{
+  f->fnode.mtime = ceph_clock_now();
+  ceph_assert(f->fnode.ino >= 1);
+  if (f->dirty_seq == 0) {
+    f->dirty_seq = log_seq + 1;
+    dirty_files[f->dirty_seq].push_back(*f);
+    dout(20) << __func__ << " dirty_seq = " << log_seq + 1
+	     << " (was clean)" << dendl;
+  } else {
+    if (f->dirty_seq != log_seq + 1) {
+      // need re-dirty, erase from list first
+      ceph_assert(dirty_files.count(f->dirty_seq));
+      auto it = dirty_files[f->dirty_seq].iterator_to(*f);
+      dirty_files[f->dirty_seq].erase(it);
+      f->dirty_seq = log_seq + 1;
+      dirty_files[f->dirty_seq].push_back(*f);
+      dout(20) << __func__ << " dirty_seq = " << log_seq + 1
+	       << " (was " << f->dirty_seq << ")" << dendl;
+    } else {
+      dout(20) << __func__ << " dirty_seq = " << log_seq + 1
+	       << " (unchanged, do nothing) " << dendl;
+    }
+  }
+}
+
+int BlueFS::_flush_range_F(FileWriter *h, uint64_t offset, uint64_t length,
+			   flush_plan_t *plan)
+{
+  ceph_assert(ceph_mutex_is_locked(lock));
   dout(10) << __func__ << " " << h << " pos 0x" << std::hex << h->pos
 	   << " 0x" << offset << "~" << length << std::dec
 	   << " to " << h->file->fnode << dendl;
   ceph_assert(!h->file->deleted);
   ceph_assert(h->file->num_readers.load() == 0);
 
-  bool buffered;
+  if (h->file->fnode.envelope_nonce) {
+    // envelopes always carry the whole buffer
+    return _flush_envelope_F(h, plan);
+  }
+
   if (h->file->fnode.ino == 1)
-    buffered = false;
+    plan->buffered = false;
   else
-    buffered = cct->_conf->bluefs_buffered_io;
+    plan->buffered = cct->_conf->bluefs_buffered_io;
 
   if (offset + length <= h->pos)
     return 0;
@@ -2562,28 +2770,7 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
     }
   }
   if (must_dirty) {
-    h->file->fnode.mtime = ceph_clock_now();
-    ceph_assert(h->file->fnode.ino >= 1);
-    if (h->file->dirty_seq == 0) {
-      h->file->dirty_seq = log_seq + 1;
-      dirty_files[h->file->dirty_seq].push_back(*h->file);
-      dout(20) << __func__ << " dirty_seq = " << log_seq + 1
-	       << " (was clean)" << dendl;
-    } else {
-      if (h->file->dirty_seq != log_seq + 1) {
-        // need re-dirty, erase from list first
-        ceph_assert(dirty_files.count(h->file->dirty_seq));
-        auto it = dirty_files[h->file->dirty_seq].iterator_to(*h->file);
-        dirty_files[h->file->dirty_seq].erase(it);
-        h->file->dirty_seq = log_seq + 1;
-        dirty_files[h->file->dirty_seq].push_back(*h->file);
-        dout(20) << __func__ << " dirty_seq = " << log_seq + 1
-                 << " (was " << h->file->dirty_seq << ")" << dendl;
-      } else {
-        dout(20) << __func__ << " dirty_seq = " << log_seq + 1
-                 << " (unchanged, do nothing) " << dendl;
-      }
-    }
+    _mark_dirty(h->file.get());
   }
   dout(20) << __func__ << " file now " << h->file->fnode << dendl;
 
@@ -2600,18 +2787,114 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
     x_off -= partial;
     offset -= partial;
     length += partial;
-    dout(20) << __func__ << " waiting for previous aio to complete" << dendl;
-    for (auto p : h->iocv) {
-      if (p) {
-	p->aio_wait();
-      }
+  }
+
+  // the buffer is padded up to a block boundary on flush; remember every
+  // extent that the padded write may touch so that the data can be issued
+  // without the global lock (the extent vector may be reallocated by a
+  // concurrent preallocate).
+  uint64_t want = x_off + p2roundup(length, (uint64_t)super.block_size);
+  for (; p != h->file->fnode.extents.end() && want > 0; ++p) {
+    plan->extents.push_back(*p);
+    want -= std::min<uint64_t>(p->length, want);
+  }
+  plan->offset = offset;
+  plan->length = length;
+  plan->partial = partial;
+  plan->x_off = x_off;
+  vselector->add_usage(h->file->vselector_hint, h->file->fnode);
+  return 0;
+}
+
+/*
+ * Envelope mode: the buffer goes out as one self-describing envelope at
+ * the next block boundary.  Growing the file is not logged (mount finds
+ * the tail by scanning), so unless we run out of preallocated space a
+ * commit is a single aligned write plus the device flush.
+ */
+int BlueFS::_flush_envelope_F(FileWriter *h, flush_plan_t *plan)
+{
+  uint64_t length = h->get_buffer_length();
+  if (length == 0) {
+    return 0;
+  }
+  uint64_t offset = h->envelope_pos;
+  uint64_t disk_len = bluefs_wal_envelope_t::disk_length(length,
+							 super.block_size);
+  plan->buffered = cct->_conf->bluefs_buffered_io;
+
+  uint64_t allocated = h->file->fnode.get_allocated();
+  vselector->sub_usage(h->file->vselector_hint, h->file->fnode);
+  bool must_dirty = false;
+  if (allocated < offset + disk_len) {
+    uint64_t want = std::max<uint64_t>(
+      offset + disk_len - allocated,
+      cct->_conf.get_val<Option::size_t>("bluefs_wal_envelope_prealloc"));
+    int r = _allocate(vselector->select_prefer_bdev(h->file->vselector_hint),
+		      want,
+		      &h->file->fnode);
+    if (r < 0) {
+      derr << __func__ << " allocated: 0x" << std::hex << allocated
+           << " offset: 0x" << offset << " length: 0x" << disk_len << std::dec
+           << dendl;
+      vselector->add_usage(h->file->vselector_hint, h->file->fnode); // undo
+      ceph_abort_msg("bluefs enospc");
+      return r;
     }
+    must_dirty = true;
+  }
+  h->file->envelope_index[h->pos] = offset;
+  h->file->fnode.size = h->pos + length;
+  if (must_dirty) {
+    _mark_dirty(h->file.get());
   }
+  dout(20) << __func__ << " seq " << h->envelope_seq << " 0x" << std::hex
+	   << h->pos << "~" << length << " at 0x" << offset << "~" << disk_len
+	   << std::dec << " file now " << h->file->fnode << dendl;
+
+  uint64_t x_off = 0;
+  auto p = h->file->fnode.seek(offset, &x_off);
+  ceph_assert(p != h->file->fnode.extents.end());
+  plan->x_off = x_off;
+  uint64_t want = x_off + disk_len;
+  for (; p != h->file->fnode.extents.end() && want > 0; ++p) {
+    plan->extents.push_back(*p);
+    want -= std::min<uint64_t>(p->length, want);
+  }
+  plan->offset = offset;
+  plan->length = length;
+  plan->envelope = true;
+  vselector->add_usage(h->file->vselector_hint, h->file->fnode);
+  return 0;
+}
 
-  auto bl = h->flush_buffer(cct, partial, length, super);
-  ceph_assert(bl.length() >= length);
-  h->pos = offset + length;
-  length = bl.length();
+int BlueFS::_flush_data(FileWriter *h, flush_plan_t& plan)
+{
+  if (plan.length == 0) {
+    return 0;
+  }
+  if (flush_data_hook) {
+    flush_data_hook(h);
+  }
+  ceph::bufferlist bl;
+  if (plan.envelope) {
+    bl = h->flush_envelope(h->envelope_seq++, super);
+    h->pos += plan.length;
+    h->envelope_pos += bl.length();
+  } else {
+    if (plan.partial) {
+      dout(20) << __func__ << " waiting for previous aio to complete" << dendl;
+      for (auto p : h->iocv) {
+	if (p) {
+	  p->aio_wait();
+	}
+      }
+    }
+    bl = h->flush_buffer(cct, plan.partial, plan.length, super);
+    ceph_assert(bl.length() >= plan.length);
+    h->pos = plan.offset + plan.length;
+  }
+  uint64_t length = bl.length();
 
   switch (h->writer_type) {
   case WRITER_WAL:
@@ -2626,16 +2909,20 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
   bl.hexdump(*_dout);
   *_dout << dendl;
 
+  auto p = plan.extents.begin();
+  uint64_t x_off = plan.x_off;
   uint64_t bloff = 0;
   uint64_t bytes_written_slow = 0;
   while (length > 0) {
+    ceph_assert(p != plan.extents.end());
     uint64_t x_len = std::min(p->length - x_off, length);
     bufferlist t;
     t.substr_of(bl, bloff, x_len);
     if (cct->_conf->bluefs_sync_write) {
-      bdev[p->bdev]->write(p->offset + x_off, t, buffered, h->write_hint);
+      bdev[p->bdev]->write(p->offset + x_off, t, plan.buffered, h->write_hint);
     } else {
-      bdev[p->bdev]->aio_write(p->offset + x_off, t, h->iocv[p->bdev], buffered, h->write_hint);
+      bdev[p->bdev]->aio_write(p->offset + x_off, t, h->iocv[p->bdev],
+			       plan.buffered, h->write_hint);
     }
     h->dirty_devs[p->bdev] = true;
     if (p->bdev == BDEV_SLOW) {
@@ -2657,12 +2944,21 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
       }
     }
   }
-  vselector->add_usage(h->file->vselector_hint, h->file->fnode);
   dout(20) << __func__ << " h " << h << " pos now 0x"
            << std::hex << h->pos << std::dec << dendl;
   return 0;
 }
 
+int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
+{
+  flush_plan_t plan;
+  int r = _flush_range_F(h, offset, length, &plan);
+  if (r < 0) {
+    return r;
+  }
+  return _flush_data(h, plan);
+}
+
 #ifdef HAVE_LIBAIO
 // we need to retire old completed aios so they don't stick around in
 // memory indefinitely (along with their bufferlist refs).
@@ -2703,25 +2999,34 @@ int BlueFS::_flush(FileWriter *h, bool force, std::unique_lock<ceph::mutex>& l)
   return r;
 }
 
-int BlueFS::_flush(FileWriter *h, bool force, bool *flushed)
+bool BlueFS::_need_flush(FileWriter *h, bool force)
 {
   uint64_t length = h->get_buffer_length();
-  uint64_t offset = h->pos;
-  if (flushed) {
-    *flushed = false;
-  }
   if (!force &&
       length < cct->_conf->bluefs_min_flush_size) {
     dout(10) << __func__ << " " << h << " ignoring, length " << length
 	     << " < min_flush_size " << cct->_conf->bluefs_min_flush_size
 	     << dendl;
-    return 0;
+    return false;
   }
   if (length == 0) {
     dout(10) << __func__ << " " << h << " no dirty data on "
 	     << h->file->fnode << dendl;
+    return false;
+  }
+  return true;
+}
+
+int BlueFS::_flush(FileWriter *h, bool force, bool *flushed)
+{
+  if (flushed) {
+    *flushed = false;
+  }
+  if (!_need_flush(h, force)) {
     return 0;
   }
+  uint64_t length = h->get_buffer_length();
+  uint64_t offset = h->pos;
   dout(10) << __func__ << " " << h << " 0x"
            << std::hex << offset << "~" << length << std::dec
 	   << " to " << h->file->fnode << dendl;
@@ -2733,6 +3038,67 @@ int BlueFS::_flush(FileWriter *h, bool force, bool *flushed)
   return r;
 }
 
+/*
+ * Flush a regular file while holding only h->lock.  The global lock
+ * is held just long enough to allocate, update the fnode and mark the
+ * file dirty; the device writes (and any wait on the previous aio
+ * for a partial tail block) happen without it, so that e.g. a WAL
+ * fsync is not queued behind a large SST flush.
+ */
+int BlueFS::_flush_unlocked(FileWriter *h, bool force, bool *flushed)
+{
+  ceph_assert(ceph_mutex_is_locked(h->lock));
+  if (flushed) {
+    *flushed = false;
+  }
+  if (!_need_flush(h, force)) {
+    return 0;
+  }
+  uint64_t length = h->get_buffer_length();
+  uint64_t offset = h->pos;
+  flush_plan_t plan;
+  {
+    std::lock_guard l(lock);
+    dout(10) << __func__ << " " << h << " 0x"
+	     << std::hex << offset << "~" << length << std::dec
+	     << " to " << h->file->fnode << dendl;
+    ceph_assert(h->pos <= h->file->fnode.size);
+    int r = _flush_range_F(h, offset, length, &plan);
+    if (r < 0) {
+      return r;
+    }
+  }
+  int r = _flush_data(h, plan);
+  if (flushed) {
+    *flushed = true;
+  }
+  return r;
+}
+
+void BlueFS::flush(FileWriter *h, bool force)
+{
+  std::unique_lock hl(h->lock);
+  bool flushed = false;
+  int r = _flush_unlocked(h, force, &flushed);
+  ceph_assert(r == 0);
+  hl.unlock();
+  if (flushed) {
+    std::unique_lock l(lock);
+    _maybe_compact_log(l);
+  }
+}
+
+void BlueFS::flush_range(FileWriter *h, uint64_t offset, uint64_t length)
+{
+  std::lock_guard hl(h->lock);
+  flush_plan_t plan;
+  {
+    std::lock_guard l(lock);
+    _flush_range_F(h, offset, length, &plan);
+  }
+  _flush_data(h, plan);
+}
+
 int BlueFS::_truncate(FileWriter *h, uint64_t offset)
 {
   dout(10) << __func__ << " 0x" << std::hex << offset << std::dec
@@ -2763,6 +3129,11 @@ int BlueFS::_truncate(FileWriter *h, uint64_t offset)
   if (offset > h->file->fnode.size) {
     ceph_abort_msg("truncate up not supported");
   }
+  if (h->file->fnode.envelope_nonce) {
+    derr << __func__ << " cannot truncate envelope file " << h->file->fnode
+	 << " to 0x" << std::hex << offset << std::dec << dendl;
+    return -EOPNOTSUPP;
+  }
   ceph_assert(h->file->fnode.size >= offset);
   vselector->sub_usage(h->file->vselector_hint, h->file->fnode.size);
   h->file->fnode.size = offset;
@@ -2771,23 +3142,34 @@ int BlueFS::_truncate(FileWriter *h, uint64_t offset)
   return 0;
 }
 
-int BlueFS::_fsync(FileWriter *h, std::unique_lock<ceph::mutex>& l)
+int BlueFS::fsync(FileWriter *h)
 {
+  std::unique_lock hl(h->lock);
   dout(10) << __func__ << " " << h << " " << h->file->fnode << dendl;
-  int r = _flush(h, true);
+  bool flushed = false;
+  int r = _flush_unlocked(h, true, &flushed);
   if (r < 0)
      return r;
-  uint64_t old_dirty_seq = h->file->dirty_seq;
+  uint64_t old_dirty_seq;
+  {
+    std::lock_guard l(lock);
+    old_dirty_seq = h->file->dirty_seq;
+  }
 
-  _flush_bdev_safely(h);
+  _flush_bdev(h);
+  hl.unlock();
 
-  if (old_dirty_seq) {
-    uint64_t s = log_seq;
-    dout(20) << __func__ << " file metadata was dirty (" << old_dirty_seq
-	     << ") on " << h->file->fnode << ", flushing log" << dendl;
-    _flush_and_sync_log(l, old_dirty_seq);
-    ceph_assert(h->file->dirty_seq == 0 ||  // cleaned
-	   h->file->dirty_seq > s);    // or redirtied by someone else
+  if (old_dirty_seq || flushed) {
+    std::unique_lock l(lock);
+    if (old_dirty_seq) {
+      uint64_t s = log_seq;
+      dout(20) << __func__ << " file metadata was dirty (" << old_dirty_seq
+	       << ") on " << h->file->fnode << ", flushing log" << dendl;
+      _flush_and_sync_log(l, old_dirty_seq);
+      ceph_assert(h->file->dirty_seq == 0 ||  // cleaned
+		  h->file->dirty_seq > s);    // or redirtied by someone else
+    }
+    _maybe_compact_log(l);
   }
   return 0;
 }
@@ -2814,6 +3196,22 @@ void BlueFS::_flush_bdev_safely(FileWriter *h)
   }
 }
 
+void BlueFS::_flush_bdev(FileWriter *h)
+{
+  ceph_assert(ceph_mutex_is_locked(h->lock));
+  std::array<bool, MAX_BDEV> flush_devs = h->dirty_devs;
+  h->dirty_devs.fill(false);
+#ifdef HAVE_LIBAIO
+  if (!cct->_conf->bluefs_sync_write) {
+    list<aio_t> completed_ios;
+    _claim_completed_aios(h, &completed_ios);
+    wait_for_aio(h);
+    completed_ios.clear();
+  }
+#endif
+  flush_bdev(flush_devs);
+}
+
 void BlueFS::flush_bdev(std::array<bool, MAX_BDEV>& dirty_bdevs)
 {
   // NOTE: this is safe to call without a lock.
@@ -3057,6 +3455,37 @@ int BlueFS::open_for_write(
     vselector->add_usage(file->vselector_hint, file->fnode); // update file count
   }
 
+  bool is_wal = boost::algorithm::ends_with(filename, ".log");
+  file->envelope_index.clear();
+  if (is_wal && cct->_conf.get_val<bool>("bluefs_wal_envelope_mode")) {
+    // every incarnation gets a new nonce so that envelopes left over
+    // from a previous one are not mistaken for data on replay
+    vselector->sub_usage(file->vselector_hint, file->fnode.size);
+    file->fnode.size = 0;
+    vselector->add_usage(file->vselector_hint, file->fnode.size);
+    file->fnode.envelope_nonce =
+      ceph::util::generate_random_number<uint64_t>(1, UINT64_MAX);
+    uint64_t prealloc =
+      cct->_conf.get_val<Option::size_t>("bluefs_wal_envelope_prealloc");
+    if (prealloc > file->fnode.get_allocated()) {
+      vselector->sub_usage(file->vselector_hint, file->fnode);
+      int r = _allocate(vselector->select_prefer_bdev(file->vselector_hint),
+			prealloc - file->fnode.get_allocated(),
+			&file->fnode);
+      vselector->add_usage(file->vselector_hint, file->fnode);
+      if (r < 0) {
+	// fall back to growing on demand
+	dout(10) << __func__ << " failed to preallocate 0x" << std::hex
+		 << prealloc << std::dec << " for " << filename << dendl;
+      }
+    }
+    // appends will not dirty the file, so make sure the first fsync
+    // persists the new nonce and extents
+    _mark_dirty(file.get());
+  } else {
+    file->fnode.envelope_nonce = 0;
+  }
+
   dout(20) << __func__ << " mapping " << dirname << "/" << filename
 	   << " vsel_hint " << file->vselector_hint
 	   << dendl;
@@ -3067,7 +3496,7 @@ int BlueFS::open_for_write(
 
   *h = _create_writer(file);
 
-  if (boost::algorithm::ends_with(filename, ".log")) {
+  if (is_wal) {
     (*h)->writer_type = BlueFS::WRITER_WAL;
     if (logger && !overwrite) {
       logger->inc(l_bluefs_files_written_wal);
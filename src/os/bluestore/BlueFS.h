@@ -4,6 +4,7 @@
 #define CEPH_OS_BLUESTORE_BLUEFS_H
 
 #include <atomic>
+#include <functional>
 #include <mutex>
 
 #include "bluefs_types.h"
@@ -118,6 +119,9 @@ public:
 
     void* vselector_hint = nullptr;
 
+    /// envelope mode only: logical offset -> disk offset of its envelope
+    mempool::bluefs::map<uint64_t,uint64_t> envelope_index;
+
   private:
     FRIEND_MAKE_REF(File);
     File()
@@ -175,11 +179,17 @@ public:
       const bool partial,
       const unsigned length,
       const bluefs_super_t& super);
+    ceph::bufferlist flush_envelope(
+      const uint64_t seq,
+      const bluefs_super_t& super);
     ceph::buffer::list::page_aligned_appender buffer_appender;  //< for const char* only
   public:
     int writer_type = 0;    ///< WRITER_*
     int write_hint = WRITE_LIFE_NOT_SET;
+    uint64_t envelope_pos = 0;  ///< envelope mode: disk offset of next flush
+    uint64_t envelope_seq = 0;  ///< envelope mode: seq of next flush
 
+    /// serializes flushes of this writer; always taken before BlueFS::lock
     ceph::mutex lock = ceph::make_mutex("BlueFS::FileWriter::lock");
     std::array<IOContext*,MAX_BDEV> iocv; ///< for each bdev
     std::array<bool, MAX_BDEV> dirty_devs;
@@ -348,6 +358,8 @@ private:
   class SocketHook;
   SocketHook* asok_hook = nullptr;
 
+  std::function<void(FileWriter*)> flush_data_hook; ///< for tests
+
   void _init_logger();
   void _shutdown_logger();
   void _update_logger_stats();
@@ -373,10 +385,27 @@ private:
   int _allocate_without_fallback(uint8_t id, uint64_t len,
 				 PExtentVector* extents);
 
+  /// the data half of a flush, resolved while holding the global lock
+  struct flush_plan_t {
+    uint64_t offset = 0;    ///< block aligned file offset of the write
+    uint64_t length = 0;    ///< buffered bytes to write, including partial
+    unsigned partial = 0;   ///< bytes of the cached tail block rewritten
+    uint64_t x_off = 0;     ///< offset into the first extent
+    bool buffered = false;
+    bool envelope = false;  ///< write the buffer as one envelope
+    std::vector<bluefs_extent_t> extents; ///< extents covering the write
+  };
+
+  void _mark_dirty(File *f);
+  int _flush_range_F(FileWriter *h, uint64_t offset, uint64_t length,
+		     flush_plan_t *plan);
+  int _flush_envelope_F(FileWriter *h, flush_plan_t *plan);
+  int _flush_data(FileWriter *h, flush_plan_t& plan);
   int _flush_range(FileWriter *h, uint64_t offset, uint64_t length);
+  bool _need_flush(FileWriter *h, bool force);
   int _flush(FileWriter *h, bool force, std::unique_lock<ceph::mutex>& l);
   int _flush(FileWriter *h, bool force, bool *flushed = nullptr);
-  int _fsync(FileWriter *h, std::unique_lock<ceph::mutex>& l);
+  int _flush_unlocked(FileWriter *h, bool force, bool *flushed = nullptr);
 
 #ifdef HAVE_LIBAIO
   void _claim_completed_aios(FileWriter *h, std::list<aio_t> *ls);
@@ -410,10 +439,15 @@ private:
   //void _aio_finish(void *priv);
 
   void _flush_bdev_safely(FileWriter *h);
+  void _flush_bdev(FileWriter *h);  // caller holds h->lock, not the global lock
   void flush_bdev();  // this is safe to call without a lock
   void flush_bdev(std::array<bool, MAX_BDEV>& dirty_bdevs);  // this is safe to call without a lock
 
   int _preallocate(FileRef f, uint64_t off, uint64_t len);
+  int _read_disk(bluefs_fnode_t& fnode, uint64_t off, uint64_t len,
+		 char *out);
+  int64_t _read_envelope(File *f, uint64_t off, uint64_t len, char *out);
+  void _scan_envelope(File *f);
   int _truncate(FileWriter *h, uint64_t off);
 
   int64_t _read(
@@ -507,6 +541,10 @@ public:
     bool random = false);
 
   void close_writer(FileWriter *h) {
+#ifdef HAVE_LIBAIO
+    // drain outstanding aios before taking the global lock
+    wait_for_aio(h);
+#endif
     std::lock_guard l(lock);
     _close_writer(h);
   }
@@ -555,26 +593,14 @@ public:
   // handler for discard event
   void handle_discard(unsigned dev, interval_set<uint64_t>& to_release);
 
-  void flush(FileWriter *h, bool force = false) {
-    std::unique_lock l(lock);
-    int r = _flush(h, force, l);
-    ceph_assert(r == 0);
-  }
+  void flush(FileWriter *h, bool force = false);
   void try_flush(FileWriter *h) {
     if (h->get_buffer_length() >= cct->_conf->bluefs_min_flush_size) {
       flush(h, true);
     }
   }
-  void flush_range(FileWriter *h, uint64_t offset, uint64_t length) {
-    std::lock_guard l(lock);
-    _flush_range(h, offset, length);
-  }
-  int fsync(FileWriter *h) {
-    std::unique_lock l(lock);
-    int r = _fsync(h, l);
-    _maybe_compact_log(l);
-    return r;
-  }
+  void flush_range(FileWriter *h, uint64_t offset, uint64_t length);
+  int fsync(FileWriter *h);
   int64_t read(FileReader *h, uint64_t offset, size_t len,
 	   ceph::buffer::list *outbl, char *out) {
     // no need to hold the global lock here; we only touch h and
@@ -598,6 +624,7 @@ public:
     return _preallocate(f, offset, len);
   }
   int truncate(FileWriter *h, uint64_t offset) {
+    std::lock_guard hl(h->lock);
     std::lock_guard l(lock);
     return _truncate(h, offset);
   }
@@ -611,6 +638,11 @@ public:
   const PerfCounters* get_perf_counters() const {
     return logger;
   }
+  /// called by a flush just before it writes the data; set while no
+  /// flush is running
+  void set_flush_data_hook(std::function<void(FileWriter*)> hook) {
+    flush_data_hook = std::move(hook);
+  }
 };
 
 class OriginalVolumeSelector : public BlueFSVolumeSelector {
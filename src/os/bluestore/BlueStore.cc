@@ -34,8 +34,10 @@
 #include "common/errno.h"
 #include "common/safe_io.h"
 #include "common/PriorityCache.h"
+#include "common/admin_socket.h"
 #include "common/RWLock.h"
 #include "Allocator.h"
+#include "CachingAllocator.h"
 #include "FreelistManager.h"
 #include "BlueFS.h"
 #include "BlueRocksEnv.h"
@@ -105,6 +107,60 @@ using ceph::mono_clock;
 using ceph::mono_time;
 using ceph::timespan_str;
 
+class BlueStore::SocketHook : public AdminSocketHook {
+  BlueStore *store;
+public:
+  static BlueStore::SocketHook* create(BlueStore *store)
+  {
+    BlueStore::SocketHook *hook = nullptr;
+    AdminSocket *admin_socket = store->cct->get_admin_socket();
+    if (admin_socket) {
+      hook = new BlueStore::SocketHook(store);
+      int r = admin_socket->register_command(
+	"bluestore write amp dump",
+	hook,
+	"Dump device bytes written per pool for data, deferred writes "
+	"and the kv store");
+      if (r == 0) {
+	r = admin_socket->register_command(
+	  "bluestore write amp reset",
+	  hook,
+	  "Reset the per pool write amplification statistics");
+      }
+      if (r != 0) {
+	ldout(store->cct, 1) << __func__ << " cannot register SocketHook"
+			     << dendl;
+	admin_socket->unregister_commands(hook);
+	delete hook;
+	hook = nullptr;
+      }
+    }
+    return hook;
+  }
+
+  ~SocketHook() {
+    AdminSocket *admin_socket = store->cct->get_admin_socket();
+    admin_socket->unregister_commands(this);
+  }
+private:
+  SocketHook(BlueStore *store) :
+    store(store) {}
+  int call(std::string_view command, const cmdmap_t& cmdmap,
+	   Formatter *f,
+	   std::ostream& errss,
+	   bufferlist& out) override {
+    if (command == "bluestore write amp dump") {
+      store->dump_write_amp(f);
+    } else if (command == "bluestore write amp reset") {
+      store->reset_write_amp();
+    } else {
+      errss << "Invalid command" << std::endl;
+      return -ENOSYS;
+    }
+    return 0;
+  }
+};
+
 // kv store prefixes
 const string PREFIX_SUPER = "S";       // field -> value
 const string PREFIX_STAT = "T";        // field -> value(int64 array)
@@ -113,6 +169,7 @@ const string PREFIX_OBJ = "O";         // object name -> onode_t
 const string PREFIX_OMAP = "M";        // u64 + keyname -> value
 const string PREFIX_PGMETA_OMAP = "P"; // u64 + keyname -> value(for meta coll)
 const string PREFIX_PERPOOL_OMAP = "m"; // s64 + u64 + keyname -> value
+const string PREFIX_PERPG_OMAP = "p";   // s64 + u32 + u64 + keyname -> value
 const string PREFIX_DEFERRED = "L";    // id -> deferred_transaction_t
 const string PREFIX_ALLOC = "B";       // u64 offset -> u64 length (freelist)
 const string PREFIX_ALLOC_BITMAP = "b";// (see BitmapFreelistManager)
@@ -1038,7 +1095,7 @@ struct LruOnodeCacheShard : public BlueStore::OnodeCacheShard {
   }
   void _unpin(BlueStore::Onode* o) override
   {
-    lru.push_front(*o);
+    o->cold ? lru.push_back(*o) : lru.push_front(*o);
     ceph_assert(num_pinned);
     --num_pinned;
     dout(20) << __func__ << this << " " << " " << " " << o->oid << " unpinned" << dendl;
@@ -1092,6 +1149,24 @@ struct LruOnodeCacheShard : public BlueStore::OnodeCacheShard {
 };
 
 // OnodeCacheShard
+void BlueStore::OnodeCacheShard::unpin(Onode* o,
+                                        std::function<bool()> validator)
+{
+  std::lock_guard l(lock);
+  if (validator()) {
+    _unpin(o);
+    // nobody but the cache references the onode now, and nobody can get
+    // a new reference while we hold the lock
+    if (o->c->store->onode_compact) {
+      auto n = o->extent_map.compact();
+      if (n) {
+        logger->inc(l_bluestore_onode_compacted);
+        logger->inc(l_bluestore_onode_compacted_extents, n);
+      }
+    }
+  }
+}
+
 BlueStore::OnodeCacheShard *BlueStore::OnodeCacheShard::create(
     CephContext* cct,
     string type,
@@ -1265,6 +1340,9 @@ public:
         break;
       case BUFFER_WARM_OUT:
         b->cache_private = BUFFER_HOT;
+        if (logger) {
+          logger->inc(l_bluestore_buffer_ghost_hits);
+        }
         // move to hot.  fall-thru
       case BUFFER_HOT:
         dout(20) << __func__ << " move to front of hot " << *b << dendl;
@@ -1514,6 +1592,270 @@ public:
 #endif
 };
 
+// ArcBufferCacheShard
+
+/*
+ * Adaptive Replacement Cache (Megiddo & Modha, FAST'03), sized in bytes
+ * rather than pages.  t1 holds buffers seen once recently, t2 buffers
+ * seen at least twice; b1 and b2 are empty (ghost) buffers evicted from
+ * t1 and t2 respectively.  A read of a ghost range tells us which list
+ * was too short and moves the target size of t1 ('p') accordingly, so
+ * the split between recency and frequency follows the workload.  A one
+ * pass scan only ever touches t1, so it can't push the hot set in t2 out.
+ */
+struct ArcBufferCacheShard : public BlueStore::BufferCacheShard {
+  typedef boost::intrusive::list<
+    BlueStore::Buffer,
+    boost::intrusive::member_hook<
+      BlueStore::Buffer,
+      boost::intrusive::list_member_hook<>,
+      &BlueStore::Buffer::lru_item> > list_t;
+  list_t t1;  ///< recently used once
+  list_t t2;  ///< recently used at least twice
+  list_t b1;  ///< empty buffers evicted from t1
+  list_t b2;  ///< empty buffers evicted from t2
+
+  // _discard() hands back the highest value among the trimmed buffers,
+  // so rank them by how strong a hint they are.
+  enum {
+    BUFFER_NEW = 0,
+    BUFFER_T1,
+    BUFFER_B1,
+    BUFFER_B2,
+    BUFFER_T2,
+    BUFFER_TYPE_MAX
+  };
+
+  uint64_t list_bytes[BUFFER_TYPE_MAX] = {0}; ///< bytes per type
+  uint64_t p = 0;  ///< target size of t1, in bytes
+
+public:
+  explicit ArcBufferCacheShard(CephContext *cct) : BufferCacheShard(cct) {}
+
+  list_t& _list(int cache_private) {
+    switch (cache_private) {
+    case BUFFER_T1:
+      return t1;
+    case BUFFER_T2:
+      return t2;
+    case BUFFER_B1:
+      return b1;
+    case BUFFER_B2:
+      return b2;
+    default:
+      ceph_abort_msg("bad cache_private");
+    }
+  }
+
+  void _account(BlueStore::Buffer *b, int64_t delta) {
+    if (!b->is_empty()) {
+      ceph_assert((int64_t)buffer_bytes + delta >= 0);
+      buffer_bytes += delta;
+    }
+    ceph_assert((int64_t)list_bytes[b->cache_private] + delta >= 0);
+    list_bytes[b->cache_private] += delta;
+  }
+
+  /// move the t1 target towards the list whose ghost was just read
+  void _adapt(BlueStore::Buffer *b) {
+    // the ghost itself has already been dropped by _discard()
+    uint64_t b1_bytes = list_bytes[BUFFER_B1];
+    uint64_t b2_bytes = list_bytes[BUFFER_B2];
+    if (b->cache_private == BUFFER_B1) {
+      uint64_t ratio = std::max<uint64_t>(1, b2_bytes / (b1_bytes + b->length));
+      p = std::min<uint64_t>(max, p + ratio * b->length);
+    } else {
+      uint64_t ratio = std::max<uint64_t>(1, b1_bytes / (b2_bytes + b->length));
+      uint64_t delta = ratio * b->length;
+      p = p > delta ? p - delta : 0;
+    }
+    dout(20) << __func__ << " ghost hit on " << b->cache_private
+             << ", t1 target now " << p << dendl;
+  }
+
+  void _add(BlueStore::Buffer *b, int level, BlueStore::Buffer *near) override
+  {
+    dout(20) << __func__ << " level " << level << " near " << near
+             << " on " << *b
+             << " which has cache_private " << b->cache_private << dendl;
+    if (near) {
+      b->cache_private = near->cache_private;
+      auto& l = _list(b->cache_private);
+      l.insert(l.iterator_to(*near), *b);
+    } else {
+      switch (b->cache_private) {
+      case BUFFER_NEW:
+        b->cache_private = BUFFER_T1;
+        if (level > 0) {
+          t1.push_front(*b);
+        } else {
+          // take caller hint to start at the back of t1
+          t1.push_back(*b);
+        }
+        break;
+      case BUFFER_B1:
+      case BUFFER_B2:
+        _adapt(b);
+        if (logger) {
+          logger->inc(l_bluestore_buffer_ghost_hits);
+        }
+        // fall-thru
+      case BUFFER_T1:
+      case BUFFER_T2:
+        // re-read or rewrite of something we had; it is frequent now
+        b->cache_private = BUFFER_T2;
+        t2.push_front(*b);
+        break;
+      default:
+        ceph_abort_msg("bad cache_private");
+      }
+    }
+    _account(b, b->length);
+    num = t1.size() + t2.size();
+  }
+
+  void _rm(BlueStore::Buffer *b) override
+  {
+    dout(20) << __func__ << " " << *b << dendl;
+    _account(b, -(int64_t)b->length);
+    auto& l = _list(b->cache_private);
+    l.erase(l.iterator_to(*b));
+    num = t1.size() + t2.size();
+  }
+
+  void _move(BlueStore::BufferCacheShard *srcc, BlueStore::Buffer *b) override
+  {
+    ArcBufferCacheShard *src = static_cast<ArcBufferCacheShard*>(srcc);
+    src->_rm(b);
+    // preserve which list we're on (even if we can't preserve the order!)
+    _list(b->cache_private).push_back(*b);
+    _account(b, b->length);
+    num = t1.size() + t2.size();
+  }
+
+  void _adjust_size(BlueStore::Buffer *b, int64_t delta) override
+  {
+    dout(20) << __func__ << " delta " << delta << " on " << *b << dendl;
+    if (b->is_writing()) {
+      // not on any of our lists yet
+      return;
+    }
+    _account(b, delta);
+  }
+
+  void _touch(BlueStore::Buffer *b) override {
+    switch (b->cache_private) {
+    case BUFFER_T1:
+      t1.erase(t1.iterator_to(*b));
+      ceph_assert(list_bytes[BUFFER_T1] >= b->length);
+      list_bytes[BUFFER_T1] -= b->length;
+      list_bytes[BUFFER_T2] += b->length;
+      b->cache_private = BUFFER_T2;
+      t2.push_front(*b);
+      if (logger) {
+        logger->inc(l_bluestore_buffer_arc_recent_hits);
+      }
+      break;
+    case BUFFER_T2:
+      t2.erase(t2.iterator_to(*b));
+      t2.push_front(*b);
+      if (logger) {
+        logger->inc(l_bluestore_buffer_arc_frequent_hits);
+      }
+      break;
+    default:
+      ceph_abort_msg("ghost buffers are never read");
+    }
+    _audit("_touch_buffer end");
+  }
+
+  /// turn the tail of t1 or t2 into a ghost on the matching b list
+  void _evict_to_ghost(list_t& from, list_t& to, int type) {
+    BlueStore::Buffer *b = &*from.rbegin();
+    ceph_assert(b->is_clean());
+    dout(20) << __func__ << " " << *b << " -> " << type << dendl;
+    _account(b, -(int64_t)b->length);
+    b->state = BlueStore::Buffer::STATE_EMPTY;
+    b->data.clear();
+    from.erase(from.iterator_to(*b));
+    b->cache_private = type;
+    to.push_front(*b);
+    _account(b, b->length);
+  }
+
+  void _trim_to(uint64_t max) override
+  {
+    if (p > max) {
+      p = max;
+    }
+    // ARC replace(): shrink t1 while it is above target, t2 otherwise
+    while (buffer_bytes > max) {
+      if (!t1.empty() && (list_bytes[BUFFER_T1] > p || t2.empty())) {
+        _evict_to_ghost(t1, b1, BUFFER_B1);
+      } else if (!t2.empty()) {
+        _evict_to_ghost(t2, b2, BUFFER_B2);
+      } else {
+        break;
+      }
+    }
+    // keep |t1| + |b1| <= c and the whole directory within 2c
+    while (!b1.empty() &&
+           list_bytes[BUFFER_T1] + list_bytes[BUFFER_B1] > max) {
+      BlueStore::Buffer *b = &*b1.rbegin();
+      dout(20) << __func__ << " b1 rm " << *b << dendl;
+      b->space->_rm_buffer(this, b);
+    }
+    while (!b2.empty() &&
+           buffer_bytes + list_bytes[BUFFER_B1] + list_bytes[BUFFER_B2] >
+             2 * max) {
+      BlueStore::Buffer *b = &*b2.rbegin();
+      dout(20) << __func__ << " b2 rm " << *b << dendl;
+      b->space->_rm_buffer(this, b);
+    }
+    num = t1.size() + t2.size();
+  }
+
+  void add_stats(uint64_t *extents,
+                 uint64_t *blobs,
+                 uint64_t *buffers,
+                 uint64_t *bytes) override {
+    *extents += num_extents;
+    *blobs += num_blobs;
+    *buffers += num;
+    *bytes += buffer_bytes;
+  }
+
+#ifdef DEBUG_CACHE
+  void _audit(const char *when) override
+  {
+    dout(10) << __func__ << " " << when << " start" << dendl;
+    uint64_t s = 0;
+    for (int t = BUFFER_T1; t < BUFFER_TYPE_MAX; ++t) {
+      uint64_t ls = 0;
+      for (auto& b : _list(t)) {
+        ceph_assert(b.cache_private == t);
+        ls += b.length;
+      }
+      if (ls != list_bytes[t]) {
+        derr << __func__ << " list " << t << " bytes " << list_bytes[t]
+             << " != actual " << ls << dendl;
+        ceph_assert(ls == list_bytes[t]);
+      }
+      if (t == BUFFER_T1 || t == BUFFER_T2) {
+        s += ls;
+      }
+    }
+    if (s != buffer_bytes) {
+      derr << __func__ << " buffer_bytes " << buffer_bytes << " actual " << s
+           << dendl;
+      ceph_assert(s == buffer_bytes);
+    }
+    dout(20) << __func__ << " " << when << " buffer_bytes " << buffer_bytes
+             << " p " << p << " ok" << dendl;
+  }
+#endif
+};
+
 // BuferCacheShard
 
 BlueStore::BufferCacheShard *BlueStore::BufferCacheShard::create(
@@ -1526,6 +1868,8 @@ BlueStore::BufferCacheShard *BlueStore::BufferCacheShard::create(
     c = new LruBufferCacheShard(cct);
   else if (type == "2q")
     c = new TwoQBufferCacheShard(cct);
+  else if (type == "arc")
+    c = new ArcBufferCacheShard(cct);
   else
     ceph_abort_msg("unrecognized cache type");
   c->logger = logger;
@@ -1666,7 +2010,7 @@ void BlueStore::BufferSpace::read(
 	  offset += gap;
 	  length -= gap;
         }
-        if (!b->is_writing()) {
+        if (!b->is_writing() && !(flags & NO_PROMOTE)) {
 	  cache->_touch(b);
         }
         if (b->length > length) {
@@ -1690,6 +2034,7 @@ void BlueStore::BufferSpace::read(
   uint64_t miss_bytes = want_bytes - hit_bytes;
   cache->logger->inc(l_bluestore_buffer_hit_bytes, hit_bytes);
   cache->logger->inc(l_bluestore_buffer_miss_bytes, miss_bytes);
+  cache->note_access(hit_bytes, miss_bytes);
 }
 
 void BlueStore::BufferSpace::_finish_write(BufferCacheShard* cache, uint64_t seq)
@@ -1793,7 +2138,7 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::add(const ghobject_t& oid,
   }
   ldout(cache->cct, 20) << __func__ << " " << oid << " " << o << dendl;
   onode_map[oid] = o;
-  cache->_add(o.get(), 1);
+  cache->_add(o.get(), o->cold ? 0 : 1);
   cache->_trim();
   return o;
 }
@@ -1804,7 +2149,8 @@ void BlueStore::OnodeSpace::_remove(const ghobject_t& oid)
   onode_map.erase(oid);
 }
 
-BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
+BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid,
+                                                   bool cold)
 {
   ldout(cache->cct, 30) << __func__ << dendl;
   OnodeRef o;
@@ -1825,6 +2171,10 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
       // eventually will become unpinned
       o = p->second;
       ceph_assert(!o->cached || o->pinned);
+      if (!cold) {
+        // regular users want it too, treat it as any other onode
+        o->cold = false;
+      }
 
       hit = true;
     }
@@ -1835,6 +2185,7 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
   } else {
     cache->logger->inc(l_bluestore_onode_misses);
   }
+  cache->note_access(hit, !hit);
   return o;
 }
 
@@ -1848,6 +2199,12 @@ void BlueStore::OnodeSpace::clear()
   onode_map.clear();
 }
 
+bool BlueStore::OnodeSpace::has(const ghobject_t& oid)
+{
+  std::lock_guard l(cache->lock);
+  return onode_map.count(oid);
+}
+
 bool BlueStore::OnodeSpace::empty()
 {
   std::lock_guard l(cache->lock);
@@ -2535,6 +2892,15 @@ void BlueStore::ExtentMap::update(KeyValueDB::Transaction t,
     for (auto& it : encoded_shards) {
       it.shard->dirty = false;
       it.shard->shard_info->bytes = it.bl.length();
+      if (onode->c->store->onode_compact) {
+	// keep the fresh encoding so that the shard can be compacted
+	it.shard->packed = it.bl;
+	it.shard->packed.rebuild();
+	it.shard->packed.reassign_to_mempool(
+	  mempool::mempool_bluestore_inline_bl);
+      } else {
+	it.shard->packed.clear();
+      }
       generate_extent_shard_key_and_apply(
 	onode->key,
 	it.shard->shard_info->offset,
@@ -3127,6 +3493,7 @@ void BlueStore::ExtentMap::init_shards(bool loaded, bool dirty)
     shards[i].shard_info = &s;
     shards[i].loaded = loaded;
     shards[i].dirty = dirty;
+    shards[i].packed.clear();
     ++i;
   }
 }
@@ -3138,6 +3505,12 @@ void BlueStore::ExtentMap::fault_range(
 {
   dout(30) << __func__ << " 0x" << std::hex << offset << "~" << length
 	   << std::dec << dendl;
+  if (!inline_loaded) {
+    dout(30) << __func__ << " unpacking inline extents" << dendl;
+    decode_some(inline_bl);
+    inline_loaded = true;
+    onode->c->store->logger->inc(l_bluestore_onode_unpacked);
+  }
   auto start = seek_shard(offset);
   auto last = seek_shard(offset + length);
 
@@ -3149,7 +3522,13 @@ void BlueStore::ExtentMap::fault_range(
   while (start <= last) {
     ceph_assert((size_t)start < shards.size());
     auto p = &shards[start];
-    if (!p->loaded) {
+    if (!p->loaded && p->packed.length()) {
+      dout(30) << __func__ << " unpacking shard 0x" << std::hex
+	       << p->shard_info->offset << std::dec << dendl;
+      p->extents = decode_some(p->packed);
+      p->loaded = true;
+      onode->c->store->logger->inc(l_bluestore_onode_unpacked);
+    } else if (!p->loaded) {
       dout(30) << __func__ << " opening shard 0x" << std::hex
 	       << p->shard_info->offset << std::dec << dendl;
       bufferlist v;
@@ -3166,6 +3545,10 @@ void BlueStore::ExtentMap::fault_range(
         }
       );
       p->extents = decode_some(v);
+      if (onode->c->store->onode_compact) {
+	p->packed = v;
+	p->packed.reassign_to_mempool(mempool::mempool_bluestore_inline_bl);
+      }
       p->loaded = true;
       dout(20) << __func__ << " open shard 0x" << std::hex
 	       << p->shard_info->offset
@@ -3189,6 +3572,10 @@ void BlueStore::ExtentMap::dirty_range(
 	   << std::dec << dendl;
   if (shards.empty()) {
     dout(20) << __func__ << " mark inline shard dirty" << dendl;
+    if (!inline_loaded) {
+      decode_some(inline_bl);
+      inline_loaded = true;
+    }
     inline_bl.clear();
     return;
   }
@@ -3214,11 +3601,58 @@ void BlueStore::ExtentMap::dirty_range(
       dout(20) << __func__ << " mark shard 0x" << std::hex
 	       << p->shard_info->offset << std::dec << " dirty" << dendl;
       p->dirty = true;
+      p->packed.clear();
     }
     ++start;
   }
 }
 
+unsigned BlueStore::ExtentMap::compact()
+{
+  // blobs with cached data are kept so that the buffers stay reachable
+  std::lock_guard l(onode->c->cache->lock);
+  auto has_buffers = [](extent_map_t::iterator p, extent_map_t::iterator e) {
+    for (; p != e; ++p) {
+      if (!p->blob->shared_blob->bc.buffer_map.empty()) {
+	return true;
+      }
+    }
+    return false;
+  };
+
+  unsigned n = 0;
+  if (shards.empty()) {
+    if (!inline_loaded || inline_bl.length() == 0 ||
+	has_buffers(extent_map.begin(), extent_map.end())) {
+      return 0;
+    }
+    n = extent_map.size();
+    extent_map.clear_and_dispose(DeleteDisposer());
+    inline_loaded = false;
+    return n;
+  }
+  for (size_t i = 0; i < shards.size(); ++i) {
+    auto& s = shards[i];
+    if (!s.loaded || s.dirty || s.packed.length() == 0) {
+      continue;
+    }
+    uint32_t end = i + 1 < shards.size() ?
+      shards[i + 1].shard_info->offset : OBJECT_MAX_SIZE;
+    // extents never cross shard boundaries
+    auto p = seek_lextent(s.shard_info->offset);
+    auto e = seek_lextent(end);
+    if (has_buffers(p, e)) {
+      continue;
+    }
+    while (p != e) {
+      p = extent_map.erase_and_dispose(p, DeleteDisposer());
+      ++n;
+    }
+    s.loaded = false;
+  }
+  return n;
+}
+
 BlueStore::extent_map_t::iterator BlueStore::ExtentMap::find(
   uint64_t offset)
 {
@@ -3511,7 +3945,12 @@ BlueStore::Onode* BlueStore::Onode::decode(
   on->extent_map.decode_spanning_blobs(p);
   if (on->onode.extent_map_shards.empty()) {
     denc(on->extent_map.inline_bl, p);
-    on->extent_map.decode_some(on->extent_map.inline_bl);
+    if (c->store->onode_compact) {
+      // decoded on first use; many onodes are only ever stat'ed
+      on->extent_map.inline_loaded = false;
+    } else {
+      on->extent_map.decode_some(on->extent_map.inline_bl);
+    }
     on->extent_map.inline_bl.reassign_to_mempool(
       mempool::mempool_bluestore_cache_data);
   }
@@ -3547,58 +3986,75 @@ const string& BlueStore::Onode::get_omap_prefix()
   if (onode.is_pgmeta_omap()) {
     return PREFIX_PGMETA_OMAP;
   }
+  if (onode.is_perpg_omap()) {
+    return PREFIX_PERPG_OMAP;
+  }
   if (onode.is_perpool_omap()) {
     return PREFIX_PERPOOL_OMAP;
   }
   return PREFIX_OMAP;
 }
 
-// '-' < '.' < '~'
+// per-pg keys carry the bit-reversed object hash after the pool, so all
+// the keys of a PG form one contiguous range, whatever its pg_num
 
-void BlueStore::Onode::get_omap_header(string *out)
+void BlueStore::Onode::get_omap_key_base(string *out)
 {
-  if (onode.is_perpool_omap() && !onode.is_pgmeta_omap()) {
-    _key_encode_u64(c->pool(), out);
+  if (!onode.is_pgmeta_omap()) {
+    if (onode.is_perpg_omap()) {
+      _key_encode_u64(c->pool(), out);
+      _key_encode_u32(oid.hobj.get_bitwise_key_u32(), out);
+    } else if (onode.is_perpool_omap()) {
+      _key_encode_u64(c->pool(), out);
+    }
   }
   _key_encode_u64(onode.nid, out);
+}
+
+size_t BlueStore::Onode::get_omap_key_base_size() const
+{
+  if (!onode.is_pgmeta_omap()) {
+    if (onode.is_perpg_omap()) {
+      return sizeof(uint64_t) * 2 + sizeof(uint32_t);
+    } else if (onode.is_perpool_omap()) {
+      return sizeof(uint64_t) * 2;
+    }
+  }
+  return sizeof(uint64_t);
+}
+
+// '-' < '.' < '~'
+
+void BlueStore::Onode::get_omap_header(string *out)
+{
+  get_omap_key_base(out);
   out->push_back('-');
 }
 
 void BlueStore::Onode::get_omap_key(const string& key, string *out)
 {
-  if (onode.is_perpool_omap() && !onode.is_pgmeta_omap()) {
-    _key_encode_u64(c->pool(), out);
-  }
-  _key_encode_u64(onode.nid, out);
+  get_omap_key_base(out);
   out->push_back('.');
   out->append(key);
 }
 
-void BlueStore::Onode::rewrite_omap_key(const string& old, string *out)
+void BlueStore::Onode::rewrite_omap_key(const string& old,
+					size_t old_base_size,
+					string *out)
 {
-  if (onode.is_perpool_omap() && !onode.is_pgmeta_omap()) {
-    _key_encode_u64(c->pool(), out);
-  }
-  _key_encode_u64(onode.nid, out);
-  out->append(old.c_str() + out->length(), old.size() - out->length());
+  get_omap_key_base(out);
+  out->append(old.c_str() + old_base_size, old.size() - old_base_size);
 }
 
 void BlueStore::Onode::get_omap_tail(string *out)
 {
-  if (onode.is_perpool_omap() && !onode.is_pgmeta_omap()) {
-    _key_encode_u64(c->pool(), out);
-  }
-  _key_encode_u64(onode.nid, out);
+  get_omap_key_base(out);
   out->push_back('~');
 }
 
 void BlueStore::Onode::decode_omap_key(const string& key, string *user_key)
 {
-  if (onode.is_perpool_omap() && !onode.is_pgmeta_omap()) {
-    *user_key = key.substr(sizeof(uint64_t)*2 + 1);
-  } else {
-    *user_key = key.substr(sizeof(uint64_t) + 1);
-  }
+  *user_key = key.substr(get_omap_key_base_size() + 1);
 }
 
 
@@ -3856,7 +4312,8 @@ uint64_t BlueStore::Collection::make_blob_unshared(SharedBlob *sb)
 BlueStore::OnodeRef BlueStore::Collection::get_onode(
   const ghobject_t& oid,
   bool create,
-  bool is_createop)
+  bool is_createop,
+  bool cold)
 {
   ceph_assert(create ? ceph_mutex_is_wlocked(lock) : ceph_mutex_is_locked(lock));
 
@@ -3869,7 +4326,7 @@ BlueStore::OnodeRef BlueStore::Collection::get_onode(
     }
   }
 
-  OnodeRef o = onode_map.lookup(oid);
+  OnodeRef o = onode_map.lookup(oid, cold);
   if (o)
     return o;
 
@@ -3898,11 +4355,68 @@ BlueStore::OnodeRef BlueStore::Collection::get_onode(
     // loaded
     ceph_assert(r >= 0);
     on = Onode::decode(this, oid, key, v);
+    if (cold) {
+      on->cold = true;
+      store->logger->inc(l_bluestore_onode_cold_loads);
+    }
   }
   o.reset(on);
   return onode_map.add(oid, o);
 }
 
+size_t BlueStore::Collection::prefetch_onodes(
+  const std::vector<ghobject_t>& oids)
+{
+  // same as any other reader: an onode that a transaction in flight has
+  // touched stays in the cache until it's committed, so whatever is not
+  // cached while we hold the lock is current in the kv store
+  std::shared_lock l(lock);
+  if (!exists) {
+    return 0;
+  }
+  std::set<string> keys;
+  std::map<string, const ghobject_t*> oid_of;
+  for (auto& oid : oids) {
+    if (!contains(oid) || onode_map.has(oid)) {
+      continue;
+    }
+    string key;
+    get_object_key(store->cct, oid, &key);
+    oid_of[key] = &oid;
+    keys.insert(std::move(key));
+  }
+  if (keys.empty()) {
+    return 0;
+  }
+  std::map<string, bufferlist> values;
+  store->db->get(PREFIX_OBJ, keys, &values);
+  for (auto& [key, v] : values) {
+    const ghobject_t& oid = *oid_of[key];
+    OnodeRef o(Onode::decode(this, oid, key, v));
+    onode_map.add(oid, o);
+  }
+  ldout(store->cct, 20) << __func__ << " " << cid << " loaded " << values.size()
+			<< " of " << oids.size() << dendl;
+  return values.size();
+}
+
+void BlueStore::Collection::note_compress_ratio(
+  double ratio,
+  double required,
+  uint64_t skip)
+{
+  if (compress_ratio_avg > required && ratio <= required) {
+    // the data has become compressible again; don't make it work its
+    // way down through the average
+    compress_ratio_avg = ratio;
+  } else {
+    compress_ratio_avg += (ratio - compress_ratio_avg) / 8;
+  }
+  if (skip && compress_ratio_avg > required) {
+    compress_skip_left = skip;
+  }
+}
+
 void BlueStore::Collection::split_cache(
   Collection *dest)
 {
@@ -3990,6 +4504,151 @@ void BlueStore::Collection::split_cache(
 #undef dout_context
 #define dout_context store->cct
 
+void *BlueStore::OnodePrefetchThread::entry()
+{
+  std::unique_lock l{lock};
+  while (!stop) {
+    if (queue.empty()) {
+      cond.wait(l);
+      continue;
+    }
+    // a batch never spans collections; keep the order callers asked for
+    CollectionRef c = queue.front().first;
+    std::vector<ghobject_t> batch;
+    while (!queue.empty() && queue.front().first == c &&
+	   batch.size() < BATCH) {
+      batch.emplace_back(std::move(queue.front().second));
+      queue.pop_front();
+    }
+    l.unlock();
+    size_t loaded = c->prefetch_onodes(batch);
+    store->logger->inc(l_bluestore_onode_prefetched, loaded);
+    c.reset();
+    l.lock();
+  }
+  queue.clear();
+  return nullptr;
+}
+
+size_t BlueStore::OnodePrefetchThread::queue_objects(
+  CollectionRef c,
+  const std::vector<ghobject_t>& ls,
+  size_t max)
+{
+  std::lock_guard l{lock};
+  size_t n = 0;
+  for (auto& oid : ls) {
+    if (queue.size() >= max) {
+      break;
+    }
+    queue.emplace_back(c, oid);
+    ++n;
+  }
+  if (n) {
+    cond.notify_one();
+  }
+  return ls.size() - n;
+}
+
+// blobs of one write; whoever gets to them first compresses them
+struct BlueStore::CompressBatch {
+  struct result_t {
+    int r = 0;
+    bufferlist out;
+    boost::optional<int32_t> compressor_message;
+    mono_clock::duration lat;
+  };
+
+  CompressorRef c;
+  std::vector<const bufferlist*> in;
+  std::vector<result_t> results;
+  std::atomic<size_t> next = {0};
+
+  ceph::mutex lock = ceph::make_mutex("BlueStore::CompressBatch::lock");
+  ceph::condition_variable cond;
+  size_t done = 0;
+
+  CompressBatch(CompressorRef c, std::vector<const bufferlist*>&& in)
+    : c(c), in(std::move(in)), results(this->in.size()) {}
+
+  /// returns how many blobs this call compressed
+  size_t run() {
+    size_t n = 0;
+    size_t i;
+    while ((i = next++) < in.size()) {
+      auto start = mono_clock::now();
+      auto& res = results[i];
+      res.r = c->compress(*in[i], res.out, res.compressor_message);
+      res.lat = mono_clock::now() - start;
+      ++n;
+    }
+    if (n) {
+      std::lock_guard l{lock};
+      done += n;
+      if (done == in.size()) {
+	cond.notify_all();
+      }
+    }
+    return n;
+  }
+  void wait() {
+    std::unique_lock l{lock};
+    cond.wait(l, [this] { return done == in.size(); });
+  }
+};
+
+void BlueStore::CompressWorkers::init(unsigned n)
+{
+  stop = false;
+  for (unsigned i = 0; i < n; ++i) {
+    threads.emplace_back(std::make_unique<Worker>(this));
+    threads.back()->create("bstore_compress");
+  }
+}
+
+void BlueStore::CompressWorkers::shutdown()
+{
+  lock.lock();
+  stop = true;
+  cond.notify_all();
+  lock.unlock();
+  for (auto& t : threads) {
+    t->join();
+  }
+  threads.clear();
+  queue.clear();
+}
+
+void BlueStore::CompressWorkers::queue_batch(
+  std::shared_ptr<CompressBatch> batch,
+  size_t n)
+{
+  std::lock_guard l{lock};
+  n = std::min(n, threads.size());
+  for (size_t i = 0; i < n; ++i) {
+    queue.push_back(batch);
+  }
+  cond.notify_all();
+}
+
+void BlueStore::CompressWorkers::run()
+{
+  std::unique_lock l{lock};
+  while (!stop) {
+    if (queue.empty()) {
+      cond.wait(l);
+      continue;
+    }
+    auto batch = std::move(queue.front());
+    queue.pop_front();
+    l.unlock();
+    // the batch may be finished already, in which case this is a no-op
+    batch->run();
+    batch.reset();
+    l.lock();
+  }
+}
+
 void *BlueStore::MempoolThread::entry()
 {
   std::unique_lock l{lock};
@@ -4194,17 +4853,62 @@ void BlueStore::MempoolThread::_update_cache_settings()
 #define dout_prefix *_dout << "bluestore.OmapIteratorImpl(" << this << ") "
 
 BlueStore::OmapIteratorImpl::OmapIteratorImpl(
-  CollectionRef c, OnodeRef o, KeyValueDB::Iterator it)
-  : c(c), o(o), it(it)
+  CollectionRef c, OnodeRef o)
+  : c(c), o(o)
 {
   std::shared_lock l(c->lock);
+  auto cct = c->store->cct;
+  if (cct->_conf.get_val<bool>("bluestore_omap_tombstone_stats")) {
+    opts |= KeyValueDB::ITERATOR_TOMBSTONE_STATS;
+  }
+  readahead_threshold =
+    cct->_conf.get_val<uint64_t>("bluestore_omap_readahead_threshold");
   if (o->onode.has_omap()) {
     o->get_omap_key(string(), &head);
     o->get_omap_tail(&tail);
+    it = _get_iterator(opts);
     it->lower_bound(head);
+  } else {
+    it = c->store->db->get_iterator(o->get_omap_prefix());
+  }
+}
+
+BlueStore::OmapIteratorImpl::~OmapIteratorImpl()
+{
+  if (opts & KeyValueDB::ITERATOR_TOMBSTONE_STATS) {
+    if (it) {
+      tombstones += it->tombstones_skipped();
+    }
+    c->store->logger->inc(l_bluestore_omap_tombstones_skipped, tombstones);
   }
 }
 
+KeyValueDB::Iterator BlueStore::OmapIteratorImpl::_get_iterator(
+  KeyValueDB::IteratorOpts opts)
+{
+  // keep rocksdb from walking into the next object's keys (or their
+  // tombstones) once this object's omap is exhausted
+  KeyValueDB::IteratorBounds bounds;
+  bounds.lower_bound = head;
+  bounds.upper_bound = tail;
+  return c->store->db->get_iterator(o->get_omap_prefix(), opts,
+				    std::move(bounds));
+}
+
+void BlueStore::OmapIteratorImpl::_start_readahead()
+{
+  // the caller is listing, not probing: continue from the current
+  // position with an iterator that prefetches ahead of it
+  ldout(c->store->cct, 20) << __func__ << " after " << sequential
+			   << " nexts" << dendl;
+  auto nit = _get_iterator(opts | KeyValueDB::ITERATOR_READAHEAD);
+  nit->lower_bound(it->raw_key().second);
+  tombstones += it->tombstones_skipped();
+  it = nit;
+  opts |= KeyValueDB::ITERATOR_READAHEAD;
+  c->store->logger->inc(l_bluestore_omap_readahead);
+}
+
 string BlueStore::OmapIteratorImpl::_stringify() const
 {
   stringstream s;
@@ -4217,6 +4921,7 @@ int BlueStore::OmapIteratorImpl::seek_to_first()
 {
   std::shared_lock l(c->lock);
   auto start1 = mono_clock::now();
+  sequential = 0;
   if (o->onode.has_omap()) {
     it->lower_bound(head);
   } else {
@@ -4235,6 +4940,7 @@ int BlueStore::OmapIteratorImpl::upper_bound(const string& after)
 {
   std::shared_lock l(c->lock);
   auto start1 = mono_clock::now();
+  sequential = 0;
   if (o->onode.has_omap()) {
     string key;
     o->get_omap_key(after, &key);
@@ -4261,6 +4967,7 @@ int BlueStore::OmapIteratorImpl::lower_bound(const string& to)
 {
   std::shared_lock l(c->lock);
   auto start1 = mono_clock::now();
+  sequential = 0;
   if (o->onode.has_omap()) {
     string key;
     o->get_omap_key(to, &key);
@@ -4303,6 +5010,12 @@ int BlueStore::OmapIteratorImpl::next()
   auto start1 = mono_clock::now();
   if (o->onode.has_omap()) {
     it->next();
+    if (readahead_threshold &&
+	!(opts & KeyValueDB::ITERATOR_READAHEAD) &&
+	++sequential >= readahead_threshold &&
+	it->valid()) {
+      _start_readahead();
+    }
     r = 0;
   }
   c->store->log_latency(
@@ -4372,10 +5085,12 @@ BlueStore::BlueStore(CephContext *cct,
     throttle(cct),
     finisher(cct, "commit_finisher", "cfin"),
     kv_sync_thread(this),
+    kv_commit_thread(this),
     kv_finalize_thread(this),
     min_alloc_size(_min_alloc_size),
     min_alloc_size_order(ctz(_min_alloc_size)),
-    mempool_thread(this)
+    mempool_thread(this),
+    onode_prefetch_thread(this)
 {
   _init_logger();
   cct->_conf.add_observer(this);
@@ -4421,6 +5136,8 @@ const char **BlueStore::get_tracked_conf_keys() const
     "bluestore_deferred_batch_ops",
     "bluestore_deferred_batch_ops_hdd",
     "bluestore_deferred_batch_ops_ssd",
+    "bluestore_deferred_elevator",
+    "bluestore_deferred_batch_window",
     "bluestore_throttle_bytes",
     "bluestore_throttle_deferred_bytes",
     "bluestore_throttle_cost_per_io_hdd",
@@ -4479,7 +5196,9 @@ void BlueStore::handle_conf_change(const ConfigProxy& conf,
       changed.count("bluestore_max_alloc_size") ||
       changed.count("bluestore_deferred_batch_ops") ||
       changed.count("bluestore_deferred_batch_ops_hdd") ||
-      changed.count("bluestore_deferred_batch_ops_ssd")) {
+      changed.count("bluestore_deferred_batch_ops_ssd") ||
+      changed.count("bluestore_deferred_elevator") ||
+      changed.count("bluestore_deferred_batch_window")) {
     if (bdev) {
       // only after startup
       _set_alloc_sizes();
@@ -4631,6 +5350,8 @@ int BlueStore::_set_cache_sizes()
 {
   ceph_assert(bdev);
   cache_autotune = cct->_conf.get_val<bool>("bluestore_cache_autotune");
+  onode_compact = cct->_conf.get_val<bool>("bluestore_onode_compact");
+  cache_cold_reads = cct->_conf.get_val<bool>("bluestore_cache_cold_reads");
   cache_autotune_interval =
       cct->_conf.get_val<double>("bluestore_cache_autotune_interval");
   osd_memory_target = cct->_conf.get_val<Option::size_t>("osd_memory_target");
@@ -4734,6 +5455,12 @@ void BlueStore::_init_logger()
   b.add_time_avg(l_bluestore_kv_final_lat, "kv_final_lat",
 		 "Average kv_finalize thread latency",
 		 "kf_l", PerfCountersBuilder::PRIO_INTERESTING);
+  b.add_time_avg(l_bluestore_kv_apply_lat, "kv_apply_lat",
+		 "Average time to apply queued transactions of a kv_sync batch");
+  b.add_time_avg(l_bluestore_kv_pipeline_wait_lat, "kv_pipeline_wait_lat",
+		 "Average time a prepared kv_sync batch waits for the commit stage");
+  b.add_u64_avg(l_bluestore_kv_sync_batch, "kv_sync_batch",
+		"Average number of transactions committed per kv sync");
   b.add_time_avg(l_bluestore_state_prepare_lat, "state_prepare_lat",
     "Average prepare state latency");
   b.add_time_avg(l_bluestore_state_aio_wait_lat, "state_aio_wait_lat",
@@ -4783,12 +5510,34 @@ void BlueStore::_init_logger()
     "Sum for beneficial compress ops");
   b.add_u64_counter(l_bluestore_compress_rejected_count, "compress_rejected_count",
     "Sum for compress ops rejected due to low net gain of space");
+  b.add_u64_counter(l_bluestore_compress_skipped_count, "compress_skipped_count",
+    "Sum for blobs left uncompressed because of a poor recent compression ratio");
+  b.add_u64_counter(l_bluestore_compress_offloaded_count,
+    "compress_offloaded_count",
+    "Sum for blobs compressed by the compression workers");
   b.add_u64_counter(l_bluestore_write_pad_bytes, "write_pad_bytes",
 		    "Sum for write-op padded bytes", NULL, 0, unit_t(UNIT_BYTES));
   b.add_u64_counter(l_bluestore_deferred_write_ops, "deferred_write_ops",
 		    "Sum for deferred write op");
   b.add_u64_counter(l_bluestore_deferred_write_bytes, "deferred_write_bytes",
 		    "Sum for deferred write bytes", "def", 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_deferred_elevator_batches,
+		    "deferred_elevator_batches",
+		    "Sum for sequencer batches submitted through the deferred elevator");
+  b.add_u64_counter(l_bluestore_deferred_elevator_extents,
+		    "deferred_elevator_extents",
+		    "Sum for deferred extents sorted by the elevator");
+  b.add_u64_counter(l_bluestore_deferred_elevator_ios,
+		    "deferred_elevator_ios",
+		    "Sum for ios issued by the elevator after merging extents");
+  b.add_u64_avg(l_bluestore_deferred_elevator_seek_bytes,
+		"deferred_elevator_seek_bytes",
+		"Average distance between consecutive deferred ios as issued",
+		NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_avg(l_bluestore_deferred_elevator_unsorted_seek_bytes,
+		"deferred_elevator_unsorted_seek_bytes",
+		"Average distance between consecutive deferred ios in queue order",
+		NULL, 0, unit_t(UNIT_BYTES));
   b.add_u64_counter(l_bluestore_write_penalty_read_ops, "write_penalty_read_ops",
 		    "Sum for write penalty read ops");
   b.add_u64(l_bluestore_allocated, "bluestore_allocated",
@@ -4817,6 +5566,36 @@ void BlueStore::_init_logger()
   b.add_u64_counter(l_bluestore_onode_shard_misses,
 		    "bluestore_onode_shard_misses",
 		    "Sum for onode-shard lookups missed in the cache");
+  b.add_u64_counter(l_bluestore_onode_compacted, "bluestore_onode_compacted",
+		    "Sum for idle onodes whose extent maps were compacted");
+  b.add_u64_counter(l_bluestore_onode_compacted_extents,
+		    "bluestore_onode_compacted_extents",
+		    "Sum for extents dropped from idle onodes");
+  b.add_u64_counter(l_bluestore_onode_unpacked, "bluestore_onode_unpacked",
+		    "Sum for extent map shards decoded from their compact form");
+  b.add_u64_counter(l_bluestore_onode_cold_loads, "bluestore_onode_cold_loads",
+		    "Sum for onodes loaded by no-cache reads and kept at the cold end of the cache");
+  b.add_u64_counter(l_bluestore_onode_prefetched, "bluestore_onode_prefetched",
+		    "Sum for onodes loaded ahead of use after a listing");
+  b.add_u64_counter(l_bluestore_onode_prefetch_dropped,
+		    "bluestore_onode_prefetch_dropped",
+		    "Sum for onode prefetch requests dropped on a full queue");
+  b.add_u64_counter(l_bluestore_write_amp_client_bytes,
+		    "write_amp_client_bytes",
+		    "Sum for object data and omap bytes written by clients",
+		    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_write_amp_data_bytes,
+		    "write_amp_data_bytes",
+		    "Sum for bytes written to the device directly",
+		    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_write_amp_deferred_bytes,
+		    "write_amp_deferred_bytes",
+		    "Sum for bytes written to the device after going through the kv store",
+		    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_write_amp_kv_bytes,
+		    "write_amp_kv_bytes",
+		    "Sum for bytes of kv transactions",
+		    NULL, 0, unit_t(UNIT_BYTES));
   b.add_u64(l_bluestore_extents, "bluestore_extents",
 	    "Number of extents in cache");
   b.add_u64(l_bluestore_blobs, "bluestore_blobs",
@@ -4829,6 +5608,21 @@ void BlueStore::_init_logger()
 	    "Sum for bytes of read hit in the cache", NULL, 0, unit_t(UNIT_BYTES));
   b.add_u64_counter(l_bluestore_buffer_miss_bytes, "bluestore_buffer_miss_bytes",
 	    "Sum for bytes of read missed in the cache", NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_buffer_ghost_hits, "bluestore_buffer_ghost_hits",
+	    "Sum for reads of recently evicted buffers (2q, arc)");
+  b.add_u64_counter(l_bluestore_buffer_arc_recent_hits,
+	    "bluestore_buffer_arc_recent_hits",
+	    "Sum for buffer hits on the arc recency list");
+  b.add_u64_counter(l_bluestore_buffer_arc_frequent_hits,
+	    "bluestore_buffer_arc_frequent_hits",
+	    "Sum for buffer hits on the arc frequency list");
+  b.add_u64_counter(l_bluestore_buffer_cold_read_bytes,
+	    "bluestore_buffer_cold_read_bytes",
+	    "Sum for bytes read by no-cache reads and kept off the hot end of the cache",
+	    NULL, 0, unit_t(UNIT_BYTES));
+  b.add_u64_counter(l_bluestore_numa_remote_accesses,
+	    "bluestore_numa_remote_accesses",
+	    "Sum for cache lookups from a numa node other than the cache shard's");
 
   b.add_u64_counter(l_bluestore_write_big, "bluestore_write_big",
 		    "Large aligned writes into fresh blobs");
@@ -4880,6 +5674,10 @@ void BlueStore::_init_logger()
     "Average omap iterator lower_bound call latency");
   b.add_time_avg(l_bluestore_omap_next_lat, "omap_next_lat",
     "Average omap iterator next call latency");
+  b.add_u64_avg(l_bluestore_omap_tombstones_skipped, "omap_tombstones_skipped",
+    "Average number of deletion tombstones skipped per omap iteration");
+  b.add_u64_counter(l_bluestore_omap_readahead, "omap_readahead",
+    "Omap iterations switched to readahead");
   b.add_time_avg(l_bluestore_clist_lat, "clist_lat",
     "Average collection listing latency");
   logger = b.create_perf_counters();
@@ -5070,6 +5868,9 @@ void BlueStore::_set_alloc_sizes(void)
       deferred_batch_ops = cct->_conf->bluestore_deferred_batch_ops_ssd;
     }
   }
+  deferred_elevator = cct->_conf.get_val<bool>("bluestore_deferred_elevator");
+  deferred_batch_window =
+    cct->_conf.get_val<double>("bluestore_deferred_batch_window");
 
   dout(10) << __func__ << " min_alloc_size 0x" << std::hex << min_alloc_size
 	   << std::dec << " order " << (int)min_alloc_size_order
@@ -5077,6 +5878,8 @@ void BlueStore::_set_alloc_sizes(void)
 	   << " prefer_deferred_size 0x" << prefer_deferred_size
 	   << std::dec
 	   << " deferred_batch_ops " << deferred_batch_ops
+	   << " deferred_elevator " << deferred_elevator
+	   << " deferred_batch_window " << deferred_batch_window.load()
 	   << dendl;
 }
 
@@ -5279,16 +6082,29 @@ int BlueStore::_create_alloc()
     alloc_size = _zoned_piggyback_device_parameters_onto(alloc_size);
   }
 
-  shared_alloc.set(Allocator::create(cct, cct->_conf->bluestore_allocator,
+  auto cache_shards =
+    cct->_conf.get_val<uint64_t>("bluestore_allocator_cache_shards");
+  // zoned allocator hands out space sequentially, don't cache in front of it
+  bool cached = cache_shards > 0 && !bdev->is_smr();
+  Allocator* a = Allocator::create(cct, cct->_conf->bluestore_allocator,
     bdev->get_size(),
-    alloc_size, "block"));
+    alloc_size, cached ? "block.backend" : "block");
 
-  if (!shared_alloc.a) {
+  if (!a) {
     lderr(cct) << __func__ << "Failed to create allocator:: "
       << cct->_conf->bluestore_allocator
       << dendl;
     return -EINVAL;
   }
+  if (cached) {
+    a = new CachingAllocator(cct, a, alloc_size,
+      cache_shards,
+      cct->_conf.get_val<uint64_t>("bluestore_allocator_cache_slots"),
+      cct->_conf.get_val<Option::size_t>("bluestore_allocator_cache_refill_size"),
+      cct->_conf.get_val<Option::size_t>("bluestore_allocator_cache_max_request"),
+      "block");
+  }
+  shared_alloc.set(a);
   return 0;
 }
 
@@ -6076,6 +6892,8 @@ void BlueStore::_set_per_pool_omap()
   } else {
     dout(10) << __func__ << " per_pool_omap not present" << dendl;
   }
+  per_pg_omap = cct->_conf.get_val<bool>("bluestore_omap_per_pg");
+  dout(10) << __func__ << " per_pg_omap=" << per_pg_omap << dendl;
   _check_no_per_pool_omap_alert();
 }
 
@@ -6798,6 +7616,72 @@ void BlueStore::set_cache_shards(unsigned num)
   }
 }
 
+void BlueStore::set_cache_numa_nodes(const std::vector<int>& op_shard_nodes)
+{
+  size_t num_op = op_shard_nodes.size();
+  size_t num = onode_cache_shards.size();
+  ceph_assert(num == buffer_cache_shards.size());
+  if (!num_op) {
+    return;
+  }
+  // collections map to both kinds of shard by pg seed modulo the shard
+  // count, so a cache shard only ever serves a single op shard when the
+  // op shard count divides ours
+  bool aligned = num % num_op == 0;
+  if (!aligned) {
+    dout(1) << __func__ << " " << num << " cache shards can't follow "
+	    << num_op << " op shards, leaving them unbound" << dendl;
+  }
+  for (size_t i = 0; i < num; ++i) {
+    int node = aligned ? op_shard_nodes[i % num_op] : -1;
+    dout(10) << __func__ << " cache shard " << i << " numa node " << node
+	     << dendl;
+    onode_cache_shards[i]->numa_node = node;
+    buffer_cache_shards[i]->numa_node = node;
+  }
+}
+
+void BlueStore::_dump_cache_numa_stats(Formatter *f)
+{
+  struct node_stats_t {
+    uint64_t onode_hits = 0, onode_misses = 0;
+    uint64_t buffer_hit_bytes = 0, buffer_miss_bytes = 0;
+    uint64_t remote = 0;
+  };
+  std::map<int, node_stats_t> nodes;
+  for (auto i : onode_cache_shards) {
+    if (int node = i->numa_node; node >= 0) {
+      auto& n = nodes[node];
+      n.onode_hits += i->numa_hits;
+      n.onode_misses += i->numa_misses;
+      n.remote += i->numa_remote;
+    }
+  }
+  for (auto i : buffer_cache_shards) {
+    if (int node = i->numa_node; node >= 0) {
+      auto& n = nodes[node];
+      n.buffer_hit_bytes += i->numa_hits;
+      n.buffer_miss_bytes += i->numa_misses;
+      n.remote += i->numa_remote;
+    }
+  }
+  if (nodes.empty()) {
+    return;
+  }
+  f->open_array_section("numa_nodes");
+  for (auto& [node, n] : nodes) {
+    f->open_object_section("node");
+    f->dump_int("node", node);
+    f->dump_unsigned("onode_hits", n.onode_hits);
+    f->dump_unsigned("onode_misses", n.onode_misses);
+    f->dump_unsigned("buffer_hit_bytes", n.buffer_hit_bytes);
+    f->dump_unsigned("buffer_miss_bytes", n.buffer_miss_bytes);
+    f->dump_unsigned("remote_accesses", n.remote);
+    f->close_section();
+  }
+  f->close_section();
+}
+
 int BlueStore::_mount()
 {
   dout(1) << __func__ << " path " << path << dendl;
@@ -6845,6 +7729,9 @@ int BlueStore::_mount()
     goto out_stop;
 
   mempool_thread.init();
+  onode_prefetch_thread.init();
+  compress_workers.init(cct->_conf.get_val<uint64_t>("bluestore_compression_threads"));
+  asok_hook = SocketHook::create(this);
 
   if ((!per_pool_stat_collection || !per_pool_omap) &&
     cct->_conf->bluestore_fsck_quick_fix_on_mount == true) {
@@ -6886,6 +7773,10 @@ int BlueStore::umount()
 
   mounted = false;
   if (!_kv_only) {
+    delete asok_hook;
+    asok_hook = nullptr;
+    compress_workers.shutdown();
+    onode_prefetch_thread.shutdown();
     mempool_thread.shutdown();
     dout(20) << __func__ << " stopping kv thread" << dendl;
     _kv_stop();
@@ -6947,12 +7838,28 @@ int _fsck_sum_extents(
   return 0;
 }
 
+static bool fsck_test_and_set(BlueStore::mempool_dynamic_bitset& bs,
+			      uint64_t pos)
+{
+  if (bs.test(pos)) {
+    return true;
+  }
+  bs.set(pos);
+  return false;
+}
+
+static bool fsck_test_and_set(BlueStore::atomic_bitset& bs, uint64_t pos)
+{
+  return bs.test_and_set(pos);
+}
+
+template <typename Bitset>
 int BlueStore::_fsck_check_extents(
   const coll_t& cid,
   const ghobject_t& oid,
   const PExtentVector& extents,
   bool compressed,
-  mempool_dynamic_bitset &used_blocks,
+  Bitset &used_blocks,
   uint64_t granularity,
   BlueStoreRepairer* repairer,
   store_statfs_t& expected_statfs,
@@ -6971,8 +7878,8 @@ int BlueStore::_fsck_check_extents(
       bool already = false;
       apply_for_bitset_range(
         e.offset, e.length, granularity, used_blocks,
-        [&](uint64_t pos, mempool_dynamic_bitset &bs) {
-	  if (bs.test(pos)) {
+        [&](uint64_t pos, Bitset &bs) {
+	  if (fsck_test_and_set(bs, pos)) {
 	    if (repairer) {
 	      repairer->note_misreference(
 	        pos * min_alloc_size, min_alloc_size, !already);
@@ -6984,8 +7891,6 @@ int BlueStore::_fsck_check_extents(
 	      already = true;
 	    }
 	  }
-	  else
-	    bs.set(pos);
         });
         if (repairer) {
 	  repairer->get_space_usage_tracker().set_used( e.offset, e.length, cid, oid);
@@ -7257,9 +8162,16 @@ BlueStore::OnodeRef BlueStore::fsck_check_objects_shallow(
         sb_info_lock->lock();
       }
       sb_info_t& sbi = sb_info[i.first->shared_blob->get_sbid()];
-      ceph_assert(sbi.cid == coll_t() || sbi.cid == c->cid);
-      ceph_assert(sbi.pool_id == INT64_MIN ||
-        sbi.pool_id == oid.hobj.get_logical_pool());
+      if ((sbi.cid != coll_t() && sbi.cid != c->cid) ||
+          (sbi.pool_id != INT64_MIN &&
+           sbi.pool_id != oid.hobj.get_logical_pool())) {
+        derr << "fsck error: " << oid << " blob " << blob
+          << " shared blob 0x" << std::hex
+          << i.first->shared_blob->get_sbid() << std::dec
+          << " is also used in " << sbi.cid << " (pool " << sbi.pool_id
+          << ")" << dendl;
+        ++errors;
+      }
       sbi.cid = c->cid;
       sbi.pool_id = oid.hobj.get_logical_pool();
       sbi.sb = i.first->shared_blob;
@@ -7273,6 +8185,14 @@ BlueStore::OnodeRef BlueStore::fsck_check_objects_shallow(
       if (sb_info_lock) {
         sb_info_lock->unlock();
       }
+    } else if (depth != FSCK_SHALLOW && ctx.atomic_used_blocks) {
+      errors += _fsck_check_extents(c->cid, oid, blob.get_extents(),
+        blob.is_compressed(),
+        *ctx.atomic_used_blocks,
+        fm->get_alloc_size(),
+        repairer,
+        *res_statfs,
+        depth);
     } else if (depth != FSCK_SHALLOW) {
       ceph_assert(used_blocks);
       errors += _fsck_check_extents(c->cid, oid, blob.get_extents(),
@@ -7575,10 +8495,12 @@ void BlueStore::_fsck_check_object_omap(FSCKDepth depth,
         << fsck_dendl;
     }
   }
-  if (repairer &&
-    !o->onode.is_perpool_omap() &&
-    !o->onode.is_pgmeta_omap()) {
-    dout(10) << "fsck converting " << o->oid << " omap to per-pool" << dendl;
+  bool to_perpool = !o->onode.is_perpool_omap() && !o->onode.is_pgmeta_omap();
+  bool to_perpg = per_pg_omap &&
+    !o->onode.is_perpg_omap() && !o->onode.is_pgmeta_omap();
+  if (repairer && (to_perpool || to_perpg)) {
+    dout(10) << "fsck converting " << o->oid << " omap to "
+	     << (per_pg_omap ? "per-pg" : "per-pool") << dendl;
     bufferlist h;
     map<string, bufferlist> kv;
     int r = _onode_omap_get(o, &h, &kv);
@@ -7594,7 +8516,7 @@ void BlueStore::_fsck_check_object_omap(FSCKDepth depth,
       txn->rm_range_keys(old_omap_prefix, old_head, old_tail);
       txn->rmkey(old_omap_prefix, old_tail);
       // set flag
-      o->onode.set_flag(bluestore_onode_t::FLAG_PERPOOL_OMAP);
+      o->onode.set_omap_flags(per_pg_omap);
       _record_onode(o, txn);
       const string& new_omap_prefix = o->get_omap_prefix();
       // head
@@ -7623,260 +8545,523 @@ void BlueStore::_fsck_check_object_omap(FSCKDepth depth,
   }
 }
 
-void BlueStore::_fsck_check_objects(FSCKDepth depth,
-  BlueStore::FSCK_ObjectCtx& ctx)
+size_t BlueStore::_fsck_check_objects_range(FSCKDepth depth,
+  BlueStore::FSCK_ObjectCtx& ctx,
+  const string& from,
+  const string& to,
+  uint64_t_btree_t& used_nids,
+  fsck_queue_fn_t queue,
+  const std::function<void()>& progress)
 {
   auto& errors = ctx.errors;
-  auto sb_info_lock = ctx.sb_info_lock;
-  auto& sb_info = ctx.sb_info;
-  auto repairer = ctx.repairer;
-
-  uint64_t_btree_t used_nids;
 
   size_t processed_myself = 0;
+  size_t keys = 0;
 
   auto it = db->get_iterator(PREFIX_OBJ, KeyValueDB::ITERATOR_NOCACHE);
+  if (!it) {
+    return 0;
+  }
   mempool::bluestore_fsck::list<string> expecting_shards;
-  if (it) {
-    const size_t thread_count = cct->_conf->bluestore_fsck_quick_fix_threads;
-    typedef ShallowFSCKThreadPool::FSCKWorkQueue<256> WQ;
-    std::unique_ptr<WQ> wq(
-      new WQ(
-        "FSCKWorkQueue",
-        (thread_count ? : 1) * 32,
-        this,
-        sb_info_lock,
-        sb_info,
-        repairer));
 
-    ShallowFSCKThreadPool thread_pool(cct, "ShallowFSCKThreadPool", "ShallowFSCK", thread_count);
-
-    thread_pool.add_work_queue(wq.get());
-    if (depth == FSCK_SHALLOW && thread_count > 0) {
-      //not the best place but let's check anyway
-      ceph_assert(sb_info_lock);
-      thread_pool.start();
+  //fill global if not overriden below
+  CollectionRef c;
+  int64_t pool_id = -1;
+  spg_t pgid;
+  for (it->lower_bound(from); it->valid(); it->next()) {
+    if (!to.empty() && it->key() >= to) {
+      break;
     }
-
-    //fill global if not overriden below
-    CollectionRef c;
-    int64_t pool_id = -1;
-    spg_t pgid;
-    for (it->lower_bound(string()); it->valid(); it->next()) {
-      dout(30) << __func__ << " key "
-        << pretty_binary_string(it->key()) << dendl;
-      if (is_extent_shard_key(it->key())) {
-        if (depth == FSCK_SHALLOW) {
-          continue;
-        }
-        while (!expecting_shards.empty() &&
-          expecting_shards.front() < it->key()) {
-          derr << "fsck error: missing shard key "
-            << pretty_binary_string(expecting_shards.front())
-            << dendl;
-          ++errors;
-          expecting_shards.pop_front();
-        }
-        if (!expecting_shards.empty() &&
-          expecting_shards.front() == it->key()) {
-          // all good
-          expecting_shards.pop_front();
-          continue;
-        }
-
-        uint32_t offset;
-        string okey;
-        get_key_extent_shard(it->key(), &okey, &offset);
-        derr << "fsck error: stray shard 0x" << std::hex << offset
-          << std::dec << dendl;
-        if (expecting_shards.empty()) {
-          derr << "fsck error: " << pretty_binary_string(it->key())
-            << " is unexpected" << dendl;
-          ++errors;
-          continue;
-        }
-        while (expecting_shards.front() > it->key()) {
-          derr << "fsck error:   saw " << pretty_binary_string(it->key())
-            << dendl;
-          derr << "fsck error:   exp "
-            << pretty_binary_string(expecting_shards.front()) << dendl;
-          ++errors;
-          expecting_shards.pop_front();
-          if (expecting_shards.empty()) {
-            break;
-          }
-        }
+    if (progress && (++keys & 1023) == 0) {
+      progress();
+    }
+    dout(30) << __func__ << " key "
+      << pretty_binary_string(it->key()) << dendl;
+    if (is_extent_shard_key(it->key())) {
+      if (depth == FSCK_SHALLOW) {
+        continue;
+      }
+      while (!expecting_shards.empty() &&
+        expecting_shards.front() < it->key()) {
+        derr << "fsck error: missing shard key "
+          << pretty_binary_string(expecting_shards.front())
+          << dendl;
+        ++errors;
+        expecting_shards.pop_front();
+      }
+      if (!expecting_shards.empty() &&
+        expecting_shards.front() == it->key()) {
+        // all good
+        expecting_shards.pop_front();
         continue;
       }
 
-      ghobject_t oid;
-      int r = get_key_object(it->key(), &oid);
-      if (r < 0) {
-        derr << "fsck error: bad object key "
-          << pretty_binary_string(it->key()) << dendl;
+      uint32_t offset;
+      string okey;
+      get_key_extent_shard(it->key(), &okey, &offset);
+      derr << "fsck error: stray shard 0x" << std::hex << offset
+        << std::dec << dendl;
+      if (expecting_shards.empty()) {
+        derr << "fsck error: " << pretty_binary_string(it->key())
+          << " is unexpected" << dendl;
         ++errors;
         continue;
       }
-      if (!c ||
-        oid.shard_id != pgid.shard ||
-        oid.hobj.get_logical_pool() != (int64_t)pgid.pool() ||
-        !c->contains(oid)) {
-        c = nullptr;
-        for (auto& p : coll_map) {
-          if (p.second->contains(oid)) {
-            c = p.second;
-            break;
-          }
-        }
-        if (!c) {
-          derr << "fsck error: stray object " << oid
-            << " not owned by any collection" << dendl;
-          ++errors;
-          continue;
-        }
-        pool_id = c->cid.is_pg(&pgid) ? pgid.pool() : META_POOL_ID;
-        dout(20) << __func__ << "  collection " << c->cid << " " << c->cnode
+      while (expecting_shards.front() > it->key()) {
+        derr << "fsck error:   saw " << pretty_binary_string(it->key())
           << dendl;
+        derr << "fsck error:   exp "
+          << pretty_binary_string(expecting_shards.front()) << dendl;
+        ++errors;
+        expecting_shards.pop_front();
+        if (expecting_shards.empty()) {
+          break;
+        }
       }
+      continue;
+    }
 
-      if (depth != FSCK_SHALLOW &&
-        !expecting_shards.empty()) {
-        for (auto& k : expecting_shards) {
-          derr << "fsck error: missing shard key "
-            << pretty_binary_string(k) << dendl;
+    ghobject_t oid;
+    int r = get_key_object(it->key(), &oid);
+    if (r < 0) {
+      derr << "fsck error: bad object key "
+        << pretty_binary_string(it->key()) << dendl;
+      ++errors;
+      continue;
+    }
+    if (!c ||
+      oid.shard_id != pgid.shard ||
+      oid.hobj.get_logical_pool() != (int64_t)pgid.pool() ||
+      !c->contains(oid)) {
+      c = nullptr;
+      for (auto& p : coll_map) {
+        if (p.second->contains(oid)) {
+          c = p.second;
+          break;
         }
+      }
+      if (!c) {
+        derr << "fsck error: stray object " << oid
+          << " not owned by any collection" << dendl;
         ++errors;
-        expecting_shards.clear();
-      }
-
-      bool queued = false;
-      if (depth == FSCK_SHALLOW && thread_count > 0) {
-        queued = wq->queue(
-          pool_id,
-          c,
-          oid,
-          it->key(),
-          it->value());
-      }
-      OnodeRef o;
-      map<BlobRef, bluestore_blob_t::unused_t> referenced;
-
-      if (!queued) {
-        ++processed_myself;
-
-         o = fsck_check_objects_shallow(
-          depth,
-          pool_id,
-          c,
-          oid,
-          it->key(),
-          it->value(),
-          &expecting_shards,
-          &referenced,
-          ctx);
+        continue;
       }
+      pool_id = c->cid.is_pg(&pgid) ? pgid.pool() : META_POOL_ID;
+      dout(20) << __func__ << "  collection " << c->cid << " " << c->cnode
+        << dendl;
+    }
 
-      if (depth != FSCK_SHALLOW) {
-        ceph_assert(o != nullptr);
-        if (o->onode.nid) {
-          if (o->onode.nid > nid_max) {
-            derr << "fsck error: " << oid << " nid " << o->onode.nid
-              << " > nid_max " << nid_max << dendl;
-            ++errors;
-          }
-          if (used_nids.count(o->onode.nid)) {
-            derr << "fsck error: " << oid << " nid " << o->onode.nid
-              << " already in use" << dendl;
-            ++errors;
-            continue; // go for next object
-          }
-          used_nids.insert(o->onode.nid);
+    if (depth != FSCK_SHALLOW &&
+      !expecting_shards.empty()) {
+      for (auto& k : expecting_shards) {
+        derr << "fsck error: missing shard key "
+          << pretty_binary_string(k) << dendl;
+      }
+      ++errors;
+      expecting_shards.clear();
+    }
+
+    bool queued = false;
+    if (queue) {
+      queued = queue(
+        pool_id,
+        c,
+        oid,
+        it->key(),
+        it->value());
+    }
+    if (ctx.progress_objects) {
+      ++(*ctx.progress_objects);
+    }
+    OnodeRef o;
+    map<BlobRef, bluestore_blob_t::unused_t> referenced;
+
+    if (!queued) {
+      ++processed_myself;
+
+       o = fsck_check_objects_shallow(
+        depth,
+        pool_id,
+        c,
+        oid,
+        it->key(),
+        it->value(),
+        &expecting_shards,
+        &referenced,
+        ctx);
+    }
+
+    if (depth != FSCK_SHALLOW) {
+      ceph_assert(o != nullptr);
+      if (o->onode.nid) {
+        if (o->onode.nid > nid_max) {
+          derr << "fsck error: " << oid << " nid " << o->onode.nid
+            << " > nid_max " << nid_max << dendl;
+          ++errors;
         }
-        for (auto& i : referenced) {
-          dout(20) << __func__ << "  referenced 0x" << std::hex << i.second
-            << std::dec << " for " << *i.first << dendl;
-          const bluestore_blob_t& blob = i.first->get_blob();
-          if (i.second & blob.unused) {
-            derr << "fsck error: " << oid << " blob claims unused 0x"
-              << std::hex << blob.unused
-              << " but extents reference 0x" << i.second << std::dec
-              << " on blob " << *i.first << dendl;
-            ++errors;
-          }
-          if (blob.has_csum()) {
-            uint64_t blob_len = blob.get_logical_length();
-            uint64_t unused_chunk_size = blob_len / (sizeof(blob.unused) * 8);
-            unsigned csum_count = blob.get_csum_count();
-            unsigned csum_chunk_size = blob.get_csum_chunk_size();
-            for (unsigned p = 0; p < csum_count; ++p) {
-              unsigned pos = p * csum_chunk_size;
-              unsigned firstbit = pos / unused_chunk_size;    // [firstbit,lastbit]
-              unsigned lastbit = (pos + csum_chunk_size - 1) / unused_chunk_size;
-              unsigned mask = 1u << firstbit;
-              for (unsigned b = firstbit + 1; b <= lastbit; ++b) {
-                mask |= 1u << b;
-              }
-              if ((blob.unused & mask) == mask) {
-                // this csum chunk region is marked unused
-                if (blob.get_csum_item(p) != 0) {
-                  derr << "fsck error: " << oid
-                    << " blob claims csum chunk 0x" << std::hex << pos
-                    << "~" << csum_chunk_size
-                    << " is unused (mask 0x" << mask << " of unused 0x"
-                    << blob.unused << ") but csum is non-zero 0x"
-                    << blob.get_csum_item(p) << std::dec << " on blob "
-                    << *i.first << dendl;
-                  ++errors;
-                }
+        if (used_nids.count(o->onode.nid)) {
+          derr << "fsck error: " << oid << " nid " << o->onode.nid
+            << " already in use" << dendl;
+          ++errors;
+          continue; // go for next object
+        }
+        used_nids.insert(o->onode.nid);
+      }
+      for (auto& i : referenced) {
+        dout(20) << __func__ << "  referenced 0x" << std::hex << i.second
+          << std::dec << " for " << *i.first << dendl;
+        const bluestore_blob_t& blob = i.first->get_blob();
+        if (i.second & blob.unused) {
+          derr << "fsck error: " << oid << " blob claims unused 0x"
+            << std::hex << blob.unused
+            << " but extents reference 0x" << i.second << std::dec
+            << " on blob " << *i.first << dendl;
+          ++errors;
+        }
+        if (blob.has_csum()) {
+          uint64_t blob_len = blob.get_logical_length();
+          uint64_t unused_chunk_size = blob_len / (sizeof(blob.unused) * 8);
+          unsigned csum_count = blob.get_csum_count();
+          unsigned csum_chunk_size = blob.get_csum_chunk_size();
+          for (unsigned p = 0; p < csum_count; ++p) {
+            unsigned pos = p * csum_chunk_size;
+            unsigned firstbit = pos / unused_chunk_size;    // [firstbit,lastbit]
+            unsigned lastbit = (pos + csum_chunk_size - 1) / unused_chunk_size;
+            unsigned mask = 1u << firstbit;
+            for (unsigned b = firstbit + 1; b <= lastbit; ++b) {
+              mask |= 1u << b;
+            }
+            if ((blob.unused & mask) == mask) {
+              // this csum chunk region is marked unused
+              if (blob.get_csum_item(p) != 0) {
+                derr << "fsck error: " << oid
+                  << " blob claims csum chunk 0x" << std::hex << pos
+                  << "~" << csum_chunk_size
+                  << " is unused (mask 0x" << mask << " of unused 0x"
+                  << blob.unused << ") but csum is non-zero 0x"
+                  << blob.get_csum_item(p) << std::dec << " on blob "
+                  << *i.first << dendl;
+                ++errors;
               }
             }
           }
         }
-        // omap
-        if (o->onode.has_omap()) {
-          ceph_assert(ctx.used_omap_head);
-          if (ctx.used_omap_head->count(o->onode.nid)) {
-            derr << "fsck error: " << o->oid << " omap_head " << o->onode.nid
-                 << " already in use" << dendl;
+      }
+      // omap
+      if (o->onode.has_omap()) {
+        ceph_assert(ctx.used_omap_head);
+        if (ctx.used_omap_head->count(o->onode.nid)) {
+          derr << "fsck error: " << o->oid << " omap_head " << o->onode.nid
+               << " already in use" << dendl;
+          ++errors;
+        } else {
+          ctx.used_omap_head->insert(o->onode.nid);
+        }
+      } // if (o->onode.has_omap())
+      if (depth == FSCK_DEEP) {
+        bufferlist bl;
+        uint64_t max_read_block = cct->_conf->bluestore_fsck_read_bytes_cap;
+        uint64_t offset = 0;
+        do {
+          uint64_t l = std::min(uint64_t(o->onode.size - offset), max_read_block);
+          int r = _do_read(c.get(), o, offset, l, bl,
+            CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
+          if (r < 0) {
             ++errors;
-          } else {
-            ctx.used_omap_head->insert(o->onode.nid);
+            derr << "fsck error: " << oid << std::hex
+              << " error during read: "
+              << " " << offset << "~" << l
+              << " " << cpp_strerror(r) << std::dec
+              << dendl;
+            break;
           }
-        } // if (o->onode.has_omap())
-        if (depth == FSCK_DEEP) {
-          bufferlist bl;
-          uint64_t max_read_block = cct->_conf->bluestore_fsck_read_bytes_cap;
-          uint64_t offset = 0;
-          do {
-            uint64_t l = std::min(uint64_t(o->onode.size - offset), max_read_block);
-            int r = _do_read(c.get(), o, offset, l, bl,
-              CEPH_OSD_OP_FLAG_FADVISE_NOCACHE);
-            if (r < 0) {
-              ++errors;
-              derr << "fsck error: " << oid << std::hex
-                << " error during read: "
-                << " " << offset << "~" << l
-                << " " << cpp_strerror(r) << std::dec
-                << dendl;
-              break;
-            }
-            offset += l;
-          } while (offset < o->onode.size);
-        } // deep
-      } //if (depth != FSCK_SHALLOW)
-    } // for (it->lower_bound(string()); it->valid(); it->next())
-    if (depth == FSCK_SHALLOW && thread_count > 0) {
-      wq->finalize(thread_pool, ctx);
-      if (processed_myself) {
-        // may be needs more threads?
-        dout(0) << __func__ << " partial offload"
-                << ", done myself " << processed_myself
-                << " of " << ctx.num_objects
-                << "objects, threads " << thread_count
-                << dendl;
+          if (ctx.progress_bytes) {
+            *ctx.progress_bytes += l;
+          }
+          offset += l;
+        } while (offset < o->onode.size);
+      } // deep
+    } //if (depth != FSCK_SHALLOW)
+  } // for (it->lower_bound(from); it->valid(); it->next())
+  if (depth != FSCK_SHALLOW && !expecting_shards.empty()) {
+    for (auto& k : expecting_shards) {
+      derr << "fsck error: missing shard key "
+        << pretty_binary_string(k) << dendl;
+    }
+    ++errors;
+  }
+  return processed_myself;
+}
+
+/*
+ * Regular and deep fsck spend most of their time decoding onodes, faulting
+ * in extent map shards and (deep) reading object data, all of which is
+ * independent per object.  Split the object keyspace at collection
+ * boundaries and let each thread walk whole ranges with private
+ * accounting; only the allocation bitmap is shared, as an atomic bitset.
+ * Cross-range state (nids, omap heads, shared blob references) is merged
+ * and checked for duplicates once all ranges are done.
+ */
+void BlueStore::_fsck_check_objects_parallel(FSCKDepth depth,
+  BlueStore::FSCK_ObjectCtx& ctx,
+  size_t thread_count)
+{
+  ceph_assert(depth != FSCK_SHALLOW);
+  ceph_assert(!ctx.repairer);
+  ceph_assert(ctx.used_blocks);
+
+  // range boundaries: the first key of every collection, which never
+  // separates an onode from its extent shards
+  vector<string> bounds;
+  for (auto& p : coll_map) {
+    ghobject_t temp_start, temp_end, start, end;
+    get_coll_range(p.first, p.second->cnode.bits,
+		   &temp_start, &temp_end, &start, &end);
+    bounds.emplace_back();
+    get_object_key(cct, start, &bounds.back());
+    if (p.first.is_pg()) {
+      bounds.emplace_back();
+      get_object_key(cct, temp_start, &bounds.back());
+    }
+  }
+  std::sort(bounds.begin(), bounds.end());
+  bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+  // a few ranges per thread to even out the load
+  size_t num_ranges = std::min(bounds.size() + 1, thread_count * 8);
+  vector<std::pair<string, string>> ranges;
+  string prev;
+  for (size_t i = 1; i < num_ranges; ++i) {
+    auto& b = bounds[i * bounds.size() / num_ranges];
+    if (b > prev) {
+      ranges.emplace_back(prev, b);
+      prev = b;
+    }
+  }
+  ranges.emplace_back(prev, string());
+
+  struct worker_t {
+    int64_t errors = 0;
+    int64_t warnings = 0;
+    uint64_t num_objects = 0;
+    uint64_t num_extents = 0;
+    uint64_t num_blobs = 0;
+    uint64_t num_sharded_objects = 0;
+    uint64_t num_spanning_blobs = 0;
+    uint64_t_btree_t used_nids;
+    uint64_t_btree_t used_omap_head;
+    sb_info_map_t sb_info;
+    store_statfs_t expected_store_statfs;
+    per_pool_statfs expected_pool_statfs;
+  };
+  vector<worker_t> workers(std::min(thread_count, ranges.size()));
+
+  std::unique_ptr<atomic_bitset> used_blocks(
+    new atomic_bitset(ctx.used_blocks->size()));
+  for (auto pos = ctx.used_blocks->find_first();
+       pos != mempool_dynamic_bitset::npos;
+       pos = ctx.used_blocks->find_next(pos)) {
+    used_blocks->set(pos);
+  }
+  mempool_dynamic_bitset().swap(*ctx.used_blocks);
+
+  dout(1) << __func__ << " " << ranges.size() << " ranges, "
+	  << workers.size() << " threads" << dendl;
+  std::atomic<size_t> next_range = {0};
+  std::atomic<size_t> ranges_done = {0};
+  std::atomic<uint64_t> objects = {0};
+  std::atomic<uint64_t> bytes = {0};
+  vector<std::thread> threads;
+  for (auto& w : workers) {
+    threads.push_back(make_named_thread("bstore_fsck", [&, this] {
+      FSCK_ObjectCtx wctx(
+	w.errors,
+	w.warnings,
+	w.num_objects,
+	w.num_extents,
+	w.num_blobs,
+	w.num_sharded_objects,
+	w.num_spanning_blobs,
+	nullptr,
+	&w.used_omap_head,
+	nullptr,
+	w.sb_info,
+	w.expected_store_statfs,
+	w.expected_pool_statfs,
+	nullptr);
+      wctx.atomic_used_blocks = used_blocks.get();
+      wctx.progress_objects = &objects;
+      wctx.progress_bytes = &bytes;
+      size_t i;
+      while ((i = next_range++) < ranges.size()) {
+	_fsck_check_objects_range(depth, wctx,
+	  ranges[i].first, ranges[i].second,
+	  w.used_nids, nullptr, nullptr);
+	++ranges_done;
       }
+    }));
+  }
+
+  auto start = mono_clock::now();
+  auto report = [&] {
+    if (fsck_progress_cb) {
+      fsck_progress_t p;
+      p.objects = objects;
+      p.bytes_read = bytes;
+      p.ranges_done = ranges_done;
+      p.ranges_total = ranges.size();
+      p.elapsed = ceph::to_seconds<double>(mono_clock::now() - start);
+      fsck_progress_cb(p);
+    }
+  };
+  auto last_report = start;
+  while (ranges_done < ranges.size()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    auto now = mono_clock::now();
+    if (now - last_report >= std::chrono::seconds(1)) {
+      last_report = now;
+      report();
+    }
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  report();
+
+  // reduce
+  for (size_t i = 0; i < used_blocks->num_words(); ++i) {
+    ctx.used_blocks->append(used_blocks->word(i));
+  }
+  ctx.used_blocks->resize(used_blocks->size());
+  used_blocks.reset();
+
+  uint64_t_btree_t used_nids;
+  for (auto& w : workers) {
+    ctx.errors += w.errors;
+    ctx.warnings += w.warnings;
+    ctx.num_objects += w.num_objects;
+    ctx.num_extents += w.num_extents;
+    ctx.num_blobs += w.num_blobs;
+    ctx.num_sharded_objects += w.num_sharded_objects;
+    ctx.num_spanning_blobs += w.num_spanning_blobs;
+    ctx.expected_store_statfs.add(w.expected_store_statfs);
+    for (auto& [pool, statfs] : w.expected_pool_statfs) {
+      ctx.expected_pool_statfs[pool].add(statfs);
+    }
+    for (auto nid : w.used_nids) {
+      if (!used_nids.insert(nid).second) {
+        derr << "fsck error: nid " << nid
+          << " already in use" << dendl;
+        ++ctx.errors;
+      }
+    }
+    for (auto nid : w.used_omap_head) {
+      if (!ctx.used_omap_head->insert(nid).second) {
+        derr << "fsck error: omap_head " << nid
+          << " already in use" << dendl;
+        ++ctx.errors;
+      }
+    }
+    for (auto& [sbid, from] : w.sb_info) {
+      sb_info_t& sbi = ctx.sb_info[sbid];
+      if (sbi.cid == coll_t()) {
+        sbi = std::move(from);
+        continue;
+      }
+      if (sbi.cid != from.cid || sbi.pool_id != from.pool_id) {
+        derr << "fsck error: shared blob 0x" << std::hex << sbid << std::dec
+          << " is used in " << sbi.cid << " (pool " << sbi.pool_id
+          << ") and in " << from.cid << " (pool " << from.pool_id << ")"
+          << dendl;
+        ++ctx.errors;
+      }
+      sbi.oids.splice(sbi.oids.end(), from.oids);
+      sbi.compressed = from.compressed;
+      for (auto& [offset, r] : from.ref_map.ref_map) {
+        for (uint32_t n = 0; n < r.refs; ++n) {
+          sbi.ref_map.get(offset, r.length);
+        }
+      }
+    }
+    w.sb_info.clear();
+  }
+}
+
+void BlueStore::_fsck_check_objects(FSCKDepth depth,
+  BlueStore::FSCK_ObjectCtx& ctx)
+{
+  auto sb_info_lock = ctx.sb_info_lock;
+  auto& sb_info = ctx.sb_info;
+  auto repairer = ctx.repairer;
+
+  const size_t fsck_threads = cct->_conf.get_val<uint64_t>("bluestore_fsck_threads");
+  if (depth != FSCK_SHALLOW && !repairer && fsck_threads > 1) {
+    _fsck_check_objects_parallel(depth, ctx, fsck_threads);
+    return;
+  }
+
+  uint64_t_btree_t used_nids;
+
+  const size_t thread_count = cct->_conf->bluestore_fsck_quick_fix_threads;
+  typedef ShallowFSCKThreadPool::FSCKWorkQueue<256> WQ;
+  std::unique_ptr<WQ> wq(
+    new WQ(
+      "FSCKWorkQueue",
+      (thread_count ? : 1) * 32,
+      this,
+      sb_info_lock,
+      sb_info,
+      repairer));
+
+  ShallowFSCKThreadPool thread_pool(cct, "ShallowFSCKThreadPool", "ShallowFSCK", thread_count);
+
+  thread_pool.add_work_queue(wq.get());
+  fsck_queue_fn_t queue;
+  if (depth == FSCK_SHALLOW && thread_count > 0) {
+    //not the best place but let's check anyway
+    ceph_assert(sb_info_lock);
+    thread_pool.start();
+    queue = [&wq](int64_t pool_id, CollectionRef c, const ghobject_t& oid,
+		  const string& key, const bufferlist& value) {
+      return wq->queue(pool_id, c, oid, key, value);
+    };
+  }
+
+  std::atomic<uint64_t> objects = {0};
+  std::atomic<uint64_t> bytes = {0};
+  ctx.progress_objects = &objects;
+  ctx.progress_bytes = &bytes;
+  auto start = mono_clock::now();
+  auto last_report = start;
+  auto report = [&](bool force) {
+    auto now = mono_clock::now();
+    if (fsck_progress_cb &&
+	(force || now - last_report >= std::chrono::seconds(1))) {
+      last_report = now;
+      fsck_progress_t p;
+      p.objects = objects;
+      p.bytes_read = bytes;
+      p.elapsed = ceph::to_seconds<double>(now - start);
+      fsck_progress_cb(p);
     }
-  } // if (it)
+  };
+  size_t processed_myself = _fsck_check_objects_range(depth, ctx,
+    string(), string(), used_nids, queue,
+    [&] { report(false); });
+  report(true);
+  ctx.progress_objects = nullptr;
+  ctx.progress_bytes = nullptr;
+
+  if (depth == FSCK_SHALLOW && thread_count > 0) {
+    wq->finalize(thread_pool, ctx);
+    if (processed_myself) {
+      // may be needs more threads?
+      dout(0) << __func__ << " partial offload"
+              << ", done myself " << processed_myself
+              << " of " << ctx.num_objects
+              << "objects, threads " << thread_count
+              << dendl;
+    }
+  }
 }
 /**
 An overview for currently implemented repair logics 
@@ -8478,6 +9663,28 @@ int BlueStore::_fsck_on_open(BlueStore::FSCKDepth depth, bool repair)
         }
       }
     }
+    it = db->get_iterator(PREFIX_PERPG_OMAP, KeyValueDB::ITERATOR_NOCACHE);
+    if (it) {
+      uint64_t last_omap_head = 0;
+      for (it->lower_bound(string()); it->valid(); it->next()) {
+        uint64_t pool;
+        uint32_t hash;
+        uint64_t omap_head;
+        string k = it->key();
+        const char *c = k.c_str();
+        c = _key_decode_u64(c, &pool);
+        c = _key_decode_u32(c, &hash);
+        c = _key_decode_u64(c, &omap_head);
+        if (used_omap_head.count(omap_head) == 0 &&
+	    omap_head != last_omap_head) {
+          fsck_derr(errors, MAX_FSCK_ERROR_LINES)
+            << "fsck error: found stray (per-pg) omap data on omap_head "
+            << omap_head << " " << last_omap_head << " " << used_omap_head.count(omap_head) << fsck_dendl;
+          ++errors;
+	  last_omap_head = omap_head;
+        }
+      }
+    }
     dout(1) << __func__ << " checking deferred events" << dendl;
     it = db->get_iterator(PREFIX_DEFERRED, KeyValueDB::ITERATOR_NOCACHE);
     if (it) {
@@ -8713,7 +9920,9 @@ void BlueStore::inject_legacy_omap(coll_t cid, ghobject_t oid)
     o = c->get_onode(oid, false);
     ceph_assert(o);
   }
-  o->onode.clear_flag(bluestore_onode_t::FLAG_PERPOOL_OMAP | bluestore_onode_t::FLAG_PGMETA_OMAP);
+  o->onode.clear_flag(bluestore_onode_t::FLAG_PERPOOL_OMAP |
+		      bluestore_onode_t::FLAG_PERPG_OMAP |
+		      bluestore_onode_t::FLAG_PGMETA_OMAP);
   txn = db->get_transaction();
   _record_onode(o, txn);
   db->submit_transaction_sync(txn);
@@ -8912,7 +10121,8 @@ void BlueStore::_get_statfs_overall(struct store_statfs_t *buf)
 
   buf->omap_allocated =
     db->estimate_prefix_size(PREFIX_OMAP, string()) +
-    db->estimate_prefix_size(PREFIX_PERPOOL_OMAP, string());
+    db->estimate_prefix_size(PREFIX_PERPOOL_OMAP, string()) +
+    db->estimate_prefix_size(PREFIX_PERPG_OMAP, string());
 
   uint64_t bfree = shared_alloc.a->get_free();
 
@@ -8982,8 +10192,9 @@ int BlueStore::pool_statfs(uint64_t pool_id, struct store_statfs_t *buf,
 
   string key_prefix;
   _key_encode_u64(pool_id, &key_prefix);
-  buf->omap_allocated = db->estimate_prefix_size(PREFIX_PERPOOL_OMAP,
-						 key_prefix);
+  buf->omap_allocated =
+    db->estimate_prefix_size(PREFIX_PERPOOL_OMAP, key_prefix) +
+    db->estimate_prefix_size(PREFIX_PERPG_OMAP, key_prefix);
   *out_per_pool_omap = per_pool_omap;
 
   dout(10) << __func__ << *buf << dendl;
@@ -9195,6 +10406,15 @@ int BlueStore::set_collection_opts(
   return 0;
 }
 
+// Background readers (scrub, backfill, copy-from) hint that they won't
+// come back for the data; keep it from displacing the client working set.
+static bool is_cold_read(uint32_t op_flags)
+{
+  return (op_flags & CEPH_OSD_OP_FLAG_FADVISE_WILLNEED) == 0 &&
+    (op_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
+		 CEPH_OSD_OP_FLAG_FADVISE_NOCACHE)) != 0;
+}
+
 int BlueStore::read(
   CollectionHandle &c_,
   const ghobject_t& oid,
@@ -9217,7 +10437,7 @@ int BlueStore::read(
   {
     std::shared_lock l(c->lock);
     auto start1 = mono_clock::now();
-    OnodeRef o = c->get_onode(oid, false);
+    OnodeRef o = c->get_onode(oid, false, false, is_cold_read(op_flags));
     log_latency("get_onode@read",
       l_bluestore_read_onode_meta_lat,
       mono_clock::now() - start1,
@@ -9431,9 +10651,11 @@ int BlueStore::_generate_read_result_bl(
   vector<bufferlist>& compressed_blob_bls,
   blobs2read_t& blobs2read,
   bool buffered,
+  bool cold,
   bool* csum_error,
   bufferlist& bl)
 {
+  uint64_t cold_bytes = 0;
  // enumerate and decompress desired blobs
   auto p = compressed_blob_bls.begin();
   blobs2read_t::iterator b2r_it = blobs2read.begin();
@@ -9456,7 +10678,10 @@ int BlueStore::_generate_read_result_bl(
         return r;
       if (buffered) {
         bptr->shared_blob->bc.did_read(bptr->shared_blob->get_cache(), 0,
-                                       raw_bl);
+                                       raw_bl, cold ? 0 : 1);
+      }
+      if (cold) {
+        cold_bytes += raw_bl.length();
       }
       for (auto& req : r2r) {
         for (auto& r : req.regs) {
@@ -9473,7 +10698,10 @@ int BlueStore::_generate_read_result_bl(
         }
         if (buffered) {
           bptr->shared_blob->bc.did_read(bptr->shared_blob->get_cache(),
-                                         req.r_off, req.bl);
+                                         req.r_off, req.bl, cold ? 0 : 1);
+        }
+        if (cold) {
+          cold_bytes += req.bl.length();
         }
 
         // prune and keep result
@@ -9484,6 +10712,9 @@ int BlueStore::_generate_read_result_bl(
     }
     ++b2r_it;
   }
+  if (cold_bytes) {
+    logger->inc(l_bluestore_buffer_cold_read_bytes, cold_bytes);
+  }
 
   // generate a resulting buffer
   auto pr = ready_regions.begin();
@@ -9541,14 +10772,19 @@ int BlueStore::_do_read(
   // generally, don't buffer anything, unless the client explicitly requests
   // it.
   bool buffered = false;
+  bool cold = is_cold_read(op_flags);
   if (op_flags & CEPH_OSD_OP_FLAG_FADVISE_WILLNEED) {
     dout(20) << __func__ << " will do buffered read" << dendl;
     buffered = true;
-  } else if (cct->_conf->bluestore_default_buffered_read &&
-	     (op_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
-			  CEPH_OSD_OP_FLAG_FADVISE_NOCACHE)) == 0) {
+  } else if (cct->_conf->bluestore_default_buffered_read && !cold) {
     dout(20) << __func__ << " defaulting to buffered read" << dendl;
     buffered = true;
+  } else if (cold && cache_cold_reads) {
+    dout(20) << __func__ << " will do buffered read at the cold end" << dendl;
+    buffered = true;
+  }
+  if (cold) {
+    read_cache_policy |= BufferSpace::NO_PROMOTE;
   }
 
   if (offset + length > o->onode.size) {
@@ -9567,7 +10803,7 @@ int BlueStore::_do_read(
   // order to read underlying block device in case there are silent disk errors.
   if (op_flags & CEPH_OSD_OP_FLAG_BYPASS_CLEAN_CACHE) {
     dout(20) << __func__ << " will bypass cache and do direct read" << dendl;
-    read_cache_policy = BufferSpace::BYPASS_CLEAN_CACHE;
+    read_cache_policy |= BufferSpace::BYPASS_CLEAN_CACHE;
   }
 
   // build blob-wise list to of stuff read (that isn't cached)
@@ -9609,7 +10845,7 @@ int BlueStore::_do_read(
   bool csum_error = false;
   r = _generate_read_result_bl(o, offset, length, ready_regions,
                               compressed_blob_bls, blobs2read,
-                              buffered, &csum_error, bl);
+                              buffered, cold, &csum_error, bl);
   if (csum_error) {
     // Handles spurious read errors caused by a kernel bug.
     // We sometimes get all-zero pages as a result of the read under
@@ -9842,7 +11078,7 @@ int BlueStore::readv(
   {
     std::shared_lock l(c->lock);
     auto start1 = mono_clock::now();
-    OnodeRef o = c->get_onode(oid, false);
+    OnodeRef o = c->get_onode(oid, false, false, is_cold_read(op_flags));
     log_latency("get_onode@read",
       l_bluestore_read_onode_meta_lat,
       mono_clock::now() - start1,
@@ -9903,14 +11139,19 @@ int BlueStore::_do_readv(
   // generally, don't buffer anything, unless the client explicitly requests
   // it.
   bool buffered = false;
+  bool cold = is_cold_read(op_flags);
   if (op_flags & CEPH_OSD_OP_FLAG_FADVISE_WILLNEED) {
     dout(20) << __func__ << " will do buffered read" << dendl;
     buffered = true;
-  } else if (cct->_conf->bluestore_default_buffered_read &&
-             (op_flags & (CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
-                          CEPH_OSD_OP_FLAG_FADVISE_NOCACHE)) == 0) {
+  } else if (cct->_conf->bluestore_default_buffered_read && !cold) {
     dout(20) << __func__ << " defaulting to buffered read" << dendl;
     buffered = true;
+  } else if (cold && cache_cold_reads) {
+    dout(20) << __func__ << " will do buffered read at the cold end" << dendl;
+    buffered = true;
+  }
+  if (cold) {
+    read_cache_policy |= BufferSpace::NO_PROMOTE;
   }
   // this method must be idempotent since we may call it several times
   // before we finally read the expected result.
@@ -9969,7 +11210,7 @@ int BlueStore::_do_readv(
                                  std::get<0>(raw_results[i]),
                                  std::get<1>(raw_results[i]),
                                  std::get<2>(raw_results[i]),
-                                 buffered, &csum_error, t);
+                                 buffered, cold, &csum_error, t);
     if (csum_error) {
       // Handles spurious read errors caused by a kernel bug.
       // We sometimes get all-zero pages as a result of the read under
@@ -10187,6 +11428,23 @@ int BlueStore::collection_list_legacy(
   return r;
 }
 
+void BlueStore::prefetch_objects(
+  CollectionHandle &c_,
+  const vector<ghobject_t>& ls)
+{
+  uint64_t max = cct->_conf.get_val<uint64_t>("bluestore_onode_prefetch_queue");
+  if (!max || ls.empty()) {
+    return;
+  }
+  CollectionRef c(static_cast<Collection*>(c_.get()));
+  size_t dropped = onode_prefetch_thread.queue_objects(c, ls, max);
+  if (dropped) {
+    logger->inc(l_bluestore_onode_prefetch_dropped, dropped);
+  }
+  dout(20) << __func__ << " " << c->cid << " " << ls.size() << " objects, "
+	   << dropped << " dropped" << dendl;
+}
+
 int BlueStore::_collection_list(
   Collection *c, const ghobject_t& start, const ghobject_t& end, int max,
   bool legacy, vector<ghobject_t> *ls, ghobject_t *pnext)
@@ -10351,6 +11609,30 @@ int BlueStore::_omap_get(
   return r;
 }
 
+KeyValueDB::Iterator BlueStore::_get_omap_list_iterator(
+  const string& prefix,
+  const string& head,
+  const string& tail)
+{
+  // full listings of a single object: bound the iterator to the object's
+  // keys and let rocksdb read ahead
+  KeyValueDB::IteratorOpts opts = KeyValueDB::ITERATOR_READAHEAD;
+  if (cct->_conf.get_val<bool>("bluestore_omap_tombstone_stats")) {
+    opts |= KeyValueDB::ITERATOR_TOMBSTONE_STATS;
+  }
+  KeyValueDB::IteratorBounds bounds;
+  bounds.lower_bound = head;
+  bounds.upper_bound = tail;
+  return db->get_iterator(prefix, opts, std::move(bounds));
+}
+
+void BlueStore::_report_omap_tombstones(KeyValueDB::Iterator& it)
+{
+  if (cct->_conf.get_val<bool>("bluestore_omap_tombstone_stats")) {
+    logger->inc(l_bluestore_omap_tombstones_skipped, it->tombstones_skipped());
+  }
+}
+
 int BlueStore::_onode_omap_get(
   const OnodeRef &o,           ///< [in] Object containing omap
   bufferlist *header,          ///< [out] omap header
@@ -10367,10 +11649,10 @@ int BlueStore::_onode_omap_get(
   o->flush();
   {
     const string& prefix = o->get_omap_prefix();
-    KeyValueDB::Iterator it = db->get_iterator(prefix);
     string head, tail;
     o->get_omap_header(&head);
     o->get_omap_tail(&tail);
+    KeyValueDB::Iterator it = _get_omap_list_iterator(prefix, head, tail);
     it->lower_bound(head);
     while (it->valid()) {
       if (it->key() == head) {
@@ -10388,6 +11670,7 @@ int BlueStore::_onode_omap_get(
       }
       it->next();
     }
+    _report_omap_tombstones(it);
   }
 out:
   return r;
@@ -10451,10 +11734,10 @@ int BlueStore::omap_get_keys(
   o->flush();
   {
     const string& prefix = o->get_omap_prefix();
-    KeyValueDB::Iterator it = db->get_iterator(prefix);
     string head, tail;
     o->get_omap_key(string(), &head);
     o->get_omap_tail(&tail);
+    KeyValueDB::Iterator it = _get_omap_list_iterator(prefix, head, tail);
     it->lower_bound(head);
     while (it->valid()) {
       if (it->key() >= tail) {
@@ -10468,6 +11751,7 @@ int BlueStore::omap_get_keys(
       keys->insert(user_key);
       it->next();
     }
+    _report_omap_tombstones(it);
   }
  out:
   dout(10) << __func__ << " " << c->get_cid() << " oid " << oid << " = " << r
@@ -10502,15 +11786,18 @@ int BlueStore::omap_get_values(
     const string& prefix = o->get_omap_prefix();
     o->get_omap_key(string(), &final_key);
     size_t base_key_len = final_key.size();
+    set<string> db_keys;
     for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
       final_key.resize(base_key_len); // keep prefix
       final_key += *p;
-      bufferlist val;
-      if (db->get(prefix, final_key, &val) >= 0) {
-	dout(30) << __func__ << "  got " << pretty_binary_string(final_key)
-		 << " -> " << *p << dendl;
-	out->insert(make_pair(*p, val));
-      }
+      db_keys.insert(db_keys.end(), final_key);
+    }
+    map<string, bufferlist> vals;
+    db->get(prefix, db_keys, &vals);
+    for (auto& [k, v] : vals) {
+      dout(30) << __func__ << "  got " << pretty_binary_string(k)
+	       << " -> " << k.substr(base_key_len) << dendl;
+      out->emplace_hint(out->end(), k.substr(base_key_len), std::move(v));
     }
   }
  out:
@@ -10588,17 +11875,22 @@ int BlueStore::omap_check_keys(
     const string& prefix = o->get_omap_prefix();
     o->get_omap_key(string(), &final_key);
     size_t base_key_len = final_key.size();
+    set<string> db_keys;
     for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
       final_key.resize(base_key_len); // keep prefix
       final_key += *p;
-      bufferlist val;
-      if (db->get(prefix, final_key, &val) >= 0) {
-	dout(30) << __func__ << "  have " << pretty_binary_string(final_key)
-		 << " -> " << *p << dendl;
-	out->insert(*p);
+      db_keys.insert(db_keys.end(), final_key);
+    }
+    map<string, bufferlist> vals;
+    db->get(prefix, db_keys, &vals);
+    for (auto& k : db_keys) {
+      if (vals.count(k)) {
+	dout(30) << __func__ << "  have " << pretty_binary_string(k)
+		 << " -> " << k.substr(base_key_len) << dendl;
+	out->insert(out->end(), k.substr(base_key_len));
       } else {
-	dout(30) << __func__ << "  miss " << pretty_binary_string(final_key)
-		 << " -> " << *p << dendl;
+	dout(30) << __func__ << "  miss " << pretty_binary_string(k)
+		 << " -> " << k.substr(base_key_len) << dendl;
       }
     }
   }
@@ -10626,8 +11918,7 @@ ObjectMap::ObjectMapIterator BlueStore::get_omap_iterator(
   }
   o->flush();
   dout(10) << __func__ << " has_omap = " << (int)o->onode.has_omap() <<dendl;
-  KeyValueDB::Iterator it = db->get_iterator(o->get_omap_prefix());
-  return ObjectMap::ObjectMapIterator(new OmapIteratorImpl(c, o, it));
+  return ObjectMap::ObjectMapIterator(new OmapIteratorImpl(c, o));
 }
 
 // -----------------
@@ -10868,6 +12159,80 @@ void BlueStore::get_db_statistics(Formatter *f)
   db->get_statistics(f);
 }
 
+void BlueStore::write_amp_t::dump(Formatter *f) const
+{
+  f->dump_unsigned("client_bytes", client);
+  f->dump_unsigned("data_bytes", data);
+  f->dump_unsigned("deferred_bytes", deferred);
+  f->dump_unsigned("kv_bytes", kv);
+}
+
+void BlueStore::dump_write_amp(Formatter *f)
+{
+  // bluefs writes on behalf of the kv store as a whole: its WAL, its
+  // flushes and compactions, and bluefs' own metadata log.  pools get
+  // their share of that by the kv bytes they submitted.
+  uint64_t wal = 0, sst = 0, log = 0;
+  if (bluefs) {
+    auto bl = bluefs->get_perf_counters();
+    wal = bl->get(l_bluefs_bytes_written_wal);
+    sst = bl->get(l_bluefs_bytes_written_sst);
+    log = bl->get(l_bluefs_logged_bytes);
+  }
+  std::map<uint64_t, write_amp_t> pools;
+  write_amp_t total;
+  {
+    std::lock_guard l(write_amp_lock);
+    pools = pool_write_amp;
+    wal -= std::min(wal, write_amp_bluefs_base[0]);
+    sst -= std::min(sst, write_amp_bluefs_base[1]);
+    log -= std::min(log, write_amp_bluefs_base[2]);
+  }
+  for (auto& p : pools) {
+    total += p.second;
+  }
+  double kv_factor = total.kv ? (double)(wal + sst + log) / total.kv : 0;
+
+  auto dump_one = [&](const write_amp_t& w) {
+    w.dump(f);
+    uint64_t device = w.data + w.deferred + (uint64_t)(w.kv * kv_factor);
+    f->dump_unsigned("device_bytes", device);
+    f->dump_float("write_amp", w.client ? (double)device / w.client : 0);
+  };
+
+  f->open_object_section("write_amp");
+  f->open_object_section("bluefs");
+  f->dump_unsigned("wal_bytes", wal);
+  f->dump_unsigned("sst_bytes", sst);
+  f->dump_unsigned("log_bytes", log);
+  f->dump_float("kv_write_amp", kv_factor);
+  f->close_section();
+  f->open_array_section("pools");
+  for (auto& p : pools) {
+    f->open_object_section("pool");
+    f->dump_int("pool_id", (int64_t)p.first);
+    dump_one(p.second);
+    f->close_section();
+  }
+  f->close_section();
+  f->open_object_section("total");
+  dump_one(total);
+  f->close_section();
+  f->close_section();
+}
+
+void BlueStore::reset_write_amp()
+{
+  std::lock_guard l(write_amp_lock);
+  pool_write_amp.clear();
+  if (bluefs) {
+    auto bl = bluefs->get_perf_counters();
+    write_amp_bluefs_base[0] = bl->get(l_bluefs_bytes_written_wal);
+    write_amp_bluefs_base[1] = bl->get(l_bluefs_bytes_written_sst);
+    write_amp_bluefs_base[2] = bl->get(l_bluefs_logged_bytes);
+  }
+}
+
 BlueStore::TransContext *BlueStore::_txc_create(
   Collection *c, OpSequencer *osr,
   list<Context*> *on_commits,
@@ -10936,6 +12301,23 @@ void BlueStore::_txc_update_store_statfs(TransContext *txc)
   txc->statfs_delta.reset();
 }
 
+void BlueStore::_txc_account_write_amp(TransContext *txc)
+{
+  auto& w = txc->write_amp;
+  if (txc->deferred_txn) {
+    for (auto& op : txc->deferred_txn->ops) {
+      w.deferred += op.data.length();
+    }
+  }
+  w.kv = txc->t->get_size_bytes();
+  logger->inc(l_bluestore_write_amp_client_bytes, w.client);
+  logger->inc(l_bluestore_write_amp_data_bytes, w.data);
+  logger->inc(l_bluestore_write_amp_deferred_bytes, w.deferred);
+  logger->inc(l_bluestore_write_amp_kv_bytes, w.kv);
+  std::lock_guard l(write_amp_lock);
+  pool_write_amp[txc->osd_pool_id] += w;
+}
+
 void BlueStore::_txc_state_proc(TransContext *txc)
 {
   while (true) {
@@ -11282,6 +12664,7 @@ void BlueStore::_txc_apply_kv(TransContext *txc, bool sync_submit_transaction)
     }
 #endif
 
+    _txc_account_write_amp(txc);
     int r = cct->_conf->bluestore_debug_omit_kv_commit ? 0 : db->submit_transaction(txc->t);
     ceph_assert(r == 0);
     txc->set_state(TransContext::STATE_KV_SUBMITTED);
@@ -11608,7 +12991,13 @@ void BlueStore::_kv_start()
   dout(10) << __func__ << dendl;
 
   finisher.start();
+  kv_sync_pipeline = cct->_conf.get_val<bool>("bluestore_kv_sync_pipeline");
+  kv_sync_group_commit_ratio =
+    cct->_conf.get_val<double>("bluestore_kv_sync_group_commit_ratio");
   kv_sync_thread.create("bstore_kv_sync");
+  if (kv_sync_pipeline) {
+    kv_commit_thread.create("bstore_kv_commit");
+  }
   kv_finalize_thread.create("bstore_kv_final");
 }
 
@@ -11623,6 +13012,22 @@ void BlueStore::_kv_stop()
     kv_stop = true;
     kv_cond.notify_all();
   }
+  kv_sync_thread.join();
+  // the commit stage drains whatever kv_sync_thread handed over before
+  // it stopped
+  if (kv_sync_pipeline) {
+    std::unique_lock l{kv_commit_lock};
+    while (!kv_commit_started) {
+      kv_commit_cond.wait(l);
+    }
+    kv_commit_stop = true;
+    kv_commit_cond.notify_all();
+  }
+  if (kv_sync_pipeline) {
+    kv_commit_thread.join();
+    std::lock_guard l(kv_commit_lock);
+    kv_commit_stop = false;
+  }
   {
     std::unique_lock l{kv_finalize_lock};
     while (!kv_finalize_started) {
@@ -11631,7 +13036,6 @@ void BlueStore::_kv_stop()
     kv_finalize_stop = true;
     kv_finalize_cond.notify_all();
   }
-  kv_sync_thread.join();
   kv_finalize_thread.join();
   ceph_assert(removed_collections.empty());
   {
@@ -11651,7 +13055,6 @@ void BlueStore::_kv_stop()
 void BlueStore::_kv_sync_thread()
 {
   dout(10) << __func__ << " start" << dendl;
-  deque<DeferredBatch*> deferred_stable_queue; ///< deferred ios done + stable
   std::unique_lock l{kv_lock};
   ceph_assert(!kv_sync_started);
   kv_sync_started = true;
@@ -11661,15 +13064,28 @@ void BlueStore::_kv_sync_thread()
     if (kv_queue.empty() &&
 	((deferred_done_queue.empty() && deferred_stable_queue.empty()) ||
 	 !deferred_aggressive)) {
-      if (kv_stop)
+      // with the pipeline, the batch being committed may still turn
+      // deferred done into stable ones
+      if (kv_stop && !kv_commit_busy)
 	break;
       dout(20) << __func__ << " sleep" << dendl;
       kv_sync_in_progress = false;
       kv_cond.wait(l);
       dout(20) << __func__ << " wake" << dendl;
+    } else if (kv_commit_busy && !kv_stop &&
+	       kv_queue.size() <
+	       kv_sync_batch_avg * kv_sync_group_commit_ratio) {
+      // group commit: the previous batch is still being synced, give
+      // more txcs a chance to join this one instead of queueing up a
+      // tiny batch behind it.  we get woken up by new txcs (hence
+      // clearing kv_sync_in_progress) and by the commit stage going idle.
+      dout(20) << __func__ << " waiting for more than " << kv_queue.size()
+	       << " txcs to batch" << dendl;
+      kv_sync_in_progress = false;
+      kv_cond.wait(l);
     } else {
+      KVSyncBatch batch;
       deque<TransContext*> kv_submitting;
-      deque<DeferredBatch*> deferred_done, deferred_stable;
       uint64_t aios = 0, costs = 0;
 
       dout(20) << __func__ << " committing " << kv_queue.size()
@@ -11679,20 +13095,22 @@ void BlueStore::_kv_sync_thread()
 	       << dendl;
       kv_committing.swap(kv_queue);
       kv_submitting.swap(kv_queue_unsubmitted);
-      deferred_done.swap(deferred_done_queue);
-      deferred_stable.swap(deferred_stable_queue);
+      batch.deferred_done.swap(deferred_done_queue);
+      batch.deferred_stable.swap(deferred_stable_queue);
       aios = kv_ios;
       costs = kv_throttle_costs;
       kv_ios = 0;
       kv_throttle_costs = 0;
       l.unlock();
 
+      auto& deferred_done = batch.deferred_done;
+      auto& deferred_stable = batch.deferred_stable;
       dout(30) << __func__ << " committing " << kv_committing << dendl;
       dout(30) << __func__ << " submitting " << kv_submitting << dendl;
       dout(30) << __func__ << " deferred_done " << deferred_done << dendl;
       dout(30) << __func__ << " deferred_stable " << deferred_stable << dendl;
 
-      auto start = mono_clock::now();
+      batch.start = mono_clock::now();
 
       bool force_flush = false;
       // if bluefs is sharing the same device as data (only), then we
@@ -11727,33 +13145,33 @@ void BlueStore::_kv_sync_thread()
 			       deferred_done.end());
 	deferred_done.clear();
       }
-      auto after_flush = mono_clock::now();
+      batch.after_flush = mono_clock::now();
 
       // we will use one final transaction to force a sync
       KeyValueDB::Transaction synct = db->get_transaction();
+      batch.synct = synct;
 
       // increase {nid,blobid}_max?  note that this covers both the
       // case where we are approaching the max and the case we passed
       // it.  in either case, we increase the max in the earlier txn
       // we submit.
-      uint64_t new_nid_max = 0, new_blobid_max = 0;
       if (nid_last + cct->_conf->bluestore_nid_prealloc/2 > nid_max) {
 	KeyValueDB::Transaction t =
 	  kv_submitting.empty() ? synct : kv_submitting.front()->t;
-	new_nid_max = nid_last + cct->_conf->bluestore_nid_prealloc;
+	batch.new_nid_max = nid_last + cct->_conf->bluestore_nid_prealloc;
 	bufferlist bl;
-	encode(new_nid_max, bl);
+	encode(batch.new_nid_max, bl);
 	t->set(PREFIX_SUPER, "nid_max", bl);
-	dout(10) << __func__ << " new_nid_max " << new_nid_max << dendl;
+	dout(10) << __func__ << " new_nid_max " << batch.new_nid_max << dendl;
       }
       if (blobid_last + cct->_conf->bluestore_blobid_prealloc/2 > blobid_max) {
 	KeyValueDB::Transaction t =
 	  kv_submitting.empty() ? synct : kv_submitting.front()->t;
-	new_blobid_max = blobid_last + cct->_conf->bluestore_blobid_prealloc;
+	batch.new_blobid_max = blobid_last + cct->_conf->bluestore_blobid_prealloc;
 	bufferlist bl;
-	encode(new_blobid_max, bl);
+	encode(batch.new_blobid_max, bl);
 	t->set(PREFIX_SUPER, "blobid_max", bl);
-	dout(10) << __func__ << " new_blobid_max " << new_blobid_max << dendl;
+	dout(10) << __func__ << " new_blobid_max " << batch.new_blobid_max << dendl;
       }
 
       for (auto txc : kv_committing) {
@@ -11787,110 +13205,193 @@ void BlueStore::_kv_sync_thread()
 	  synct->rm_single_key(PREFIX_DEFERRED, key);
 	}
       }
+      batch.committing.swap(kv_committing);
+      log_latency("kv_apply",
+	l_bluestore_kv_apply_lat,
+	mono_clock::now() - batch.after_flush,
+	cct->_conf->bluestore_log_op_age);
+
+      if (kv_sync_pipeline) {
+	auto wait_start = mono_clock::now();
+	std::unique_lock m{kv_commit_lock};
+	// one batch syncing plus one ready to go is enough to keep the
+	// db busy; anything beyond that just makes the batches smaller.
+	while (!kv_commit_queue.empty()) {
+	  kv_commit_cond.wait(m);
+	}
+	kv_commit_queue.emplace_back(std::move(batch));
+	kv_commit_cond.notify_all();
+	{
+	  std::lock_guard ll{kv_lock};
+	  kv_commit_busy = true;
+	}
+	m.unlock();
+	log_latency("kv_pipeline_wait",
+	  l_bluestore_kv_pipeline_wait_lat,
+	  mono_clock::now() - wait_start,
+	  cct->_conf->bluestore_log_op_age);
+	l.lock();
+      } else {
+	_kv_sync_commit(batch);
+	l.lock();
+      }
+    }
+  }
+  dout(10) << __func__ << " finish" << dendl;
+  kv_sync_started = false;
+}
+
+/*
+ * Second half of a kv_sync cycle: make the batch durable, hand its txcs
+ * over to the finalizer, and mark the deferred ios it covered as stable.
+ * Called from kv_sync_thread, or from kv_commit_thread when the sync is
+ * pipelined.
+ */
+void BlueStore::_kv_sync_commit(KVSyncBatch& b)
+{
+  auto& kv_committing = b.committing;
+  auto& deferred_done = b.deferred_done;
+  auto& deferred_stable = b.deferred_stable;
 
 #if defined(WITH_LTTNG)
-      auto sync_start = mono_clock::now();
+  auto sync_start = mono_clock::now();
 #endif
-      // submit synct synchronously (block and wait for it to commit)
-      int r = cct->_conf->bluestore_debug_omit_kv_commit ? 0 : db->submit_transaction_sync(synct);
-      ceph_assert(r == 0);
+  auto commit_start = mono_clock::now();
+  // submit synct synchronously (block and wait for it to commit)
+  int r = cct->_conf->bluestore_debug_omit_kv_commit ? 0 : db->submit_transaction_sync(b.synct);
+  ceph_assert(r == 0);
 
 #ifdef WITH_BLKIN
-      for (auto txc : kv_committing) {
-        if (txc->trace) {
-          txc->trace.event("db sync submit");
-          txc->trace.keyval("kv_committing size", kv_committing.size());
-        }
-      }
+  for (auto txc : kv_committing) {
+    if (txc->trace) {
+      txc->trace.event("db sync submit");
+      txc->trace.keyval("kv_committing size", kv_committing.size());
+    }
+  }
 #endif
 
-      int committing_size = kv_committing.size();
-      int deferred_size = deferred_stable.size();
+  int committing_size = kv_committing.size();
+  int deferred_size = deferred_stable.size();
+  logger->inc(l_bluestore_kv_sync_batch, committing_size);
 
 #if defined(WITH_LTTNG)
-      double sync_latency = ceph::to_seconds<double>(mono_clock::now() - sync_start);
-      for (auto txc: kv_committing) {
-	if (txc->tracing) {
-	  tracepoint(
-	    bluestore,
-	    transaction_kv_sync_latency,
-	    txc->osr->get_sequencer_id(),
-	    txc->seq,
-	    kv_committing.size(),
-	    deferred_done.size(),
-	    deferred_stable.size(),
-	    sync_latency);
-	}
-      }
+  double sync_latency = ceph::to_seconds<double>(mono_clock::now() - sync_start);
+  for (auto txc: kv_committing) {
+    if (txc->tracing) {
+      tracepoint(
+	bluestore,
+	transaction_kv_sync_latency,
+	txc->osr->get_sequencer_id(),
+	txc->seq,
+	kv_committing.size(),
+	deferred_done.size(),
+	deferred_stable.size(),
+	sync_latency);
+    }
+  }
 #endif
 
-      {
-	std::unique_lock m{kv_finalize_lock};
-	if (kv_committing_to_finalize.empty()) {
-	  kv_committing_to_finalize.swap(kv_committing);
-	} else {
-	  kv_committing_to_finalize.insert(
-	      kv_committing_to_finalize.end(),
-	      kv_committing.begin(),
-	      kv_committing.end());
-	  kv_committing.clear();
-	}
-	if (deferred_stable_to_finalize.empty()) {
-	  deferred_stable_to_finalize.swap(deferred_stable);
-	} else {
-	  deferred_stable_to_finalize.insert(
-	      deferred_stable_to_finalize.end(),
-	      deferred_stable.begin(),
-	      deferred_stable.end());
-	  deferred_stable.clear();
-	}
-	if (!kv_finalize_in_progress) {
-	  kv_finalize_in_progress = true;
-	  kv_finalize_cond.notify_one();
-	}
-      }
+  {
+    std::unique_lock m{kv_finalize_lock};
+    if (kv_committing_to_finalize.empty()) {
+      kv_committing_to_finalize.swap(kv_committing);
+    } else {
+      kv_committing_to_finalize.insert(
+	  kv_committing_to_finalize.end(),
+	  kv_committing.begin(),
+	  kv_committing.end());
+      kv_committing.clear();
+    }
+    if (deferred_stable_to_finalize.empty()) {
+      deferred_stable_to_finalize.swap(deferred_stable);
+    } else {
+      deferred_stable_to_finalize.insert(
+	  deferred_stable_to_finalize.end(),
+	  deferred_stable.begin(),
+	  deferred_stable.end());
+      deferred_stable.clear();
+    }
+    if (!kv_finalize_in_progress) {
+      kv_finalize_in_progress = true;
+      kv_finalize_cond.notify_one();
+    }
+  }
 
-      if (new_nid_max) {
-	nid_max = new_nid_max;
-	dout(10) << __func__ << " nid_max now " << nid_max << dendl;
-      }
-      if (new_blobid_max) {
-	blobid_max = new_blobid_max;
-	dout(10) << __func__ << " blobid_max now " << blobid_max << dendl;
-      }
+  if (b.new_nid_max) {
+    nid_max = b.new_nid_max;
+    dout(10) << __func__ << " nid_max now " << nid_max << dendl;
+  }
+  if (b.new_blobid_max) {
+    blobid_max = b.new_blobid_max;
+    dout(10) << __func__ << " blobid_max now " << blobid_max << dendl;
+  }
+
+  {
+    auto finish = mono_clock::now();
+    ceph::timespan dur_flush = b.after_flush - b.start;
+    ceph::timespan dur_kv = finish - commit_start;
+    ceph::timespan dur = finish - b.start;
+    dout(20) << __func__ << " committed " << committing_size
+      << " cleaned " << deferred_size
+      << " in " << dur
+      << " (" << dur_flush << " flush + " << dur_kv << " kv commit)"
+      << dendl;
+    log_latency("kv_flush",
+      l_bluestore_kv_flush_lat,
+      dur_flush,
+      cct->_conf->bluestore_log_op_age);
+    log_latency("kv_commit",
+      l_bluestore_kv_commit_lat,
+      dur_kv,
+      cct->_conf->bluestore_log_op_age);
+    log_latency("kv_sync",
+      l_bluestore_kv_sync_lat,
+      dur,
+      cct->_conf->bluestore_log_op_age);
+  }
 
+  std::lock_guard l{kv_lock};
+  // previously deferred "done" are now "stable" by virtue of this
+  // commit cycle.
+  deferred_stable_queue.insert(deferred_stable_queue.end(),
+			       deferred_done.begin(), deferred_done.end());
+  kv_sync_batch_avg = kv_sync_batch_avg * 0.875 + committing_size * 0.125;
+}
+
+void BlueStore::_kv_commit_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock m{kv_commit_lock};
+  ceph_assert(!kv_commit_started);
+  kv_commit_started = true;
+  kv_commit_cond.notify_all();
+  while (true) {
+    if (kv_commit_queue.empty()) {
+      if (kv_commit_stop)
+	break;
       {
-	auto finish = mono_clock::now();
-	ceph::timespan dur_flush = after_flush - start;
-	ceph::timespan dur_kv = finish - after_flush;
-	ceph::timespan dur = finish - start;
-	dout(20) << __func__ << " committed " << committing_size
-	  << " cleaned " << deferred_size
-	  << " in " << dur
-	  << " (" << dur_flush << " flush + " << dur_kv << " kv commit)"
-	  << dendl;
-	log_latency("kv_flush",
-	  l_bluestore_kv_flush_lat,
-	  dur_flush,
-	  cct->_conf->bluestore_log_op_age);
-	log_latency("kv_commit",
-	  l_bluestore_kv_commit_lat,
-	  dur_kv,
-	  cct->_conf->bluestore_log_op_age);
-	log_latency("kv_sync",
-	  l_bluestore_kv_sync_lat,
-	  dur,
-	  cct->_conf->bluestore_log_op_age);
+	std::lock_guard l{kv_lock};
+	kv_commit_busy = false;
+	// whatever kv_sync_thread has been holding back can go now
+	if (!kv_sync_in_progress) {
+	  kv_sync_in_progress = true;
+	  kv_cond.notify_all();
+	}
       }
-
-      l.lock();
-      // previously deferred "done" are now "stable" by virtue of this
-      // commit cycle.
-      deferred_stable_queue.swap(deferred_done);
+      dout(20) << __func__ << " sleep" << dendl;
+      kv_commit_cond.wait(m);
+      dout(20) << __func__ << " wake" << dendl;
+    } else {
+      KVSyncBatch b = std::move(kv_commit_queue.front());
+      kv_commit_queue.pop_front();
+      kv_commit_cond.notify_all();
+      m.unlock();
+      _kv_sync_commit(b);
+      m.lock();
     }
   }
   dout(10) << __func__ << " finish" << dendl;
-  kv_sync_started = false;
+  kv_commit_started = false;
 }
 
 void BlueStore::_kv_finalize_thread()
@@ -11942,7 +13443,8 @@ void BlueStore::_kv_finalize_thread()
 
       if (!deferred_aggressive) {
 	if (deferred_queue_size >= deferred_batch_ops.load() ||
-	    throttle.should_submit_deferred()) {
+	    throttle.should_submit_deferred() ||
+	    _deferred_window_expired()) {
 	  deferred_try_submit();
 	}
       }
@@ -12006,10 +13508,33 @@ void BlueStore::_deferred_queue(TransContext *txc)
   }
 }
 
+bool BlueStore::_deferred_window_expired()
+{
+  double window = deferred_batch_window.load();
+  if (window <= 0) {
+    return false;
+  }
+  // only batches that can go out now count; one queued behind a running
+  // batch of its sequencer is looked at again once that has finished
+  auto expired = mono_clock::now() - make_timespan(window);
+  std::lock_guard l(deferred_lock);
+  for (auto& osr : deferred_queue) {
+    if (osr.deferred_pending && !osr.deferred_running &&
+	osr.deferred_pending->first_queued <= expired) {
+      return true;
+    }
+  }
+  return false;
+}
+
 void BlueStore::deferred_try_submit()
 {
   dout(20) << __func__ << " " << deferred_queue.size() << " osrs, "
 	   << deferred_queue_size << " txcs" << dendl;
+  if (deferred_elevator) {
+    _deferred_elevator_submit();
+    return;
+  }
   std::lock_guard l(deferred_lock);
   vector<OpSequencerRef> osrs;
   osrs.reserve(deferred_queue.size());
@@ -12090,6 +13615,107 @@ void BlueStore::_deferred_submit_unlock(OpSequencer *osr)
   bdev->aio_submit(&b->ioc);
 }
 
+/*
+ * Each sequencer's batch is already sorted by offset with overwrites
+ * resolved, but batches are submitted one after another in queue order.
+ * The elevator takes the pending batches of all idle sequencers at once
+ * and issues their ios as a single offset-ordered sweep, merging extents
+ * that happen to be adjacent on disk across sequencers.
+ */
+void BlueStore::_deferred_elevator_submit()
+{
+  auto g = new DeferredGroup(cct);
+  {
+    std::lock_guard l(deferred_lock);
+    for (auto& osr : deferred_queue) {
+      if (!osr.deferred_pending || osr.deferred_running) {
+	continue;
+      }
+      auto b = osr.deferred_pending;
+      deferred_queue_size -= b->seq_bytes.size();
+      ceph_assert(deferred_queue_size >= 0);
+      osr.deferred_running = b;
+      osr.deferred_pending = nullptr;
+      g->batches.push_back(b);
+    }
+    deferred_last_submitted = ceph_clock_now();
+  }
+  if (g->batches.empty()) {
+    delete g;
+    return;
+  }
+
+  // iomap offsets are unique within a batch; sort across batches and
+  // keep batch order for any (unexpected) overlap between them
+  std::vector<std::pair<uint64_t, DeferredBatch::deferred_io*>> ios;
+  uint64_t unsorted_seek = 0, last_end = 0;
+  for (auto b : g->batches) {
+    for (auto& txc : b->txcs) {
+      throttle.log_state_latency(txc, logger,
+				 l_bluestore_state_deferred_queued_lat);
+    }
+    for (auto& [offset, io] : b->iomap) {
+      if (!ios.empty()) {
+	unsorted_seek += offset > last_end ?
+	  offset - last_end : last_end - offset;
+      }
+      last_end = offset + io.bl.length();
+      ios.emplace_back(offset, &io);
+    }
+  }
+  std::stable_sort(ios.begin(), ios.end(),
+		   [](const auto& a, const auto& b) {
+		     return a.first < b.first;
+		   });
+
+  dout(10) << __func__ << " " << g->batches.size() << " batches, "
+	   << ios.size() << " extents" << dendl;
+  uint64_t start = 0, pos = 0, seek = 0, num_ios = 0;
+  bufferlist bl;
+  auto flush = [&]() {
+    if (!bl.length()) {
+      return;
+    }
+    dout(20) << __func__ << " write 0x" << std::hex
+	     << start << "~" << bl.length() << std::dec << dendl;
+    if (num_ios) {
+      seek += start > last_end ? start - last_end : last_end - start;
+    }
+    last_end = start + bl.length();
+    ++num_ios;
+    if (!g_conf()->bluestore_debug_omit_block_device_write) {
+      logger->inc(l_bluestore_deferred_write_ops);
+      logger->inc(l_bluestore_deferred_write_bytes, bl.length());
+      int r = bdev->aio_write(start, bl, &g->ioc, false);
+      ceph_assert(r == 0);
+    }
+    bl.clear();
+  };
+  for (auto& [offset, io] : ios) {
+    if (!bl.length() || offset != pos) {
+      flush();
+      start = offset;
+    }
+    pos = offset + io->bl.length();
+    bl.claim_append(io->bl);
+  }
+  flush();
+
+  logger->inc(l_bluestore_deferred_elevator_batches, g->batches.size());
+  logger->inc(l_bluestore_deferred_elevator_extents, ios.size());
+  logger->inc(l_bluestore_deferred_elevator_ios, num_ios);
+  logger->inc(l_bluestore_deferred_elevator_seek_bytes, seek);
+  logger->inc(l_bluestore_deferred_elevator_unsorted_seek_bytes,
+	      unsorted_seek);
+
+  if (g->ioc.has_pending_aios()) {
+    bdev->aio_submit(&g->ioc);
+  } else {
+    // nothing to write (or writes omitted for debugging)
+    g->aio_finish(this);
+  }
+}
+
 struct C_DeferredTrySubmit : public Context {
   BlueStore *store;
   C_DeferredTrySubmit(BlueStore *s) : store(s) {}
@@ -12422,6 +14048,8 @@ void BlueStore::_txc_add_transaction(TransContext *txc, Transaction *t)
           dout(10) << __func__ << " collection hint objects is a no-op, "
 		   << " pg_num " << pg_num << " num_objects " << num_objs
 		   << dendl;
+        } else if (type == Transaction::COLL_HINT_REMOVING) {
+	  _remove_collection_omap(txc, c);
         } else {
           // Ignore the hint
           dout(10) << __func__ << " unknown collection hint " << type << dendl;
@@ -12931,6 +14559,7 @@ void BlueStore::_do_write_small(
 		  bdev->aio_write(offset, t,
 				  &txc->ioc, wctx->buffered);
 		});
+	      txc->write_amp.data += bl.length();
 	    }
 	  }
 	  b->dirty_blob().calc_csum(b_off, bl);
@@ -13521,21 +15150,61 @@ int BlueStore::_do_alloc_write(
     }
   );
 
-  // compress (as needed) and calc needed space
-  uint64_t need = 0;
-  auto max_bsize = std::max(wctx->target_blob_size, min_alloc_size);
-  for (auto& wi : wctx->writes) {
-    if (c && wi.blob_length > min_alloc_size) {
-      auto start = mono_clock::now();
-
-      // compress
+  // compress (as needed); with compression workers the blobs of this
+  // write are compressed in parallel while we wait, so the transaction
+  // keeps its place in the sequencer.
+  std::shared_ptr<CompressBatch> batch;
+  std::vector<size_t> batch_pos(wctx->writes.size(), SIZE_MAX);
+  uint64_t skip = 0;
+  if (c) {
+    skip = cct->_conf.get_val<uint64_t>("bluestore_compression_adaptive_skip");
+    if (!skip) {
+      coll->compress_skip_left = 0;
+    }
+    std::vector<const bufferlist*> in;
+    for (size_t i = 0; i < wctx->writes.size(); ++i) {
+      auto& wi = wctx->writes[i];
+      if (wi.blob_length <= min_alloc_size) {
+	continue;
+      }
+      if (coll->compress_skip_left) {
+	--coll->compress_skip_left;
+	logger->inc(l_bluestore_compress_skipped_count);
+	continue;
+      }
       ceph_assert(wi.b_off == 0);
       ceph_assert(wi.blob_length == wi.bl.length());
+      batch_pos[i] = in.size();
+      in.push_back(&wi.bl);
+    }
+    if (!in.empty()) {
+      batch = std::make_shared<CompressBatch>(c, std::move(in));
+      size_t n = batch->in.size();
+      if (n > 1 && compress_workers.enabled()) {
+	compress_workers.queue_batch(batch, n - 1);
+      }
+      size_t ours = batch->run();
+      batch->wait();
+      if (ours < n) {
+	logger->inc(l_bluestore_compress_offloaded_count, n - ours);
+      }
+    }
+  }
+
+  // calc needed space
+  uint64_t need = 0;
+  auto max_bsize = std::max(wctx->target_blob_size, min_alloc_size);
+  for (size_t i = 0; i < wctx->writes.size(); ++i) {
+    auto& wi = wctx->writes[i];
+    if (batch_pos[i] != SIZE_MAX) {
+      auto& res = batch->results[batch_pos[i]];
 
       // FIXME: memory alignment here is bad
-      bufferlist t;
-      boost::optional<int32_t> compressor_message;
-      int r = c->compress(wi.bl, t, compressor_message);
+      bufferlist& t = res.out;
+      boost::optional<int32_t>& compressor_message = res.compressor_message;
+      int r = res.r;
+      coll->note_compress_ratio(
+	r == 0 ? (double)t.length() / wi.blob_length : 1.0, crr, skip);
       uint64_t want_len_raw = wi.blob_length * crr;
       uint64_t want_len = p2roundup(want_len_raw, min_alloc_size);
       bool rejected = false;
@@ -13598,7 +15267,7 @@ int BlueStore::_do_alloc_write(
       }
       log_latency("compress@_do_alloc_write",
 	l_bluestore_compress_lat,
-        mono_clock::now() - start,
+	res.lat,
 	cct->_conf->bluestore_log_op_age );
     } else {
       need += wi.blob_length;
@@ -13759,6 +15428,7 @@ int BlueStore::_do_alloc_write(
 	  [&](uint64_t offset, bufferlist& t) {
 	    bdev->aio_write(offset, t, &txc->ioc, false);
 	  });
+	txc->write_amp.data += l->length();
 	logger->inc(l_bluestore_write_new);
       }
     }
@@ -14162,6 +15832,7 @@ int BlueStore::_write(TransContext *txc,
     _assign_nid(txc, o);
     r = _do_write(txc, c, o, offset, length, bl, fadvise_flags);
     txc->write_onode(o);
+    txc->write_amp.client += length;
   }
   dout(10) << __func__ << " " << c->cid << " " << o->oid
 	   << " 0x" << std::hex << offset << "~" << length << std::dec
@@ -14294,7 +15965,8 @@ int BlueStore::_do_remove(
   set<SharedBlob*> maybe_unshared_blobs;
   bool is_gen = !o->oid.is_no_gen();
   _do_truncate(txc, c, o, 0, is_gen ? &maybe_unshared_blobs : nullptr);
-  if (o->onode.has_omap()) {
+  if (o->onode.has_omap() &&
+      !(o->onode.is_perpg_omap() && c->perpg_omap_removed)) {
     o->flush();
     _do_omap_clear(txc, o);
   }
@@ -14533,7 +16205,7 @@ int BlueStore::_omap_setkeys(TransContext *txc,
     if (o->oid.is_pgmeta()) {
       o->onode.set_omap_flags_pgmeta();
     } else {
-      o->onode.set_omap_flags();
+      o->onode.set_omap_flags(per_pg_omap);
     }
     txc->write_onode(o);
 
@@ -14560,6 +16232,7 @@ int BlueStore::_omap_setkeys(TransContext *txc,
     dout(20) << __func__ << "  " << pretty_binary_string(final_key)
 	     << " <- " << key << dendl;
     txc->t->set(prefix, final_key, value);
+    txc->write_amp.client += key.length() + value.length();
   }
   r = 0;
   dout(10) << __func__ << " " << c->cid << " " << o->oid << " = " << r << dendl;
@@ -14578,7 +16251,7 @@ int BlueStore::_omap_setheader(TransContext *txc,
     if (o->oid.is_pgmeta()) {
       o->onode.set_omap_flags_pgmeta();
     } else {
-      o->onode.set_omap_flags();
+      o->onode.set_omap_flags(per_pg_omap);
     }
     txc->write_onode(o);
 
@@ -14593,6 +16266,7 @@ int BlueStore::_omap_setheader(TransContext *txc,
   const string& prefix = o->get_omap_prefix();
   o->get_omap_header(&key);
   txc->t->set(prefix, key, bl);
+  txc->write_amp.client += bl.length();
   r = 0;
   dout(10) << __func__ << " " << c->cid << " " << o->oid << " = " << r << dendl;
   return r;
@@ -14734,13 +16408,16 @@ int BlueStore::_clone(TransContext *txc,
     if (newo->oid.is_pgmeta()) {
       newo->onode.set_omap_flags_pgmeta();
     } else {
-      newo->onode.set_omap_flags();
+      newo->onode.set_omap_flags(per_pg_omap);
     }
+    // the layouts of the two objects may differ
+    const string& old_prefix = oldo->get_omap_prefix();
+    size_t old_base_size = oldo->get_omap_key_base_size();
     const string& prefix = newo->get_omap_prefix();
-    KeyValueDB::Iterator it = db->get_iterator(prefix);
     string head, tail;
     oldo->get_omap_header(&head);
     oldo->get_omap_tail(&tail);
+    KeyValueDB::Iterator it = _get_omap_list_iterator(old_prefix, head, tail);
     it->lower_bound(head);
     while (it->valid()) {
       if (it->key() >= tail) {
@@ -14750,11 +16427,12 @@ int BlueStore::_clone(TransContext *txc,
 	dout(30) << __func__ << "  got header/data "
 		 << pretty_binary_string(it->key()) << dendl;
         string key;
-	newo->rewrite_omap_key(it->key(), &key);
+	newo->rewrite_omap_key(it->key(), old_base_size, &key);
 	txc->t->set(prefix, key, it->value());
       }
       it->next();
     }
+    _report_omap_tombstones(it);
     string new_tail;
     bufferlist new_tail_value;
     newo->get_omap_tail(&new_tail);
@@ -14854,6 +16532,7 @@ int BlueStore::_rename(TransContext *txc,
   int r;
   ghobject_t old_oid = oldo->oid;
   mempool::bluestore_cache_meta::string new_okey;
+  string omap_head, omap_tail;
 
   if (newo) {
     if (newo->exists) {
@@ -14880,6 +16559,15 @@ int BlueStore::_rename(TransContext *txc,
     }
   }
 
+  // per-pg omap keys carry the object hash, move them if it changes
+  if (oldo->onode.has_omap() && oldo->onode.is_perpg_omap() &&
+      old_oid.hobj.get_bitwise_key_u32() !=
+      new_oid.hobj.get_bitwise_key_u32()) {
+    oldo->flush();
+    oldo->get_omap_header(&omap_head);
+    oldo->get_omap_tail(&omap_tail);
+  }
+
   newo = oldo;
   txc->write_onode(newo);
 
@@ -14888,6 +16576,28 @@ int BlueStore::_rename(TransContext *txc,
   c->onode_map.rename(oldo, old_oid, new_oid, new_okey);
   r = 0;
 
+  if (!omap_head.empty()) {
+    dout(20) << __func__ << " moving omap data" << dendl;
+    const string& prefix = newo->get_omap_prefix();
+    size_t base_size = newo->get_omap_key_base_size();
+    KeyValueDB::Iterator it =
+      _get_omap_list_iterator(prefix, omap_head, omap_tail);
+    it->lower_bound(omap_head);
+    while (it->valid() && it->key() < omap_tail) {
+      string key;
+      newo->rewrite_omap_key(it->key(), base_size, &key);
+      txc->t->set(prefix, key, it->value());
+      txc->t->rmkey(prefix, it->key());
+      it->next();
+    }
+    _report_omap_tombstones(it);
+    txc->t->rmkey(prefix, omap_tail);
+    string new_tail;
+    bufferlist new_tail_value;
+    newo->get_omap_tail(&new_tail);
+    txc->t->set(prefix, new_tail, new_tail_value);
+  }
+
   // hold a ref to new Onode in old name position, to ensure we don't drop
   // it from the cache before this txc commits (or else someone may come along
   // and read newo's metadata via the old name).
@@ -15010,6 +16720,37 @@ void BlueStore::_do_remove_collection(TransContext *txc,
   c->reset();
 }
 
+/*
+ * The per-pg omap keys of a PG's objects start with the pool and the
+ * object's bitwise hash, so they form a single key range, which is removed
+ * here as a whole.  The objects removed from c afterwards don't need to
+ * remove their omap key ranges one by one.
+ */
+void BlueStore::_remove_collection_omap(TransContext *txc, CollectionRef& c)
+{
+  spg_t pgid;
+  if (!c || !c->cid.is_pg(&pgid)) {
+    return;
+  }
+  std::unique_lock l(c->lock);
+  uint32_t reverse_hash = hobject_t::_reverse_bits(pgid.ps());
+  uint64_t end_hash = reverse_hash + (1ull << (32 - c->cnode.bits));
+  string start, end;
+  _key_encode_u64(c->pool(), &start);
+  _key_encode_u32(reverse_hash, &start);
+  if (end_hash > 0xffffffffull) {
+    _key_encode_u64(c->pool() + 1, &end);
+  } else {
+    _key_encode_u64(c->pool(), &end);
+    _key_encode_u32(end_hash, &end);
+  }
+  dout(15) << __func__ << " " << c->cid << " bits " << c->cnode.bits
+	   << " " << pretty_binary_string(start)
+	   << " to " << pretty_binary_string(end) << dendl;
+  txc->t->rm_range_keys(PREFIX_PERPG_OMAP, start, end);
+  c->perpg_omap_removed = true;
+}
+
 int BlueStore::_split_collection(TransContext *txc,
 				CollectionRef& c,
 				CollectionRef& d,
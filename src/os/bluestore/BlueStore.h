@@ -42,6 +42,7 @@
 #include "common/bloom_filter.hpp"
 #include "common/Finisher.h"
 #include "common/ceph_mutex.h"
+#include "common/numa.h"
 #include "common/Throttle.h"
 #include "common/perf_counters.h"
 #include "common/PriorityCache.h"
@@ -75,6 +76,9 @@ enum {
   l_bluestore_kv_commit_lat,
   l_bluestore_kv_sync_lat,
   l_bluestore_kv_final_lat,
+  l_bluestore_kv_apply_lat,
+  l_bluestore_kv_pipeline_wait_lat,
+  l_bluestore_kv_sync_batch,
   l_bluestore_state_prepare_lat,
   l_bluestore_state_aio_wait_lat,
   l_bluestore_state_io_done_lat,
@@ -97,9 +101,16 @@ enum {
   l_bluestore_csum_lat,
   l_bluestore_compress_success_count,
   l_bluestore_compress_rejected_count,
+  l_bluestore_compress_skipped_count,
+  l_bluestore_compress_offloaded_count,
   l_bluestore_write_pad_bytes,
   l_bluestore_deferred_write_ops,
   l_bluestore_deferred_write_bytes,
+  l_bluestore_deferred_elevator_batches,
+  l_bluestore_deferred_elevator_extents,
+  l_bluestore_deferred_elevator_ios,
+  l_bluestore_deferred_elevator_seek_bytes,
+  l_bluestore_deferred_elevator_unsorted_seek_bytes,
   l_bluestore_write_penalty_read_ops,
   l_bluestore_allocated,
   l_bluestore_stored,
@@ -112,12 +123,27 @@ enum {
   l_bluestore_onode_misses,
   l_bluestore_onode_shard_hits,
   l_bluestore_onode_shard_misses,
+  l_bluestore_onode_compacted,
+  l_bluestore_onode_compacted_extents,
+  l_bluestore_onode_unpacked,
+  l_bluestore_onode_cold_loads,
+  l_bluestore_onode_prefetched,
+  l_bluestore_onode_prefetch_dropped,
+  l_bluestore_write_amp_client_bytes,
+  l_bluestore_write_amp_data_bytes,
+  l_bluestore_write_amp_deferred_bytes,
+  l_bluestore_write_amp_kv_bytes,
   l_bluestore_extents,
   l_bluestore_blobs,
   l_bluestore_buffers,
   l_bluestore_buffer_bytes,
   l_bluestore_buffer_hit_bytes,
   l_bluestore_buffer_miss_bytes,
+  l_bluestore_buffer_ghost_hits,
+  l_bluestore_buffer_arc_recent_hits,
+  l_bluestore_buffer_arc_frequent_hits,
+  l_bluestore_buffer_cold_read_bytes,
+  l_bluestore_numa_remote_accesses,
   l_bluestore_write_big,
   l_bluestore_write_big_bytes,
   l_bluestore_write_big_blobs,
@@ -140,6 +166,8 @@ enum {
   l_bluestore_omap_upper_bound_lat,
   l_bluestore_omap_lower_bound_lat,
   l_bluestore_omap_next_lat,
+  l_bluestore_omap_tombstones_skipped,
+  l_bluestore_omap_readahead,
   l_bluestore_clist_lat,
   l_bluestore_last
 };
@@ -275,6 +303,7 @@ public:
   struct BufferSpace {
     enum {
       BYPASS_CLEAN_CACHE = 0x1,  // bypass clean cache
+      NO_PROMOTE = 0x2,          // leave hit buffers where they are
     };
 
     typedef boost::intrusive::list<
@@ -370,11 +399,12 @@ public:
       cache->_trim();
     }
     void _finish_write(BufferCacheShard* cache, uint64_t seq);
-    void did_read(BufferCacheShard* cache, uint32_t offset, ceph::buffer::list& bl) {
+    void did_read(BufferCacheShard* cache, uint32_t offset, ceph::buffer::list& bl,
+		  int level = 1) {
       std::lock_guard l(cache->lock);
       Buffer *b = new Buffer(this, Buffer::STATE_CLEAN, 0, offset, bl);
       b->cache_private = _discard(cache, offset, bl.length());
-      _add_buffer(cache, b, 1, nullptr);
+      _add_buffer(cache, b, level, nullptr);
       cache->_trim();
     }
 
@@ -795,10 +825,12 @@ public:
       unsigned extents = 0;  ///< count extents in this shard
       bool loaded = false;   ///< true if shard is loaded
       bool dirty = false;    ///< true if shard is dirty and needs reencoding
+      ceph::buffer::list packed; ///< encoded shard, kept in compact mode
     };
     mempool::bluestore_cache_meta::vector<Shard> shards;    ///< shards
 
     ceph::buffer::list inline_bl;    ///< cached encoded map, if unsharded; empty=>dirty
+    bool inline_loaded = true;       ///< inline_bl is decoded into extent_map
 
     uint32_t needs_reshard_begin = 0;
     uint32_t needs_reshard_end = 0;
@@ -834,6 +866,7 @@ public:
       extent_map.clear_and_dispose(DeleteDisposer());
       shards.clear();
       inline_bl.clear();
+      inline_loaded = true;
       clear_needs_reshard();
     }
 
@@ -909,6 +942,11 @@ public:
     /// ensure a range of the map is marked dirty
     void dirty_range(uint32_t offset, uint32_t length);
 
+    /// drop decoded extents of clean shards (or the clean inline map) for
+    /// which we still have the encoded form; they are decoded again on
+    /// the next fault_range().  returns the number of extents dropped.
+    unsigned compact();
+
     /// for seek_lextent test
     extent_map_t::iterator find(uint64_t offset);
 
@@ -1074,6 +1112,8 @@ public:
                               /// of it at the moment though)
     bool pinned;              ///< Onode is pinned
                               /// (or should be pinned when cached)
+    bool cold;                ///< only used by no-cache readers so far,
+                              /// kept at the cold end of the cache
     ExtentMap extent_map;
 
     // track txc's that have not been committed to kv store (and whose
@@ -1093,6 +1133,7 @@ public:
 	exists(false),
         cached(false),
         pinned(false),
+        cold(false),
 	extent_map(this) {
     }
     Onode(Collection* c, const ghobject_t& o,
@@ -1104,6 +1145,7 @@ public:
       exists(false),
       cached(false),
       pinned(false),
+      cold(false),
       extent_map(this) {
     }
     Onode(Collection* c, const ghobject_t& o,
@@ -1115,6 +1157,7 @@ public:
       exists(false),
       cached(false),
       pinned(false),
+      cold(false),
       extent_map(this) {
     }
 
@@ -1142,9 +1185,14 @@ public:
     }
 
     const std::string& get_omap_prefix();
+    /// pool/pg and nid part that every omap key of this object starts with
+    void get_omap_key_base(std::string *out);
+    size_t get_omap_key_base_size() const;
     void get_omap_header(std::string *out);
     void get_omap_key(const std::string& key, std::string *out);
-    void rewrite_omap_key(const std::string& old, std::string *out);
+    /// rebase a key whose base is old_base_size bytes long onto this object
+    void rewrite_omap_key(const std::string& old, size_t old_base_size,
+			  std::string *out);
     void get_omap_tail(std::string *out);
     void decode_omap_key(const std::string& key, std::string *user_key);
 
@@ -1172,9 +1220,28 @@ public:
     std::atomic<uint64_t> max = {0};
     std::atomic<uint64_t> num = {0};
 
+    /// numa node of the OSD shard serving our collections, -1 if unbound
+    std::atomic<int> numa_node = {-1};
+    std::atomic<uint64_t> numa_hits = {0};   ///< onodes or bytes, when bound
+    std::atomic<uint64_t> numa_misses = {0};
+    std::atomic<uint64_t> numa_remote = {0}; ///< accesses from other nodes
+
     CacheShard(CephContext* cct) : cct(cct), logger(nullptr) {}
     virtual ~CacheShard() {}
 
+    void note_access(uint64_t hits, uint64_t misses) {
+      int node = numa_node;
+      if (node < 0) {
+        return;
+      }
+      numa_hits += hits;
+      numa_misses += misses;
+      if (get_current_numa_node() != node) {
+        ++numa_remote;
+        logger->inc(l_bluestore_numa_remote_accesses);
+      }
+    }
+
     void set_max(uint64_t max_) {
       max = max_;
     }
@@ -1233,12 +1300,7 @@ public:
       }
     }
 
-    void unpin(Onode* o, std::function<bool()> validator) {
-      std::lock_guard l(lock);
-      if (validator()) {
-        _unpin(o);
-      }
-    }
+    void unpin(Onode* o, std::function<bool()> validator);
 
     virtual void move_pinned(OnodeCacheShard *to, Onode *o) = 0;
     virtual void add_stats(uint64_t *onodes, uint64_t *pinned_onodes) = 0;
@@ -1310,7 +1372,9 @@ public:
     }
 
     OnodeRef add(const ghobject_t& oid, OnodeRef& o);
-    OnodeRef lookup(const ghobject_t& o);
+    OnodeRef lookup(const ghobject_t& o, bool cold = false);
+    /// like lookup(), but neither counts nor touches anything
+    bool has(const ghobject_t& oid);
     void rename(OnodeRef& o, const ghobject_t& old_oid,
 		const ghobject_t& new_oid,
 		const mempool::bluestore_cache_meta::string& new_okey);
@@ -1347,10 +1411,25 @@ public:
     pool_opts_t pool_opts;
     ContextQueue *commit_queue;
 
+    // recent compression ratio of the blobs written here and how many
+    // blobs to leave uncompressed because of it; see _do_alloc_write.
+    // protected by lock.
+    double compress_ratio_avg = 0;
+    uint64_t compress_skip_left = 0;
+
+    /// per-pg omap of the whole PG has been removed ahead of its objects
+    /// (COLL_HINT_REMOVING); protected by lock
+    bool perpg_omap_removed = false;
+
+    void note_compress_ratio(double ratio, double required, uint64_t skip);
+
     OnodeCacheShard* get_onode_cache() const {
       return onode_map.cache;
     }
-    OnodeRef get_onode(const ghobject_t& oid, bool create, bool is_createop=false);
+    OnodeRef get_onode(const ghobject_t& oid, bool create, bool is_createop=false,
+                       bool cold=false);
+    /// load the onodes of oids that are not cached yet, in key order
+    size_t prefetch_onodes(const std::vector<ghobject_t>& oids);
 
     // the terminology is confusing here, sorry!
     //
@@ -1403,11 +1482,18 @@ public:
     OnodeRef o;
     KeyValueDB::Iterator it;
     std::string head, tail;
+    KeyValueDB::IteratorOpts opts = 0;
+    uint64_t readahead_threshold = 0;   ///< 0 = never switch to readahead
+    uint64_t sequential = 0;            ///< next() calls since last seek
+    uint64_t tombstones = 0;            ///< skipped by retired iterators
 
     std::string _stringify() const;
+    KeyValueDB::Iterator _get_iterator(KeyValueDB::IteratorOpts opts);
+    void _start_readahead();
 
   public:
-    OmapIteratorImpl(CollectionRef c, OnodeRef o, KeyValueDB::Iterator it);
+    OmapIteratorImpl(CollectionRef c, OnodeRef o);
+    ~OmapIteratorImpl() override;
     int seek_to_first() override;
     int upper_bound(const std::string &after) override;
     int lower_bound(const std::string &to) override;
@@ -1514,6 +1600,23 @@ public:
     }
   };
 
+  /// bytes written on behalf of transactions, by where they went
+  struct write_amp_t {
+    uint64_t client = 0;    ///< object data and omap the client wrote
+    uint64_t data = 0;      ///< written to the device directly
+    uint64_t deferred = 0;  ///< written to the device after the kv commit
+    uint64_t kv = 0;        ///< logged by the kv store (deferred data too)
+
+    write_amp_t& operator+=(const write_amp_t& o) {
+      client += o.client;
+      data += o.data;
+      deferred += o.deferred;
+      kv += o.kv;
+      return *this;
+    }
+    void dump(ceph::Formatter *f) const;
+  };
+
   struct TransContext final : public AioContext {
     MEMPOOL_CLASS_HELPERS();
 
@@ -1611,6 +1714,7 @@ public:
     interval_set<uint64_t> allocated, released;
     volatile_statfs statfs_delta;	   ///< overall store statistics delta
     uint64_t osd_pool_id = META_POOL_ID;    ///< osd pool id we're operating on
+    write_amp_t write_amp;
 
     IOContext ioc;
     bool had_ios = false;  ///< true if we submitted IOs before our kv txn
@@ -1827,6 +1931,8 @@ public:
     IOContext ioc;                   ///< our aios
     /// bytes of pending io for each deferred seq (may be 0)
     std::map<uint64_t,int> seq_bytes;
+    /// when the first txc was queued, for bluestore_deferred_batch_window
+    mono_clock::time_point first_queued = mono_clock::now();
 
     void _discard(CephContext *cct, uint64_t offset, uint64_t length);
     void _audit(CephContext *cct);
@@ -1844,6 +1950,23 @@ public:
     }
   };
 
+  /// deferred batches of several OpSequencers submitted as one sorted set
+  /// of ios, see _deferred_elevator_submit()
+  struct DeferredGroup final : public AioContext {
+    std::vector<DeferredBatch*> batches;
+    IOContext ioc;
+
+    explicit DeferredGroup(CephContext *cct)
+      : ioc(cct, this) {}
+
+    void aio_finish(BlueStore *store) override {
+      for (auto b : batches) {
+	store->_deferred_aio_finish(b->osr);
+      }
+      delete this;
+    }
+  };
+
   class OpSequencer : public RefCountedObject {
   public:
     ceph::mutex qlock = ceph::make_mutex("BlueStore::OpSequencer::qlock");
@@ -1986,6 +2109,14 @@ public:
       return NULL;
     }
   };
+  struct KVCommitThread : public Thread {
+    BlueStore *store;
+    explicit KVCommitThread(BlueStore *s) : store(s) {}
+    void *entry() override {
+      store->_kv_commit_thread();
+      return NULL;
+    }
+  };
   struct KVFinalizeThread : public Thread {
     BlueStore *store;
     explicit KVFinalizeThread(BlueStore *s) : store(s) {}
@@ -2099,8 +2230,33 @@ private:
   std::deque<TransContext*> kv_queue_unsubmitted; ///< ready, need submit by kv thread
   std::deque<TransContext*> kv_committing;        ///< currently syncing
   std::deque<DeferredBatch*> deferred_done_queue;   ///< deferred ios done
+  std::deque<DeferredBatch*> deferred_stable_queue; ///< deferred ios done + stable
   bool kv_sync_in_progress = false;
 
+  /// a batch prepared by kv_sync_thread which has yet to be synced to the db
+  struct KVSyncBatch {
+    std::deque<TransContext*> committing;
+    std::deque<DeferredBatch*> deferred_done;   ///< stable once synced
+    std::deque<DeferredBatch*> deferred_stable; ///< keys removed by synct
+    KeyValueDB::Transaction synct;
+    uint64_t new_nid_max = 0, new_blobid_max = 0;
+    ceph::mono_clock::time_point start, after_flush;
+  };
+
+  // with bluestore_kv_sync_pipeline, kv_sync_thread only prepares the
+  // batches and kv_commit_thread syncs them, so the next batch is built
+  // while the current one is being committed.
+  bool kv_sync_pipeline = false;
+  double kv_sync_group_commit_ratio = 0;
+  double kv_sync_batch_avg = 1;  ///< decaying average of txcs per batch
+  KVCommitThread kv_commit_thread;
+  ceph::mutex kv_commit_lock = ceph::make_mutex("BlueStore::kv_commit_lock");
+  ceph::condition_variable kv_commit_cond;
+  std::deque<KVSyncBatch> kv_commit_queue;  ///< prepared, waiting for sync
+  bool kv_commit_busy = false;  ///< protected by kv_lock
+  bool kv_commit_started = false;
+  bool kv_commit_stop = false;
+
   KVFinalizeThread kv_finalize_thread;
   ceph::mutex kv_finalize_lock = ceph::make_mutex("BlueStore::kv_finalize_lock");
   ceph::condition_variable kv_finalize_cond;
@@ -2131,6 +2287,7 @@ private:
 		"not enough bits for min_alloc_size");
 
   bool per_pool_omap = false;
+  bool per_pg_omap = false;  ///< new omap objects use the per-pg layout
 
   ///< maximum allocation unit (power of 2)
   std::atomic<uint64_t> max_alloc_size = {0};
@@ -2138,6 +2295,12 @@ private:
   ///< number threshold for forced deferred writes
   std::atomic<int> deferred_batch_ops = {0};
 
+  ///< sort and merge deferred ios of all sequencers before submitting
+  std::atomic<bool> deferred_elevator = {false};
+
+  ///< max time deferred writes wait for a batch to fill up (0 for no limit)
+  std::atomic<double> deferred_batch_window = {0};
+
   ///< size threshold for forced deferred writes
   std::atomic<uint64_t> prefer_deferred_size = {0};
 
@@ -2161,6 +2324,8 @@ private:
   double cache_kv_ratio = 0;     ///< cache ratio dedicated to kv (e.g., rocksdb)
   double cache_data_ratio = 0;   ///< cache ratio dedicated to object data
   bool cache_autotune = false;   ///< cache autotune setting
+  bool onode_compact = false;    ///< keep extent maps of idle onodes encoded
+  bool cache_cold_reads = false; ///< cache no-cache reads at the cold end
   double cache_autotune_interval = 0; ///< time to wait between cache rebalancing
   uint64_t osd_memory_target = 0;   ///< OSD memory target when autotuning cache
   uint64_t osd_memory_base = 0;     ///< OSD base memory when autotuning cache
@@ -2178,6 +2343,14 @@ private:
 
   bool per_pool_stat_collection = true;
 
+  ceph::mutex write_amp_lock = ceph::make_mutex("BlueStore::write_amp_lock");
+  std::map<uint64_t, write_amp_t> pool_write_amp; ///< protected by write_amp_lock
+  /// what bluefs had written when pool_write_amp was last reset
+  uint64_t write_amp_bluefs_base[3] = {0, 0, 0};
+
+  class SocketHook;
+  SocketHook *asok_hook = nullptr;
+
   struct MempoolThread : public Thread {
   public:
     BlueStore *store;
@@ -2321,6 +2494,63 @@ private:
     void _resize_shards(bool interval_stats);
   } mempool_thread;
 
+  /// loads onodes that listing callers are about to visit
+  struct OnodePrefetchThread : public Thread {
+    static constexpr size_t BATCH = 64;
+
+    BlueStore *store;
+    ceph::condition_variable cond;
+    ceph::mutex lock = ceph::make_mutex("BlueStore::OnodePrefetchThread::lock");
+    bool stop = false;
+    std::deque<std::pair<CollectionRef, ghobject_t>> queue;
+
+    explicit OnodePrefetchThread(BlueStore *s) : store(s) {}
+    void *entry() override;
+    void init() {
+      stop = false;
+      create("bstore_prefetch");
+    }
+    void shutdown() {
+      lock.lock();
+      stop = true;
+      cond.notify_all();
+      lock.unlock();
+      join();
+    }
+    /// returns how many of ls did not fit into a queue of max entries
+    size_t queue_objects(CollectionRef c, const std::vector<ghobject_t>& ls,
+			 size_t max);
+  } onode_prefetch_thread;
+
+  struct CompressBatch;
+
+  /// compresses the blobs of a single write in parallel, see _do_alloc_write
+  struct CompressWorkers {
+    struct Worker : public Thread {
+      CompressWorkers *workers;
+      explicit Worker(CompressWorkers *w) : workers(w) {}
+      void *entry() override {
+	workers->run();
+	return nullptr;
+      }
+    };
+
+    ceph::condition_variable cond;
+    ceph::mutex lock = ceph::make_mutex("BlueStore::CompressWorkers::lock");
+    bool stop = false;
+    std::deque<std::shared_ptr<CompressBatch>> queue;
+    std::vector<std::unique_ptr<Worker>> threads;
+
+    void init(unsigned n);
+    void shutdown();
+    bool enabled() const {
+      return !threads.empty();
+    }
+    /// let up to n workers help with batch
+    void queue_batch(std::shared_ptr<CompressBatch> batch, size_t n);
+    void run();
+  } compress_workers;
+
 #ifdef WITH_BLKIN
   ZTracer::Endpoint trace_endpoint {"0.0.0.0", 0, "BlueStore"};
 #endif
@@ -2437,6 +2667,7 @@ private:
 			    std::list<Context*> *on_commits,
 			    TrackedOpRef osd_op=TrackedOpRef());
   void _txc_update_store_statfs(TransContext *txc);
+  void _txc_account_write_amp(TransContext *txc);
   void _txc_add_transaction(TransContext *txc, Transaction *t);
   void _txc_calc_cost(TransContext *txc);
   void _txc_write_nodes(TransContext *txc, KeyValueDB::Transaction t);
@@ -2463,6 +2694,8 @@ private:
   void _kv_start();
   void _kv_stop();
   void _kv_sync_thread();
+  void _kv_sync_commit(KVSyncBatch& b);
+  void _kv_commit_thread();
   void _kv_finalize_thread();
 
   bluestore_deferred_op_t *_get_deferred_op(TransContext *txc);
@@ -2471,6 +2704,8 @@ public:
   void deferred_try_submit();
 private:
   void _deferred_submit_unlock(OpSequencer *osr);
+  void _deferred_elevator_submit();
+  bool _deferred_window_expired();
   void _deferred_aio_finish(OpSequencer *osr);
   int _deferred_replay();
 
@@ -2481,6 +2716,52 @@ public:
   using  per_pool_statfs =
     mempool::bluestore_fsck::map<uint64_t, store_statfs_t>;
 
+  /// fixed-size bitset whose bits may be tested and set concurrently
+  class atomic_bitset {
+    std::unique_ptr<std::atomic<uint64_t>[]> words;
+    size_t bits;
+  public:
+    explicit atomic_bitset(size_t n)
+      : words(new std::atomic<uint64_t>[(n + 63) / 64]), bits(n) {
+      for (size_t i = 0; i < (n + 63) / 64; ++i) {
+        words[i].store(0, std::memory_order_relaxed);
+      }
+    }
+    size_t size() const {
+      return bits;
+    }
+    size_t num_words() const {
+      return (bits + 63) / 64;
+    }
+    uint64_t word(size_t i) const {
+      return words[i].load(std::memory_order_relaxed);
+    }
+    bool test(size_t pos) const {
+      return words[pos / 64].load(std::memory_order_relaxed) &
+        (1ull << (pos % 64));
+    }
+    void set(size_t pos) {
+      words[pos / 64].fetch_or(1ull << (pos % 64), std::memory_order_relaxed);
+    }
+    /// set a bit, returning whether it was set already
+    bool test_and_set(size_t pos) {
+      uint64_t mask = 1ull << (pos % 64);
+      return words[pos / 64].fetch_or(mask, std::memory_order_relaxed) & mask;
+    }
+  };
+
+  struct fsck_progress_t {
+    uint64_t objects = 0;      ///< onodes checked so far
+    uint64_t bytes_read = 0;   ///< object data read by deep fsck
+    size_t ranges_done = 0;    ///< keyspace ranges completed (parallel only)
+    size_t ranges_total = 0;
+    double elapsed = 0;        ///< seconds spent walking objects
+  };
+  /// called (from the fsck thread) about once a second while walking objects
+  void set_fsck_progress_cb(std::function<void(const fsck_progress_t&)> cb) {
+    fsck_progress_cb = std::move(cb);
+  }
+
   enum FSCKDepth {
     FSCK_REGULAR,
     FSCK_DEEP,
@@ -2491,12 +2772,15 @@ public:
   };
 
 private:
+  std::function<void(const fsck_progress_t&)> fsck_progress_cb;
+
+  template <typename Bitset>
   int _fsck_check_extents(
     const coll_t& cid,
     const ghobject_t& oid,
     const PExtentVector& extents,
     bool compressed,
-    mempool_dynamic_bitset &used_blocks,
+    Bitset &used_blocks,
     uint64_t granularity,
     BlueStoreRepairer* repairer,
     store_statfs_t& expected_statfs,
@@ -2628,6 +2912,7 @@ public:
   }
 
   void set_cache_shards(unsigned num) override;
+  void set_cache_numa_nodes(const std::vector<int>& op_shard_nodes) override;
   void dump_cache_stats(ceph::Formatter *f) override {
     int onode_count = 0, buffers_bytes = 0;
     for (auto i: onode_cache_shards) {
@@ -2638,7 +2923,9 @@ public:
     }
     f->dump_int("bluestore_onode", onode_count);
     f->dump_int("bluestore_buffers", buffers_bytes);
+    _dump_cache_numa_stats(f);
   }
+  void _dump_cache_numa_stats(ceph::Formatter *f);
   void dump_cache_stats(std::ostream& ss) override {
     int onode_count = 0, buffers_bytes = 0;
     for (auto i: onode_cache_shards) {
@@ -2664,6 +2951,9 @@ public:
   }
 
   void get_db_statistics(ceph::Formatter *f) override;
+  /// device bytes written per pool and op class, see write_amp_t
+  void dump_write_amp(ceph::Formatter *f);
+  void reset_write_amp();
   void generate_db_histogram(ceph::Formatter *f) override;
   void _shutdown_cache();
   int flush_cache(std::ostream *os = NULL) override;
@@ -2780,6 +3070,7 @@ private:
     std::vector<ceph::buffer::list>& compressed_blob_bls,
     blobs2read_t& blobs2read,
     bool buffered,
+    bool cold,
     bool* csum_error,
     ceph::buffer::list& bl);
 
@@ -2848,6 +3139,9 @@ public:
                              std::vector<ghobject_t> *ls,
                              ghobject_t *next) override;
 
+  void prefetch_objects(CollectionHandle &c,
+			const std::vector<ghobject_t>& ls) override;
+
   int omap_get(
     CollectionHandle &c,     ///< [in] Collection containing oid
     const ghobject_t &oid,   ///< [in] Object containing omap
@@ -2865,6 +3159,12 @@ public:
     ceph::buffer::list *header,          ///< [out] omap header
     std::map<std::string, ceph::buffer::list> *out /// < [out] Key to value map
   );
+  /// iterator over [head, tail) of a single object's omap, for full scans
+  KeyValueDB::Iterator _get_omap_list_iterator(
+    const std::string& prefix,
+    const std::string& head,
+    const std::string& tail);
+  void _report_omap_tombstones(KeyValueDB::Iterator& it);
 
 
   /// Get omap header
@@ -3327,6 +3627,7 @@ private:
   int _remove_collection(TransContext *txc, const coll_t &cid,
                          CollectionRef *c);
   void _do_remove_collection(TransContext *txc, CollectionRef *c);
+  void _remove_collection_omap(TransContext *txc, CollectionRef& c);
   int _split_collection(TransContext *txc,
 			CollectionRef& c,
 			CollectionRef& d,
@@ -3385,6 +3686,12 @@ public:
     per_pool_statfs& expected_pool_statfs;
     BlueStoreRepairer* repairer;
 
+    /// replaces used_blocks when several threads check objects
+    atomic_bitset* atomic_used_blocks = nullptr;
+    /// shared progress counters for parallel fsck
+    std::atomic<uint64_t>* progress_objects = nullptr;
+    std::atomic<uint64_t>* progress_bytes = nullptr;
+
     FSCK_ObjectCtx(int64_t& e,
                    int64_t& w,
                    uint64_t& _num_objects,
@@ -3432,6 +3739,19 @@ private:
     OnodeRef& o,
     const BlueStore::FSCK_ObjectCtx& ctx);
 
+  typedef std::function<bool(int64_t, CollectionRef, const ghobject_t&,
+			     const std::string&,
+			     const ceph::buffer::list&)> fsck_queue_fn_t;
+  size_t _fsck_check_objects_range(FSCKDepth depth,
+    FSCK_ObjectCtx& ctx,
+    const std::string& from,
+    const std::string& to,
+    uint64_t_btree_t& used_nids,
+    fsck_queue_fn_t queue,
+    const std::function<void()>& progress);
+  void _fsck_check_objects_parallel(FSCKDepth depth,
+    FSCK_ObjectCtx& ctx,
+    size_t thread_count);
   void _fsck_check_objects(FSCKDepth depth,
     FSCK_ObjectCtx& ctx);
 };
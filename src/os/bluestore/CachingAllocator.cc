@@ -0,0 +1,398 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "CachingAllocator.h"
+
+#include <limits>
+
+#include "common/admin_socket.h"
+#include "common/config_proxy.h"
+#include "common/debug.h"
+
+#define dout_context cct
+#define dout_subsys ceph_subsys_bluestore
+#undef  dout_prefix
+#define dout_prefix *_dout << "CachingAllocator(" << get_name() << ") "
+
+using ceph::bufferlist;
+using ceph::Formatter;
+
+class CachingAllocator::SocketHook : public AdminSocketHook {
+  CachingAllocator* alloc;
+  std::string command;
+public:
+  explicit SocketHook(CachingAllocator* alloc)
+    : alloc(alloc),
+      command("bluestore allocator cache stats " + alloc->get_name())
+  {
+    AdminSocket* admin_socket = g_ceph_context->get_admin_socket();
+    if (admin_socket) {
+      int r = admin_socket->register_command(
+	command.c_str(),
+	this,
+	"dump allocator cache hit rate and cached (stranded) space");
+      if (r != 0)
+	alloc = nullptr; //some collision, disable
+    }
+  }
+  ~SocketHook()
+  {
+    AdminSocket* admin_socket = g_ceph_context->get_admin_socket();
+    if (admin_socket && alloc) {
+      admin_socket->unregister_commands(this);
+    }
+  }
+
+  int call(std::string_view cmd,
+	   const cmdmap_t& cmdmap,
+	   Formatter *f,
+	   std::ostream& ss,
+	   bufferlist& out) override {
+    if (cmd != command) {
+      ss << "Invalid command" << std::endl;
+      return -ENOSYS;
+    }
+    f->open_object_section("allocator_cache");
+    alloc->dump_stats(f);
+    f->close_section();
+    return 0;
+  }
+};
+
+CachingAllocator::CachingAllocator(CephContext* cct,
+				   Allocator* _backend,
+				   int64_t _block_size,
+				   size_t num_shards,
+				   size_t _slots_per_shard,
+				   uint64_t _refill_size,
+				   uint64_t _max_request,
+				   const std::string& name)
+  : Allocator(name),
+    cct(cct),
+    backend(_backend),
+    block_size(_block_size),
+    block_shift(ctz(uint64_t(_block_size))),
+    slots_per_shard(std::max<size_t>(_slots_per_shard, 1)),
+    refill_size(std::min<uint64_t>(p2roundup(_refill_size, block_size),
+			 ((1ull << LENGTH_BITS) - 1) << block_shift)),
+    max_request(std::min<uint64_t>(p2roundup(_max_request, block_size), refill_size)),
+    max_slot_length(((1ull << LENGTH_BITS) - 1) << block_shift),
+    shards(std::max<size_t>(num_shards, 1))
+{
+  ceph_assert(backend);
+  ceph_assert(isp2(block_size));
+  for (auto& s : shards) {
+    s.slots.reset(new std::atomic<uint64_t>[slots_per_shard]);
+    for (size_t i = 0; i < slots_per_shard; ++i) {
+      s.slots[i] = 0;
+    }
+  }
+  asok_hook = new SocketHook(this);
+  ldout(cct, 1) << __func__ << " shards " << shards.size()
+		<< " slots " << slots_per_shard
+		<< std::hex << " refill 0x" << refill_size
+		<< " max_request 0x" << max_request << std::dec
+		<< dendl;
+}
+
+CachingAllocator::~CachingAllocator()
+{
+  delete asok_hook;
+}
+
+CachingAllocator::shard_t& CachingAllocator::_get_shard()
+{
+  static std::atomic<unsigned> next_thread_id = {0};
+  static thread_local unsigned thread_id = next_thread_id++;
+  return shards[thread_id % shards.size()];
+}
+
+void CachingAllocator::_append(uint64_t offset, uint64_t length,
+			       uint64_t max_alloc_size,
+			       PExtentVector* extents)
+{
+  if (!extents->empty()) {
+    auto& last = extents->back();
+    if (last.end() == offset && last.length < max_alloc_size) {
+      auto l = std::min(length, max_alloc_size - last.length);
+      last.length += l;
+      offset += l;
+      length -= l;
+    }
+  }
+  while (length > 0) {
+    auto l = std::min(length, max_alloc_size);
+    extents->emplace_back(offset, l);
+    offset += l;
+    length -= l;
+  }
+}
+
+bool CachingAllocator::_put(shard_t& s, uint64_t offset, uint64_t length)
+{
+  if (length == 0 || length > max_slot_length) {
+    return false;
+  }
+  uint64_t v = _encode(offset, length);
+  for (size_t i = 0; i < slots_per_shard; ++i) {
+    uint64_t expected = 0;
+    if (s.slots[i].load(std::memory_order_relaxed) == 0 &&
+	s.slots[i].compare_exchange_strong(expected, v,
+					   std::memory_order_release,
+					   std::memory_order_relaxed)) {
+      s.cached += length;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t CachingAllocator::_take(shard_t& s, uint64_t want,
+				 uint64_t max_alloc_size,
+				 interval_set<uint64_t>* spill,
+				 PExtentVector* extents)
+{
+  uint64_t got = 0;
+  for (size_t i = 0; i < slots_per_shard && got < want; ++i) {
+    if (s.slots[i].load(std::memory_order_relaxed) == 0) {
+      continue;
+    }
+    uint64_t v = s.slots[i].exchange(0, std::memory_order_acquire);
+    if (v == 0) {
+      continue;
+    }
+    uint64_t offset, length;
+    _decode(v, &offset, &length);
+    s.cached -= length;
+    auto l = std::min(length, want - got);
+    _append(offset, l, max_alloc_size, extents);
+    got += l;
+    if (l < length && !_put(s, offset + l, length - l)) {
+      spill->insert(offset + l, length - l);
+    }
+  }
+  return got;
+}
+
+void CachingAllocator::_evict(shard_t& s, bool all, interval_set<uint64_t>* out)
+{
+  size_t n = all ? slots_per_shard : (slots_per_shard + 1) / 2;
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t v = s.slots[i].exchange(0, std::memory_order_acquire);
+    if (v == 0) {
+      continue;
+    }
+    uint64_t offset, length;
+    _decode(v, &offset, &length);
+    s.cached -= length;
+    out->insert(offset, length);
+  }
+}
+
+int64_t CachingAllocator::allocate(
+  uint64_t want,
+  uint64_t unit,
+  uint64_t max_alloc_size,
+  int64_t  hint,
+  PExtentVector* extents)
+{
+  auto& s = _get_shard();
+  if (!_is_cacheable(want, unit)) {
+    ++s.bypassed;
+    return backend->allocate(want, unit, max_alloc_size, hint, extents);
+  }
+  if (max_alloc_size == 0) {
+    max_alloc_size = want;
+  }
+  if (constexpr auto cap = std::numeric_limits<decltype(bluestore_pextent_t::length)>::max();
+      max_alloc_size >= cap) {
+    max_alloc_size = p2align(uint64_t(cap), block_size);
+  }
+
+  interval_set<uint64_t> spill;
+  uint64_t got = _take(s, want, max_alloc_size, &spill, extents);
+  if (got == want) {
+    ++s.hits;
+  } else {
+    ++s.misses;
+    // grab one batch covering both the remainder and the next few requests
+    uint64_t need = want - got;
+    PExtentVector fresh;
+    int64_t r = backend->allocate(need + refill_size, unit,
+				  need + refill_size, hint, &fresh);
+    if (r < int64_t(need)) {
+      // backend is (nearly) out of space, return whatever is parked in
+      // the shards and try once more
+      ldout(cct, 5) << __func__ << std::hex << " want 0x" << want
+		    << " got 0x" << got << " + 0x" << std::max<int64_t>(r, 0)
+		    << ", flushing 0x" << get_cached() << std::dec << dendl;
+      flush();
+      uint64_t have = r > 0 ? r : 0;
+      r = backend->allocate(need - have, unit, need - have, hint, &fresh);
+    }
+    for (auto& e : fresh) {
+      uint64_t l = std::min<uint64_t>(e.length, want - got);
+      if (l) {
+	_append(e.offset, l, max_alloc_size, extents);
+	got += l;
+      }
+      if (l < e.length && !_put(s, e.offset + l, e.length - l)) {
+	spill.insert(e.offset + l, e.length - l);
+      }
+    }
+  }
+  if (!spill.empty()) {
+    s.released_backend += spill.num_intervals();
+    backend->release(spill);
+  }
+  ldout(cct, 20) << __func__ << std::hex << " want 0x" << want
+		 << " got 0x" << got << std::dec
+		 << " extents " << *extents << dendl;
+  return got ? int64_t(got) : -ENOSPC;
+}
+
+void CachingAllocator::release(const interval_set<uint64_t>& release_set)
+{
+  auto& s = _get_shard();
+  interval_set<uint64_t> to_backend;
+  for (auto p = release_set.begin(); p != release_set.end(); ++p) {
+    auto offset = p.get_start();
+    auto length = p.get_len();
+    if (length <= refill_size &&
+	p2phase(offset, block_size) == 0 &&
+	p2phase(length, block_size) == 0) {
+      if (!_put(s, offset, length)) {
+	// shard is full, give back half of it in the same backend call
+	_evict(s, false, &to_backend);
+	if (!_put(s, offset, length)) {
+	  to_backend.insert(offset, length);
+	  continue;
+	}
+      }
+      ++s.released_cached;
+      continue;
+    }
+    to_backend.insert(offset, length);
+  }
+  if (!to_backend.empty()) {
+    s.released_backend += to_backend.num_intervals();
+    backend->release(to_backend);
+  }
+}
+
+void CachingAllocator::flush()
+{
+  interval_set<uint64_t> to_backend;
+  for (auto& s : shards) {
+    _evict(s, true, &to_backend);
+  }
+  if (!to_backend.empty()) {
+    backend->release(to_backend);
+  }
+}
+
+uint64_t CachingAllocator::get_cached() const
+{
+  uint64_t r = 0;
+  for (auto& s : shards) {
+    r += s.cached;
+  }
+  return r;
+}
+
+uint64_t CachingAllocator::get_free()
+{
+  return backend->get_free() + get_cached();
+}
+
+double CachingAllocator::get_fragmentation()
+{
+  return backend->get_fragmentation();
+}
+
+void CachingAllocator::dump()
+{
+  backend->dump();
+  for (size_t i = 0; i < shards.size(); ++i) {
+    auto& s = shards[i];
+    for (size_t j = 0; j < slots_per_shard; ++j) {
+      uint64_t v = s.slots[j].load(std::memory_order_relaxed);
+      if (v) {
+	uint64_t offset, length;
+	_decode(v, &offset, &length);
+	ldout(cct, 0) << __func__ << " shard " << i << std::hex
+		      << " 0x" << offset << "~" << length
+		      << std::dec << dendl;
+      }
+    }
+  }
+}
+
+void CachingAllocator::dump(std::function<void(uint64_t offset, uint64_t length)> notify)
+{
+  backend->dump(notify);
+  for (auto& s : shards) {
+    for (size_t j = 0; j < slots_per_shard; ++j) {
+      uint64_t v = s.slots[j].load(std::memory_order_relaxed);
+      if (v) {
+	uint64_t offset, length;
+	_decode(v, &offset, &length);
+	notify(offset, length);
+      }
+    }
+  }
+}
+
+void CachingAllocator::dump_stats(Formatter *f) const
+{
+  uint64_t hits = 0, misses = 0, bypassed = 0;
+  uint64_t released_cached = 0, released_backend = 0;
+  f->open_array_section("shards");
+  for (auto& s : shards) {
+    f->open_object_section("shard");
+    f->dump_unsigned("cached_bytes", s.cached);
+    f->dump_unsigned("hits", s.hits);
+    f->dump_unsigned("misses", s.misses);
+    f->dump_unsigned("bypassed", s.bypassed);
+    f->dump_unsigned("released_cached", s.released_cached);
+    f->dump_unsigned("released_backend", s.released_backend);
+    f->close_section();
+    hits += s.hits;
+    misses += s.misses;
+    bypassed += s.bypassed;
+    released_cached += s.released_cached;
+    released_backend += s.released_backend;
+  }
+  f->close_section();
+  f->dump_unsigned("cached_bytes", get_cached());
+  f->dump_unsigned("hits", hits);
+  f->dump_unsigned("misses", misses);
+  f->dump_unsigned("bypassed", bypassed);
+  f->dump_float("hit_ratio",
+		hits + misses ? double(hits) / (hits + misses) : 0.0);
+  f->dump_unsigned("released_cached", released_cached);
+  f->dump_unsigned("released_backend", released_backend);
+}
+
+void CachingAllocator::set_zone_states(std::vector<zone_state_t> &&_zone_states)
+{
+  backend->set_zone_states(std::move(_zone_states));
+}
+
+void CachingAllocator::init_add_free(uint64_t offset, uint64_t length)
+{
+  backend->init_add_free(offset, length);
+}
+
+void CachingAllocator::init_rm_free(uint64_t offset, uint64_t length)
+{
+  // the range might be parked in a shard, make sure backend sees it all
+  flush();
+  backend->init_rm_free(offset, length);
+}
+
+void CachingAllocator::shutdown()
+{
+  flush();
+  backend->shutdown();
+}
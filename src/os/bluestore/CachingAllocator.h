@@ -0,0 +1,115 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "Allocator.h"
+#include "include/intarith.h"
+
+/*
+ * CachingAllocator is a front-end for any other allocator. It keeps a
+ * set of per-thread shards with a small number of free extents in each of
+ * them. Allocation requests which are small enough are served from the
+ * calling thread's shard without touching the backend (and its mutex),
+ * released extents are put back to the shard if there is a free slot.
+ * The backend is only hit in batches: when a shard runs dry it's refilled
+ * with 'refill_size' bytes at once, and when it overflows half of its
+ * extents are released to the backend in a single call.
+ *
+ * Shard slots are plain atomics holding (offset, length) packed into
+ * 64 bits so neither path needs a lock.
+ */
+class CachingAllocator : public Allocator {
+public:
+  CachingAllocator(CephContext* cct,
+		   Allocator* backend,
+		   int64_t block_size,
+		   size_t num_shards,
+		   size_t slots_per_shard,
+		   uint64_t refill_size,
+		   uint64_t max_request,
+		   const std::string& name);
+  ~CachingAllocator() override;
+
+  int64_t allocate(
+    uint64_t want,
+    uint64_t unit,
+    uint64_t max_alloc_size,
+    int64_t  hint,
+    PExtentVector *extents) override;
+  void release(const interval_set<uint64_t>& release_set) override;
+  using Allocator::release;
+
+  uint64_t get_free() override;
+  double get_fragmentation() override;
+
+  void dump() override;
+  void dump(std::function<void(uint64_t offset, uint64_t length)> notify) override;
+  void set_zone_states(std::vector<zone_state_t> &&_zone_states) override;
+  void init_add_free(uint64_t offset, uint64_t length) override;
+  void init_rm_free(uint64_t offset, uint64_t length) override;
+  void shutdown() override;
+
+  /// return all cached extents to the backend
+  void flush();
+  /// bytes currently parked in the shards (free but not visible to backend)
+  uint64_t get_cached() const;
+  void dump_stats(ceph::Formatter *f) const;
+
+  Allocator* get_backend() {
+    return backend.get();
+  }
+
+private:
+  class SocketHook;
+
+  // one cache line worth of counters per shard, plus the slot array
+  struct alignas(128) shard_t {
+    std::unique_ptr<std::atomic<uint64_t>[]> slots;
+    std::atomic<uint64_t> cached = {0};    ///< bytes parked in slots
+    std::atomic<uint64_t> hits = {0};      ///< requests served w/o backend
+    std::atomic<uint64_t> misses = {0};    ///< requests which needed a refill
+    std::atomic<uint64_t> bypassed = {0};  ///< requests passed through as is
+    std::atomic<uint64_t> released_cached = {0}; ///< extents kept on release
+    std::atomic<uint64_t> released_backend = {0}; ///< extents given back
+  };
+
+  CephContext* cct;
+  std::unique_ptr<Allocator> backend;
+  const uint64_t block_size;
+  const uint64_t block_shift;
+  const size_t slots_per_shard;
+  const uint64_t refill_size;
+  const uint64_t max_request;
+  /// longest extent a slot can hold
+  const uint64_t max_slot_length;
+  std::vector<shard_t> shards;
+  SocketHook* asok_hook = nullptr;
+
+  uint64_t _encode(uint64_t offset, uint64_t length) const {
+    return ((offset >> block_shift) << LENGTH_BITS) | (length >> block_shift);
+  }
+  void _decode(uint64_t v, uint64_t* offset, uint64_t* length) const {
+    *offset = (v >> LENGTH_BITS) << block_shift;
+    *length = (v & ((1ull << LENGTH_BITS) - 1)) << block_shift;
+  }
+  static constexpr unsigned LENGTH_BITS = 20;
+
+  shard_t& _get_shard();
+  bool _is_cacheable(uint64_t want, uint64_t unit) const {
+    return want <= max_request && unit == block_size && want % unit == 0;
+  }
+  /// take up to 'want' bytes from the shard, returns bytes taken
+  uint64_t _take(shard_t& s, uint64_t want, uint64_t max_alloc_size,
+		 interval_set<uint64_t>* spill, PExtentVector* extents);
+  /// park an extent in the shard, false if it doesn't fit
+  bool _put(shard_t& s, uint64_t offset, uint64_t length);
+  /// move half of the shard's extents (or all of them) into 'out'
+  void _evict(shard_t& s, bool all, interval_set<uint64_t>* out);
+  void _append(uint64_t offset, uint64_t length, uint64_t max_alloc_size,
+	       PExtentVector* extents);
+};
@@ -152,6 +152,9 @@ void bluefs_fnode_t::dump(Formatter *f) const
   f->dump_unsigned("ino", ino);
   f->dump_unsigned("size", size);
   f->dump_stream("mtime") << mtime;
+  if (envelope_nonce) {
+    f->dump_unsigned("envelope_nonce", envelope_nonce);
+  }
   f->open_array_section("extents");
   for (auto& p : extents)
     f->dump_object("extent", p);
@@ -176,6 +179,7 @@ ostream& operator<<(ostream& out, const bluefs_fnode_t& file)
 	     << " mtime " << file.mtime
 	     << " allocated " << std::hex << file.allocated << std::dec
 	     << " extents " << file.extents
+	     << (file.envelope_nonce ? " envelope" : "")
 	     << ")";
 }
 
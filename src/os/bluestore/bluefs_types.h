@@ -41,6 +41,9 @@ struct bluefs_fnode_t {
   utime_t mtime;
   uint8_t __unused__; // was prefer_bdev
   mempool::bluefs::vector<bluefs_extent_t> extents;
+  /// non-zero if the file is written as a sequence of self-describing
+  /// envelopes (see bluefs_wal_envelope_t); identifies this incarnation
+  uint64_t envelope_nonce = 0;
 
   // precalculated logical offsets for extents vector entries
   // allows fast lookup for extent index by the offset value via upper_bound()
@@ -78,12 +81,15 @@ struct bluefs_fnode_t {
   template<typename T, typename P>
   friend std::enable_if_t<std::is_same_v<bluefs_fnode_t, std::remove_const_t<T>>>
   _denc_friend(T& v, P& p) {
-    DENC_START(1, 1, p);
+    DENC_START(2, 1, p);
     denc_varint(v.ino, p);
     denc_varint(v.size, p);
     denc(v.mtime, p);
     denc(v.__unused__, p);
     denc(v.extents, p);
+    if (struct_v >= 2) {
+      denc(v.envelope_nonce, p);
+    }
     DENC_FINISH(p);
   }
 
@@ -132,6 +138,30 @@ WRITE_CLASS_DENC(bluefs_fnode_t)
 
 std::ostream& operator<<(std::ostream& out, const bluefs_fnode_t& file);
 
+/*
+ * Header of a single flush of a file written in envelope mode.  Every
+ * flush starts on a block boundary and is padded to the next one, so a
+ * commit is a single aligned write that never rewrites earlier data.
+ * The file size is not logged on each append; on mount the valid tail
+ * is found by scanning envelopes until one does not match.
+ */
+struct bluefs_wal_envelope_t {
+  static constexpr uint32_t MAGIC = 0x4c415742;  // "BWAL"
+
+  ceph_le32 magic;
+  ceph_le32 crc;     ///< crc32c over the header (with crc = 0) and payload
+  ceph_le64 nonce;   ///< bluefs_fnode_t::envelope_nonce
+  ceph_le64 seq;     ///< flush sequence within the file, from 0
+  ceph_le32 length;  ///< payload bytes following the header
+  ceph_le32 reserved;
+
+  /// bytes used on disk by an envelope carrying len payload bytes
+  static uint64_t disk_length(uint64_t len, uint64_t block_size) {
+    return p2roundup<uint64_t>(sizeof(bluefs_wal_envelope_t) + len,
+			       block_size);
+  }
+} __attribute__ ((packed));
+
 struct bluefs_layout_t {
   unsigned shared_bdev = 0;         ///< which bluefs bdev we are sharing
   bool dedicated_db = false;        ///< whether block.db is present
@@ -238,6 +238,7 @@ int main(int argc, char **argv)
   string resharding_ctrl;
   int log_level = 30;
   bool fsck_deep = false;
+  bool fsck_progress = false;
   po::options_description po_options("Options");
   po_options.add_options()
     ("help,h", "produce help message")
@@ -249,6 +250,7 @@ int main(int argc, char **argv)
     ("devs-source", po::value<vector<string>>(&devs_source), "bluefs-dev-migrate source device(s)")
     ("dev-target", po::value<string>(&dev_target), "target/resulting device")
     ("deep", po::value<bool>(&fsck_deep), "deep fsck (read all data)")
+    ("progress", po::value<bool>(&fsck_progress), "report fsck progress and throughput")
     ("key,k", po::value<string>(&key), "label metadata key name")
     ("value,v", po::value<string>(&value), "label metadata value")
     ("allocator", po::value<vector<string>>(&allocs_name), "allocator to inspect: 'block'/'bluefs-wal'/'bluefs-db'/'bluefs-slow'")
@@ -446,6 +448,24 @@ int main(int argc, char **argv)
       action == "quick-fix") {
     validate_path(cct.get(), path, false);
     BlueStore bluestore(cct.get(), path);
+    BlueStore::fsck_progress_t last;
+    if (fsck_progress) {
+      bluestore.set_fsck_progress_cb(
+	[&last](const BlueStore::fsck_progress_t& p) {
+	  last = p;
+	  double secs = std::max(p.elapsed, 0.001);
+	  cerr << "progress: " << p.objects << " objects";
+	  if (p.ranges_total) {
+	    cerr << ", " << p.ranges_done << "/" << p.ranges_total << " ranges";
+	  }
+	  cerr << ", " << (uint64_t)(p.objects / secs) << " objects/s";
+	  if (p.bytes_read) {
+	    cerr << ", " << byte_u_t(p.bytes_read) << " read at "
+		 << byte_u_t(p.bytes_read / secs) << "/s";
+	  }
+	  cerr << std::endl;
+	});
+    }
     int r;
     if (action == "fsck") {
       r = bluestore.fsck(fsck_deep);
@@ -463,6 +483,10 @@ int main(int argc, char **argv)
     } else {
       cout << action << " success" << std::endl;
     }
+    if (fsck_progress) {
+      cout << action << " checked " << last.objects << " objects in "
+	   << last.elapsed << "s" << std::endl;
+    }
   }
   else if (action == "prime-osd-dir") {
     bluestore_bdev_label_t label;
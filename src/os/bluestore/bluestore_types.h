@@ -964,6 +964,7 @@ struct bluestore_onode_t {
     FLAG_OMAP = 1,       ///< object may have omap data
     FLAG_PGMETA_OMAP = 2,  ///< omap data is in meta omap prefix
     FLAG_PERPOOL_OMAP = 4, ///< omap data is in per-pool prefix; per-pool keys
+    FLAG_PERPG_OMAP = 8,   ///< omap data is in per-pg prefix; per-pg keys
   };
 
   std::string get_flags_string() const {
@@ -977,6 +978,9 @@ struct bluestore_onode_t {
     if (flags & FLAG_PERPOOL_OMAP) {
       s += "+perpool_omap";
     }
+    if (flags & FLAG_PERPG_OMAP) {
+      s += "+perpg_omap";
+    }
     return s;
   }
 
@@ -1001,9 +1005,13 @@ struct bluestore_onode_t {
   bool is_perpool_omap() const {
     return has_flag(FLAG_PERPOOL_OMAP);
   }
+  bool is_perpg_omap() const {
+    return has_flag(FLAG_PERPG_OMAP);
+  }
 
-  void set_omap_flags() {
-    set_flag(FLAG_OMAP | FLAG_PERPOOL_OMAP);
+  /// per-pg objects are per-pool as well, their keys just carry more
+  void set_omap_flags(bool per_pg = false) {
+    set_flag(FLAG_OMAP | FLAG_PERPOOL_OMAP | (per_pg ? FLAG_PERPG_OMAP : 0));
   }
   void set_omap_flags_pgmeta() {
     set_flag(FLAG_OMAP | FLAG_PGMETA_OMAP);
@@ -16,6 +16,7 @@
 #include <sstream>
 
 #include "ECBackend.h"
+#include "ScrubReader.h"
 #include "messages/MOSDPGPush.h"
 #include "messages/MOSDPGPushReply.h"
 #include "messages/MOSDECSubOpWrite.h"
@@ -1453,6 +1454,10 @@ void ECBackend::on_change()
     cache.release_write_pin(op.second.pin);
   }
   tid_to_op_map.clear();
+  cache.drop_retained();
+  retain_blocked.clear();
+  get_parent()->get_logger()->set(l_osd_ec_cache_bytes,
+				  ExtentCache::get_all_retained_bytes());
 
   for (map<ceph_tid_t, ReadOp>::iterator i = tid_to_read_map.begin();
        i != tid_to_read_map.end();
@@ -1893,6 +1898,10 @@ bool ECBackend::try_state_to_reads()
 	     << " because it requires an rmw and the cache is invalid "
 	     << pipeline_state
 	     << dendl;
+    if (!op->stalled) {
+      op->stalled = true;
+      get_parent()->get_logger()->inc(l_osd_ec_pipeline_stall);
+    }
     return false;
   }
 
@@ -1902,14 +1911,27 @@ bool ECBackend::try_state_to_reads()
     dout(20) << __func__ << ": invalidating cache after this op"
 	     << dendl;
     pipeline_state.invalidate();
+    cache.drop_retained();
   }
 
   waiting_state.pop_front();
   waiting_reads.push_back(*op);
 
   if (op->using_cache) {
+    ceph_assert(op->plan.t);
+    for (auto &&i: op->plan.t->op_map) {
+      if (i.second.deletes_first() ||
+	  i.second.truncate ||
+	  i.second.has_source()) {
+	op->resets_cache.insert(i.first);
+	++retain_blocked[i.first];
+	cache.drop_retained(i.first);
+      }
+    }
+
     cache.open_write_pin(op->pin);
 
+    uint64_t to_read = 0, cached = 0;
     extent_set empty;
     for (auto &&hpair: op->plan.will_write) {
       auto to_read_plan_iter = op->plan.to_read.find(hpair.first);
@@ -1927,6 +1949,8 @@ bool ECBackend::try_state_to_reads()
       extent_set pending_read = to_read_plan;
       pending_read.subtract(remote_read);
 
+      to_read += to_read_plan.size();
+      cached += pending_read.size();
       if (!remote_read.empty()) {
 	op->remote_read[hpair.first] = std::move(remote_read);
       }
@@ -1934,6 +1958,11 @@ bool ECBackend::try_state_to_reads()
 	op->pending_read[hpair.first] = std::move(pending_read);
       }
     }
+    if (to_read) {
+      auto logger = get_parent()->get_logger();
+      logger->inc(cached == to_read ? l_osd_ec_cache_hit : l_osd_ec_cache_miss);
+      logger->inc(l_osd_ec_cache_read_avoided_bytes, cached);
+    }
   } else {
     op->remote_read = op->plan.to_read;
   }
@@ -2153,7 +2182,19 @@ bool ECBackend::try_finish_rmw()
   }
 
   if (op->using_cache) {
-    cache.release_write_pin(op->pin);
+    for (auto &&i: op->resets_cache) {
+      auto p = retain_blocked.find(i);
+      ceph_assert(p != retain_blocked.end());
+      if (--p->second == 0) {
+	retain_blocked.erase(p);
+      }
+    }
+    cache.release_write_pin(op->pin, get_cache_retain_bytes());
+    for (auto &&i: retain_blocked) {
+      cache.drop_retained(i.first);
+    }
+    get_parent()->get_logger()->set(l_osd_ec_cache_bytes,
+				    ExtentCache::get_all_retained_bytes());
   }
   tid_to_op_map.erase(op->tid);
 
@@ -2167,6 +2208,17 @@ bool ECBackend::try_finish_rmw()
   return true;
 }
 
+uint64_t ECBackend::get_cache_retain_bytes() const
+{
+  if (pipeline_state.cache_invalid()) {
+    return 0;
+  }
+  // the budget is for the whole OSD; each of its EC PGs gets an equal
+  // share, so the total stays bounded however many PGs it has
+  return cct->_conf.get_val<Option::size_t>("osd_ec_stripe_cache_size") /
+    std::max(1u, ExtentCache::get_num_caches());
+}
+
 void ECBackend::check_ops()
 {
   while (try_state_to_reads() ||
@@ -2491,6 +2543,19 @@ void ECBackend::rollback_append(
       old_size));
 }
 
+void ECBackend::be_deep_scrub_read_params(
+  uint64_t *stride,
+  uint64_t *align,
+  uint32_t *fadvise_flags) const
+{
+  *stride = cct->_conf->osd_deep_scrub_stride;
+  if (*stride % sinfo.get_chunk_size())
+    *stride += sinfo.get_chunk_size() - (*stride % sinfo.get_chunk_size());
+  *align = sinfo.get_chunk_size();
+  *fadvise_flags = CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL |
+                   CEPH_OSD_OP_FLAG_FADVISE_DONTNEED;
+}
+
 int ECBackend::be_deep_scrub(
   const hobject_t &poid,
   ScrubMap &map,
@@ -2500,8 +2565,9 @@ int ECBackend::be_deep_scrub(
   dout(10) << __func__ << " " << poid << " pos " << pos << dendl;
   int r;
 
-  uint32_t fadvise_flags = CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL |
-                           CEPH_OSD_OP_FLAG_FADVISE_DONTNEED;
+  uint64_t stride, align;
+  uint32_t fadvise_flags;
+  be_deep_scrub_read_params(&stride, &align, &fadvise_flags);
 
   utime_t sleeptime;
   sleeptime.set_from_double(cct->_conf->osd_debug_deep_scrub_sleep);
@@ -2510,41 +2576,68 @@ int ECBackend::be_deep_scrub(
     sleeptime.sleep();
   }
 
-  if (pos.data_pos == 0) {
-    pos.data_hash = bufferhash(-1);
-  }
-
-  uint64_t stride = cct->_conf->osd_deep_scrub_stride;
-  if (stride % sinfo.get_chunk_size())
-    stride += sinfo.get_chunk_size() - (stride % sinfo.get_chunk_size());
+  object_info_t oi;
+  bool unchanged = false;
+  if (pos.data_pos == 0 && be_deep_scrub_unchanged(pos, o, &oi)) {
+    // verified by an earlier deep scrub; only check the size
+    dout(20) << __func__ << "  " << poid << " unchanged since "
+	     << pos.deep_since << ", not reading data" << dendl;
+    unchanged = true;
+    pos.data_pos = o.size;
+  } else if (pos.data_pos == 0 && pos.reader) {
+    ScrubReader::result_t res;
+    if (!pos.reader->get(pos.pos, &res)) {
+      dout(20) << __func__ << "  " << poid << " waiting for read ahead"
+	       << dendl;
+      return -EAGAIN;
+    }
+    if (res.r < 0) {
+      dout(20) << __func__ << "  " << poid << " got "
+	       << res.r << " on read, read_error" << dendl;
+      o.read_error = true;
+      return 0;
+    }
+    if (res.misaligned) {
+      dout(20) << __func__ << "  " << poid << " got read not chunk size "
+	       << sinfo.get_chunk_size() << " aligned" << dendl;
+      o.read_error = true;
+      return 0;
+    }
+    pos.data_hash = bufferhash(res.digest);
+    pos.data_pos = res.size;
+  } else {
+    if (pos.data_pos == 0) {
+      pos.data_hash = bufferhash(-1);
+    }
 
-  bufferlist bl;
-  r = store->read(
-    ch,
-    ghobject_t(
-      poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
-    pos.data_pos,
-    stride, bl,
-    fadvise_flags);
-  if (r < 0) {
-    dout(20) << __func__ << "  " << poid << " got "
-	     << r << " on read, read_error" << dendl;
-    o.read_error = true;
-    return 0;
-  }
-  if (bl.length() % sinfo.get_chunk_size()) {
-    dout(20) << __func__ << "  " << poid << " got "
-	     << r << " on read, not chunk size " << sinfo.get_chunk_size() << " aligned"
-	     << dendl;
-    o.read_error = true;
-    return 0;
-  }
-  if (r > 0) {
-    pos.data_hash << bl;
-  }
-  pos.data_pos += r;
-  if (r == (int)stride) {
-    return -EINPROGRESS;
+    bufferlist bl;
+    r = store->read(
+      ch,
+      ghobject_t(
+	poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
+      pos.data_pos,
+      stride, bl,
+      fadvise_flags);
+    if (r < 0) {
+      dout(20) << __func__ << "  " << poid << " got "
+	       << r << " on read, read_error" << dendl;
+      o.read_error = true;
+      return 0;
+    }
+    if (bl.length() % align) {
+      dout(20) << __func__ << "  " << poid << " got "
+	       << r << " on read, not chunk size " << sinfo.get_chunk_size() << " aligned"
+	       << dendl;
+      o.read_error = true;
+      return 0;
+    }
+    if (r > 0) {
+      pos.data_hash << bl;
+    }
+    pos.data_pos += r;
+    if (r == (int)stride) {
+      return -EINPROGRESS;
+    }
   }
 
   ECUtil::HashInfoRef hinfo = get_hash_info(poid, false, &o.attrs);
@@ -2565,7 +2658,8 @@ int ECBackend::be_deep_scrub(
 	return 0;
       }
 
-      if (hinfo->get_chunk_hash(get_parent()->whoami_shard().shard) !=
+      if (!unchanged &&
+	  hinfo->get_chunk_hash(get_parent()->whoami_shard().shard) !=
 	  pos.data_hash.digest()) {
 	dout(0) << "_scan_list  " << poid << " got incorrect hash on read 0x"
 		<< std::hex << pos.data_hash.digest() << " !=  expected 0x"
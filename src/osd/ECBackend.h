@@ -477,6 +477,11 @@ public:
     // must be true if requires_rmw(), must be false if invalidates_cache()
     bool using_cache = true;
 
+    /// objects deleted, truncated or cloned/renamed onto, see retain_blocked
+    std::set<hobject_t> resets_cache;
+    /// counted as an ec_pipeline_stall already
+    bool stalled = false;
+
     /// In progress read state;
     std::map<hobject_t,extent_set> pending_read; // subset already being read
     std::map<hobject_t,extent_set> remote_read;  // subset we must read
@@ -513,6 +518,19 @@ public:
   ExtentCache cache;
   std::map<ceph_tid_t, Op> tid_to_op_map; /// Owns Op structure
 
+  /**
+   * Completed writes leave their stripes in the cache (up to this PG's
+   * share of osd_ec_stripe_cache_size) so that later overwrites of the same
+   * stripes need not read them back from the shards.  Those stripes
+   * must not outlive a change of the object that does not go through
+   * the cache: the ops in the pipeline which delete, truncate or
+   * replace an object (Op::resets_cache) drop its stripes when they
+   * reach the reads stage, and until they complete, writes completing
+   * before them do not leave stripes of that object behind.
+   */
+  std::map<hobject_t, unsigned> retain_blocked;
+  uint64_t get_cache_retain_bytes() const;
+
   /**
    * We model the possible rmw states as a std::set of waitlists.
    * All writes at this time complete in order, so a write blocked
@@ -675,6 +693,10 @@ public:
     ScrubMap &map,
     ScrubMapBuilder &pos,
     ScrubMap::object &o) override;
+  void be_deep_scrub_read_params(
+    uint64_t *stride,
+    uint64_t *align,
+    uint32_t *fadvise_flags) const override;
   uint64_t be_get_ondisk_size(uint64_t logical_size) override {
     return sinfo.logical_to_next_chunk_offset(logical_size);
   }
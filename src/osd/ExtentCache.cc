@@ -18,12 +18,19 @@ using std::ostream;
 
 using ceph::bufferlist;
 
+std::atomic<uint64_t> ExtentCache::all_retained_bytes = {0};
+std::atomic<unsigned> ExtentCache::num_caches = {0};
+
 void ExtentCache::extent::_link_pin_state(pin_state &pin_state)
 {
   ceph_assert(parent_extent_set);
   ceph_assert(!parent_pin_state);
   parent_pin_state = &pin_state;
   pin_state.pin_list.push_back(*this);
+  pin_state.bytes += length;
+  if (pin_state.osd_wide) {
+    all_retained_bytes += length;
+  }
 }
 
 void ExtentCache::extent::_unlink_pin_state()
@@ -32,6 +39,10 @@ void ExtentCache::extent::_unlink_pin_state()
   ceph_assert(parent_pin_state);
   auto liter = pin_state::list::s_iterator_to(*this);
   parent_pin_state->pin_list.erase(liter);
+  parent_pin_state->bytes -= length;
+  if (parent_pin_state->osd_wide) {
+    all_retained_bytes -= length;
+  }
   parent_pin_state = nullptr;
 }
 
@@ -220,6 +231,51 @@ void ExtentCache::present_rmw_update(
   }
 }
 
+void ExtentCache::trim_retained(uint64_t max)
+{
+  while (retained.bytes > max) {
+    std::unique_ptr<extent> extent(&retained.pin_list.front());
+    auto &eset = *(extent->parent_extent_set);
+    extent->unlink();
+    remove_and_destroy_if_empty(eset);
+  }
+}
+
+void ExtentCache::release_write_pin(
+  write_pin &pin,
+  uint64_t retain_bytes)
+{
+  if (retain_bytes) {
+    for (auto iter = pin.pin_list.begin(); iter != pin.pin_list.end(); ) {
+      extent *ext = &*iter;
+      iter++; // move will invalidate
+      if (!ext->is_pending()) {
+	ext->move(retained);
+      }
+    }
+  }
+  release_pin(pin);
+  trim_retained(retain_bytes);
+}
+
+void ExtentCache::drop_retained(const hobject_t &oid)
+{
+  auto *eset = get_if_exists(oid);
+  if (!eset) {
+    return;
+  }
+  for (auto iter = eset->extent_set.begin();
+       iter != eset->extent_set.end(); ) {
+    extent *ext = &*iter;
+    iter++; // unlink will invalidate
+    if (ext->parent_pin_state == &retained) {
+      ext->unlink();
+      delete ext;
+    }
+  }
+  remove_and_destroy_if_empty(*eset);
+}
+
 ostream &ExtentCache::print(ostream &out) const
 {
   out << "ExtentCache(" << std::endl;
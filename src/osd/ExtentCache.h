@@ -15,6 +15,7 @@
 #ifndef EXTENT_CACHE_H
 #define EXTENT_CACHE_H
 
+#include <atomic>
 #include <map>
 #include <list>
 #include <vector>
@@ -92,6 +93,17 @@
    All of the above suggests that there are 3 things users can
    ask of the cache corresponding to the 3 Write pipelines
    states.
+
+   Additionally, the user may ask to retain the extents of a completed
+   write instead of dropping them (see release_write_pin):
+   3) Retained:
+      - This extent has the data of the last completed write to it
+      - Nothing pins it; the least recently retained extents are
+        dropped once the retained extents exceed the limit given
+      - reserve_extents_for_rmw moves it to Write Pinned, so the write
+        need not read it again
+   The user must drop retained extents of objects which are changed by
+   other means (deletes, truncates, clones, interval changes).
  */
 
 /// If someone wants these types, but not ExtentCache, move to another file
@@ -353,6 +365,8 @@ private:
     };
     pin_type_t pin_type = NONE;
     bool is_write() const { return pin_type == WRITE; }
+    uint64_t bytes = 0; ///< length of the extents in pin_list
+    bool osd_wide = false; ///< bytes also count in all_retained_bytes
 
     pin_state(const pin_state &other) = delete;
     pin_state &operator=(const pin_state &other) = delete;
@@ -391,7 +405,24 @@ private:
     p.pin_type = pin_state::NONE;
   }
 
+  /// completed writes' extents, least recently written first
+  pin_state retained;
+  void trim_retained(uint64_t max);
+
+  /// retained bytes of all caches of the OSD, and how many caches it has
+  static std::atomic<uint64_t> all_retained_bytes;
+  static std::atomic<unsigned> num_caches;
+
 public:
+  ExtentCache() {
+    retained.osd_wide = true;
+    ++num_caches;
+  }
+  ~ExtentCache() {
+    release_pin(retained);
+    --num_caches;
+  }
+
   class write_pin : private pin_state {
     friend class ExtentCache;
   private:
@@ -475,10 +506,37 @@ public:
 
   /**
    * Release all buffers pinned by pin
+   *
+   * Extents with data are retained rather than dropped, as long as
+   * all retained extents fit into retain_bytes.
+   *
+   * Transition table:
+   * - Write Pending pin.reqid -> Empty
+   * - Write Pinned pin.reqid -> Retained (or Empty)
+   *
+   * @param pin [in,out] pin to release
+   * @param retain_bytes [in] limit for retained extents, 0 drops all
    */
   void release_write_pin(
-    write_pin &pin) {
-    release_pin(pin);
+    write_pin &pin,
+    uint64_t retain_bytes = 0);
+
+  /// Drop the retained extents of oid
+  void drop_retained(const hobject_t &oid);
+
+  /// Drop all retained extents
+  void drop_retained() {
+    release_pin(retained);
+  }
+
+  uint64_t get_retained_bytes() const {
+    return retained.bytes;
+  }
+  static uint64_t get_all_retained_bytes() {
+    return all_retained_bytes;
+  }
+  static unsigned get_num_caches() {
+    return num_caches;
   }
 
   std::ostream &print(std::ostream &out) const;
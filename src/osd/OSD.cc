@@ -19,6 +19,7 @@
 #include <fstream>
 #include <iostream>
 #include <iterator>
+#include <numeric>
 
 #include <unistd.h>
 #include <sys/stat.h>
@@ -283,6 +284,7 @@ OSDService::OSDService(OSD *osd, ceph::async::io_context_pool& poolctx) :
   next_notif_id(0),
   recovery_request_timer(cct, recovery_request_lock, false),
   sleep_timer(cct, sleep_lock, false),
+  scrub_read_queue(cct),
   reserver_finisher(cct),
   local_reserver(cct, &reserver_finisher, cct->_conf->osd_max_backfills,
 		 cct->_conf->osd_min_recovery_priority),
@@ -493,6 +495,7 @@ void OSDService::start_shutdown()
     std::lock_guard l(sleep_lock);
     sleep_timer.shutdown();
   }
+  scrub_read_queue.stop();
 
   {
     std::lock_guard l(recovery_request_lock);
@@ -531,6 +534,9 @@ void OSDService::init()
   for (auto& f : objecter_finishers) {
     f->start();
   }
+  scrub_read_queue.start(logger);
+  scrub_read_queue.set_limit(
+    cct->_conf.get_val<Option::size_t>("osd_scrub_read_bytes_per_sec"));
   objecter->set_client_incarnation(0);
 
   // deprioritize objecter in daemonperf output
@@ -2353,12 +2359,47 @@ int OSD::set_numa_affinity()
 	numa_node = -1;
       }
     }
+  } else if (g_conf().get_val<bool>("osd_numa_shard_affinity")) {
+    set_shard_numa_affinity();
   } else {
     dout(1) << __func__ << " not setting numa affinity" << dendl;
   }
   return 0;
 }
 
+void OSD::set_shard_numa_affinity()
+{
+  std::set<int> nodes;
+  int r = get_numa_nodes(&nodes);
+  if (r < 0 || nodes.size() < 2) {
+    dout(1) << __func__ << " not spreading op shards, numa nodes " << nodes
+	    << dendl;
+    return;
+  }
+  std::vector<int> node_list(nodes.begin(), nodes.end());
+  std::vector<int> shard_nodes(num_shards, -1);
+  for (uint32_t i = 0; i < num_shards; ++i) {
+    int node = node_list[i % node_list.size()];
+    auto sdata = shards[i];
+    r = get_numa_node_cpu_set(node, &sdata->numa_cpu_set_size,
+			      &sdata->numa_cpu_set);
+    if (r < 0) {
+      derr << __func__ << " unable to determine numa node " << node
+	   << " CPUs: " << cpp_strerror(r) << dendl;
+      continue;
+    }
+    dout(1) << __func__ << " op shard " << i << " numa node " << node
+	    << " cpus "
+	    << cpu_set_to_str_list(sdata->numa_cpu_set_size,
+				   &sdata->numa_cpu_set)
+	    << dendl;
+    // workers pick this up on their next pass through _process
+    sdata->numa_node = node;
+    shard_nodes[i] = node;
+  }
+  store->set_cache_numa_nodes(shard_nodes);
+}
+
 // asok
 
 class OSDSocketHook : public AdminSocketHook {
@@ -2530,6 +2571,55 @@ will start to track new ops received afterwards.";
     f->open_object_section("pq");
     op_shardedwq.dump(f);
     f->close_section();
+  } else if (prefix == "dump_op_shard_load") {
+    f->open_object_section("shard_load");
+    dump_shard_load(f);
+    f->close_section();
+  } else if (prefix == "move_pg_shard") {
+    string pgidstr;
+    pg_t pgid;
+    int64_t shard_id = 0;
+    cmd_getval(cmdmap, "pgid", pgidstr);
+    cmd_getval(cmdmap, "shard", shard_id);
+    if (!pgid.parse(pgidstr.c_str())) {
+      ss << "couldn't parse pgid '" << pgidstr << "'";
+      ret = -EINVAL;
+      goto out;
+    }
+    if (shard_id < 0 || shard_id >= (int64_t)num_shards) {
+      ss << "no op shard " << shard_id << ", have " << num_shards;
+      ret = -EINVAL;
+      goto out;
+    }
+    spg_t pcand;
+    PGRef pg;
+    if (!get_osdmap()->get_primary_shard(pgid, &pcand) ||
+	!(pg = _lookup_lock_pg(pcand))) {
+      ss << "i don't have pgid " << pgid;
+      ret = -ENOENT;
+      goto out;
+    }
+    bool balancing = pg->osd_shard->balancing;
+    bool moved;
+    {
+      std::unique_lock move_locker{pg_shard_move_lock};
+      moved = _move_pg_shard(pg, shards[shard_id]);
+    }
+    unsigned now_on = pg->osd_shard->shard_id;
+    pg->unlock();
+    if (!balancing) {
+      ss << "op shard balancing is off, see osd_op_shard_rebalance_interval";
+      ret = -EPERM;
+      goto out;
+    }
+    if (moved) {
+      logger->inc(l_osd_pg_shard_moves);
+    }
+    f->open_object_section("move_pg_shard");
+    f->dump_stream("pgid") << pcand;
+    f->dump_bool("moved", moved);
+    f->dump_unsigned("shard", now_on);
+    f->close_section();
   } else if (prefix == "dump_blocklist") {
     list<pair<entity_addr_t,utime_t> > bl;
     OSDMapRef curmap = service.get_osdmap();
@@ -3580,6 +3670,7 @@ int OSD::init()
     }
     for (auto pg : pgs) {
       std::scoped_lock l{*pg};
+      std::shared_lock move_locker{pg_shard_move_lock};
       set<pair<spg_t,epoch_t>> new_children;
       set<pair<spg_t,epoch_t>> merge_pgs;
       service.identify_splits_and_merges(pg->get_osdmap(), osdmap, pg->pg_id,
@@ -3728,6 +3819,18 @@ void OSD::final_init()
 				     asok_hook,
 				     "dump op priority queue state");
   ceph_assert(r == 0);
+  r = admin_socket->register_command("dump_op_shard_load",
+				     asok_hook,
+				     "dump load per op shard and the last pg "
+				     "rebalance between shards");
+  ceph_assert(r == 0);
+  r = admin_socket->register_command("move_pg_shard " \
+				     "name=pgid,type=CephPgid " \
+				     "name=shard,type=CephInt,range=0",
+				     asok_hook,
+				     "move a pg to another op shard once it "
+				     "is quiet; for testing");
+  ceph_assert(r == 0);
   r = admin_socket->register_command("dump_blocklist",
 				     asok_hook,
 				     "dump blocklisted clients and times");
@@ -4538,6 +4641,8 @@ PG* OSD::_make_pg(
 
 void OSD::_get_pgs(vector<PGRef> *v, bool clear_too)
 {
+  // a pg moving between shards must be seen exactly once
+  std::shared_lock move_locker{pg_shard_move_lock};
   v->clear();
   v->reserve(get_num_pgs());
   for (auto& s : shards) {
@@ -4556,6 +4661,8 @@ void OSD::_get_pgs(vector<PGRef> *v, bool clear_too)
 
 void OSD::_get_pgids(vector<spg_t> *v)
 {
+  // a pg moving between shards must be seen exactly once
+  std::shared_lock move_locker{pg_shard_move_lock};
   v->clear();
   v->reserve(get_num_pgs());
   for (auto& s : shards) {
@@ -4572,9 +4679,8 @@ void OSD::_get_pgids(vector<spg_t> *v)
 void OSD::register_pg(PGRef pg)
 {
   spg_t pgid = pg->get_pgid();
-  uint32_t shard_index = pgid.hash_to_shard(num_shards);
-  auto sdata = shards[shard_index];
-  std::lock_guard l(sdata->shard_lock);
+  auto sdata = _lock_pg_shard(pgid);
+  std::lock_guard l(sdata->shard_lock, std::adopt_lock);
   auto r = sdata->pg_slots.emplace(pgid, make_unique<OSDShardPGSlot>());
   ceph_assert(r.second);
   auto *slot = r.first->second.get();
@@ -4619,9 +4725,8 @@ bool OSD::try_finish_pg_delete(PG *pg, unsigned old_pg_num)
 
 PGRef OSD::_lookup_pg(spg_t pgid)
 {
-  uint32_t shard_index = pgid.hash_to_shard(num_shards);
-  auto sdata = shards[shard_index];
-  std::lock_guard l(sdata->shard_lock);
+  auto sdata = _lock_pg_shard(pgid);
+  std::lock_guard l(sdata->shard_lock, std::adopt_lock);
   auto p = sdata->pg_slots.find(pgid);
   if (p == sdata->pg_slots.end()) {
     return nullptr;
@@ -4648,6 +4753,312 @@ PGRef OSD::lookup_lock_pg(spg_t pgid)
   return _lookup_lock_pg(pgid);
 }
 
+unsigned OSD::get_pg_shard_index(spg_t pgid)
+{
+  if (num_pg_shard_remaps) {
+    std::shared_lock l{pg_shard_remap_lock};
+    if (auto p = pg_shard_remap.find(pgid); p != pg_shard_remap.end()) {
+      return p->second;
+    }
+  }
+  return pgid.hash_to_shard(num_shards);
+}
+
+OSDShard *OSD::_lock_pg_shard(spg_t pgid)
+{
+  // a pg only changes shard under the lock of the shard it leaves, so
+  // once we hold the lock of the shard it still maps to it stays there
+  while (true) {
+    unsigned shard_index = get_pg_shard_index(pgid);
+    auto sdata = shards[shard_index];
+    sdata->shard_lock.lock();
+    if (get_pg_shard_index(pgid) == shard_index) {
+      return sdata;
+    }
+    sdata->shard_lock.unlock();
+  }
+}
+
+void OSD::_set_pg_shard(spg_t pgid, unsigned shard_index)
+{
+  // caller holds pg_shard_move_lock and the lock of pgid's current shard
+  std::unique_lock l{pg_shard_remap_lock};
+  if (shard_index == pgid.hash_to_shard(num_shards)) {
+    pg_shard_remap.erase(pgid);
+  } else {
+    pg_shard_remap[pgid] = shard_index;
+  }
+  num_pg_shard_remaps = pg_shard_remap.size();
+}
+
+bool OSD::_move_pg_shard(PGRef pg, OSDShard *to)
+{
+  // caller holds the pg lock and pg_shard_move_lock
+  OSDShard *from = pg->osd_shard;
+  if (!from || from == to || pg->is_deleted()) {
+    return false;
+  }
+  OSDShard *first = from->shard_id < to->shard_id ? from : to;
+  OSDShard *second = first == from ? to : from;
+  std::lock_guard l1{first->shard_lock};
+  std::lock_guard l2{second->shard_lock};
+
+  auto p = from->pg_slots.find(pg->pg_id);
+  ceph_assert(p != from->pg_slots.end());
+  OSDShardPGSlot *slot = p->second.get();
+  // only move at a quiet point: nothing of the pg is queued, waiting or
+  // being run on the old shard, so nothing can be reordered by the new
+  // shard's threads picking up its next items.
+  if (!from->balancing ||
+      from->pg_queued_untracked ||
+      from->pg_queued.count(pg->pg_id) ||
+      slot->num_running ||
+      !slot->to_process.empty() ||
+      !slot->waiting.empty() ||
+      !slot->waiting_peering.empty() ||
+      !slot->waiting_for_split.empty() ||
+      slot->waiting_for_merge_epoch ||
+      !from->shard_osdmap || !to->shard_osdmap ||
+      slot->epoch < from->shard_osdmap->get_epoch() ||
+      to->shard_osdmap->get_epoch() < from->shard_osdmap->get_epoch() ||
+      to->pg_slots.count(pg->pg_id)) {
+    dout(20) << __func__ << " " << pg->pg_id << " busy on shard "
+	     << from->shard_id << ", not moving" << dendl;
+    return false;
+  }
+
+  dout(10) << __func__ << " " << pg->pg_id << " shard " << from->shard_id
+	   << " -> " << to->shard_id << dendl;
+  from->pg_slots_by_epoch.erase(from->pg_slots_by_epoch.iterator_to(*slot));
+  to->pg_slots.emplace(pg->pg_id, std::move(p->second));
+  from->pg_slots.erase(p);
+  to->pg_slots_by_epoch.insert(*slot);
+  pg->osd_shard = to;
+  ++from->pgs_moved_out;
+  ++to->pgs_moved_in;
+  // the collection keeps committing to the old shard's context_queue, so
+  // its oncommits stay in order.
+  _set_pg_shard(pg->pg_id, to->shard_id);
+  if (from->waiting_for_min_pg_epoch) {
+    from->min_pg_epoch_cond.notify_all();
+  }
+  return true;
+}
+
+void OSD::_prune_pg_shard_remap()
+{
+  // caller holds pg_shard_move_lock; forget moved pgs that are gone
+  std::vector<std::pair<spg_t,unsigned>> remaps;
+  {
+    std::shared_lock l{pg_shard_remap_lock};
+    remaps.assign(pg_shard_remap.begin(), pg_shard_remap.end());
+  }
+  for (auto& [pgid, shard_index] : remaps) {
+    auto sdata = shards[shard_index];
+    std::lock_guard l{sdata->shard_lock};
+    if (sdata->balancing && !sdata->pg_queued_untracked &&
+	!sdata->pg_slots.count(pgid) && !sdata->pg_queued.count(pgid)) {
+      dout(10) << __func__ << " " << pgid << " gone from shard "
+	       << shard_index << dendl;
+      _set_pg_shard(pgid, pgid.hash_to_shard(num_shards));
+    }
+  }
+}
+
+void OSD::maybe_rebalance_shards()
+{
+  double interval =
+    cct->_conf.get_val<double>("osd_op_shard_rebalance_interval");
+  // pg_queued and pg load are only tracked while the balancer is on
+  bool on = interval > 0 && num_shards >= 2;
+  for (auto sdata : shards) {
+    std::lock_guard l{sdata->shard_lock};
+    sdata->_set_balancing(on);
+  }
+  auto now = ceph::mono_clock::now();
+  shard_balance_t b;
+  {
+    std::lock_guard l{shard_balance_lock};
+    if (!on) {
+      shard_load_since = ceph::mono_time();
+      return;
+    }
+    if (shard_load_since == ceph::mono_time()) {
+      shard_load_since = now;
+    }
+    b.interval = std::chrono::duration<double>(now - shard_load_since).count();
+    if (b.interval < interval) {
+      return;
+    }
+    shard_load_since = now;
+  }
+  b.stamp = ceph_clock_now();
+
+  // what each pg cost its shard's threads since the last pass
+  struct pg_load_t {
+    PGRef pg;
+    uint64_t load;
+  };
+  std::vector<std::vector<pg_load_t>> pgs(num_shards);
+  b.before.resize(num_shards);
+  for (auto sdata : shards) {
+    std::lock_guard l{sdata->shard_lock};
+    for (auto& [pgid, slot] : sdata->pg_slots) {
+      if (slot->pg) {
+	uint64_t load = slot->pg->shard_load_ns.exchange(0);
+	b.before[sdata->shard_id] += load;
+	pgs[sdata->shard_id].push_back({slot->pg, load});
+      }
+    }
+  }
+  b.after = b.before;
+
+  {
+    std::unique_lock move_locker{pg_shard_move_lock};
+    _prune_pg_shard_remap();
+  }
+
+  uint64_t total = std::accumulate(b.before.begin(), b.before.end(), 0ull);
+  double limit = (double)total / num_shards *
+    (1.0 + cct->_conf.get_val<double>("osd_op_shard_rebalance_threshold"));
+  // leave shards alone while the busiest is mostly idle
+  double min_busy = b.interval * 1e9 / 10;
+  auto max_moves =
+    cct->_conf.get_val<uint64_t>("osd_op_shard_rebalance_max_moves");
+  // pgs that are never quiet are skipped, but give up eventually
+  for (uint64_t tries = 0;
+       b.moves.size() < max_moves && tries < max_moves * 4;
+       ++tries) {
+    unsigned hot = std::max_element(b.after.begin(), b.after.end()) -
+      b.after.begin();
+    if (b.after[hot] <= limit || b.after[hot] < min_busy) {
+      break;
+    }
+    // coolest shard on the same numa node, see osd_numa_shard_affinity
+    int cold = -1;
+    for (unsigned i = 0; i < num_shards; ++i) {
+      if (i != hot &&
+	  shards[i]->numa_node == shards[hot]->numa_node &&
+	  (cold < 0 || b.after[i] < b.after[cold])) {
+	cold = i;
+      }
+    }
+    if (cold < 0) {
+      break;
+    }
+    // the pg that best evens out the two; anything below the gap leaves
+    // both cooler than the hot shard is now
+    uint64_t gap = b.after[hot] - b.after[cold];
+    auto& cands = pgs[hot];
+    auto best = cands.end();
+    auto dist = [gap](uint64_t load) {
+      return load > gap / 2 ? load - gap / 2 : gap / 2 - load;
+    };
+    for (auto p = cands.begin(); p != cands.end(); ++p) {
+      if (p->load > 0 && p->load < gap &&
+	  (best == cands.end() || dist(p->load) < dist(best->load))) {
+	best = p;
+      }
+    }
+    if (best == cands.end()) {
+      break;
+    }
+    pg_load_t c = std::move(*best);
+    cands.erase(best);
+
+    bool moved;
+    {
+      std::scoped_lock l{*c.pg};
+      std::unique_lock move_locker{pg_shard_move_lock};
+      moved = _move_pg_shard(c.pg, shards[cold]);
+    }
+    if (!moved) {
+      ++b.busy;
+      continue;
+    }
+    logger->inc(l_osd_pg_shard_moves);
+    b.after[hot] -= c.load;
+    b.after[cold] += c.load;
+    b.moves.push_back({c.pg->pg_id, hot, (unsigned)cold, c.load});
+    pgs[cold].push_back(std::move(c));
+  }
+
+  dout(10) << __func__ << " over " << b.interval << "s busy " << b.before
+	   << " -> " << b.after << ", moved " << b.moves.size()
+	   << " pgs, " << b.busy << " busy" << dendl;
+  std::lock_guard l{shard_balance_lock};
+  last_shard_balance = std::move(b);
+}
+
+void OSD::shard_balance_t::dump(Formatter *f) const
+{
+  f->dump_stream("stamp") << stamp;
+  f->dump_float("interval", interval);
+  f->open_array_section("busy_secs_before");
+  for (auto l : before) {
+    f->dump_float("shard", (double)l / 1e9);
+  }
+  f->close_section();
+  f->open_array_section("busy_secs_after");
+  for (auto l : after) {
+    f->dump_float("shard", (double)l / 1e9);
+  }
+  f->close_section();
+  f->open_array_section("moves");
+  for (auto& m : moves) {
+    f->open_object_section("move");
+    f->dump_stream("pgid") << m.pgid;
+    f->dump_unsigned("from", m.from);
+    f->dump_unsigned("to", m.to);
+    f->dump_float("busy_secs", (double)m.load / 1e9);
+    f->close_section();
+  }
+  f->close_section();
+  f->dump_unsigned("busy", busy);
+}
+
+void OSD::dump_shard_load(Formatter *f)
+{
+  std::lock_guard l{shard_balance_lock};
+  f->dump_float(
+    "rebalance_interval",
+    cct->_conf.get_val<double>("osd_op_shard_rebalance_interval"));
+  f->dump_float(
+    "measured_secs",
+    shard_load_since == ceph::mono_time() ? 0.0 :
+    std::chrono::duration<double>(
+      ceph::mono_clock::now() - shard_load_since).count());
+  f->open_array_section("shards");
+  for (auto sdata : shards) {
+    std::lock_guard sl{sdata->shard_lock};
+    uint64_t load = 0;
+    unsigned num_pgs = 0, num_moved_here = 0;
+    for (auto& [pgid, slot] : sdata->pg_slots) {
+      if (slot->pg) {
+	load += slot->pg->shard_load_ns;
+	++num_pgs;
+	if (pgid.hash_to_shard(num_shards) != sdata->shard_id) {
+	  ++num_moved_here;
+	}
+      }
+    }
+    f->open_object_section("shard");
+    f->dump_unsigned("shard_id", sdata->shard_id);
+    f->dump_int("numa_node", sdata->numa_node);
+    f->dump_unsigned("num_pgs", num_pgs);
+    f->dump_unsigned("num_pgs_moved_here", num_moved_here);
+    f->dump_unsigned("queue_len", sdata->queue_len);
+    f->dump_float("busy_secs", (double)load / 1e9);
+    f->dump_unsigned("pgs_moved_in", sdata->pgs_moved_in);
+    f->dump_unsigned("pgs_moved_out", sdata->pgs_moved_out);
+    f->close_section();
+  }
+  f->close_section();
+  f->open_object_section("last_rebalance");
+  last_shard_balance.dump(f);
+  f->close_section();
+}
+
 void OSD::load_pgs()
 {
   ceph_assert(ceph_mutex_is_locked(osd_lock));
@@ -5908,6 +6319,7 @@ void OSD::tick_without_osd_lock()
     }
     service.promote_throttle_recalibrate();
     resume_creating_pg();
+    maybe_rebalance_shards();
     bool need_send_beacon = false;
     const auto now = ceph::coarse_mono_clock::now();
     {
@@ -6580,6 +6992,12 @@ void OSD::_collect_metadata(map<string,string> *pm)
     (*pm)["numa_node"] = stringify(numa_node);
     (*pm)["numa_node_cpus"] = cpu_set_to_str_list(numa_cpu_set_size,
 						  &numa_cpu_set);
+  } else if (shards.size() && shards[0]->numa_node >= 0) {
+    std::vector<int> shard_nodes;
+    for (auto sdata : shards) {
+      shard_nodes.push_back(sdata->numa_node);
+    }
+    (*pm)["numa_shard_nodes"] = stringify(shard_nodes);
   }
 
   set<string> devnames;
@@ -7346,8 +7764,14 @@ bool OSDService::ScrubJob::ScrubJob::operator<(const OSDService::ScrubJob& rhs)
   return pgid < rhs.pgid;
 }
 
-double OSD::scrub_sleep_time(bool must_scrub)
+double OSD::scrub_sleep_time(bool must_scrub, bool deep)
 {
+  if (deep &&
+      cct->_conf.get_val<uint64_t>("osd_deep_scrub_read_ahead") > 0 &&
+      cct->_conf.get_val<Option::size_t>("osd_scrub_read_bytes_per_sec") > 0) {
+    // paced by the scrub read token bucket instead
+    return 0;
+  }
   if (must_scrub) {
     return cct->_conf->osd_scrub_sleep;
   }
@@ -8434,7 +8858,7 @@ void OSD::_finish_splits(set<PGRef>& pgs)
     dispatch_context(rctx, pg, service.get_osdmap());
     pg->unlock();
 
-    unsigned shard_index = pg->pg_id.hash_to_shard(num_shards);
+    unsigned shard_index = get_pg_shard_index(pg->pg_id);
     shards[shard_index]->register_and_wake_split_child(pg);
   }
 };
@@ -8677,6 +9101,7 @@ void OSD::consume_map()
   service.publish_map(osdmap);
 
   // prime splits and merges
+  std::shared_lock move_locker{pg_shard_move_lock};
   set<pair<spg_t,epoch_t>> newly_split;  // splits, and when
   set<pair<spg_t,epoch_t>> merge_pgs;    // merge participants, and when
   for (auto& shard : shards) {
@@ -8710,6 +9135,7 @@ void OSD::consume_map()
     }
     ceph_assert(merge_pgs.empty());
   }
+  move_locker.unlock();
 
   service.prune_pg_created();
 
@@ -9758,6 +10184,7 @@ const char** OSD::get_tracked_conf_keys() const
 {
   static const char* KEYS[] = {
     "osd_max_backfills",
+    "osd_scrub_read_bytes_per_sec",
     "osd_min_recovery_priority",
     "osd_max_trimming_pgs",
     "osd_op_complaint_time",
@@ -9789,6 +10216,7 @@ const char** OSD::get_tracked_conf_keys() const
     "osd_object_clean_region_max_num_intervals",
     "osd_scrub_min_interval",
     "osd_scrub_max_interval",
+    "osd_op_shard_steal_min_queue",
     NULL
   };
   return KEYS;
@@ -9802,6 +10230,10 @@ void OSD::handle_conf_change(const ConfigProxy& conf,
     service.local_reserver.set_max(cct->_conf->osd_max_backfills);
     service.remote_reserver.set_max(cct->_conf->osd_max_backfills);
   }
+  if (changed.count("osd_scrub_read_bytes_per_sec")) {
+    service.scrub_read_queue.set_limit(
+      cct->_conf.get_val<Option::size_t>("osd_scrub_read_bytes_per_sec"));
+  }
   if (changed.count("osd_min_recovery_priority")) {
     service.local_reserver.set_min_priority(cct->_conf->osd_min_recovery_priority);
     service.remote_reserver.set_min_priority(cct->_conf->osd_min_recovery_priority);
@@ -9884,6 +10316,10 @@ void OSD::handle_conf_change(const ConfigProxy& conf,
     resched_all_scrubs();
     dout(0) << __func__ << ": scrub interval change" << dendl;
   }
+  if (changed.count("osd_op_shard_steal_min_queue")) {
+    op_shardedwq.steal_min_queue =
+      conf.get_val<uint64_t>("osd_op_shard_steal_min_queue");
+  }
   check_config();
   if (changed.count("osd_asio_thread_count")) {
     service.poolctx.stop();
@@ -10183,13 +10619,13 @@ void OSDShard::_wake_pg_slot(
   for (auto i = slot->to_process.rbegin();
        i != slot->to_process.rend();
        ++i) {
-    scheduler->enqueue_front(std::move(*i));
+    _enqueue_front(std::move(*i));
   }
   slot->to_process.clear();
   for (auto i = slot->waiting.rbegin();
        i != slot->waiting.rend();
        ++i) {
-    scheduler->enqueue_front(std::move(*i));
+    _enqueue_front(std::move(*i));
   }
   slot->waiting.clear();
   for (auto i = slot->waiting_peering.rbegin();
@@ -10199,13 +10635,61 @@ void OSDShard::_wake_pg_slot(
     // items are waiting for maps we don't have yet.  FIXME, maybe,
     // someday, if we decide this inefficiency matters
     for (auto j = i->second.rbegin(); j != i->second.rend(); ++j) {
-      scheduler->enqueue_front(std::move(*j));
+      _enqueue_front(std::move(*j));
     }
   }
   slot->waiting_peering.clear();
   ++slot->requeue_seq;
 }
 
+void OSDShard::_enqueue(OpSchedulerItem&& item)
+{
+  if (balancing) {
+    ++pg_queued[item.get_ordering_token()];
+  }
+  scheduler->enqueue(std::move(item));
+  ++queue_len;
+}
+
+void OSDShard::_enqueue_front(OpSchedulerItem&& item)
+{
+  if (balancing) {
+    ++pg_queued[item.get_ordering_token()];
+  }
+  scheduler->enqueue_front(std::move(item));
+  ++queue_len;
+}
+
+ceph::osd::scheduler::WorkItem OSDShard::_dequeue()
+{
+  auto work_item = scheduler->dequeue();
+  if (auto item = std::get_if<OpSchedulerItem>(&work_item)) {
+    if (balancing) {
+      auto p = pg_queued.find(item->get_ordering_token());
+      if (p == pg_queued.end()) {
+	// queued before balancing was turned on
+	ceph_assert(pg_queued_untracked > 0);
+	--pg_queued_untracked;
+      } else if (--p->second == 0) {
+	pg_queued.erase(p);
+      }
+    }
+    --queue_len;
+  }
+  return work_item;
+}
+
+void OSDShard::_set_balancing(bool on)
+{
+  // caller holds shard_lock
+  if (balancing == on) {
+    return;
+  }
+  balancing = on;
+  pg_queued.clear();
+  pg_queued_untracked = on ? queue_len.load() : 0;
+}
+
 void OSDShard::identify_splits_and_merges(
   const OSDMapRef& as_of_osdmap,
   set<pair<spg_t,epoch_t>> *split_pgs,
@@ -10265,7 +10749,7 @@ void OSDShard::_prime_splits(set<pair<spg_t,epoch_t>> *pgids)
   dout(10) << *pgids << dendl;
   auto p = pgids->begin();
   while (p != pgids->end()) {
-    unsigned shard_index = p->first.hash_to_shard(osd->num_shards);
+    unsigned shard_index = osd->get_pg_shard_index(p->first);
     if (shard_index == shard_id) {
       auto r = pg_slots.emplace(p->first, nullptr);
       if (r.second) {
@@ -10296,7 +10780,7 @@ void OSDShard::prime_merges(const OSDMapRef& as_of_osdmap,
   while (p != merge_pgs->end()) {
     spg_t pgid = p->first;
     epoch_t epoch = p->second;
-    unsigned shard_index = pgid.hash_to_shard(osd->num_shards);
+    unsigned shard_index = osd->get_pg_shard_index(pgid);
     if (shard_index != shard_id) {
       ++p;
       continue;
@@ -10444,9 +10928,20 @@ void OSD::ShardedOpWQ::_add_slot_waiter(
 void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
 {
   uint32_t shard_index = thread_index % osd->num_shards;
-  auto& sdata = osd->shards[shard_index];
+  OSDShard *sdata = osd->shards[shard_index];
   ceph_assert(sdata);
 
+  // follow the shard's numa binding, see OSD::set_shard_numa_affinity()
+  static thread_local int bound_numa_node = -1;
+  if (int node = sdata->numa_node; node != bound_numa_node) {
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &sdata->numa_cpu_set) < 0) {
+      int r = -errno;
+      derr << __func__ << " failed to bind to numa node " << node << ": "
+	   << cpp_strerror(r) << dendl;
+    }
+    bound_numa_node = node;
+  }
+
   // If all threads of shards do oncommits, there is a out-of-order
   // problem.  So we choose the thread which has the smallest
   // thread_index(thread_index < num_shards) of shard to do oncommit
@@ -10455,6 +10950,35 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
 
   // peek at spg_t
   sdata->shard_lock.lock();
+
+  // nothing to do here; help a shard that is falling behind instead.
+  // we act as one more thread of that shard, so its ordering (the
+  // scheduler, pg_slots, the pg lock) applies unchanged; we just never
+  // run its oncommits, which are ordered by its own first thread.
+  bool stolen = false;
+  if (steal_min_queue &&
+      sdata->scheduler->empty() &&
+      (!is_smallest_thread_index || sdata->context_queue.empty())) {
+    if (OSDShard *victim = _pick_steal_victim(sdata)) {
+      sdata->shard_lock.unlock();
+      victim->shard_lock.lock();
+      if (!victim->scheduler->empty()) {
+	dout(20) << __func__ << " shard " << sdata->shard_id
+		 << " stealing from shard " << victim->shard_id
+		 << " queue_len " << victim->queue_len << dendl;
+	++sdata->stolen_by;
+	++victim->stolen_from;
+	osd->logger->inc(l_osd_op_stolen);
+	sdata = victim;
+	is_smallest_thread_index = false;
+	stolen = true;
+      } else {
+	victim->shard_lock.unlock();
+	sdata->shard_lock.lock();
+      }
+    }
+  }
+
   if (sdata->scheduler->empty() &&
       (!is_smallest_thread_index || sdata->context_queue.empty())) {
     std::unique_lock wait_lock{sdata->sdata_wait_lock};
@@ -10465,7 +10989,9 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
       dout(20) << __func__ << " empty q, waiting" << dendl;
       osd->cct->get_heartbeat_map()->clear_timeout(hb);
       sdata->shard_lock.unlock();
+      ++sdata->idle_threads;
       sdata->sdata_cond.wait(wait_lock);
+      --sdata->idle_threads;
       wait_lock.unlock();
       sdata->shard_lock.lock();
       if (sdata->scheduler->empty() &&
@@ -10505,7 +11031,7 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
       return;
     }
 
-    work_item = sdata->scheduler->dequeue();
+    work_item = sdata->_dequeue();
     if (osd->is_stopping()) {
       sdata->shard_lock.unlock();
       for (auto c : oncommits) {
@@ -10518,7 +11044,7 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
     // If the work item is scheduled in the future, wait until
     // the time returned in the dequeue response before retrying.
     if (auto when_ready = std::get_if<double>(&work_item)) {
-      if (is_smallest_thread_index) {
+      if (is_smallest_thread_index || stolen) {
         sdata->shard_lock.unlock();
         handle_oncommits(oncommits);
         return;
@@ -10725,6 +11251,7 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
   sdata->shard_lock.unlock();
 
   if (!new_children.empty()) {
+    std::shared_lock move_locker{osd->pg_shard_move_lock};
     for (auto shard : osd->shards) {
       shard->prime_splits(osdmap, &new_children);
     }
@@ -10753,7 +11280,14 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
   delete f;
   *_dout << dendl;
 
-  qi.run(osd, sdata, pg, tp_handle);
+  if (sdata->balancing) {
+    auto run_start = ceph::mono_clock::now();
+    qi.run(osd, sdata, pg, tp_handle);
+    pg->shard_load_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+      ceph::mono_clock::now() - run_start).count();
+  } else {
+    qi.run(osd, sdata, pg, tp_handle);
+  }
 
   {
 #ifdef WITH_LTTNG
@@ -10770,19 +11304,17 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb)
 }
 
 void OSD::ShardedOpWQ::_enqueue(OpSchedulerItem&& item) {
-  uint32_t shard_index =
-    item.get_ordering_token().hash_to_shard(osd->shards.size());
+  OSDShard* sdata = osd->_lock_pg_shard(item.get_ordering_token());
+  assert (NULL != sdata);
+  uint32_t shard_index = sdata->shard_id;
 
   dout(20) << __func__ << " " << item << dendl;
 
-  OSDShard* sdata = osd->shards[shard_index];
-  assert (NULL != sdata);
-
   bool empty = true;
   {
-    std::lock_guard l{sdata->shard_lock};
+    std::lock_guard l{sdata->shard_lock, std::adopt_lock};
     empty = sdata->scheduler->empty();
-    sdata->scheduler->enqueue(std::move(item));
+    sdata->_enqueue(std::move(item));
   }
 
   {
@@ -10793,14 +11325,48 @@ void OSD::ShardedOpWQ::_enqueue(OpSchedulerItem&& item) {
       sdata->sdata_cond.notify_one();
     }
   }
+  if (!empty) {
+    _maybe_wake_stealer(sdata);
+  }
+}
+
+OSDShard *OSD::ShardedOpWQ::_pick_steal_victim(OSDShard *home)
+{
+  uint64_t min = steal_min_queue;
+  OSDShard *victim = nullptr;
+  uint64_t victim_len = 0;
+  for (auto s : osd->shards) {
+    uint64_t len = s->queue_len;
+    if (_can_steal(home, s) && len >= min && len > victim_len) {
+      victim = s;
+      victim_len = len;
+    }
+  }
+  return victim;
+}
+
+void OSD::ShardedOpWQ::_maybe_wake_stealer(OSDShard *sdata)
+{
+  uint64_t min = steal_min_queue;
+  if (!min || sdata->queue_len < min) {
+    return;
+  }
+  for (auto s : osd->shards) {
+    if (_can_steal(s, sdata) && s->idle_threads > 0) {
+      // it finds its own queue empty and comes back through _process,
+      // where it looks for a shard to help
+      std::lock_guard l{s->sdata_wait_lock};
+      s->sdata_cond.notify_one();
+      return;
+    }
+  }
 }
 
 void OSD::ShardedOpWQ::_enqueue_front(OpSchedulerItem&& item)
 {
-  auto shard_index = item.get_ordering_token().hash_to_shard(osd->shards.size());
-  auto& sdata = osd->shards[shard_index];
+  auto sdata = osd->_lock_pg_shard(item.get_ordering_token());
   ceph_assert(sdata);
-  sdata->shard_lock.lock();
+  auto shard_index = sdata->shard_id;
   auto p = sdata->pg_slots.find(item.get_ordering_token());
   if (p != sdata->pg_slots.end() &&
       !p->second->to_process.empty()) {
@@ -10817,7 +11383,7 @@ void OSD::ShardedOpWQ::_enqueue_front(OpSchedulerItem&& item)
   } else {
     dout(20) << __func__ << " " << item << dendl;
   }
-  sdata->scheduler->enqueue_front(std::move(item));
+  sdata->_enqueue_front(std::move(item));
   sdata->shard_lock.unlock();
   std::lock_guard l{sdata->sdata_wait_lock};
   sdata->sdata_cond.notify_one();
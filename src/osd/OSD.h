@@ -37,6 +37,7 @@
 
 #include "OpRequest.h"
 #include "Session.h"
+#include "ScrubReader.h"
 
 #include "osd/scheduler/OpScheduler.h"
 
@@ -540,6 +541,8 @@ public:
   // For recovery & scrub & snap
   ceph::mutex sleep_lock = ceph::make_mutex("OSDService::sleep_lock");
   SafeTimer sleep_timer;
+  // reads deep scrub data ahead of the PGs, paced by its token bucket
+  ScrubReadQueue scrub_read_queue;
 
   // -- tids --
   // for ops i issue
@@ -967,6 +970,8 @@ struct OSDShardPGSlot {
 };
 
 struct OSDShard {
+  using OpSchedulerItem = ceph::osd::scheduler::OpSchedulerItem;
+
   const unsigned shard_id;
   CephContext *cct;
   OSD *osd;
@@ -1013,14 +1018,43 @@ struct OSDShard {
 
   /// priority queue
   ceph::osd::scheduler::OpSchedulerRef scheduler;
+  /// items in scheduler; read without shard_lock to find stealing victims
+  std::atomic<uint64_t> queue_len = {0};
+  /// threads waiting for work in _process
+  std::atomic<int> idle_threads = {0};
+  /// items other shards' threads took from us / our threads took elsewhere
+  std::atomic<uint64_t> stolen_from = {0};
+  std::atomic<uint64_t> stolen_by = {0};
+  /// the shard balancer is on; pg_queued and pg load are only kept then
+  std::atomic<bool> balancing = {false};
+  /// items in scheduler per pg; a pg only moves to another shard while
+  /// it has none
+  std::unordered_map<spg_t,unsigned> pg_queued;
+  /// items queued before balancing was turned on, so not in pg_queued;
+  /// no pg moves until they are drained
+  uint64_t pg_queued_untracked = 0;
+  /// pgs the shard balancer moved here / away
+  uint64_t pgs_moved_in = 0;
+  uint64_t pgs_moved_out = 0;
 
   bool stop_waiting = false;
 
   ContextQueue context_queue;
 
+  /// numa node our worker threads are bound to (-1 for none)
+  std::atomic<int> numa_node = {-1};
+  size_t numa_cpu_set_size = 0;
+  cpu_set_t numa_cpu_set;
+
   void _attach_pg(OSDShardPGSlot *slot, PG *pg);
   void _detach_pg(OSDShardPGSlot *slot);
 
+  // scheduler access; keeps queue_len and pg_queued in step
+  void _enqueue(OpSchedulerItem&& item);
+  void _enqueue_front(OpSchedulerItem&& item);
+  ceph::osd::scheduler::WorkItem _dequeue();
+  void _set_balancing(bool on);
+
   void update_pg_epoch(OSDShardPGSlot *slot, epoch_t epoch);
   epoch_t get_min_pg_epoch();
   void wait_min_pg_epoch(epoch_t need);
@@ -1573,8 +1607,24 @@ protected:
 		ShardedThreadPool* tp)
       : ShardedThreadPool::ShardedWQ<OpSchedulerItem>(ti, si, tp),
         osd(o) {
+      steal_min_queue = o->cct->_conf.get_val<uint64_t>(
+	"osd_op_shard_steal_min_queue");
     }
 
+    /// queue depth at which idle threads of other shards help out, 0 never
+    std::atomic<uint64_t> steal_min_queue = {0};
+
+    /// whether threads of home may take work from victim; not across
+    /// numa nodes, see osd_numa_shard_affinity
+    static bool _can_steal(const OSDShard *home, const OSDShard *victim) {
+      return victim != home &&
+	(victim->numa_node < 0 || victim->numa_node == home->numa_node);
+    }
+    /// the busiest shard other than home that is worth stealing from
+    OSDShard *_pick_steal_victim(OSDShard *home);
+    /// wake an idle thread elsewhere if sdata has become worth stealing from
+    void _maybe_wake_stealer(OSDShard *sdata);
+
     void _add_slot_waiter(
       spg_t token,
       OSDShardPGSlot *slot,
@@ -1619,6 +1669,9 @@ protected:
 	std::scoped_lock l{sdata->shard_lock};
 	f->open_object_section(queue_name);
 	sdata->scheduler->dump(*f);
+	f->dump_unsigned("queue_len", sdata->queue_len);
+	f->dump_unsigned("stolen_from", sdata->stolen_from);
+	f->dump_unsigned("stolen_by", sdata->stolen_by);
 	f->close_section();
       }
     }
@@ -1735,6 +1788,10 @@ public:
     return num_pgs;
   }
 
+  /// shard a pg's items go to: the hashed one, unless the shard balancer
+  /// moved the pg elsewhere
+  unsigned get_pg_shard_index(spg_t pgid);
+
 protected:
   ceph::mutex merge_lock = ceph::make_mutex("OSD::merge_lock");
   /// merge epoch -> target pgid -> source pgid -> pg
@@ -1758,6 +1815,45 @@ protected:
   void register_pg(PGRef pg);
   bool try_finish_pg_delete(PG *pg, unsigned old_pg_num);
 
+  // -- op shard balancing --
+  /// held exclusively while a pg changes shard; held shared by whoever
+  /// needs the pg -> shard mapping to stay put across all shards
+  ceph::shared_mutex pg_shard_move_lock =
+    ceph::make_shared_mutex("OSD::pg_shard_move_lock");
+  /// protects pg_shard_remap; taken last
+  ceph::shared_mutex pg_shard_remap_lock =
+    ceph::make_shared_mutex("OSD::pg_shard_remap_lock");
+  /// pgs moved off their hashed shard
+  std::unordered_map<spg_t,unsigned> pg_shard_remap;
+  std::atomic<size_t> num_pg_shard_remaps = {0};
+
+  struct shard_balance_t {
+    struct move_t {
+      spg_t pgid;
+      unsigned from, to;
+      uint64_t load;
+    };
+    utime_t stamp;
+    double interval = 0;           ///< seconds the loads were measured over
+    std::vector<uint64_t> before;  ///< busy ns per shard
+    std::vector<uint64_t> after;   ///< same, with the moves applied
+    std::vector<move_t> moves;
+    unsigned busy = 0;             ///< pgs picked to move that were not quiet
+
+    void dump(ceph::Formatter *f) const;
+  };
+  ceph::mutex shard_balance_lock = ceph::make_mutex("OSD::shard_balance_lock");
+  ceph::mono_time shard_load_since;   ///< start of the current measurement
+  shard_balance_t last_shard_balance;
+
+  /// lock the shard pgid currently maps to
+  OSDShard *_lock_pg_shard(spg_t pgid);
+  void _set_pg_shard(spg_t pgid, unsigned shard_index);
+  bool _move_pg_shard(PGRef pg, OSDShard *to);
+  void _prune_pg_shard_remap();
+  void maybe_rebalance_shards();
+  void dump_shard_load(ceph::Formatter *f);
+
   void _get_pgs(std::vector<PGRef> *v, bool clear_too=false);
   void _get_pgids(std::vector<spg_t> *v);
 
@@ -1855,7 +1951,7 @@ protected:
     return service.get_tid();
   }
 
-  double scrub_sleep_time(bool must_scrub);
+  double scrub_sleep_time(bool must_scrub, bool deep);
 
   // -- generic pg peering --
   PeeringCtx create_context();
@@ -2048,6 +2144,7 @@ public:
 
   int enable_disable_fuse(bool stop);
   int set_numa_affinity();
+  void set_shard_numa_affinity();
 
   void suicide(int exitcode);
   int shutdown();
@@ -1932,6 +1932,9 @@ void PG::_request_scrub_map(
     allow_preemption,
     scrubber.priority,
     ops_blocked_by_scrub());
+  if (deep) {
+    repscrubop->deep_since = scrubber.deep_since;
+  }
   // default priority, we want the rep scrub processed prior to any recovery
   // or client io messages (we are holding a lock!)
   osd->send_message_osd_cluster(
@@ -2340,6 +2343,9 @@ int PG::build_scrub_map_chunk(
   // start
   while (pos.empty()) {
     pos.deep = deep;
+    if (deep) {
+      pos.deep_since = scrubber.deep_since;
+    }
     map.valid_through = info.last_update;
 
     // objects
@@ -2357,6 +2363,26 @@ int PG::build_scrub_map_chunk(
       break;
     }
     _scan_rollback_obs(rollback_obs);
+    get_pgbackend()->objects_prefetch(pos.ls);
+    unsigned read_ahead =
+      cct->_conf.get_val<uint64_t>("osd_deep_scrub_read_ahead");
+    if (deep && read_ahead > 0) {
+      OSDService *osds = osd;
+      spg_t pgid = get_pgid();
+      get_pgbackend()->be_start_scrub_reads(
+	pos, &osd->scrub_read_queue, read_ahead,
+	[osds, pgid]() {
+	  PGRef pg = osds->osd->lookup_lock_pg(pgid);
+	  if (pg == nullptr) {
+	    return;
+	  }
+	  if (pg->scrubber.waiting_for_reads) {
+	    pg->scrubber.waiting_for_reads = false;
+	    pg->requeue_scrub();
+	  }
+	  pg->unlock();
+	});
+    }
     pos.pos = 0;
     return -EINPROGRESS;
   }
@@ -2364,7 +2390,7 @@ int PG::build_scrub_map_chunk(
   // scan objects
   while (!pos.done()) {
     int r = get_pgbackend()->be_scan_list(map, pos);
-    if (r == -EINPROGRESS) {
+    if (r == -EINPROGRESS || r == -EAGAIN) {
       return r;
     }
   }
@@ -2475,6 +2501,7 @@ void PG::replica_scrub(
   scrubber.end = msg->end;
   scrubber.max_end = msg->end;
   scrubber.deep = msg->deep;
+  scrubber.deep_since = msg->deep_since;
   scrubber.epoch_start = info.history.same_interval_since;
   if (msg->priority) {
     scrubber.priority = msg->priority;
@@ -2498,7 +2525,8 @@ void PG::replica_scrub(
 void PG::scrub(epoch_t queued, ThreadPool::TPHandle &handle)
 {
   OSDService *osds = osd;
-  double scrub_sleep = osds->osd->scrub_sleep_time(scrubber.must_scrub);
+  double scrub_sleep = osds->osd->scrub_sleep_time(
+    scrubber.must_scrub, state_test(PG_STATE_DEEP_SCRUB));
   if (scrub_sleep > 0 &&
       (scrubber.state == PG::Scrubber::NEW_CHUNK ||
        scrubber.state == PG::Scrubber::INACTIVE) &&
@@ -2564,6 +2592,10 @@ void PG::scrub(epoch_t queued, ThreadPool::TPHandle &handle)
     ceph_assert(recovery_state.get_backfill_targets().empty());
 
     scrubber.deep = state_test(PG_STATE_DEEP_SCRUB);
+    if (scrubber.deep) {
+      scrubber.deep_since = get_deep_scrub_since();
+      scrubber.deep_begin = recovery_state.get_info().last_update;
+    }
 
     dout(10) << "starting a new chunky scrub" << dendl;
   }
@@ -2577,6 +2609,46 @@ void PG::abort_scrub()
   scrub_unreserve_replicas();
 }
 
+/*
+ * An incremental deep scrub only reads the data of objects modified since
+ * the previous deep scrub started; everything older has been verified by
+ * it or by the ones before, back to the last full pass.  Recovery and
+ * backfill write copies without changing the object version, so this only
+ * holds within the interval of the previous scrub.
+ */
+eversion_t PG::get_deep_scrub_since()
+{
+  const pg_history_t &history = info.history;
+  if (!cct->_conf.get_val<bool>("osd_deep_scrub_incremental")) {
+    return eversion_t();
+  }
+  if (scrubber.req_scrub || scrubber.check_repair ||
+      state_test(PG_STATE_REPAIR)) {
+    dout(20) << __func__ << " requested or repair scrub, full" << dendl;
+    return eversion_t();
+  }
+  if (info.stats.stats.sum.num_scrub_errors > 0 ||
+      history.deep_scrub_verified == eversion_t()) {
+    dout(20) << __func__ << " nothing verified, full" << dendl;
+    return eversion_t();
+  }
+  if (history.deep_scrub_verified_interval != history.same_interval_since) {
+    dout(20) << __func__ << " interval changed since "
+	     << history.deep_scrub_verified_interval << ", full" << dendl;
+    return eversion_t();
+  }
+  double full_interval =
+    cct->_conf.get_val<double>("osd_deep_scrub_full_interval");
+  if (ceph_clock_now() >= history.last_full_deep_scrub_stamp + full_interval) {
+    dout(20) << __func__ << " last full pass "
+	     << history.last_full_deep_scrub_stamp << ", full" << dendl;
+    return eversion_t();
+  }
+  dout(10) << __func__ << " incremental since "
+	   << history.deep_scrub_verified << dendl;
+  return history.deep_scrub_verified;
+}
+
 /*
  * Chunky scrub scrubs objects one chunk at a time with writes blocked for that
  * chunk.
@@ -2894,6 +2966,12 @@ void PG::chunky_scrub(ThreadPool::TPHandle &handle)
 	  done = true;
 	  break;
 	}
+	if (ret == -EAGAIN) {
+	  // requeued by the scrub reader
+	  scrubber.waiting_for_reads = true;
+	  done = true;
+	  break;
+	}
 	scrubber.state = PG::Scrubber::BUILD_MAP_DONE;
 	break;
 
@@ -2999,6 +3077,12 @@ void PG::chunky_scrub(ThreadPool::TPHandle &handle)
 	  done = true;
 	  break;
 	}
+	if (ret == -EAGAIN) {
+	  // requeued by the scrub reader
+	  scrubber.waiting_for_reads = true;
+	  done = true;
+	  break;
+	}
 	// reply
 	{
 	  MOSDRepScrubMap *reply = new MOSDRepScrubMap(
@@ -3319,6 +3403,16 @@ void PG::scrub_finish()
 	if (scrubber.deep) {
 	  history.last_deep_scrub = recovery_state.get_info().last_update;
 	  history.last_deep_scrub_stamp = now;
+	  if (scrubber.deep_since == eversion_t()) {
+	    history.last_full_deep_scrub_stamp = now;
+	  }
+	  if (scrubber.shallow_errors == 0 && scrubber.deep_errors == 0) {
+	    history.deep_scrub_verified = scrubber.deep_begin;
+	    history.deep_scrub_verified_interval = history.same_interval_since;
+	  } else {
+	    history.deep_scrub_verified = eversion_t();
+	    history.deep_scrub_verified_interval = 0;
+	  }
 	}
 
 	if (deep_scrub) {
@@ -3901,6 +3995,14 @@ void PG::do_delete_work(ObjectStore::Transaction &t)
 
   delete_needs_sleep = true;
 
+  if (!delete_hinted) {
+    // lets the store drop data of the whole PG at once (e.g. BlueStore's
+    // per-pg omap) rather than object by object
+    t.collection_hint(coll, ObjectStore::Transaction::COLL_HINT_REMOVING,
+		      bufferlist());
+    delete_hinted = true;
+  }
+
   vector<ghobject_t> olist;
   int max = std::min(osd->store->get_ideal_list_max(),
 		     (int)cct->_conf->osd_target_transaction_size);
@@ -584,6 +584,8 @@ protected:
 public:
   OSDShard *osd_shard = nullptr;
   OSDShardPGSlot *pg_slot = nullptr;
+  /// time op shard threads spent on our items; drained by the shard balancer
+  std::atomic<uint64_t> shard_load_ns = {0};
 protected:
   CephContext *cct;
 
@@ -1031,6 +1033,9 @@ public:
     bool needs_sleep = true;
     utime_t sleep_start;
 
+    // requeued once the scrub read ahead has caught up
+    bool waiting_for_reads = false;
+
     // flags to indicate explicitly requested scrubs (by admin)
     bool must_scrub, must_deep_scrub, must_repair, need_auto, req_scrub;
 
@@ -1106,6 +1111,8 @@ public:
     std::unique_ptr<Scrub::Store> store;
     // deep scrub
     bool deep;
+    eversion_t deep_since;  // incremental: only read objects modified since
+    eversion_t deep_begin;  // last_update when the deep scrub started
     int preempt_left;
     int preempt_divisor;
 
@@ -1173,6 +1180,8 @@ public:
       fixed = 0;
       omap_stats = (const struct omap_stat_t){ 0 };
       deep = false;
+      deep_since = eversion_t();
+      deep_begin = eversion_t();
       run_callbacks();
       inconsistent.clear();
       missing.clear();
@@ -1186,6 +1195,7 @@ public:
       sleeping = false;
       needs_sleep = true;
       sleep_start = utime_t();
+      waiting_for_reads = false;
     }
 
     void create_results(const hobject_t& obj);
@@ -1216,6 +1226,7 @@ protected:
     const std::set<pg_shard_t> &bad_peers);
 
   void abort_scrub();
+  eversion_t get_deep_scrub_since();
   void chunky_scrub(ThreadPool::TPHandle &handle);
   void scrub_compare_maps();
   /**
@@ -1290,6 +1301,7 @@ public:
   int pg_stat_adjust(osd_stat_t *new_stat);
 protected:
   bool delete_needs_sleep = false;
+  bool delete_hinted = false;  ///< COLL_HINT_REMOVING has been sent
 
 protected:
   bool state_test(uint64_t m) const { return recovery_state.state_test(m); }
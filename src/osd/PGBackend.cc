@@ -20,6 +20,7 @@
 #include "common/scrub_types.h"
 #include "ReplicatedBackend.h"
 #include "ScrubStore.h"
+#include "ScrubReader.h"
 #include "ECBackend.h"
 #include "PGBackend.h"
 #include "OSD.h"
@@ -447,6 +448,84 @@ int PGBackend::objects_list_range(
   return r;
 }
 
+void PGBackend::objects_prefetch(const vector<hobject_t> &ls)
+{
+  vector<ghobject_t> objects;
+  objects.reserve(ls.size());
+  for (auto& hoid : ls) {
+    objects.emplace_back(hoid, ghobject_t::NO_GEN,
+			 get_parent()->whoami_shard().shard);
+  }
+  store->prefetch_objects(ch, objects);
+}
+
+static bool deep_scrub_unchanged(
+  const ScrubMapBuilder &pos,
+  bufferlist& oi_bl,
+  object_info_t *oi)
+{
+  if (pos.deep_since == eversion_t() || oi_bl.length() == 0) {
+    return false;
+  }
+  try {
+    auto p = oi_bl.cbegin();
+    decode(*oi, p);
+  } catch (ceph::buffer::error& e) {
+    // leave it to be_select_auth_object() to complain
+    return false;
+  }
+  return oi->version <= pos.deep_since;
+}
+
+bool PGBackend::be_deep_scrub_unchanged(
+  const ScrubMapBuilder &pos,
+  const ScrubMap::object &o,
+  object_info_t *oi)
+{
+  auto i = o.attrs.find(OI_ATTR);
+  if (i == o.attrs.end()) {
+    return false;
+  }
+  bufferlist bl;
+  bl.push_back(i->second);
+  if (!deep_scrub_unchanged(pos, bl, oi)) {
+    return false;
+  }
+  get_parent()->get_logger()->inc(l_osd_deep_scrub_skipped);
+  get_parent()->get_logger()->inc(l_osd_deep_scrub_skipped_bytes, o.size);
+  return true;
+}
+
+void PGBackend::be_start_scrub_reads(
+  ScrubMapBuilder &pos,
+  ScrubReadQueue *queue,
+  unsigned depth,
+  std::function<void()>&& on_ready)
+{
+  vector<ghobject_t> objects;
+  objects.reserve(pos.ls.size());
+  for (auto& hoid : pos.ls) {
+    if (pos.deep_since != eversion_t()) {
+      bufferlist bl;
+      object_info_t oi;
+      objects_get_attr(hoid, OI_ATTR, &bl);
+      if (deep_scrub_unchanged(pos, bl, &oi)) {
+	// be_deep_scrub() won't ask for it
+	objects.emplace_back();
+	continue;
+      }
+    }
+    objects.emplace_back(hoid, ghobject_t::NO_GEN,
+			 get_parent()->whoami_shard().shard);
+  }
+  uint64_t stride, align;
+  uint32_t fadvise_flags;
+  be_deep_scrub_read_params(&stride, &align, &fadvise_flags);
+  pos.reader = std::make_shared<ScrubReader>(
+    queue, store, ch, std::move(objects), stride, align, fadvise_flags,
+    depth, std::move(on_ready));
+}
+
 int PGBackend::objects_get_attr(
   const hobject_t &hoid,
   const string &attr,
@@ -649,8 +728,8 @@ int PGBackend::be_scan_list(
     derr << __func__ << " got: " << cpp_strerror(r) << dendl;
     ceph_abort();
   }
-  if (r == -EINPROGRESS) {
-    return -EINPROGRESS;
+  if (r == -EINPROGRESS || r == -EAGAIN) {
+    return r;
   }
   pos.next_object();
   return 0;
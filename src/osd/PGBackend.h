@@ -36,6 +36,7 @@ struct inconsistent_obj_wrapper;
 //forward declaration
 class OSDMap;
 class PGLog;
+class ScrubReadQueue;
 typedef std::shared_ptr<const OSDMap> OSDMapRef;
 
  /**
@@ -550,6 +551,9 @@ typedef std::shared_ptr<const OSDMap> OSDMapRef;
      std::vector<hobject_t> *ls,
      std::vector<ghobject_t> *gen_obs=0);
 
+   /// hint that the listed objects in ls are about to be read one by one
+   void objects_prefetch(const std::vector<hobject_t> &ls);
+
    int objects_get_attr(
      const hobject_t &hoid,
      const std::string &attr,
@@ -622,6 +626,27 @@ typedef std::shared_ptr<const OSDMap> OSDMapRef;
      ScrubMap &map,
      ScrubMapBuilder &pos,
      ScrubMap::object &o) = 0;
+   /// how be_deep_scrub() reads object data
+   virtual void be_deep_scrub_read_params(
+     uint64_t *stride,
+     uint64_t *align,
+     uint32_t *fadvise_flags) const = 0;
+   /**
+    * true if an incremental deep scrub need not read the data of o
+    *
+    * i.e. if it has not been modified since pos.deep_since; oi is then
+    * decoded from its OI_ATTR.
+    */
+   bool be_deep_scrub_unchanged(
+     const ScrubMapBuilder &pos,
+     const ScrubMap::object &o,
+     object_info_t *oi);
+   /// read and hash the data of pos.ls ahead on the scrub read threads
+   void be_start_scrub_reads(
+     ScrubMapBuilder &pos,
+     ScrubReadQueue *queue,
+     unsigned depth,
+     std::function<void()>&& on_ready);
    void be_omap_checks(
      const std::map<pg_shard_t,ScrubMap*> &maps,
      const std::set<hobject_t> &master_set,
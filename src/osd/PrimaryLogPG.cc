@@ -13015,6 +13015,9 @@ uint64_t PrimaryLogPG::recover_backfill(
   backfill_info.trim_to(last_backfill_started);
 
   PGBackend::RecoveryHandle *h = pgbackend->open_recovery_op();
+  // objects are pushed in hash order, once; don't let them evict the
+  // client working set from the object store caches
+  h->cache_dont_need = true;
   while (ops < max) {
     if (backfill_info.begin <= earliest_peer_backfill() &&
 	!backfill_info.extends_to_end() && backfill_info.empty()) {
@@ -13413,6 +13416,7 @@ void PrimaryLogPG::scan_range(
   ceph_assert(r >= 0);
   dout(10) << " got " << ls.size() << " items, next " << bi->end << dendl;
   dout(20) << ls << dendl;
+  pgbackend->objects_prefetch(ls);
 
   for (vector<hobject_t>::iterator p = ls.begin(); p != ls.end(); ++p) {
     handle.reset_tp_timeout();
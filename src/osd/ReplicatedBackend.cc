@@ -13,6 +13,7 @@
  */
 #include "common/errno.h"
 #include "ReplicatedBackend.h"
+#include "ScrubReader.h"
 #include "messages/MOSDOp.h"
 #include "messages/MOSDRepOp.h"
 #include "messages/MOSDRepOpReply.h"
@@ -625,6 +626,18 @@ void ReplicatedBackend::do_repop_reply(OpRequestRef op)
   }
 }
 
+void ReplicatedBackend::be_deep_scrub_read_params(
+  uint64_t *stride,
+  uint64_t *align,
+  uint32_t *fadvise_flags) const
+{
+  *stride = cct->_conf->osd_deep_scrub_stride;
+  *align = 0;
+  *fadvise_flags = CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL |
+                   CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
+                   CEPH_OSD_OP_FLAG_BYPASS_CLEAN_CACHE;
+}
+
 int ReplicatedBackend::be_deep_scrub(
   const hobject_t &poid,
   ScrubMap &map,
@@ -633,9 +646,9 @@ int ReplicatedBackend::be_deep_scrub(
 {
   dout(10) << __func__ << " " << poid << " pos " << pos << dendl;
   int r;
-  uint32_t fadvise_flags = CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL |
-                           CEPH_OSD_OP_FLAG_FADVISE_DONTNEED |
-                           CEPH_OSD_OP_FLAG_BYPASS_CLEAN_CACHE;
+  uint64_t stride, align;
+  uint32_t fadvise_flags;
+  be_deep_scrub_read_params(&stride, &align, &fadvise_flags);
 
   utime_t sleeptime;
   sleeptime.set_from_double(cct->_conf->osd_debug_deep_scrub_sleep);
@@ -645,6 +658,38 @@ int ReplicatedBackend::be_deep_scrub(
   }
 
   ceph_assert(poid == pos.ls[pos.pos]);
+  object_info_t oi;
+  if (!pos.data_done() && pos.data_pos == 0 &&
+      be_deep_scrub_unchanged(pos, o, &oi)) {
+    // verified by an earlier deep scrub; vouch with the recorded digest
+    pos.data_pos = -1;
+    if (oi.is_data_digest()) {
+      o.digest = oi.data_digest;
+      o.digest_present = true;
+    }
+    dout(20) << __func__ << "  " << poid << " unchanged since "
+	     << pos.deep_since << ", not reading data" << dendl;
+  }
+  if (!pos.data_done() && pos.data_pos == 0 && pos.reader) {
+    ScrubReader::result_t res;
+    if (!pos.reader->get(pos.pos, &res)) {
+      dout(20) << __func__ << "  " << poid << " waiting for read ahead"
+	       << dendl;
+      return -EAGAIN;
+    }
+    if (res.r < 0) {
+      dout(20) << __func__ << "  " << poid << " got "
+	       << res.r << " on read, read_error" << dendl;
+      o.read_error = true;
+      return 0;
+    }
+    pos.data_hash = bufferhash(res.digest);
+    pos.data_pos = -1;
+    o.digest = pos.data_hash.digest();
+    o.digest_present = true;
+    dout(20) << __func__ << "  " << poid << " read ahead data, digest 0x"
+	     << std::hex << o.digest << std::dec << dendl;
+  }
   if (!pos.data_done()) {
     if (pos.data_pos == 0) {
       pos.data_hash = bufferhash(-1);
@@ -656,7 +701,7 @@ int ReplicatedBackend::be_deep_scrub(
       ghobject_t(
 	poid, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard),
       pos.data_pos,
-      cct->_conf->osd_deep_scrub_stride, bl,
+      stride, bl,
       fadvise_flags);
     if (r < 0) {
       dout(20) << __func__ << "  " << poid << " got "
@@ -668,7 +713,7 @@ int ReplicatedBackend::be_deep_scrub(
       pos.data_hash << bl;
     }
     pos.data_pos += r;
-    if (r == cct->_conf->osd_deep_scrub_stride) {
+    if ((uint64_t)r == stride) {
       dout(20) << __func__ << "  " << poid << " more data, digest so far 0x"
 	       << std::hex << pos.data_hash.digest() << std::dec << dendl;
       return -EINPROGRESS;
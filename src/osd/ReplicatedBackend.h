@@ -431,6 +431,10 @@ private:
     ScrubMap &map,
     ScrubMapBuilder &pos,
     ScrubMap::object &o) override;
+  void be_deep_scrub_read_params(
+    uint64_t *stride,
+    uint64_t *align,
+    uint32_t *fadvise_flags) const override;
   uint64_t be_get_ondisk_size(uint64_t logical_size) override { return logical_size; }
 };
 
@@ -0,0 +1,243 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "ScrubReader.h"
+#include "osd_perf_counters.h"
+#include "common/perf_counters.h"
+#include "include/Context.h"
+#include "include/crc32c.h"
+
+using std::vector;
+
+using ceph::bufferlist;
+
+struct ScrubReader::State : public std::enable_shared_from_this<State> {
+  static constexpr size_t NONE = SIZE_MAX;
+
+  ScrubReadQueue *queue;
+  ObjectStore *store;
+  ObjectStore::CollectionHandle ch;
+  const vector<ghobject_t> objects;
+  const uint64_t stride;
+  const uint64_t align;
+  const uint32_t fadvise_flags;
+  const unsigned depth;
+  const std::function<void()> on_ready;
+
+  ceph::mutex lock = ceph::make_mutex("ScrubReader::lock");
+  vector<result_t> results;
+  vector<bool> done;
+  size_t next = 0;        ///< next object to start reading
+  unsigned reading = 0;   ///< objects being read
+  size_t waiting = NONE;  ///< object get() found missing
+  bool canceled = false;
+
+  State(ScrubReadQueue *queue,
+	ObjectStore *store,
+	ObjectStore::CollectionHandle ch,
+	vector<ghobject_t>&& objects,
+	uint64_t stride,
+	uint64_t align,
+	uint32_t fadvise_flags,
+	unsigned depth,
+	std::function<void()>&& on_ready)
+    : queue(queue), store(store), ch(ch), objects(std::move(objects)),
+      stride(stride), align(align), fadvise_flags(fadvise_flags),
+      depth(std::max(depth, 1u)), on_ready(std::move(on_ready)),
+      results(this->objects.size()), done(this->objects.size()) {}
+
+  void start_reads();
+  void read(std::shared_ptr<Read> rd);
+  void finish(Read& rd);
+};
+
+struct ScrubReader::Read {
+  std::shared_ptr<State> state;
+  size_t i;
+  uint64_t off = 0;
+  result_t res;
+
+  Read(std::shared_ptr<State> state, size_t i)
+    : state(std::move(state)), i(i) {}
+};
+
+void ScrubReader::State::start_reads()
+{
+  vector<std::shared_ptr<Read>> reads;
+  {
+    std::lock_guard l(lock);
+    while (!canceled && reading < depth && next < objects.size()) {
+      if (objects[next] == ghobject_t()) {
+	done[next++] = true;
+	continue;
+      }
+      reads.push_back(std::make_shared<Read>(shared_from_this(), next++));
+      ++reading;
+    }
+  }
+  for (auto& rd : reads) {
+    queue->queue(std::move(rd));
+  }
+}
+
+void ScrubReader::State::read(std::shared_ptr<Read> rd)
+{
+  {
+    std::lock_guard l(lock);
+    if (canceled) {
+      return;
+    }
+  }
+  bufferlist bl;
+  int r = store->read(ch, objects[rd->i], rd->off, stride, bl, fadvise_flags);
+  if (r < 0) {
+    rd->res.r = r;
+    finish(*rd);
+    return;
+  }
+  queue->note_read(r);
+  if (align && bl.length() % align) {
+    rd->res.misaligned = true;
+    finish(*rd);
+    return;
+  }
+  // same value bufferhash would compute, without caching crcs on the
+  // buffers we are about to drop
+  for (auto& p : bl.buffers()) {
+    rd->res.digest = ceph_crc32c(rd->res.digest,
+				 (const unsigned char*)p.c_str(), p.length());
+  }
+  rd->off += r;
+  if ((uint64_t)r == stride) {
+    queue->queue(std::move(rd));
+    return;
+  }
+  rd->res.size = rd->off;
+  finish(*rd);
+}
+
+void ScrubReader::State::finish(Read& rd)
+{
+  bool ready = false;
+  {
+    std::lock_guard l(lock);
+    results[rd.i] = rd.res;
+    done[rd.i] = true;
+    --reading;
+    if (waiting == rd.i && !canceled) {
+      waiting = NONE;
+      ready = true;
+    }
+  }
+  start_reads();
+  if (ready) {
+    on_ready();
+  }
+}
+
+ScrubReader::ScrubReader(ScrubReadQueue *queue,
+			 ObjectStore *store,
+			 ObjectStore::CollectionHandle ch,
+			 vector<ghobject_t>&& objects,
+			 uint64_t stride,
+			 uint64_t align,
+			 uint32_t fadvise_flags,
+			 unsigned depth,
+			 std::function<void()>&& on_ready)
+  : state(std::make_shared<State>(queue, store, ch, std::move(objects),
+				  stride, align, fadvise_flags, depth,
+				  std::move(on_ready)))
+{
+  state->start_reads();
+}
+
+ScrubReader::~ScrubReader()
+{
+  std::lock_guard l(state->lock);
+  state->canceled = true;
+}
+
+bool ScrubReader::get(size_t i, result_t *res)
+{
+  std::lock_guard l(state->lock);
+  ceph_assert(i < state->objects.size());
+  if (!state->done[i]) {
+    state->waiting = i;
+    return false;
+  }
+  *res = state->results[i];
+  return true;
+}
+
+ScrubReadQueue::ScrubReadQueue(CephContext *cct)
+  : cct(cct),
+    timer(cct, timer_lock),
+    throttle(cct, "osd_scrub_read_bytes", 0, 0, &timer, &timer_lock)
+{
+  unsigned n = std::max<uint64_t>(
+    cct->_conf.get_val<uint64_t>("osd_deep_scrub_read_threads"), 1);
+  for (unsigned i = 0; i < n; ++i) {
+    finishers.push_back(std::make_unique<Finisher>(
+      cct, "scrub-reader-" + std::to_string(i), "scrub_rd"));
+  }
+}
+
+void ScrubReadQueue::start(PerfCounters *l)
+{
+  logger = l;
+  timer.init();
+  for (auto& f : finishers) {
+    f->start();
+  }
+}
+
+void ScrubReadQueue::stop()
+{
+  stopping = true;
+  {
+    std::lock_guard l(timer_lock);
+    timer.shutdown();
+  }
+  for (auto& f : finishers) {
+    f->wait_for_empty();
+    f->stop();
+  }
+}
+
+void ScrubReadQueue::set_limit(uint64_t bytes_per_sec)
+{
+  throttle.set_limit(bytes_per_sec, 0, 1);
+}
+
+void ScrubReadQueue::queue(std::shared_ptr<ScrubReader::Read> read)
+{
+  uint64_t cost = read->state->stride;
+  if (throttle.get(cost, this, &ScrubReadQueue::_queue, read, 0)) {
+    if (logger) {
+      logger->inc(l_osd_scrub_read_throttled);
+    }
+    return;
+  }
+  _queue(std::move(read), 0);
+}
+
+void ScrubReadQueue::_queue(std::shared_ptr<ScrubReader::Read> read, uint64_t)
+{
+  if (stopping) {
+    return;
+  }
+  auto& f = finishers[next_finisher++ % finishers.size()];
+  f->queue(new LambdaContext([this, read=std::move(read)](int) mutable {
+    if (!stopping) {
+      auto state = read->state;
+      state->read(std::move(read));
+    }
+  }));
+}
+
+void ScrubReadQueue::note_read(uint64_t bytes)
+{
+  if (logger) {
+    logger->inc(l_osd_scrub_read_bytes, bytes);
+  }
+}
@@ -0,0 +1,103 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_OSD_SCRUBREADER_H
+#define CEPH_OSD_SCRUBREADER_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "include/common_fwd.h"
+#include "common/Finisher.h"
+#include "common/Throttle.h"
+#include "common/Timer.h"
+#include "common/ceph_mutex.h"
+#include "os/ObjectStore.h"
+
+class ScrubReadQueue;
+
+/**
+ * Reads and hashes the object data of one deep scrub chunk ahead of
+ * PGBackend::be_deep_scrub().
+ *
+ * The objects are read on the OSD's scrub read threads, up to
+ * osd_deep_scrub_read_ahead of them at a time, one stride after the
+ * other, and each stride is crc32c'd as soon as it has been read.  While
+ * the PG works on one object, the next ones are already being read.
+ * be_deep_scrub() only picks up the finished digest; if it is not there
+ * yet, the scrub is not requeued until it is (see on_ready), so op
+ * threads never wait for scrub reads.
+ *
+ * Writes to the chunk are blocked while its map is built, so data read
+ * ahead is what be_deep_scrub() would have read itself.  Destroying the
+ * reader (ScrubMapBuilder::reset()) abandons the reads still queued.
+ * Objects given as ghobject_t() are not read at all.
+ */
+class ScrubReader {
+public:
+  struct result_t {
+    int r = 0;                ///< read error, if any
+    uint64_t size = 0;        ///< bytes read
+    uint32_t digest = -1;     ///< crc32c of the data, seeded with -1
+    bool misaligned = false;  ///< a read returned a partial align unit
+  };
+
+  struct State;
+  struct Read;
+
+  ScrubReader(ScrubReadQueue *queue,
+	      ObjectStore *store,
+	      ObjectStore::CollectionHandle ch,
+	      std::vector<ghobject_t>&& objects,
+	      uint64_t stride,
+	      uint64_t align,
+	      uint32_t fadvise_flags,
+	      unsigned depth,
+	      std::function<void()>&& on_ready);
+  ~ScrubReader();
+
+  /**
+   * get the result for the i'th object
+   *
+   * @returns false if it has not been read yet; on_ready is then called
+   * once it has.
+   */
+  bool get(size_t i, result_t *res);
+
+private:
+  std::shared_ptr<State> state;
+};
+
+/**
+ * The scrub read threads of an OSD and the token bucket that bounds the
+ * rate at which all of its deep scrubs read.
+ */
+class ScrubReadQueue {
+  CephContext *cct;
+  PerfCounters *logger = nullptr;
+  std::vector<std::unique_ptr<Finisher>> finishers;
+  std::atomic<unsigned> next_finisher = {0};
+  std::atomic<bool> stopping = {false};
+  ceph::mutex timer_lock = ceph::make_mutex("ScrubReadQueue::timer_lock");
+  SafeTimer timer;
+  TokenBucketThrottle throttle;
+
+  void _queue(std::shared_ptr<ScrubReader::Read> read, uint64_t);
+
+public:
+  explicit ScrubReadQueue(CephContext *cct);
+
+  void start(PerfCounters *logger);
+  void stop();
+
+  /// bytes per second for all scrub reads, 0 for no limit
+  void set_limit(uint64_t bytes_per_sec);
+
+  /// read the next stride of read once the token bucket allows
+  void queue(std::shared_ptr<ScrubReader::Read> read);
+  void note_read(uint64_t bytes);
+};
+
+#endif
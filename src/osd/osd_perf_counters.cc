@@ -125,6 +125,34 @@ PerfCounters *build_osd_logger(CephContext *cct) {
     "Latency of IO before calling queue(before really queue into ShardedOpWq)"); // client io before queue op_wq latency
   osd_plb.add_time_avg(l_osd_op_before_dequeue_op_lat, "op_before_dequeue_op_lat",
     "Latency of IO before calling dequeue_op(already dequeued and get PG lock)"); // client io before dequeue_op latency
+  osd_plb.add_u64_counter(l_osd_op_stolen, "op_stolen",
+    "Queued items processed by an idle thread of another op shard");
+  osd_plb.add_u64_counter(l_osd_pg_shard_moves, "pg_shard_moves",
+    "PGs moved between op shards by the shard balancer");
+  osd_plb.add_u64_counter(l_osd_scrub_read_bytes, "scrub_read_bytes",
+    "Deep scrub data read ahead on the scrub read threads",
+    NULL, PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
+  osd_plb.add_u64_counter(l_osd_scrub_read_throttled, "scrub_read_throttled",
+    "Deep scrub reads delayed by osd_scrub_read_bytes_per_sec");
+  osd_plb.add_u64_counter(l_osd_deep_scrub_skipped, "deep_scrub_skipped",
+    "Objects whose data an incremental deep scrub did not read");
+  osd_plb.add_u64_counter(l_osd_deep_scrub_skipped_bytes,
+    "deep_scrub_skipped_bytes",
+    "Data an incremental deep scrub did not read",
+    NULL, PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
+  osd_plb.add_u64_counter(l_osd_ec_cache_hit, "ec_cache_hit",
+    "EC overwrites whose partial stripes were all in the stripe cache");
+  osd_plb.add_u64_counter(l_osd_ec_cache_miss, "ec_cache_miss",
+    "EC overwrites that read partial stripes from the shards");
+  osd_plb.add_u64_counter(l_osd_ec_cache_read_avoided_bytes,
+    "ec_cache_read_avoided_bytes",
+    "Partial stripe data EC overwrites took from the stripe cache",
+    NULL, PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
+  osd_plb.add_u64_counter(l_osd_ec_pipeline_stall, "ec_pipeline_stall",
+    "EC overwrites that waited for the write pipeline to drain");
+  osd_plb.add_u64(l_osd_ec_cache_bytes, "ec_cache_bytes",
+    "Stripe data the EC PGs keep for later overwrites",
+    NULL, PerfCountersBuilder::PRIO_USEFUL, unit_t(UNIT_BYTES));
 
   osd_plb.add_u64_counter(
     l_osd_sop, "subop", "Suboperations");
@@ -38,6 +38,17 @@ enum {
 
   l_osd_op_before_queue_op_lat,
   l_osd_op_before_dequeue_op_lat,
+  l_osd_op_stolen,
+  l_osd_pg_shard_moves,
+  l_osd_scrub_read_bytes,
+  l_osd_scrub_read_throttled,
+  l_osd_deep_scrub_skipped,
+  l_osd_deep_scrub_skipped_bytes,
+  l_osd_ec_cache_hit,
+  l_osd_ec_cache_miss,
+  l_osd_ec_cache_read_avoided_bytes,
+  l_osd_ec_pipeline_stall,
+  l_osd_ec_cache_bytes,
 
   l_osd_sop,
   l_osd_sop_inb,
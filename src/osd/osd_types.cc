@@ -3305,7 +3305,7 @@ void pool_stat_t::generate_test_instances(list<pool_stat_t*>& o)
 
 void pg_history_t::encode(ceph::buffer::list &bl) const
 {
-  ENCODE_START(10, 4, bl);
+  ENCODE_START(11, 4, bl);
   encode(epoch_created, bl);
   encode(last_epoch_started, bl);
   encode(last_epoch_clean, bl);
@@ -3323,12 +3323,15 @@ void pg_history_t::encode(ceph::buffer::list &bl) const
   encode(last_interval_clean, bl);
   encode(epoch_pool_created, bl);
   encode(prior_readable_until_ub, bl);
+  encode(deep_scrub_verified, bl);
+  encode(deep_scrub_verified_interval, bl);
+  encode(last_full_deep_scrub_stamp, bl);
   ENCODE_FINISH(bl);
 }
 
 void pg_history_t::decode(ceph::buffer::list::const_iterator &bl)
 {
-  DECODE_START_LEGACY_COMPAT_LEN(10, 4, 4, bl);
+  DECODE_START_LEGACY_COMPAT_LEN(11, 4, 4, bl);
   decode(epoch_created, bl);
   decode(last_epoch_started, bl);
   if (struct_v >= 3)
@@ -3376,6 +3379,11 @@ void pg_history_t::decode(ceph::buffer::list::const_iterator &bl)
   if (struct_v >= 10) {
     decode(prior_readable_until_ub, bl);
   }
+  if (struct_v >= 11) {
+    decode(deep_scrub_verified, bl);
+    decode(deep_scrub_verified_interval, bl);
+    decode(last_full_deep_scrub_stamp, bl);
+  }
   DECODE_FINISH(bl);
 }
 
@@ -3397,6 +3405,9 @@ void pg_history_t::dump(Formatter *f) const
   f->dump_stream("last_deep_scrub") << last_deep_scrub;
   f->dump_stream("last_deep_scrub_stamp") << last_deep_scrub_stamp;
   f->dump_stream("last_clean_scrub_stamp") << last_clean_scrub_stamp;
+  f->dump_stream("deep_scrub_verified") << deep_scrub_verified;
+  f->dump_int("deep_scrub_verified_interval", deep_scrub_verified_interval);
+  f->dump_stream("last_full_deep_scrub_stamp") << last_full_deep_scrub_stamp;
   f->dump_float(
     "prior_readable_until_ub",
     std::chrono::duration<double>(prior_readable_until_ub).count());
@@ -3423,6 +3434,9 @@ void pg_history_t::generate_test_instances(list<pg_history_t*>& o)
   o.back()->last_deep_scrub_stamp = utime_t(14, 15);
   o.back()->last_clean_scrub_stamp = utime_t(16, 17);
   o.back()->last_epoch_marked_full = 18;
+  o.back()->deep_scrub_verified = eversion_t(12, 10);
+  o.back()->deep_scrub_verified_interval = 6;
+  o.back()->last_full_deep_scrub_stamp = utime_t(14, 15);
 }
 
 
@@ -2692,6 +2692,15 @@ struct pg_history_t {
   /// upper bound on how long prior interval readable (relative to encode time)
   ceph::timespan prior_readable_until_ub = ceph::timespan::zero();
 
+  // incremental deep scrub: objects last modified at or before
+  // deep_scrub_verified have been verified by the deep scrubs up to and
+  // including the last one, which ran in interval
+  // deep_scrub_verified_interval.  Both describe the deep scrub of
+  // last_deep_scrub_stamp and are zero if it found errors.
+  eversion_t deep_scrub_verified;
+  epoch_t deep_scrub_verified_interval = 0;
+  utime_t last_full_deep_scrub_stamp;
+
   friend bool operator==(const pg_history_t& l, const pg_history_t& r) {
     return
       l.epoch_created == r.epoch_created &&
@@ -2710,7 +2719,10 @@ struct pg_history_t {
       l.last_scrub_stamp == r.last_scrub_stamp &&
       l.last_deep_scrub_stamp == r.last_deep_scrub_stamp &&
       l.last_clean_scrub_stamp == r.last_clean_scrub_stamp &&
-      l.prior_readable_until_ub == r.prior_readable_until_ub;
+      l.prior_readable_until_ub == r.prior_readable_until_ub &&
+      l.deep_scrub_verified == r.deep_scrub_verified &&
+      l.deep_scrub_verified_interval == r.deep_scrub_verified_interval &&
+      l.last_full_deep_scrub_stamp == r.last_full_deep_scrub_stamp;
   }
 
   pg_history_t() {}
@@ -2784,6 +2796,13 @@ struct pg_history_t {
     }
     if (other.last_deep_scrub_stamp > last_deep_scrub_stamp) {
       last_deep_scrub_stamp = other.last_deep_scrub_stamp;
+      // these go with the deep scrub, including a reset after errors
+      deep_scrub_verified = other.deep_scrub_verified;
+      deep_scrub_verified_interval = other.deep_scrub_verified_interval;
+      modified = true;
+    }
+    if (other.last_full_deep_scrub_stamp > last_full_deep_scrub_stamp) {
+      last_full_deep_scrub_stamp = other.last_full_deep_scrub_stamp;
       modified = true;
     }
     if (other.last_clean_scrub_stamp > last_clean_scrub_stamp) {
@@ -6014,8 +6033,11 @@ struct ScrubMap {
 WRITE_CLASS_ENCODER(ScrubMap::object)
 WRITE_CLASS_ENCODER(ScrubMap)
 
+class ScrubReader;
+
 struct ScrubMapBuilder {
   bool deep = false;
+  eversion_t deep_since;  ///< data of objects not modified since is not read
   std::vector<hobject_t> ls;
   size_t pos = 0;
   int64_t data_pos = 0;
@@ -6024,6 +6046,7 @@ struct ScrubMapBuilder {
   ceph::buffer::hash data_hash, omap_hash;  ///< accumulatinng hash value
   uint64_t omap_keys = 0;
   uint64_t omap_bytes = 0;
+  std::shared_ptr<ScrubReader> reader;  ///< object data read ahead, if any
 
   bool empty() {
     return ls.empty();
@@ -6060,6 +6083,9 @@ struct ScrubMapBuilder {
     }
     if (pos.deep) {
       out << " deep";
+      if (pos.deep_since != eversion_t()) {
+	out << " since " << pos.deep_since;
+      }
     }
     if (pos.ret) {
       out << " ret " << pos.ret;
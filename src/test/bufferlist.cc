@@ -1870,6 +1870,41 @@ TEST(BufferList, rebuild) {
   }
 }
 
+TEST(BufferList, copied_bytes) {
+  uint64_t base = buffer::get_copied_bytes();
+  bufferlist bl;
+  {
+    bufferptr ptr(buffer::create_page_aligned(CEPH_PAGE_SIZE));
+    bl.append(ptr);
+  }
+  // references, splices and contiguous access don't copy
+  bufferlist ref, spliced;
+  ref.append(bl);
+  ref.c_str();
+  spliced.substr_of(bl, 1, 2);
+  spliced.claim_append(ref);
+  EXPECT_EQ(base, buffer::get_copied_bytes());
+  EXPECT_FALSE(bl.rebuild_page_aligned());
+  EXPECT_EQ(base, buffer::get_copied_bytes());
+  // appending raw data and flattening a fragmented list do
+  bl.append("X", 1);
+  EXPECT_EQ(base + 1, buffer::get_copied_bytes());
+  bl.c_str();
+  EXPECT_EQ(base + 1 + CEPH_PAGE_SIZE + 1, buffer::get_copied_bytes());
+  // and so do copies into and out of buffers
+  base = buffer::get_copied_bytes();
+  char out[16];
+  bl.begin().copy(sizeof(out), out);
+  EXPECT_EQ(base + 16, buffer::get_copied_bytes());
+  bl.begin().copy_in(sizeof(out), out);
+  EXPECT_EQ(base + 32, buffer::get_copied_bytes());
+  std::string s;
+  bl.begin().copy(8, s);
+  EXPECT_EQ(base + 40, buffer::get_copied_bytes());
+  bufferptr p = buffer::copy(out, sizeof(out));
+  EXPECT_EQ(base + 56, buffer::get_copied_bytes());
+}
+
 TEST(BufferList, rebuild_page_aligned) {
   {
     bufferlist bl;
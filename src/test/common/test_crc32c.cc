@@ -363,3 +363,25 @@ TEST(Crc32c, zeros_performance) {
 
 }
 
+
+TEST(Crc32c, Multi) {
+  // odd block sizes exercise the byte tail, odd counts the leftover
+  // blocks that do not fill all the lanes
+  unsigned block_lens[] = {1, 7, 8, 13, 512, 4096, 4099, 65536};
+  unsigned counts[] = {1, 3, 4, 5, 16, 17};
+  for (auto block_len : block_lens) {
+    for (auto nblocks : counts) {
+      std::vector<unsigned char> data(block_len * nblocks);
+      for (auto& c : data) {
+	c = rand();
+      }
+      std::vector<uint32_t> out(nblocks);
+      uint32_t init = rand();
+      ceph_crc32c_multi(init, data.data(), block_len, nblocks, out.data());
+      for (unsigned i = 0; i < nblocks; ++i) {
+	ASSERT_EQ(ceph_crc32c(init, data.data() + i * block_len, block_len),
+		  out[i]) << "block_len " << block_len << " block " << i;
+      }
+    }
+  }
+}
@@ -70,3 +70,26 @@ TEST(cpu_set, round_trip_list)
   }
 }
 
+
+TEST(numa, current_node)
+{
+  std::set<int> nodes;
+  if (get_numa_nodes(&nodes) < 0) {
+    return;  // no sysfs here
+  }
+  int node = get_current_numa_node();
+  if (node >= 0) {
+    ASSERT_TRUE(nodes.count(node));
+
+    // a thread bound to a node stays there
+    cpu_set_t orig, cpu_set;
+    size_t size;
+    ASSERT_EQ(0, sched_getaffinity(0, sizeof(orig), &orig));
+    ASSERT_EQ(0, get_numa_node_cpu_set(node, &size, &cpu_set));
+    ASSERT_EQ(0, sched_setaffinity(0, sizeof(cpu_set), &cpu_set));
+    for (unsigned i = 0; i < 100; ++i) {
+      ASSERT_EQ(node, get_current_numa_node());
+    }
+    ASSERT_EQ(0, sched_setaffinity(0, sizeof(orig), &orig));
+  }
+}
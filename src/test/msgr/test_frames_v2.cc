@@ -14,6 +14,7 @@
 
 #include "msg/async/frames_v2.h"
 
+#include <algorithm>
 #include <numeric>
 #include <ostream>
 #include <string>
@@ -245,6 +246,27 @@ TEST_P(RoundTripTest, Reuse) {
   }
 }
 
+TEST_P(RoundTripTest, ZeroCopy) {
+  const auto& [rti, m] = GetParam();
+  if (m.is_secure || rti.data_len == 0) {
+    // encryption has to produce new buffers
+    return;
+  }
+  uint64_t base = buffer::get_copied_bytes();
+  auto tx_frame = TestFrame::Encode(m_header, m_front, m_middle, m_data);
+  auto onwire_bl = tx_frame.get_buffer(m_tx_frame_asm);
+  // at most the preamble, epilogue and small segments are copied
+  EXPECT_LE(buffer::get_copied_bytes() - base,
+            onwire_bl.length() - m_data.length());
+  // the data segment goes out by reference
+  const char* data = m_data.front().c_str();
+  EXPECT_TRUE(std::any_of(onwire_bl.buffers().begin(),
+                          onwire_bl.buffers().end(),
+                          [data](const auto& p) {
+                            return p.c_str() == data;
+                          }));
+}
+
 static const round_trip_instance_t round_trip_instances[] = {
   // first segment is empty
   { 0,   0,   0,   0, 1, {{32,  0,  17,   0,   0,  0},
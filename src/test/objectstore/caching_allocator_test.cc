@@ -0,0 +1,194 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <iostream>
+#include <thread>
+#include <gtest/gtest.h>
+
+#include "global/global_context.h"
+#include "os/bluestore/CachingAllocator.h"
+
+const uint64_t _1m = 1024 * 1024;
+const uint64_t _64k = 64 * 1024;
+const uint64_t _4k = 4 * 1024;
+
+static CachingAllocator* create_caching(const char* type,
+					uint64_t capacity,
+					size_t shards = 1,
+					size_t slots = 8)
+{
+  auto backend = Allocator::create(g_ceph_context, type, capacity, _4k,
+				   std::string("test_caching_backend_") + type);
+  return new CachingAllocator(g_ceph_context, backend, _4k, shards, slots,
+			      _1m, _64k,
+			      std::string("test_caching_") + type);
+}
+
+TEST(CachingAllocator, basic)
+{
+  uint64_t capacity = 256 * _1m;
+  std::unique_ptr<CachingAllocator> ca(create_caching("avl", capacity));
+  ca->init_add_free(0, capacity);
+  ASSERT_EQ(capacity, ca->get_free());
+  ASSERT_EQ(0u, ca->get_cached());
+
+  // first request misses and takes a whole refill batch from backend
+  PExtentVector extents;
+  ASSERT_EQ(int64_t(_4k), ca->allocate(_4k, _4k, 0, 0, &extents));
+  ASSERT_EQ(1u, extents.size());
+  ASSERT_EQ(_1m, ca->get_cached());
+  ASSERT_EQ(capacity - _4k, ca->get_free());
+  ASSERT_EQ(capacity - _4k - _1m, ca->get_backend()->get_free());
+
+  // next requests are served from the shard
+  extents.clear();
+  for (size_t i = 0; i < 4; i++) {
+    ASSERT_EQ(int64_t(_64k), ca->allocate(_64k, _4k, 0, 0, &extents));
+  }
+  ASSERT_EQ(_1m - 4 * _64k, ca->get_cached());
+  ASSERT_EQ(capacity - _4k - _1m, ca->get_backend()->get_free());
+  ASSERT_EQ(capacity - _4k - 4 * _64k, ca->get_free());
+
+  // ... and the released space goes back to the shard
+  ca->release(extents);
+  ASSERT_EQ(capacity - _4k, ca->get_free());
+  ASSERT_EQ(capacity - _4k - _1m, ca->get_backend()->get_free());
+
+  ca->flush();
+  ASSERT_EQ(0u, ca->get_cached());
+  ASSERT_EQ(capacity - _4k, ca->get_backend()->get_free());
+  ca->shutdown();
+}
+
+TEST(CachingAllocator, bypass)
+{
+  uint64_t capacity = 256 * _1m;
+  std::unique_ptr<CachingAllocator> ca(create_caching("bitmap", capacity));
+  ca->init_add_free(0, capacity);
+
+  // too large or with a different alloc unit
+  PExtentVector extents, extents2;
+  ASSERT_EQ(int64_t(4 * _1m), ca->allocate(4 * _1m, _4k, 0, 0, &extents));
+  ASSERT_EQ(int64_t(_64k), ca->allocate(_64k, _64k, 0, 0, &extents2));
+  ASSERT_EQ(0u, ca->get_cached());
+  ASSERT_EQ(capacity - 4 * _1m - _64k, ca->get_free());
+
+  // large extents aren't cached on release either
+  ca->release(extents);
+  ASSERT_EQ(0u, ca->get_cached());
+  ASSERT_EQ(capacity - _64k, ca->get_backend()->get_free());
+  ca->shutdown();
+}
+
+TEST(CachingAllocator, max_alloc_size)
+{
+  uint64_t capacity = 256 * _1m;
+  std::unique_ptr<CachingAllocator> ca(create_caching("avl", capacity));
+  ca->init_add_free(0, capacity);
+
+  PExtentVector extents;
+  ASSERT_EQ(int64_t(_64k), ca->allocate(_64k, _4k, _4k * 4, 0, &extents));
+  ASSERT_EQ(4u, extents.size());
+  for (auto& e : extents) {
+    ASSERT_EQ(_4k * 4, e.length);
+  }
+  ca->shutdown();
+}
+
+TEST(CachingAllocator, overflow)
+{
+  uint64_t capacity = 256 * _1m;
+  size_t slots = 8;
+  std::unique_ptr<CachingAllocator> ca(create_caching("avl", capacity, 1, slots));
+  ca->init_add_free(0, capacity);
+
+  // allocate and release a set of non-adjacent extents, more than a shard
+  // can hold
+  PExtentVector extents;
+  ASSERT_EQ(int64_t(2 * _1m), ca->allocate(2 * _1m, _4k, 0, 0, &extents));
+  interval_set<uint64_t> all;
+  for (auto& e : extents) {
+    all.insert(e.offset, e.length);
+  }
+  for (uint64_t i = 0; i < 4 * slots; i++) {
+    interval_set<uint64_t> r;
+    r.insert(all.range_start() + i * 2 * _4k, _4k);
+    ca->release(r);
+    ASSERT_LE(ca->get_cached(), slots * _4k);
+  }
+  ASSERT_EQ(capacity - 2 * _1m + 4 * slots * _4k, ca->get_free());
+  ca->shutdown();
+}
+
+TEST(CachingAllocator, enospc)
+{
+  uint64_t capacity = 4 * _1m;
+  std::unique_ptr<CachingAllocator> ca(create_caching("avl", capacity, 4));
+  ca->init_add_free(0, capacity);
+
+  // park space in several shards, then ask for everything from one thread
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < 3; i++) {
+    threads.emplace_back([&] {
+      PExtentVector e;
+      ASSERT_EQ(int64_t(_4k), ca->allocate(_4k, _4k, 0, 0, &e));
+      ca->release(e);
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(capacity, ca->get_free());
+
+  PExtentVector extents;
+  uint64_t allocated = 0;
+  while (allocated < capacity) {
+    auto r = ca->allocate(_64k, _4k, 0, 0, &extents);
+    ASSERT_EQ(int64_t(_64k), r);
+    allocated += r;
+  }
+  ASSERT_EQ(0u, ca->get_free());
+  ASSERT_EQ(-ENOSPC, ca->allocate(_4k, _4k, 0, 0, &extents));
+  ca->release(extents);
+  ASSERT_EQ(capacity, ca->get_free());
+  ca->shutdown();
+}
+
+TEST(CachingAllocator, concurrent)
+{
+  uint64_t capacity = 1024 * _1m;
+  std::unique_ptr<CachingAllocator> ca(create_caching("avl", capacity, 8, 16));
+  ca->init_add_free(0, capacity);
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < 8; i++) {
+    threads.emplace_back([&] {
+      std::vector<PExtentVector> held;
+      for (size_t j = 0; j < 1000; j++) {
+	PExtentVector e;
+	uint64_t want = _4k * (1 + j % 16);
+	ASSERT_EQ(int64_t(want), ca->allocate(want, _4k, 0, 0, &e));
+	held.emplace_back(std::move(e));
+	if (held.size() > 32) {
+	  ca->release(held.front());
+	  held.erase(held.begin());
+	}
+      }
+      for (auto& e : held) {
+	ca->release(e);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  ASSERT_EQ(capacity, ca->get_free());
+
+  // every byte is reported as free exactly once
+  interval_set<uint64_t> free;
+  ca->dump([&](uint64_t offset, uint64_t length) {
+    free.insert(offset, length);
+  });
+  ASSERT_EQ(capacity, free.size());
+  ca->shutdown();
+}
@@ -37,6 +37,7 @@
 #include "common/ceph_mutex.h"
 #include "common/Cond.h"
 #include "common/errno.h"
+#include "common/perf_counters_collection.h"
 #include "include/stringify.h"
 #include "include/coredumpctl.h"
 
@@ -5519,6 +5520,128 @@ TEST_P(StoreTest, OMapIterator) {
   }
 }
 
+TEST_P(StoreTestSpecificAUSize, OmapBoundedIteration) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_omap_readahead_threshold", "8");
+  SetVal(g_conf(), "bluestore_omap_tombstone_stats", "true");
+  g_conf().apply_changes(nullptr);
+  StartDeferred(0x10000);
+
+  int r;
+  coll_t cid;
+  // neighbours on both sides so that unbounded iteration would run into them
+  ghobject_t hoid0(hobject_t("omap_a", "", CEPH_NOSNAP, 0, 0, ""));
+  ghobject_t hoid(hobject_t("omap_b", "", CEPH_NOSNAP, 0, 0, ""));
+  ghobject_t hoid2(hobject_t("omap_c", "", CEPH_NOSNAP, 0, 0, ""));
+  const PerfCounters* logger = store->get_perf_counters();
+  auto ch = store->create_new_collection(cid);
+  map<string, bufferlist> attrs;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    map<string, bufferlist> other;
+    for (int i = 0; i < 16; i++) {
+      other["other-" + stringify(i)].append("x");
+    }
+    t.touch(cid, hoid0);
+    t.omap_setkeys(cid, hoid0, other);
+    t.touch(cid, hoid2);
+    t.omap_setkeys(cid, hoid2, other);
+    t.touch(cid, hoid);
+    for (int i = 0; i < 200; i++) {
+      char key[20];
+      snprintf(key, sizeof(key), "key-%04d", i);
+      attrs[key].append(stringify(i));
+    }
+    t.omap_setkeys(cid, hoid, attrs);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    // leave a run of tombstones in the middle of the object's omap
+    ObjectStore::Transaction t;
+    set<string> to_remove;
+    for (int i = 50; i < 150; i++) {
+      char key[20];
+      snprintf(key, sizeof(key), "key-%04d", i);
+      to_remove.insert(key);
+      attrs.erase(key);
+    }
+    t.omap_rmkeys(cid, hoid, to_remove);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  uint64_t readahead = logger->get(l_bluestore_omap_readahead);
+  uint64_t tombstones = logger->get(l_bluestore_omap_tombstones_skipped);
+  {
+    // long listing switches to readahead midway and stays correct
+    auto iter = store->get_omap_iterator(ch, hoid);
+    auto p = attrs.begin();
+    for (iter->seek_to_first(); iter->valid(); iter->next(), ++p) {
+      ASSERT_TRUE(p != attrs.end());
+      ASSERT_EQ(p->first, iter->key());
+      ASSERT_TRUE(p->second.contents_equal(iter->value()));
+    }
+    ASSERT_TRUE(p == attrs.end());
+  }
+  ASSERT_EQ(readahead + 1, logger->get(l_bluestore_omap_readahead));
+  ASSERT_GT(logger->get(l_bluestore_omap_tombstones_skipped), tombstones);
+  {
+    // short probes don't
+    auto iter = store->get_omap_iterator(ch, hoid);
+    iter->lower_bound("key-0150");
+    ASSERT_TRUE(iter->valid());
+    ASSERT_EQ("key-0150", iter->key());
+    iter->next();
+    ASSERT_EQ("key-0151", iter->key());
+    iter->upper_bound("key-0199");
+    ASSERT_FALSE(iter->valid());
+  }
+  ASSERT_EQ(readahead + 1, logger->get(l_bluestore_omap_readahead));
+  {
+    bufferlist h;
+    map<string, bufferlist> out;
+    r = store->omap_get(ch, hoid, &h, &out);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(attrs.size(), out.size());
+    set<string> keys;
+    r = store->omap_get_keys(ch, hoid, &keys);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(attrs.size(), keys.size());
+    ASSERT_EQ(0u, keys.count("other-0"));
+  }
+  {
+    // batched point lookups, including removed and unknown keys
+    set<string> want = { "key-0000", "key-0049", "key-0050", "key-0100",
+			 "key-0150", "key-0199", "key-9999", "other-0" };
+    map<string, bufferlist> vals;
+    r = store->omap_get_values(ch, hoid, want, &vals);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(4u, vals.size());
+    for (auto& k : { "key-0000", "key-0049", "key-0150", "key-0199" }) {
+      ASSERT_EQ(1u, vals.count(k));
+      ASSERT_TRUE(vals[k].contents_equal(attrs[k]));
+    }
+    set<string> have;
+    r = store->omap_check_keys(ch, hoid, want, &have);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ((set<string>{ "key-0000", "key-0049", "key-0150", "key-0199" }),
+	      have);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid0);
+    t.remove(cid, hoid);
+    t.remove(cid, hoid2);
+    t.remove_collection(cid);
+    r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTest, XattrTest) {
   coll_t cid;
   ghobject_t hoid(hobject_t("tesomap", "", CEPH_NOSNAP, 0, 0, ""));
@@ -6811,6 +6934,389 @@ TEST_P(StoreTestSpecificAUSize, BlobReuseOnOverwrite) {
   }
 }
 
+TEST_P(StoreTestSpecificAUSize, KVSyncPipeline) {
+
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  size_t block_size = 4096;
+  SetVal(g_conf(), "bluestore_kv_sync_pipeline", "true");
+  SetVal(g_conf(), "bluestore_prefer_deferred_size", "65536");
+  StartDeferred(block_size);
+
+  const unsigned num_colls = 4;
+  const unsigned num_objs = 64;
+  vector<coll_t> cids;
+  vector<ObjectStore::CollectionHandle> chs;
+  for (unsigned i = 0; i < num_colls; ++i) {
+    cids.emplace_back(spg_t(pg_t(i, 0), shard_id_t::NO_SHARD));
+    chs.push_back(store->create_new_collection(cids.back()));
+    ObjectStore::Transaction t;
+    t.create_collection(cids.back(), 0);
+    int r = queue_transaction(store, chs.back(), std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  // small (deferred) writes from several sequencers at once, so that
+  // batches are prepared while others are being committed
+  auto obj = [](unsigned c, unsigned i) {
+    return ghobject_t(hobject_t(sobject_t("obj_" + stringify(c) + "_" +
+					   stringify(i), CEPH_NOSNAP)));
+  };
+  std::vector<std::thread> writers;
+  for (unsigned c = 0; c < num_colls; ++c) {
+    writers.emplace_back([&, c] {
+      for (unsigned i = 0; i < num_objs; ++i) {
+	ObjectStore::Transaction t;
+	bufferlist bl;
+	bl.append(std::string(block_size, 'a' + (c + i) % 26));
+	t.write(cids[c], obj(c, i), 0, bl.length(), bl);
+	store->queue_transaction(chs[c], std::move(t));
+      }
+    });
+  }
+  for (auto& w : writers) {
+    w.join();
+  }
+  for (auto& ch : chs) {
+    ch->flush();
+  }
+
+  const PerfCounters* logger = store->get_perf_counters();
+  // every txc went through a kv sync batch
+  ASSERT_GE(logger->get(l_bluestore_kv_sync_batch), num_colls * num_objs);
+
+  chs.clear();
+  ASSERT_EQ(store->umount(), 0);
+  ASSERT_EQ(store->mount(), 0);
+  for (unsigned c = 0; c < num_colls; ++c) {
+    auto ch = store->open_collection(cids[c]);
+    for (unsigned i = 0; i < num_objs; ++i) {
+      bufferlist bl, expected;
+      expected.append(std::string(block_size, 'a' + (c + i) % 26));
+      int r = store->read(ch, obj(c, i), 0, block_size, bl);
+      ASSERT_EQ(r, (int)block_size);
+      ASSERT_TRUE(bl_eq(expected, bl));
+    }
+  }
+}
+
+TEST_P(StoreTestSpecificAUSize, OnodeCompact) {
+
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  size_t block_size = 4096;
+  SetVal(g_conf(), "bluestore_onode_compact", "true");
+  // get some of the objects sharded
+  SetVal(g_conf(), "bluestore_extent_map_shard_max_size", "200");
+  SetVal(g_conf(), "bluestore_extent_map_shard_target_size", "100");
+  StartDeferred(block_size);
+
+  coll_t cid;
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+
+  // objects with an increasing number of non-contiguous extents
+  const unsigned num_objs = 16;
+  auto obj = [](unsigned i) {
+    return ghobject_t(hobject_t(sobject_t("obj_" + stringify(i), CEPH_NOSNAP)));
+  };
+  auto fill = [&](unsigned i, unsigned j) {
+    return std::string(block_size, 'a' + (i + j) % 26);
+  };
+  for (unsigned i = 0; i < num_objs; ++i) {
+    ObjectStore::Transaction t;
+    for (unsigned j = 0; j <= i; ++j) {
+      bufferlist bl;
+      bl.append(fill(i, j));
+      t.write(cid, obj(i), 2 * j * block_size, bl.length(), bl);
+    }
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch->flush();
+
+  auto verify = [&](ObjectStore::CollectionHandle& ch) {
+    for (unsigned i = 0; i < num_objs; ++i) {
+      for (unsigned j = 0; j <= i; ++j) {
+	bufferlist bl, expected;
+	expected.append(fill(i, j));
+	int r = store->read(ch, obj(i), 2 * j * block_size, block_size, bl);
+	ASSERT_EQ(r, (int)block_size);
+	ASSERT_TRUE(bl_eq(expected, bl));
+      }
+    }
+  };
+
+  // compacted extent maps are transparently decoded again
+  store->flush_cache();
+  verify(ch);
+  verify(ch);
+
+  // overwrite the middle of every object and check both old and new data
+  for (unsigned i = 0; i < num_objs; ++i) {
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(std::string(block_size, 'z'));
+    t.write(cid, obj(i), (2 * i + 1) * block_size, bl.length(), bl);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ch->flush();
+  verify(ch);
+
+  const PerfCounters* logger = store->get_perf_counters();
+  ASSERT_GT(logger->get(l_bluestore_onode_compacted), 0u);
+  ASSERT_GT(logger->get(l_bluestore_onode_unpacked), 0u);
+
+  ch.reset();
+  ASSERT_EQ(store->umount(), 0);
+  ASSERT_EQ(store->fsck(false), 0);
+  ASSERT_EQ(store->mount(), 0);
+  ch = store->open_collection(cid);
+  verify(ch);
+  for (unsigned i = 0; i < num_objs; ++i) {
+    bufferlist bl, expected;
+    expected.append(std::string(block_size, 'z'));
+    int r = store->read(ch, obj(i), (2 * i + 1) * block_size, block_size, bl);
+    ASSERT_EQ(r, (int)block_size);
+    ASSERT_TRUE(bl_eq(expected, bl));
+  }
+}
+
+TEST_P(StoreTestSpecificAUSize, ColdReads) {
+
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  size_t block_size = 4096;
+  SetVal(g_conf(), "bluestore_default_buffered_read", "true");
+  StartDeferred(block_size);
+
+  coll_t cid;
+  ghobject_t hoid(hobject_t("cold", "", CEPH_NOSNAP, 0, -1, ""));
+  auto ch = store->create_new_collection(cid);
+  const size_t size = 16 * block_size;
+  bufferlist data;
+  data.append(std::string(size, 'c'));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, data.length(), data);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  store->flush_cache();
+
+  const PerfCounters* logger = store->get_perf_counters();
+  const uint32_t cold = CEPH_OSD_OP_FLAG_FADVISE_SEQUENTIAL |
+                        CEPH_OSD_OP_FLAG_FADVISE_DONTNEED;
+  auto read = [&](uint32_t flags) {
+    bufferlist bl;
+    int r = store->read(ch, hoid, 0, size, bl, flags);
+    ASSERT_EQ(r, (int)size);
+    ASSERT_TRUE(bl_eq(data, bl));
+  };
+
+  // background reads load the onode cold and leave the data uncached
+  auto loads = logger->get(l_bluestore_onode_cold_loads);
+  auto cold_bytes = logger->get(l_bluestore_buffer_cold_read_bytes);
+  read(cold);
+  ASSERT_EQ(loads + 1, logger->get(l_bluestore_onode_cold_loads));
+  ASSERT_EQ(cold_bytes + size, logger->get(l_bluestore_buffer_cold_read_bytes));
+  auto hit = logger->get(l_bluestore_buffer_hit_bytes);
+  read(cold);
+  ASSERT_EQ(hit, logger->get(l_bluestore_buffer_hit_bytes));
+  ASSERT_EQ(cold_bytes + 2 * size,
+            logger->get(l_bluestore_buffer_cold_read_bytes));
+
+  // regular reads cache it, and cold reads may hit it
+  read(0);
+  read(cold);
+  ASSERT_EQ(hit + size, logger->get(l_bluestore_buffer_hit_bytes));
+
+  // with bluestore_cache_cold_reads the data lands at the cold end
+  ch.reset();
+  SetVal(g_conf(), "bluestore_cache_cold_reads", "true");
+  ASSERT_EQ(store->umount(), 0);
+  ASSERT_EQ(store->mount(), 0);
+  ch = store->open_collection(cid);
+  logger = store->get_perf_counters();
+  hit = logger->get(l_bluestore_buffer_hit_bytes);
+  read(cold);
+  ASSERT_EQ(hit, logger->get(l_bluestore_buffer_hit_bytes));
+  read(cold);
+  ASSERT_EQ(hit + size, logger->get(l_bluestore_buffer_hit_bytes));
+}
+
+TEST_P(StoreTestSpecificAUSize, ZeroCopyRead) {
+
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  size_t block_size = 4096;
+  StartDeferred(block_size);
+
+  coll_t cid;
+  ghobject_t hoid(hobject_t("zero_copy", "", CEPH_NOSNAP, 0, -1, ""));
+  auto ch = store->create_new_collection(cid);
+  const size_t size = 1024 * 1024;
+  bufferlist data;
+  for (size_t i = 0; i < size / block_size; ++i) {
+    data.append(std::string(block_size, 'a' + i % 26));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, data.length(), data);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // aligned reads hand out the (checksummed) device buffers as they are,
+  // whether they come from disk or from the cache
+  auto read = [&](uint64_t off, uint64_t len, uint32_t flags) {
+    bufferlist bl, expected;
+    int r = store->read(ch, hoid, off, len, bl, flags);
+    ASSERT_EQ(r, (int)len);
+    expected.substr_of(data, off, len);
+    ASSERT_TRUE(bl_eq(expected, bl));
+    if (off % block_size == 0) {
+      for (auto& p : bl.buffers()) {
+        ASSERT_TRUE(p.is_aligned(CEPH_PAGE_SIZE));
+      }
+    }
+  };
+  auto check_reads = [&]() {
+    store->flush_cache();
+    uint64_t base = buffer::get_copied_bytes();
+    read(0, size, 0);
+    read(block_size, size / 2, CEPH_OSD_OP_FLAG_FADVISE_WILLNEED);
+    read(block_size, size / 2, 0);
+    read(123, size / 4, 0);
+    // metadata (onode, extent map) gets decoded along the way, but none
+    // of the 2.25M of data read is copied
+    ASSERT_LT(buffer::get_copied_bytes() - base, size / 16);
+  };
+  ASSERT_NO_FATAL_FAILURE(check_reads());
+
+  // again with the device reading through buffers registered with io_uring
+  int r = store->umount();
+  ASSERT_EQ(r, 0);
+  SetVal(g_conf(), "bdev_ioring", "true");
+  SetVal(g_conf(), "bdev_ioring_fixed_buffers", "16");
+  SetVal(g_conf(), "bdev_ioring_fixed_buffer_size", "524288");
+  g_conf().apply_changes(nullptr);
+  r = store->mount();
+  ASSERT_EQ(r, 0);
+  ch = store->open_collection(cid);
+  ASSERT_NO_FATAL_FAILURE(check_reads());
+  uint64_t read_fixed = 0;
+  g_ceph_context->get_perfcounters_collection()->with_counters(
+    [&](const PerfCountersCollectionImpl::CounterMap& by_path) {
+      auto p = by_path.find("bdev-block.read_fixed");
+      if (p != by_path.end()) {
+        read_fixed = p->second.data->u64;
+      }
+    });
+  if (read_fixed == 0) {
+    // no io_uring, or registration was refused (RLIMIT_MEMLOCK)
+    cout << "no registered buffers were used" << std::endl;
+  }
+}
+
+TEST_P(StoreTestSpecificAUSize, DeferredElevator) {
+
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  size_t block_size = 4096;
+  SetVal(g_conf(), "bluestore_deferred_elevator", "true");
+  SetVal(g_conf(), "bluestore_deferred_batch_ops", "8");
+  SetVal(g_conf(), "bluestore_prefer_deferred_size", "65536");
+  StartDeferred(block_size);
+
+  const unsigned num_colls = 4;
+  const unsigned num_objs = 4;
+  const size_t size = 64 * 1024;
+  std::vector<coll_t> cids;
+  std::vector<ObjectStore::CollectionHandle> chs;
+  for (unsigned c = 0; c < num_colls; ++c) {
+    coll_t cid(spg_t(pg_t(c, 1), shard_id_t::NO_SHARD));
+    auto ch = store->create_new_collection(cid);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+    cids.push_back(cid);
+    chs.push_back(ch);
+  }
+  auto obj = [](unsigned c, unsigned i) {
+    return ghobject_t(hobject_t("elevator_" + stringify(c) + "_" + stringify(i),
+                                "", CEPH_NOSNAP, c, c, ""));
+  };
+  for (unsigned c = 0; c < num_colls; ++c) {
+    for (unsigned i = 0; i < num_objs; ++i) {
+      bufferlist bl;
+      bl.append(std::string(size, 'a'));
+      ObjectStore::Transaction t;
+      t.write(cids[c], obj(c, i), 0, bl.length(), bl);
+      int r = queue_transaction(store, chs[c], std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+  }
+
+  // small overwrites from all sequencers go through the deferred path
+  const PerfCounters* logger = store->get_perf_counters();
+  auto batches = logger->get(l_bluestore_deferred_elevator_batches);
+  auto extents = logger->get(l_bluestore_deferred_elevator_extents);
+  auto ios = logger->get(l_bluestore_deferred_elevator_ios);
+  for (unsigned round = 0; round < 4; ++round) {
+    for (unsigned i = 0; i < num_objs; ++i) {
+      for (unsigned c = 0; c < num_colls; ++c) {
+        bufferlist bl;
+        bl.append(std::string(block_size, 'b' + round));
+        ObjectStore::Transaction t;
+        t.write(cids[c], obj(c, i), (round * 2 + c % 2) * block_size,
+                bl.length(), bl);
+        int r = queue_transaction(store, chs[c], std::move(t));
+        ASSERT_EQ(r, 0);
+      }
+    }
+  }
+  chs.clear();
+  ASSERT_EQ(store->umount(), 0);
+  ASSERT_LT(batches, logger->get(l_bluestore_deferred_elevator_batches));
+  ASSERT_LT(extents, logger->get(l_bluestore_deferred_elevator_extents));
+  ASSERT_LE(logger->get(l_bluestore_deferred_elevator_ios) - ios,
+            logger->get(l_bluestore_deferred_elevator_extents) - extents);
+  ASSERT_EQ(store->fsck(false), 0);
+  ASSERT_EQ(store->mount(), 0);
+
+  for (unsigned c = 0; c < num_colls; ++c) {
+    auto ch = store->open_collection(cids[c]);
+    for (unsigned i = 0; i < num_objs; ++i) {
+      bufferlist expected;
+      for (unsigned round = 0; round < 4; ++round) {
+        for (unsigned k = 0; k < 2; ++k) {
+          char v = (k == c % 2) ? 'b' + round : 'a';
+          expected.append(std::string(block_size, v));
+        }
+      }
+      expected.append(std::string(size - 8 * block_size, 'a'));
+      bufferlist bl;
+      int r = store->read(ch, obj(c, i), 0, size, bl);
+      ASSERT_EQ(r, (int)size);
+      ASSERT_TRUE(bl_eq(expected, bl));
+    }
+  }
+}
+
 TEST_P(StoreTestSpecificAUSize, DeferredOnBigOverwrite) {
 
   if (string(GetParam()) != "bluestore")
@@ -8133,6 +8639,83 @@ TEST_P(StoreTestSpecificAUSize, BluestoreRepairTest) {
 
 }
 
+TEST_P(StoreTestSpecificAUSize, BluestoreParallelFsck) {
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_fsck_on_mount", "false");
+  SetVal(g_conf(), "bluestore_fsck_on_umount", "false");
+  SetVal(g_conf(), "bluestore_extent_map_shard_max_size", "200");
+  SetVal(g_conf(), "bluestore_fsck_error_on_no_per_pool_stats", "false");
+  StartDeferred(0x10000);
+
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+
+  const unsigned num_pools = 8;
+  const unsigned num_objs = 16;
+  bufferlist bl;
+  bl.append(std::string(0x10000, 'p'));
+  for (unsigned pool = 1; pool <= num_pools; ++pool) {
+    coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+    auto ch = store->create_new_collection(cid);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    for (unsigned i = 0; i < num_objs; ++i) {
+      auto hoid = make_object(("Object " + stringify(i)).c_str(), pool);
+      for (unsigned j = 0; j < 4; ++j) {
+        t.write(cid, hoid, j * 2 * bl.length(), bl.length(), bl);
+      }
+      map<string, bufferlist> kv;
+      kv["key"] = bl;
+      t.omap_setkeys(cid, hoid, kv);
+      if (i % 4 == 0) {
+        auto clone = hoid;
+        clone.hobj.snap = 1;
+        t.clone(cid, hoid, clone);
+      }
+    }
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bstore->umount();
+
+  auto fsck = [&](unsigned threads, bool deep) {
+    SetVal(g_conf(), "bluestore_fsck_threads", stringify(threads).c_str());
+    g_conf().apply_changes(nullptr);
+    BlueStore::fsck_progress_t last;
+    bstore->set_fsck_progress_cb([&](const BlueStore::fsck_progress_t& p) {
+      last = p;
+    });
+    int r = bstore->fsck(deep);
+    bstore->set_fsck_progress_cb(nullptr);
+    EXPECT_EQ(num_pools * num_objs * 5 / 4, last.objects);
+    if (threads > 1) {
+      EXPECT_EQ(last.ranges_total, last.ranges_done);
+      EXPECT_LT(1u, last.ranges_total);
+    }
+    return r;
+  };
+  ASSERT_EQ(fsck(1, false), 0);
+  ASSERT_EQ(fsck(4, false), 0);
+  ASSERT_EQ(fsck(4, true), 0);
+
+  // errors spanning ranges are found either way
+  bstore->mount();
+  bstore->inject_misreference(
+    coll_t(spg_t(pg_t(0, 1), shard_id_t::NO_SHARD)),
+    make_object("Object 1", 1),
+    coll_t(spg_t(pg_t(0, num_pools), shard_id_t::NO_SHARD)),
+    make_object("Object 1", num_pools),
+    0);
+  bstore->umount();
+  int errors = fsck(1, false);
+  ASSERT_LT(0, errors);
+  ASSERT_EQ(errors, fsck(4, false));
+  ASSERT_EQ(bstore->repair(false), 0);
+  ASSERT_EQ(fsck(4, false), 0);
+  bstore->mount();
+}
+
 TEST_P(StoreTest, BluestoreRepairGlobalStats)
 {
   if (string(GetParam()) != "bluestore")
@@ -8398,6 +8981,446 @@ TEST_P(StoreTest, BluestorePerPoolOmapFixOnMount)
   bstore->mount();
 }
 
+TEST_P(StoreTest, BluestorePerPgOmap)
+{
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+  const uint64_t pool = 555;
+  coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+  ghobject_t oid = make_object("Object 1", pool);
+  ghobject_t oid2 = make_object("Object 2", pool);
+  ghobject_t oid3 = make_object("Object 3", pool);
+  ghobject_t oid4 = make_object("Object 4", pool);
+  auto ch = store->create_new_collection(cid);
+  map<string, bufferlist> omap;
+  omap["a"].append("value a");
+  omap["b"].append("value b");
+  bufferlist h;
+  h.append("header");
+  auto check_omap = [&](const ghobject_t& o) {
+    bufferlist rh;
+    map<string, bufferlist> r;
+    ASSERT_EQ(0, store->omap_get(ch, o, &rh, &r));
+    ASSERT_TRUE(bl_eq(h, rh));
+    ASSERT_EQ(omap.size(), r.size());
+    for (auto& [k, v] : omap) {
+      ASSERT_TRUE(bl_eq(v, r[k]));
+    }
+  };
+  {
+    // per-pool
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.touch(cid, oid);
+    t.omap_setheader(cid, oid, h);
+    t.omap_setkeys(cid, oid, omap);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bstore->umount();
+  SetVal(g_conf(), "bluestore_omap_per_pg", "true");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  bstore->mount();
+  ch = store->open_collection(cid);
+  {
+    // per-pg, and clones across the two layouts
+    ObjectStore::Transaction t;
+    t.touch(cid, oid2);
+    t.omap_setheader(cid, oid2, h);
+    t.omap_setkeys(cid, oid2, omap);
+    t.clone(cid, oid, oid3);
+    t.clone(cid, oid2, oid4);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  for (auto& o : {oid, oid2, oid3, oid4}) {
+    check_omap(o);
+  }
+  {
+    ObjectStore::Transaction t;
+    set<string> keys = {"a"};
+    t.omap_rmkeys(cid, oid2, keys);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+    bufferlist rh;
+    map<string, bufferlist> res;
+    ASSERT_EQ(0, store->omap_get(ch, oid2, &rh, &res));
+    ASSERT_EQ(1u, res.size());
+    ASSERT_EQ(1u, res.count("b"));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.omap_setkeys(cid, oid2, omap);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bstore->umount();
+  ASSERT_EQ(bstore->fsck(false), 0);
+  // convert the remaining per-pool object
+  bstore->repair(false);
+  ASSERT_EQ(bstore->fsck(true), 0);
+  SetVal(g_conf(), "bluestore_omap_per_pg", "false");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  ASSERT_EQ(bstore->fsck(false), 0);
+  bstore->mount();
+  ch = store->open_collection(cid);
+  for (auto& o : {oid, oid2, oid3, oid4}) {
+    check_omap(o);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, oid);
+    t.remove(cid, oid2);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bstore->umount();
+  ASSERT_EQ(bstore->fsck(true), 0);
+  bstore->mount();
+}
+
+TEST_P(StoreTest, BluestoreOnodePrefetch)
+{
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  const int num = 300;
+  coll_t cid(spg_t(pg_t(0, 556), shard_id_t::NO_SHARD));
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    for (int i = 0; i < num; i++) {
+      t.touch(cid, make_object(stringify(i).c_str(), 556));
+    }
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // start with a cold cache
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+  ch = store->open_collection(cid);
+
+  auto logger = store->get_perf_counters();
+  vector<ghobject_t> ls;
+  ghobject_t next;
+  ASSERT_EQ(0, store->collection_list(ch, ghobject_t(), ghobject_t::get_max(),
+				      INT_MAX, &ls, &next));
+  ASSERT_EQ(num, (int)ls.size());
+  store->prefetch_objects(ch, ls);
+  for (int i = 0; i < 100 && logger->get(l_bluestore_onode_prefetched) < num;
+       i++) {
+    usleep(10000);
+  }
+  ASSERT_EQ(num, (int)logger->get(l_bluestore_onode_prefetched));
+  ASSERT_EQ(0u, logger->get(l_bluestore_onode_prefetch_dropped));
+
+  uint64_t misses = logger->get(l_bluestore_onode_misses);
+  for (auto& oid : ls) {
+    struct stat st;
+    ASSERT_EQ(0, store->stat(ch, oid, &st));
+  }
+  ASSERT_EQ(misses, logger->get(l_bluestore_onode_misses));
+
+  // everything is cached now, nothing more to load
+  store->prefetch_objects(ch, ls);
+  usleep(100000);
+  ASSERT_EQ(num, (int)logger->get(l_bluestore_onode_prefetched));
+
+  // disabled: nothing is queued, so nothing is dropped either
+  SetVal(g_conf(), "bluestore_onode_prefetch_queue", "0");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  store->prefetch_objects(ch, ls);
+  ASSERT_EQ(0u, logger->get(l_bluestore_onode_prefetch_dropped));
+  SetVal(g_conf(), "bluestore_onode_prefetch_queue", "1024");
+  g_ceph_context->_conf.apply_changes(nullptr);
+}
+
+TEST_P(StoreTest, BluestoreCompressWorkers)
+{
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  SetVal(g_conf(), "bluestore_compression_threads", "4");
+  SetVal(g_conf(), "bluestore_compression_mode", "force");
+  SetVal(g_conf(), "bluestore_compression_max_blob_size", "65536");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->mount());
+
+  const unsigned len = 1048576;
+  coll_t cid;
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  auto logger = store->get_perf_counters();
+
+  // compressible: every blob of the write compresses, whoever does it
+  ghobject_t a(hobject_t(sobject_t("compressible", CEPH_NOSNAP)));
+  bufferlist abl;
+  for (unsigned i = 0; i < len / 8; ++i) {
+    abl.append("abcdabcd", 8);
+  }
+  uint64_t offloaded = logger->get(l_bluestore_compress_offloaded_count);
+  // the writing thread compresses too, and may get to every blob of a
+  // write before a worker wakes up; rewrite until the workers took some
+  for (int i = 0; i < 100; ++i) {
+    uint64_t success = logger->get(l_bluestore_compress_success_count);
+    {
+      ObjectStore::Transaction t;
+      t.write(cid, a, 0, abl.length(), abl);
+      int r = queue_transaction(store, ch, std::move(t));
+      ASSERT_EQ(r, 0);
+    }
+    ASSERT_EQ(success + len / 65536,
+	      logger->get(l_bluestore_compress_success_count));
+    if (logger->get(l_bluestore_compress_offloaded_count) > offloaded) {
+      break;
+    }
+  }
+  ASSERT_LT(offloaded, logger->get(l_bluestore_compress_offloaded_count));
+  {
+    bufferlist in;
+    ASSERT_EQ((int)len, store->read(ch, a, 0, len, in));
+    ASSERT_TRUE(bl_eq(abl, in));
+  }
+
+  // incompressible: once the average is poor we stop trying for a while
+  SetVal(g_conf(), "bluestore_compression_adaptive_skip", "8");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  ghobject_t b(hobject_t(sobject_t("random", CEPH_NOSNAP)));
+  bufferlist bbl;
+  {
+    bufferptr bp(len);
+    for (unsigned i = 0; i < len; ++i) {
+      bp.c_str()[i] = rand();
+    }
+    bbl.append(bp);
+  }
+  for (int i = 0; i < 3; ++i) {
+    ObjectStore::Transaction t;
+    t.write(cid, b, 0, bbl.length(), bbl);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_LT(0u, logger->get(l_bluestore_compress_skipped_count));
+  {
+    bufferlist in;
+    ASSERT_EQ((int)len, store->read(ch, b, 0, len, in));
+    ASSERT_TRUE(bl_eq(bbl, in));
+  }
+
+  SetVal(g_conf(), "bluestore_compression_adaptive_skip", "0");
+  SetVal(g_conf(), "bluestore_compression_threads", "0");
+  SetVal(g_conf(), "bluestore_compression_mode", "none");
+  SetVal(g_conf(), "bluestore_compression_max_blob_size", "0");
+  g_ceph_context->_conf.apply_changes(nullptr);
+}
+
+TEST_P(StoreTest, BluestoreWriteAmp)
+{
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+  bstore->reset_write_amp();
+  auto logger = store->get_perf_counters();
+  uint64_t client = logger->get(l_bluestore_write_amp_client_bytes);
+  uint64_t data = logger->get(l_bluestore_write_amp_data_bytes) +
+    logger->get(l_bluestore_write_amp_deferred_bytes);
+  uint64_t kv = logger->get(l_bluestore_write_amp_kv_bytes);
+
+  coll_t cid(spg_t(pg_t(0, 557), shard_id_t::NO_SHARD));
+  auto ch = store->create_new_collection(cid);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ghobject_t hoid = make_object("write_amp", 557);
+  bufferlist bl;
+  bl.append(std::string(1048576, 'a'));
+  bufferlist omap;
+  omap.append(std::string(100, 'b'));
+  {
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 0, bl.length(), bl);
+    map<string, bufferlist> kvs;
+    kvs["key"] = omap;
+    t.omap_setkeys(cid, hoid, kvs);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_EQ(client + bl.length() + 3 + omap.length(),
+	    logger->get(l_bluestore_write_amp_client_bytes));
+  // directly or deferred, depending on the device
+  ASSERT_LE(data + bl.length(),
+	    logger->get(l_bluestore_write_amp_data_bytes) +
+	    logger->get(l_bluestore_write_amp_deferred_bytes));
+  ASSERT_LT(kv, logger->get(l_bluestore_write_amp_kv_bytes));
+
+  JSONFormatter f;
+  bstore->dump_write_amp(&f);
+  std::stringstream ss;
+  f.flush(ss);
+  cout << ss.str() << std::endl;
+  ASSERT_NE(std::string::npos, ss.str().find("\"pool_id\":557,\"client_bytes\":" +
+				       stringify(bl.length() + 3 + omap.length())));
+}
+
+TEST_P(StoreTest, BluestorePerPgOmapRename)
+{
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+  SetVal(g_conf(), "bluestore_omap_per_pg", "true");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  bstore->umount();
+  bstore->mount();
+
+  const uint64_t pool = 556;
+  coll_t cid(spg_t(pg_t(0, pool), shard_id_t::NO_SHARD));
+  // per-pg omap keys include the hash, so these live in different ranges
+  ghobject_t oid(hobject_t("src_oid", "", CEPH_NOSNAP, 1, pool, ""));
+  ghobject_t oid2(hobject_t("dest_oid", "", CEPH_NOSNAP, 0x80000000, pool, ""));
+  auto ch = store->create_new_collection(cid);
+  map<string, bufferlist> omap;
+  omap["a"].append("value a");
+  omap["b"].append("value b");
+  bufferlist h;
+  h.append("header");
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.touch(cid, oid);
+    t.omap_setheader(cid, oid, h);
+    t.omap_setkeys(cid, oid, omap);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.collection_move_rename(cid, oid, cid, oid2);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_FALSE(store->exists(ch, oid));
+  {
+    bufferlist rh;
+    map<string, bufferlist> r;
+    ASSERT_EQ(0, store->omap_get(ch, oid2, &rh, &r));
+    ASSERT_TRUE(bl_eq(h, rh));
+    ASSERT_EQ(omap.size(), r.size());
+    for (auto& [k, v] : omap) {
+      ASSERT_TRUE(bl_eq(v, r[k]));
+    }
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, oid2);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  bstore->umount();
+  // omap left behind under the old hash shows up as stray
+  ASSERT_EQ(bstore->fsck(false), 0);
+  SetVal(g_conf(), "bluestore_omap_per_pg", "false");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  bstore->mount();
+}
+
+TEST_P(StoreTest, BluestorePerPgOmapRemoveCollection)
+{
+  if (string(GetParam()) != "bluestore")
+    return;
+
+  BlueStore* bstore = dynamic_cast<BlueStore*> (store.get());
+  SetVal(g_conf(), "bluestore_omap_per_pg", "true");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  bstore->umount();
+  bstore->mount();
+
+  // the last PG of the pool, whose key range ends at the next pool, next
+  // to another PG of the pool and a PG of the next pool
+  const uint64_t pool = 557;
+  const unsigned bits = 2;
+  coll_t cid(spg_t(pg_t(3, pool), shard_id_t::NO_SHARD));
+  coll_t cid2(spg_t(pg_t(1, pool), shard_id_t::NO_SHARD));
+  coll_t cid3(spg_t(pg_t(0, pool + 1), shard_id_t::NO_SHARD));
+  vector<ghobject_t> oids;
+  for (uint32_t hash : {3u, 7u, 0xffffffffu}) {
+    oids.emplace_back(hobject_t("obj" + stringify(hash), "", CEPH_NOSNAP,
+				hash, pool, ""));
+  }
+  ghobject_t oid2(hobject_t("other_pg", "", CEPH_NOSNAP, 1, pool, ""));
+  ghobject_t oid3(hobject_t("other_pool", "", CEPH_NOSNAP, 0, pool + 1, ""));
+  map<string, bufferlist> omap;
+  omap["a"].append("value a");
+  omap["b"].append("value b");
+  auto create = [&](const coll_t& c, const vector<ghobject_t>& os,
+		    ObjectStore::CollectionHandle *ch) {
+    *ch = store->create_new_collection(c);
+    ObjectStore::Transaction t;
+    t.create_collection(c, bits);
+    for (auto& o : os) {
+      t.touch(c, o);
+      t.omap_setkeys(c, o, omap);
+    }
+    int r = queue_transaction(store, *ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  };
+  auto omap_size = [&](ObjectStore::CollectionHandle& ch,
+		       const ghobject_t& o) {
+    bufferlist h;
+    map<string, bufferlist> r;
+    store->omap_get(ch, o, &h, &r);
+    return r.size();
+  };
+  ObjectStore::CollectionHandle ch, ch2, ch3;
+  ASSERT_NO_FATAL_FAILURE(create(cid, oids, &ch));
+  ASSERT_NO_FATAL_FAILURE(create(cid2, {oid2}, &ch2));
+  ASSERT_NO_FATAL_FAILURE(create(cid3, {oid3}, &ch3));
+
+  // the hint removes the omap of the whole PG at once
+  {
+    ObjectStore::Transaction t;
+    t.collection_hint(cid, ObjectStore::Transaction::COLL_HINT_REMOVING,
+		      bufferlist());
+    t.remove(cid, oids[0]);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  for (size_t i = 1; i < oids.size(); ++i) {
+    ASSERT_EQ(0u, omap_size(ch, oids[i]));
+  }
+  ASSERT_EQ(omap.size(), omap_size(ch2, oid2));
+  ASSERT_EQ(omap.size(), omap_size(ch3, oid3));
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, oids[1]);
+    t.remove(cid, oids[2]);
+    t.remove_collection(cid);
+    int r = queue_transaction(store, ch, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_EQ(omap.size(), omap_size(ch2, oid2));
+  ASSERT_EQ(omap.size(), omap_size(ch3, oid3));
+  bstore->umount();
+  // nothing of the removed PG is left behind as stray omap
+  ASSERT_EQ(bstore->fsck(false), 0);
+  SetVal(g_conf(), "bluestore_omap_per_pg", "false");
+  g_ceph_context->_conf.apply_changes(nullptr);
+  bstore->mount();
+}
+
 TEST_P(StoreTest, SpuriousReadErrorTest) {
   if (string(GetParam()) != "bluestore")
     return;
@@ -4,6 +4,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <iostream>
+#include <random>
+#include <thread>
+#include <sys/resource.h>
 #include <gtest/gtest.h>
 #include "global/global_init.h"
 #include "global/global_context.h"
@@ -11,8 +14,12 @@
 #include "common/ceph_argparse.h"
 #include "include/stringify.h"
 #include "common/errno.h"
+#include "common/perf_counters_collection.h"
+#include "include/scope_guard.h"
 
+#include "common/ceph_time.h"
 #include "blk/BlockDevice.h"
+#include "blk/kernel/io_uring.h"
 
 class TempBdev {
 public:
@@ -89,6 +96,256 @@ TEST(KernelDevice, Ticket45337) {
   b->close();
 }
 
+static uint64_t get_bdev_counter(const std::string& dev, const char *name)
+{
+  std::string path = "bdev-" + dev.substr(dev.find_last_of('/') + 1) +
+    "." + name;
+  uint64_t v = 0;
+  g_ceph_context->get_perfcounters_collection()->with_counters(
+    [&](const PerfCountersCollectionImpl::CounterMap& by_path) {
+      auto p = by_path.find(path);
+      if (p != by_path.end()) {
+	v = p->second.data->u64;
+      }
+    });
+  return v;
+}
+
+/*
+ * Data written and read back from several threads through io_uring with
+ * SQPOLL and a small pool of registered buffers has to match, both while
+ * reads get registered buffers and once the pool is used up by the
+ * results of earlier reads that are still held.
+ */
+TEST(KernelDevice, IoringFixedBuffersReadBack) {
+  if (!ioring_queue_t::supported()) {
+    GTEST_SKIP() << "io_uring is not supported";
+  }
+  constexpr uint64_t block = 4096;
+  constexpr unsigned threads = 4;
+  constexpr unsigned blocks_per_thread = 64;
+  constexpr unsigned fixed_buffers = 8;
+  auto& conf = g_ceph_context->_conf;
+  conf.set_val("bdev_ioring", "true");
+  conf.set_val("bdev_ioring_sqthread_poll", "true");
+  conf.set_val("bdev_ioring_fixed_buffers", stringify(fixed_buffers));
+  conf.set_val("bdev_ioring_fixed_buffer_size", stringify(2 * block));
+  conf.apply_changes(nullptr);
+  auto reset_conf = make_scope_guard([&] {
+    conf.rm_val("bdev_ioring");
+    conf.rm_val("bdev_ioring_sqthread_poll");
+    conf.rm_val("bdev_ioring_fixed_buffers");
+    conf.rm_val("bdev_ioring_fixed_buffer_size");
+    conf.apply_changes(nullptr);
+  });
+
+  TempBdev bdev{ threads * blocks_per_thread * block };
+  std::unique_ptr<BlockDevice> b(
+    BlockDevice::create(g_ceph_context, bdev.path, NULL, NULL,
+      [](void* handle, void* aio) {}, NULL));
+  int r = b->open(bdev.path);
+  if (r < 0) {
+    std::cerr << "open " << bdev.path << " failed" << std::endl;
+    return;
+  }
+
+  std::vector<std::string> data(threads * blocks_per_thread);
+  std::mt19937_64 rng(0);
+  for (auto& d : data) {
+    d.resize(block);
+    for (auto& c : d) {
+      c = rng();
+    }
+  }
+  auto for_each_thread = [&](auto&& fn) {
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+      workers.emplace_back(fn, t);
+    }
+    for (auto& w : workers) {
+      w.join();
+    }
+  };
+  // payloads that are off page alignment by a byte, so they have to be
+  // copied (into registered buffers) before they are written
+  auto unaligned = [&](unsigned n, unsigned count) {
+    bufferptr p = ceph::buffer::create_page_aligned(count * block + 1);
+    for (unsigned i = 0; i < count; i++) {
+      memcpy(p.c_str() + 1 + i * block, data[n + i].c_str(), block);
+    }
+    bufferlist bl;
+    bl.append(bufferptr(p, 1, count * block));
+    return bl;
+  };
+
+  // every other write covers two blocks
+  for_each_thread([&](unsigned t) {
+    IOContext ioc(g_ceph_context, NULL);
+    for (unsigned i = 0; i < blocks_per_thread; i += 2) {
+      unsigned n = t * blocks_per_thread + i;
+      if (i % 4 == 0) {
+	auto bl = unaligned(n, 2);
+	EXPECT_EQ(0, b->aio_write(n * block, bl, &ioc, false));
+      } else {
+	auto bl = unaligned(n, 1);
+	EXPECT_EQ(0, b->aio_write(n * block, bl, &ioc, false));
+	auto bl2 = unaligned(n + 1, 1);
+	EXPECT_EQ(0, b->aio_write((n + 1) * block, bl2, &ioc, false));
+      }
+    }
+    b->aio_submit(&ioc);
+    ioc.aio_wait();
+    EXPECT_EQ(0, ioc.get_return_value());
+  });
+  ASSERT_FALSE(HasFailure());
+
+  // hold on to every result, so all but the first reads run out of
+  // registered buffers and have to fall back to regular ones
+  auto read_back = [&](unsigned t, std::vector<bufferlist>& held) {
+    for (unsigned i = 0; i < blocks_per_thread; i += 8) {
+      IOContext ioc(g_ceph_context, NULL);
+      for (unsigned j = i; j < i + 8; j++) {
+	unsigned n = t * blocks_per_thread + j;
+	EXPECT_EQ(0, b->aio_read(n * block, block, &held[n], &ioc));
+      }
+      b->aio_submit(&ioc);
+      ioc.aio_wait();
+      EXPECT_EQ(0, ioc.get_return_value());
+    }
+  };
+  {
+    std::vector<bufferlist> held(data.size());
+    for_each_thread([&](unsigned t) {
+      read_back(t, held);
+    });
+    for (unsigned n = 0; n < data.size(); n++) {
+      ASSERT_EQ(block, held[n].length());
+      ASSERT_EQ(0, memcmp(data[n].c_str(), held[n].c_str(), block))
+	<< "block " << n;
+    }
+  }
+
+  uint64_t read_fixed = get_bdev_counter(bdev.path, "read_fixed");
+  if (read_fixed == 0) {
+    // registration failed, e.g. RLIMIT_MEMLOCK; only the data is checked
+    std::cout << "no registered buffers were used" << std::endl;
+  } else {
+    EXPECT_LE(read_fixed, fixed_buffers);
+    EXPECT_GT(get_bdev_counter(bdev.path, "read_fixed_exhausted"), 0u);
+    EXPECT_GT(get_bdev_counter(bdev.path, "write_fixed"), 0u);
+
+    // the buffers went back to the pool along with the results
+    std::vector<bufferlist> held(data.size());
+    read_back(0, held);
+    EXPECT_GT(get_bdev_counter(bdev.path, "read_fixed"), read_fixed);
+    for (unsigned n = 0; n < blocks_per_thread; n++) {
+      ASSERT_EQ(0, memcmp(data[n].c_str(), held[n].c_str(), block))
+	<< "block " << n;
+    }
+  }
+  b->close();
+}
+
+/*
+ * Small random IO from several threads, the way an OSD with a few shards
+ * drives the device. Reports IOPS and CPU time per IO for each backend;
+ * it is meant for comparing them on the same box, not as a pass/fail test.
+ */
+class KernelDeviceBench : public ::testing::TestWithParam<const char*> {
+public:
+  static constexpr uint64_t size = 256ull << 20;
+  static constexpr uint64_t block = 4096;
+  static constexpr unsigned threads = 4;
+  static constexpr unsigned ops_per_thread = 4096;
+  static constexpr unsigned batch = 16;
+
+  void SetUp() override {
+    std::string mode = GetParam();
+    if (mode != "libaio" && !ioring_queue_t::supported()) {
+      GTEST_SKIP() << "io_uring is not supported";
+    }
+    auto& conf = g_ceph_context->_conf;
+    conf.set_val("bdev_ioring", mode == "libaio" ? "false" : "true");
+    conf.set_val("bdev_ioring_sqthread_poll",
+		 mode == "io_uring_tuned" ? "true" : "false");
+    conf.set_val("bdev_ioring_fixed_buffers",
+		 mode == "io_uring_tuned" ? "256" : "0");
+    conf.set_val("bdev_ioring_fixed_buffer_size", stringify(block));
+    conf.apply_changes(nullptr);
+  }
+  void TearDown() override {
+    auto& conf = g_ceph_context->_conf;
+    conf.rm_val("bdev_ioring");
+    conf.rm_val("bdev_ioring_sqthread_poll");
+    conf.rm_val("bdev_ioring_fixed_buffers");
+    conf.rm_val("bdev_ioring_fixed_buffer_size");
+    conf.apply_changes(nullptr);
+  }
+
+  static double cpu_seconds() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+      (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+  }
+
+  void run(BlockDevice *b, bool write) {
+    std::vector<std::thread> workers;
+    double cpu_start = cpu_seconds();
+    auto start = ceph::mono_clock::now();
+    for (unsigned t = 0; t < threads; t++) {
+      workers.emplace_back([=] {
+	std::mt19937_64 rng(t);
+	bufferlist data;
+	data.append(string(block, 'a' + t));
+	for (unsigned i = 0; i < ops_per_thread; i += batch) {
+	  IOContext ioc(g_ceph_context, NULL);
+	  bufferlist out;
+	  for (unsigned j = 0; j < batch; j++) {
+	    uint64_t off = (rng() % (size / block)) * block;
+	    int r = write ?
+	      b->aio_write(off, data, &ioc, false) :
+	      b->aio_read(off, block, &out, &ioc);
+	    ASSERT_EQ(0, r);
+	  }
+	  b->aio_submit(&ioc);
+	  ioc.aio_wait();
+	  ASSERT_EQ(0, ioc.get_return_value());
+	}
+      });
+    }
+    for (auto& w : workers) {
+      w.join();
+    }
+    double secs = ceph::to_seconds<double>(ceph::mono_clock::now() - start);
+    double cpu = cpu_seconds() - cpu_start;
+    unsigned ops = threads * ops_per_thread;
+    std::cout << GetParam() << (write ? " write" : " read")
+	      << ": " << ops / secs << " IOPS, "
+	      << cpu * 1000000.0 / ops << " us cpu/IO" << std::endl;
+  }
+};
+
+TEST_P(KernelDeviceBench, RandomIO) {
+  TempBdev bdev{ size };
+  std::unique_ptr<BlockDevice> b(
+    BlockDevice::create(g_ceph_context, bdev.path, NULL, NULL,
+      [](void* handle, void* aio) {}, NULL));
+  int r = b->open(bdev.path);
+  if (r < 0) {
+    std::cerr << "open " << bdev.path << " failed" << std::endl;
+    return;
+  }
+  run(b.get(), true);
+  run(b.get(), false);
+  b->close();
+}
+
+INSTANTIATE_TEST_SUITE_P(
+  KernelDevice,
+  KernelDeviceBench,
+  ::testing::Values("libaio", "io_uring", "io_uring_tuned"));
+
 int main(int argc, char **argv) {
   vector<const char*> args;
   argv_to_vec(argc, (const char **)argv, args);
@@ -9,6 +9,8 @@
 #include <unistd.h>
 #include <random>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <stack>
 #include "global/global_init.h"
 #include "common/ceph_argparse.h"
@@ -707,6 +709,429 @@ TEST(BlueFS, test_replay_growth) {
   fs.umount();
 }
 
+// the WAL written by wal_fsync_vs_sst must read back intact
+static void check_wal(BlueFS &fs, const string& dir, unsigned wal_ops)
+{
+  std::unique_ptr<char[]> data = gen_buffer(4096);
+  uint64_t size;
+  utime_t mtime;
+  ASSERT_EQ(0, fs.stat(dir, "wal", &size, &mtime));
+  ASSERT_EQ(wal_ops * 4096ull, size);
+  BlueFS::FileReader *r;
+  ASSERT_EQ(0, fs.open_for_read(dir, "wal", &r));
+  std::unique_ptr<BlueFS::FileReader> rg(r);
+  for (unsigned i = 0; i < wal_ops; i++) {
+    bufferlist bl;
+    ASSERT_EQ(4096, fs.read(r, i * 4096, 4096, &bl, nullptr));
+    ASSERT_EQ(0, memcmp(bl.c_str(), data.get(), 4096)) << dir << " " << i;
+  }
+}
+
+// One WAL-like writer doing small append+fsync while a number of
+// SST-like writers stream large flushes in parallel.
+static void wal_fsync_vs_sst(BlueFS &fs, unsigned num_sst, unsigned wal_ops,
+			     double *avg_lat, double *max_lat)
+{
+  const string dir = "dir." + stringify(num_sst);
+  ASSERT_EQ(0, fs.mkdir(dir));
+  std::unique_ptr<char[]> data = gen_buffer(4096);
+  {
+    std::atomic<bool> stop = false;
+    std::vector<std::thread> sst_threads;
+    // stop and join the writers however we leave this scope
+    auto sg = make_scope_guard([&stop, &sst_threads] {
+      stop = true;
+      join_all(sst_threads);
+    });
+    for (unsigned i = 0; i < num_sst; i++) {
+      sst_threads.emplace_back([&fs, &stop, dir, i] {
+	const size_t chunk = 1048576;
+	std::unique_ptr<char[]> buf = gen_buffer(chunk);
+	unsigned n = 0;
+	while (!stop) {
+	  BlueFS::FileWriter *h;
+	  string file = "sst." + stringify(i) + "." + stringify(n++);
+	  int r = fs.open_for_write(dir, file, &h, false);
+	  EXPECT_EQ(0, r);
+	  if (r != 0) {
+	    break;
+	  }
+	  for (unsigned j = 0; j < 4 && !stop; j++) {
+	    h->append(buf.get(), chunk);
+	    fs.flush(h, true);
+	  }
+	  fs.fsync(h);
+	  fs.close_writer(h);
+	  r = fs.unlink(dir, file);
+	  EXPECT_EQ(0, r);
+	  if (r != 0) {
+	    break;
+	  }
+	}
+      });
+    }
+
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write(dir, "wal", &h, false));
+    auto hg = make_scope_guard([&fs, h] { fs.close_writer(h); });
+    double total = 0;
+    *max_lat = 0;
+    for (unsigned i = 0; i < wal_ops; i++) {
+      h->append(data.get(), 4096);
+      auto start = mono_clock::now();
+      ASSERT_EQ(0, fs.fsync(h));
+      double lat =
+	std::chrono::duration<double>(mono_clock::now() - start).count();
+      total += lat;
+      *max_lat = std::max(*max_lat, lat);
+    }
+    *avg_lat = total / wal_ops;
+  }
+  check_wal(fs, dir, wal_ops);
+}
+
+TEST(BlueFS, test_wal_fsync_vs_sst_flush) {
+  uint64_t size = 1048576LL * 512;
+  TempBdev bdev{size};
+
+  ConfSaver conf(g_ceph_context->_conf);
+  conf.SetVal("bluefs_alloc_size", "65536");
+  conf.SetVal("bluefs_compact_log_sync", "false");
+  conf.ApplyChanges();
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false, 1048576));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.maybe_verify_layout({ BlueFS::BDEV_DB, false, false }));
+
+  const unsigned wal_ops = 500;
+  for (unsigned num_sst : {0, 1, 2, 4}) {
+    double avg_lat, max_lat;
+    ASSERT_NO_FATAL_FAILURE(
+      wal_fsync_vs_sst(fs, num_sst, wal_ops, &avg_lat, &max_lat));
+    std::cout << "sst writers " << num_sst
+	      << " wal fsync avg " << avg_lat * 1000000 << "us"
+	      << " max " << max_lat * 1000000 << "us" << std::endl;
+  }
+
+  // park an SST flush right before it writes its data: WAL fsyncs must
+  // still complete, since the data is written without the global lock.
+  const string dir = "dir.parked";
+  const unsigned parked_ops = 10;
+  ASSERT_EQ(0, fs.mkdir(dir));
+  {
+    std::mutex m;
+    std::condition_variable cv;
+    BlueFS::FileWriter *sst = nullptr;
+    bool parked = false;
+    bool release = false;
+    bool sst_flushed = false;
+    fs.set_flush_data_hook([&](BlueFS::FileWriter *h) {
+      std::unique_lock l(m);
+      if (h != sst || parked) {
+	return;
+      }
+      parked = true;
+      cv.notify_all();
+      // give up eventually so that a regression fails rather than hangs
+      cv.wait_for(l, std::chrono::seconds(60), [&] { return release; });
+    });
+    std::thread sst_thread([&] {
+      std::unique_ptr<char[]> buf = gen_buffer(1048576);
+      BlueFS::FileWriter *h;
+      ASSERT_EQ(0, fs.open_for_write(dir, "sst", &h, false));
+      {
+	std::lock_guard l(m);
+	sst = h;
+      }
+      h->append(buf.get(), 1048576);
+      fs.flush(h, true);
+      {
+	std::lock_guard l(m);
+	sst_flushed = true;
+      }
+      ASSERT_EQ(0, fs.fsync(h));
+      fs.close_writer(h);
+    });
+    auto sg = make_scope_guard([&] {
+      {
+	std::lock_guard l(m);
+	release = true;
+      }
+      cv.notify_all();
+      sst_thread.join();
+      fs.set_flush_data_hook(nullptr);
+    });
+    {
+      std::unique_lock l(m);
+      ASSERT_TRUE(cv.wait_for(l, std::chrono::seconds(60),
+			      [&] { return parked; }));
+    }
+
+    std::unique_ptr<char[]> data = gen_buffer(4096);
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write(dir, "wal", &h, false));
+    for (unsigned i = 0; i < parked_ops; i++) {
+      h->append(data.get(), 4096);
+      ASSERT_EQ(0, fs.fsync(h));
+    }
+    fs.close_writer(h);
+    std::lock_guard l(m);
+    EXPECT_FALSE(sst_flushed)
+      << "wal fsync waited for the sst flush to write its data";
+  }
+  fs.umount(true);
+
+  // and everything replays
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.maybe_verify_layout({ BlueFS::BDEV_DB, false, false }));
+  for (unsigned num_sst : {0, 1, 2, 4}) {
+    ASSERT_NO_FATAL_FAILURE(check_wal(fs, "dir." + stringify(num_sst), wal_ops));
+  }
+  ASSERT_NO_FATAL_FAILURE(check_wal(fs, dir, parked_ops));
+  fs.umount();
+}
+
+TEST(BlueFS, test_wal_envelope) {
+  uint64_t size = 1048576LL * 128;
+  TempBdev bdev{size};
+
+  ConfSaver conf(g_ceph_context->_conf);
+  conf.SetVal("bluefs_alloc_size", "65536");
+  conf.SetVal("bluefs_wal_envelope_mode", "true");
+  conf.SetVal("bluefs_wal_envelope_prealloc", "16777216");
+  conf.ApplyChanges();
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false, 1048576));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.maybe_verify_layout({ BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mkdir("db.wal"));
+
+  auto check = [&fs](const string& expected) {
+    uint64_t fsize;
+    utime_t mtime;
+    ASSERT_EQ(0, fs.stat("db.wal", "000001.log", &fsize, &mtime));
+    ASSERT_EQ(expected.size(), fsize);
+    BlueFS::FileReader *r;
+    ASSERT_EQ(0, fs.open_for_read("db.wal", "000001.log", &r));
+    bufferlist bl;
+    ASSERT_EQ((int64_t)expected.size(),
+	      fs.read(r, 0, expected.size(), &bl, nullptr));
+    ASSERT_TRUE(bl.contents_equal(expected.c_str(), expected.size()));
+    // and a read spanning envelopes at an odd offset
+    std::string part(1000, '\0');
+    ASSERT_EQ(1000, fs.read_random(r, 4000, 1000, part.data()));
+    ASSERT_EQ(expected.substr(4000, 1000), part);
+    delete r;
+  };
+
+  std::unique_ptr<char[]> buf = gen_buffer(16384);
+  string expected;
+  BlueFS::FileWriter *h;
+  ASSERT_EQ(0, fs.open_for_write("db.wal", "000001.log", &h, false));
+  h->append(buf.get(), 100);
+  expected.append(buf.get(), 100);
+  ASSERT_EQ(0, fs.fsync(h));
+  auto logged = fs.get_perf_counters()->get(l_bluefs_logged_bytes);
+  for (size_t i = 1; i < 200; i++) {
+    size_t len = 1 + (i * 7919) % 9000;
+    h->append(buf.get() + i, len);
+    expected.append(buf.get() + i, len);
+    ASSERT_EQ(0, fs.fsync(h));
+  }
+  // appends within the preallocated space never touch the bluefs log
+  ASSERT_EQ(logged, fs.get_perf_counters()->get(l_bluefs_logged_bytes));
+  fs.close_writer(h);
+  check(expected);
+
+  // the size is recovered by scanning
+  fs.umount(true);
+  ASSERT_EQ(0, fs.mount());
+  check(expected);
+
+  // reusing the file must not resurrect envelopes of the old incarnation
+  ASSERT_EQ(0, fs.open_for_write("db.wal", "000001.log", &h, true));
+  expected.clear();
+  for (size_t i = 0; i < 10; i++) {
+    h->append(buf.get() + 100 + i, 1000);
+    expected.append(buf.get() + 100 + i, 1000);
+    ASSERT_EQ(0, fs.fsync(h));
+  }
+  fs.close_writer(h);
+  fs.umount(true);
+  ASSERT_EQ(0, fs.mount());
+  check(expected);
+  fs.umount();
+}
+
+// what replay makes of a WAL whose tail was damaged by a crash
+TEST(BlueFS, test_wal_envelope_recovery) {
+  uint64_t size = 1048576LL * 128;
+  TempBdev bdev{size};
+
+  ConfSaver conf(g_ceph_context->_conf);
+  conf.SetVal("bluefs_alloc_size", "65536");
+  conf.SetVal("bluefs_wal_envelope_mode", "true");
+  conf.SetVal("bluefs_wal_envelope_prealloc", "16777216");
+  conf.ApplyChanges();
+
+  BlueFS fs(g_ceph_context);
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, bdev.path, false, 1048576));
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid, { BlueFS::BDEV_DB, false, false }));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("db.wal"));
+
+  const size_t num = 10, len = 3000;
+  std::unique_ptr<char[]> buf = gen_buffer(len + num);
+  // one envelope per fsync
+  auto write_wal = [&](const string& file, bool overwrite, size_t count,
+		       string *expected) {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("db.wal", file, &h, overwrite));
+    expected->clear();
+    for (size_t i = 0; i < count; i++) {
+      h->append(buf.get() + i, len);
+      expected->append(buf.get() + i, len);
+      ASSERT_EQ(0, fs.fsync(h));
+    }
+    fs.close_writer(h);
+  };
+  auto check = [&fs](const string& file, const string& expected) {
+    uint64_t fsize;
+    utime_t mtime;
+    ASSERT_EQ(0, fs.stat("db.wal", file, &fsize, &mtime));
+    ASSERT_EQ(expected.size(), fsize);
+    BlueFS::FileReader *r;
+    ASSERT_EQ(0, fs.open_for_read("db.wal", file, &r));
+    std::unique_ptr<BlueFS::FileReader> rg(r);
+    bufferlist bl;
+    ASSERT_EQ((int64_t)expected.size(),
+	      fs.read(r, 0, expected.size(), &bl, nullptr));
+    ASSERT_TRUE(bl.contents_equal(expected.c_str(), expected.size()));
+  };
+  // device offsets of the file's envelopes, as found by the last replay
+  auto locate = [&fs](const string& file, std::vector<uint64_t> *envs,
+		      uint64_t *nonce) {
+    BlueFS::FileReader *r;
+    ASSERT_EQ(0, fs.open_for_read("db.wal", file, &r));
+    std::unique_ptr<BlueFS::FileReader> rg(r);
+    bluefs_fnode_t fnode = r->file->fnode;
+    *nonce = fnode.envelope_nonce;
+    envs->clear();
+    for (auto& [off, disk_off] : r->file->envelope_index) {
+      uint64_t x_off;
+      auto p = fnode.seek(disk_off, &x_off);
+      ASSERT_TRUE(p != fnode.extents.end());
+      envs->push_back(p->offset + x_off);
+    }
+  };
+  // write and read the device behind the unmounted bluefs, as a crash
+  // would have left it
+  auto poke = [&bdev](uint64_t off, const void *data, size_t l) {
+    int fd = ::open(bdev.path.c_str(), O_RDWR);
+    ASSERT_LE(0, fd);
+    ASSERT_EQ((ssize_t)l, ::pwrite(fd, data, l, off));
+    ASSERT_EQ(0, ::fsync(fd));
+    ::close(fd);
+  };
+  auto peek = [&bdev](uint64_t off, bluefs_wal_envelope_t *hdr) {
+    int fd = ::open(bdev.path.c_str(), O_RDONLY);
+    ASSERT_LE(0, fd);
+    ASSERT_EQ((ssize_t)sizeof(*hdr), ::pread(fd, hdr, sizeof(*hdr), off));
+    ::close(fd);
+  };
+  auto remount = [&fs]() {
+    fs.umount(true);
+    ASSERT_EQ(0, fs.mount());
+  };
+
+  std::vector<uint64_t> envs;
+  uint64_t nonce;
+  string expected;
+
+  // a bad crc in the last envelope: its write was torn
+  ASSERT_NO_FATAL_FAILURE(write_wal("000001.log", false, num, &expected));
+  ASSERT_NO_FATAL_FAILURE(remount());
+  ASSERT_NO_FATAL_FAILURE(locate("000001.log", &envs, &nonce));
+  ASSERT_EQ(num, envs.size());
+  fs.umount(true);
+  {
+    char c;
+    uint64_t off = envs.back() + sizeof(bluefs_wal_envelope_t) + 100;
+    int fd = ::open(bdev.path.c_str(), O_RDONLY);
+    ASSERT_LE(0, fd);
+    ASSERT_EQ(1, ::pread(fd, &c, 1, off));
+    ::close(fd);
+    c = ~c;
+    ASSERT_NO_FATAL_FAILURE(poke(off, &c, 1));
+  }
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_NO_FATAL_FAILURE(check("000001.log", expected.substr(0, (num - 1) * len)));
+
+  // a torn length in the last envelope's header, pointing past the
+  // preallocated space
+  ASSERT_NO_FATAL_FAILURE(write_wal("000002.log", false, num, &expected));
+  ASSERT_NO_FATAL_FAILURE(remount());
+  ASSERT_NO_FATAL_FAILURE(locate("000002.log", &envs, &nonce));
+  ASSERT_EQ(num, envs.size());
+  fs.umount(true);
+  {
+    ceph_le32 torn;
+    torn = 0xfffff000;
+    ASSERT_NO_FATAL_FAILURE(poke(
+      envs.back() + offsetof(bluefs_wal_envelope_t, length),
+      &torn, sizeof(torn)));
+  }
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_NO_FATAL_FAILURE(check("000002.log", expected.substr(0, (num - 1) * len)));
+  // and one that is only a little longer than the payload written
+  ASSERT_NO_FATAL_FAILURE(write_wal("000002.log", true, num, &expected));
+  ASSERT_NO_FATAL_FAILURE(remount());
+  ASSERT_NO_FATAL_FAILURE(locate("000002.log", &envs, &nonce));
+  ASSERT_EQ(num, envs.size());
+  fs.umount(true);
+  {
+    ceph_le32 torn;
+    torn = len + 100;
+    ASSERT_NO_FATAL_FAILURE(poke(
+      envs.back() + offsetof(bluefs_wal_envelope_t, length),
+      &torn, sizeof(torn)));
+  }
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_NO_FATAL_FAILURE(check("000002.log", expected.substr(0, (num - 1) * len)));
+
+  // the previous incarnation's envelopes follow the new ones, in place
+  // and with the very seq replay expects next; only the nonce differs
+  ASSERT_NO_FATAL_FAILURE(write_wal("000003.log", false, num, &expected));
+  ASSERT_NO_FATAL_FAILURE(remount());
+  std::vector<uint64_t> old_envs;
+  uint64_t old_nonce;
+  ASSERT_NO_FATAL_FAILURE(locate("000003.log", &old_envs, &old_nonce));
+  ASSERT_EQ(num, old_envs.size());
+  ASSERT_NO_FATAL_FAILURE(write_wal("000003.log", true, num / 2, &expected));
+  ASSERT_NO_FATAL_FAILURE(remount());
+  ASSERT_NO_FATAL_FAILURE(locate("000003.log", &envs, &nonce));
+  ASSERT_NE(old_nonce, nonce);
+  ASSERT_EQ(num / 2, envs.size());
+  fs.umount(true);
+  {
+    bluefs_wal_envelope_t hdr;
+    ASSERT_NO_FATAL_FAILURE(peek(old_envs[num / 2], &hdr));
+    ASSERT_EQ(bluefs_wal_envelope_t::MAGIC, (uint32_t)hdr.magic);
+    ASSERT_EQ(num / 2, (uint64_t)hdr.seq);
+    ASSERT_EQ(old_nonce, (uint64_t)hdr.nonce);
+  }
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_NO_FATAL_FAILURE(check("000003.log", expected));
+  fs.umount();
+}
+
 int main(int argc, char **argv) {
   vector<const char*> args;
   argv_to_vec(argc, (const char **)argv, args);
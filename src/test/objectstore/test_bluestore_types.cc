@@ -12,6 +12,8 @@
 #include "global/global_init.h"
 #include "global/global_context.h"
 
+#include <fstream>
+#include <random>
 #include <sstream>
 
 #define _STR(x) #x
@@ -334,6 +336,99 @@ TEST(bluestore_blob_t, csum_bench)
   }
 }
 
+TEST(bluestore_blob_t, csum_fragmented)
+{
+  // the same data in one buffer and cut into pieces that split csum
+  // blocks must give the same checksums
+  bufferptr bp(65536);
+  for (unsigned i = 0; i < bp.length(); ++i) {
+    bp.c_str()[i] = rand();
+  }
+  bufferlist whole;
+  whole.append(bp);
+  bufferlist pieces;
+  for (unsigned off = 0; off < bp.length(); ) {
+    unsigned len = std::min<unsigned>(bp.length() - off, 1 + rand() % 10000);
+    pieces.append(bufferptr(bp, off, len));
+    off += len;
+  }
+  for (unsigned csum_type = Checksummer::CSUM_NONE + 1;
+       csum_type < Checksummer::CSUM_MAX;
+       ++csum_type) {
+    bluestore_blob_t a, b;
+    a.init_csum(csum_type, 12, whole.length());
+    b.init_csum(csum_type, 12, whole.length());
+    a.calc_csum(0, whole);
+    b.calc_csum(0, pieces);
+    ASSERT_EQ(0, memcmp(a.csum_data.c_str(), b.csum_data.c_str(),
+			a.csum_data.length()))
+      << Checksummer::get_csum_type_string(csum_type);
+    int bad_off;
+    uint64_t bad_csum;
+    ASSERT_EQ(0, a.verify_csum(0, pieces, &bad_off, &bad_csum));
+    ASSERT_EQ(-1, bad_off);
+
+    // a bad block in the middle of a batch
+    bufferlist bad;
+    bad.append(whole.c_str(), whole.length());
+    bad.c_str()[5 * 4096 + 17] ^= 1;
+    ASSERT_EQ(-1, a.verify_csum(0, bad, &bad_off, &bad_csum));
+    ASSERT_EQ(5 * 4096, bad_off);
+  }
+}
+
+TEST(bluestore_blob_t, csum_chunk_bench)
+{
+  // contiguous buffers take the multi block path, the fragmented one
+  // (every block split in two) forces one block at a time
+  bufferptr bp(4194304);
+  for (char *a = bp.c_str(); a < bp.c_str() + bp.length(); ++a)
+    *a = (unsigned long)a & 0xff;
+  int count = 64;
+  for (unsigned order = 12; order <= 16; ++order) {
+    unsigned chunk = 1u << order;
+    bufferlist whole;
+    whole.append(bp);
+    bufferlist split;
+    for (unsigned off = 0; off < bp.length(); off += chunk) {
+      split.append(bufferptr(bp, off, chunk / 2 + 1));
+      split.append(bufferptr(bp, off + chunk / 2 + 1, chunk / 2 - 1));
+    }
+    for (unsigned csum_type = Checksummer::CSUM_NONE + 1;
+	 csum_type < Checksummer::CSUM_MAX;
+	 ++csum_type) {
+      bluestore_blob_t b;
+      b.init_csum(csum_type, order, bp.length());
+      for (auto bl : {&whole, &split}) {
+	int bad_off;
+	uint64_t bad_csum;
+	ceph::mono_clock::time_point start = ceph::mono_clock::now();
+	for (int i = 0; i < count; ++i) {
+	  b.calc_csum(0, *bl);
+	}
+	ceph::mono_clock::time_point mid = ceph::mono_clock::now();
+	for (int i = 0; i < count; ++i) {
+	  ASSERT_EQ(0, b.verify_csum(0, *bl, &bad_off, &bad_csum));
+	  ASSERT_EQ(-1, bad_off);
+	}
+	ceph::mono_clock::time_point end = ceph::mono_clock::now();
+	double bytes = (double)count * (double)bp.length();
+	auto calc = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	  mid - start);
+	auto verify = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	  end - mid);
+	cout << "chunk " << chunk
+	     << " csum_type " << Checksummer::get_csum_type_string(csum_type)
+	     << (bl == &whole ? " contiguous" : " fragmented")
+	     << ", calc " << bytes / 1000.0 / (double)calc.count() * 1000000.0
+	     << " MB/sec, verify "
+	     << bytes / 1000.0 / (double)verify.count() * 1000000.0
+	     << " MB/sec" << std::endl;
+      }
+    }
+  }
+}
+
 TEST(Blob, put_ref)
 {
   {
@@ -1204,6 +1299,196 @@ TEST(ExtentMap, compress_extent_map)
   ASSERT_EQ(6u, em.extent_map.size());
 }
 
+TEST(ExtentMap, compact)
+{
+  BlueStore store(g_ceph_context, "", 4096);
+  BlueStore::OnodeCacheShard *oc = BlueStore::OnodeCacheShard::create(
+    g_ceph_context, "lru", NULL);
+  BlueStore::BufferCacheShard *bc = BlueStore::BufferCacheShard::create(
+    g_ceph_context, "lru", NULL);
+
+  auto coll = ceph::make_ref<BlueStore::Collection>(&store, oc, bc, coll_t());
+  BlueStore::Onode onode(coll.get(), ghobject_t(), "");
+  BlueStore::ExtentMap em(&onode);
+  for (unsigned i = 0; i < 3; ++i) {
+    BlueStore::BlobRef b = coll->new_blob();
+    b->dirty_blob().allocated_test(
+      bluestore_pextent_t(0x40000 * (i + 1), 0x1000));
+    b->get_ref(coll.get(), 0, 0x1000);
+    em.extent_map.insert(*new BlueStore::Extent(0x2000 * i, 0, 0x1000, b));
+  }
+
+  // a dirty inline map can't be rebuilt, keep it
+  ASSERT_EQ(0u, em.compact());
+  ASSERT_EQ(3u, em.extent_map.size());
+
+  unsigned n;
+  ASSERT_FALSE(em.encode_some(0, 0xffffffff, em.inline_bl, &n));
+  ASSERT_EQ(3u, n);
+  ASSERT_EQ(3u, em.compact());
+  ASSERT_TRUE(em.extent_map.empty());
+  ASSERT_FALSE(em.inline_loaded);
+
+  // unsharded maps are decoded from inline_bl, no db needed
+  em.fault_range(nullptr, 0, 0x1000);
+  ASSERT_TRUE(em.inline_loaded);
+  ASSERT_EQ(3u, em.extent_map.size());
+  unsigned i = 0;
+  for (auto& e : em.extent_map) {
+    ASSERT_EQ(0x2000u * i, e.logical_offset);
+    ASSERT_EQ(0x1000u, e.length);
+    ASSERT_EQ(0x40000u * (i + 1), e.blob->get_blob().get_extents()[0].offset);
+    ++i;
+  }
+
+  // extents of blobs with cached data stay
+  bufferlist data;
+  data.append(std::string(0x1000, 'a'));
+  em.extent_map.begin()->blob->shared_blob->bc.did_read(bc, 0, data);
+  ASSERT_EQ(0u, em.compact());
+  ASSERT_EQ(3u, em.extent_map.size());
+
+  // and marking the map dirty decodes it first
+  em.extent_map.begin()->blob->shared_blob->bc.discard(bc, 0, 0x1000);
+  ASSERT_EQ(3u, em.compact());
+  em.dirty_range(0, 0x1000);
+  ASSERT_TRUE(em.inline_loaded);
+  ASSERT_EQ(0u, em.inline_bl.length());
+  ASSERT_EQ(3u, em.extent_map.size());
+}
+
+// Replay a read trace against a buffer cache shard of the given type and
+// return the fraction of bytes served from the cache.  Misses are filled
+// with the whole (block aligned) range, as _do_read() does.
+struct cache_read_t {
+  std::string oid;
+  uint32_t offset;
+  uint32_t length;
+};
+
+static double replay_buffer_cache(const std::string& type,
+				  uint64_t cache_bytes,
+				  const std::vector<cache_read_t>& trace,
+				  uint64_t *ghost_hits)
+{
+  PerfCountersBuilder b(g_ceph_context, "replay_" + type,
+			l_bluestore_first, l_bluestore_last);
+  b.add_u64_counter(l_bluestore_buffer_hit_bytes, "hit_bytes");
+  b.add_u64_counter(l_bluestore_buffer_miss_bytes, "miss_bytes");
+  b.add_u64_counter(l_bluestore_buffer_ghost_hits, "ghost_hits");
+  b.add_u64_counter(l_bluestore_buffer_arc_recent_hits, "arc_recent_hits");
+  b.add_u64_counter(l_bluestore_buffer_arc_frequent_hits, "arc_frequent_hits");
+  std::unique_ptr<PerfCounters> logger(b.create_perf_counters());
+
+  std::unique_ptr<BlueStore::BufferCacheShard> cache(
+    BlueStore::BufferCacheShard::create(g_ceph_context, type, logger.get()));
+  cache->set_max(cache_bytes);
+  std::map<std::string, BlueStore::BufferSpace> spaces;
+  uint64_t hit = 0, total = 0;
+  for (auto& r : trace) {
+    auto& bs = spaces[r.oid];
+    uint32_t offset = p2align<uint32_t>(r.offset, 4096);
+    uint32_t length = p2roundup<uint32_t>(r.offset + r.length, 4096) - offset;
+    BlueStore::ready_regions_t res;
+    interval_set<uint32_t> res_intervals;
+    bs.read(cache.get(), offset, length, res, res_intervals);
+    hit += res_intervals.size();
+    total += length;
+    if (res_intervals.size() < length) {
+      bufferlist bl;
+      bl.append_zero(length);
+      bs.did_read(cache.get(), offset, bl);
+    }
+  }
+  ceph_assert(cache->_get_bytes() <= cache_bytes);
+  *ghost_hits = logger->get(l_bluestore_buffer_ghost_hits);
+  {
+    std::lock_guard l(cache->lock);
+    for (auto& i : spaces) {
+      i.second._clear(cache.get());
+    }
+  }
+  return total ? (double)hit / total : 0;
+}
+
+TEST(BufferCache, replay)
+{
+  std::vector<cache_read_t> trace;
+  uint64_t cache_bytes = 4 << 20;
+  const char *fn = getenv("CEPH_TEST_BUFFER_CACHE_TRACE");
+  if (fn) {
+    // one read per line: <object> <offset> <length>, e.g. pulled out of a
+    // debug_bluestore=15 log with
+    //   sed -n 's/.* read [^ ]* \([^ ]*\) \(0x[0-9a-f]*\)~\([0-9a-f]*\)$/\1 \2 0x\3/p'
+    std::ifstream in(fn);
+    ASSERT_TRUE(in.good());
+    std::string oid, off, len;
+    while (in >> oid >> off >> len) {
+      trace.push_back({oid, (uint32_t)strtoul(off.c_str(), nullptr, 0),
+		       (uint32_t)strtoul(len.c_str(), nullptr, 0)});
+    }
+    if (const char *s = getenv("CEPH_TEST_BUFFER_CACHE_SIZE")) {
+      cache_bytes = strtoull(s, nullptr, 0);
+    }
+  } else {
+    // small random reads over a hot set that fits in the cache, with a
+    // large sequential scan (scrub, backfill, big GETs) every so often
+    std::mt19937 rng(0);
+    std::uniform_int_distribution<uint32_t> hot(0, (2 << 20) / 4096 - 1);
+    unsigned scan = 0;
+    for (unsigned round = 0; round < 20; ++round) {
+      for (unsigned i = 0; i < 2000; ++i) {
+	uint32_t block = hot(rng);
+	trace.push_back({"hot" + stringify(block % 16), block * 4096, 4096});
+      }
+      for (unsigned i = 0; i < 128; ++i) {
+	trace.push_back({"scan" + stringify(scan++), 0, 0x10000});
+      }
+    }
+  }
+  ASSERT_FALSE(trace.empty());
+
+  std::map<std::string, double> ratio;
+  for (auto type : { "lru", "2q", "arc" }) {
+    uint64_t ghost_hits = 0;
+    ratio[type] = replay_buffer_cache(type, cache_bytes, trace, &ghost_hits);
+    std::cout << type << ": " << trace.size() << " reads, "
+	      << byte_u_t(cache_bytes) << " cache, hit ratio " << ratio[type]
+	      << ", ghost hits " << ghost_hits << std::endl;
+  }
+  if (!fn) {
+    // the scans flush the hot set out of the lru every round, arc keeps
+    // it on t2
+    ASSERT_GT(ratio["arc"], ratio["lru"]);
+  }
+}
+
+TEST(BlueStore, cache_numa_nodes)
+{
+  BlueStore store(g_ceph_context, "", 4096);
+  store.set_cache_shards(8);
+  auto dump = [&]() {
+    JSONFormatter f;
+    f.open_object_section("stats");
+    store.dump_cache_stats(&f);
+    f.close_section();
+    std::stringstream ss;
+    f.flush(ss);
+    return ss.str();
+  };
+
+  // cache shards follow the op shard serving the same pgs
+  store.set_cache_numa_nodes({0, 1, 1, -1});
+  std::string s = dump();
+  ASSERT_NE(std::string::npos, s.find("\"node\":0"));
+  ASSERT_NE(std::string::npos, s.find("\"node\":1"));
+  ASSERT_EQ(std::string::npos, s.find("\"node\":-1"));
+
+  // ... unless they'd have to serve several of them
+  store.set_cache_numa_nodes({0, 1, 0});
+  ASSERT_EQ(std::string::npos, dump().find("numa_nodes"));
+}
+
 TEST(GarbageCollector, BasicTest)
 {
   BlueStore::OnodeCacheShard *oc = BlueStore::OnodeCacheShard::create(
@@ -15,6 +15,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <iostream>
+#include <thread>
 #include <time.h>
 #include <sys/mount.h>
 #include "kv/KeyValueDB.h"
@@ -259,6 +260,203 @@ TEST_P(KVTest, Merge) {
   fini();
 }
 
+TEST_P(KVTest, MemDBSkipListSnapshot) {
+  if(string(GetParam()) != "memdb")
+    GTEST_SKIP();
+
+  g_conf().set_val("memdb_index", "skiplist");
+  g_conf().apply_changes(nullptr);
+  ASSERT_EQ(0, db->create_and_open(cout));
+  bufferlist v1, v2;
+  v1.append("1");
+  v2.append("2");
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (int i = 0; i < 10; i++) {
+      t->set("prefix", stringify(i), v1);
+    }
+    t->set("other", "a", v1);
+    db->submit_transaction_sync(t);
+  }
+  auto old_it = db->get_iterator("prefix");
+  old_it->seek_to_first();
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    t->rmkey("prefix", "0");
+    t->rmkey("prefix", "5");
+    t->set("prefix", "3", v2);
+    t->set("prefix", "55", v2);
+    db->submit_transaction_sync(t);
+  }
+  {
+    // the old iterator still sees the state it was created at
+    int count = 0;
+    for (; old_it->valid(); old_it->next()) {
+      bufferlist v = old_it->value();
+      ASSERT_EQ("1", tostr(v));
+      ++count;
+    }
+    ASSERT_EQ(10, count);
+    old_it->seek_to_last();
+    ASSERT_TRUE(old_it->valid());
+    ASSERT_EQ("9", old_it->key());
+    old_it->lower_bound("5");
+    ASSERT_TRUE(old_it->valid());
+    ASSERT_EQ("5", old_it->key());
+    old_it->prev();
+    ASSERT_TRUE(old_it->valid());
+    ASSERT_EQ("4", old_it->key());
+  }
+  {
+    auto it = db->get_iterator("prefix");
+    std::vector<string> keys;
+    for (it->seek_to_first(); it->valid(); it->next()) {
+      keys.push_back(it->key());
+    }
+    std::vector<string> expected = {"1", "2", "3", "4", "55", "6", "7", "8", "9"};
+    ASSERT_EQ(expected, keys);
+    it->lower_bound("5");
+    ASSERT_TRUE(it->valid());
+    ASSERT_EQ("55", it->key());
+    bufferlist v = it->value();
+    ASSERT_EQ("2", tostr(v));
+    it->upper_bound("9");
+    ASSERT_FALSE(it->valid());
+    it->seek_to_last();
+    ASSERT_EQ("9", it->key());
+  }
+  old_it.reset();
+  {
+    bufferlist v;
+    ASSERT_EQ(-ENOENT, db->get("prefix", "0", &v));
+    ASSERT_EQ(0, db->get("prefix", "3", &v));
+    ASSERT_EQ("2", tostr(v));
+  }
+  fini();
+
+  // reload from the dump
+  init();
+  ASSERT_EQ(0, db->open(cout));
+  {
+    bufferlist v;
+    ASSERT_EQ(-ENOENT, db->get("prefix", "5", &v));
+    ASSERT_EQ(0, db->get("prefix", "55", &v));
+    ASSERT_EQ("2", tostr(v));
+    std::set<string> keys = {"a", "b"};
+    std::map<string, bufferlist> out;
+    ASSERT_EQ(0, db->get("other", keys, &out));
+    ASSERT_EQ(1u, out.size());
+  }
+  fini();
+  g_conf().rm_val("memdb_index");
+  g_conf().apply_changes(nullptr);
+}
+
+static uint64_t get_rss_bytes()
+{
+  uint64_t size = 0, rss = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%" SCNu64 " %" SCNu64, &size, &rss) != 2) {
+      rss = 0;
+    }
+    fclose(f);
+  }
+  return rss * sysconf(_SC_PAGESIZE);
+}
+
+TEST_P(KVTest, MemDBIndexBench) {
+  if(string(GetParam()) != "memdb")
+    GTEST_SKIP();
+
+  const int num_keys = 200000;
+  const int num_readers = 4;
+  const double seconds = 2.0;
+  bufferlist value;
+  value.append(string(64, 'v'));
+
+  for (const char *index : {"map", "skiplist"}) {
+    g_conf().set_val("memdb_index", index);
+    g_conf().apply_changes(nullptr);
+    fini();
+    rm_r("kv_test_temp_dir");
+    init();
+    ASSERT_EQ(0, db->create_and_open(cout));
+
+    uint64_t rss_before = get_rss_bytes();
+    for (int i = 0; i < num_keys; i += 1000) {
+      KeyValueDB::Transaction t = db->get_transaction();
+      for (int j = i; j < i + 1000; j++) {
+	t->set("prefix", stringify(j * 7919 % num_keys), value);
+      }
+      db->submit_transaction(t);
+    }
+    uint64_t rss_after = get_rss_bytes();
+
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> reads{0}, scans{0}, writes{0};
+    std::vector<std::thread> threads;
+    for (int r = 0; r < num_readers; r++) {
+      threads.emplace_back([&, r] {
+	uint64_t n = 0, s = 0;
+	unsigned k = r;
+	while (!stop) {
+	  k = k * 1103515245 + 12345;
+	  if (k % 16 == 0) {
+	    // short scan
+	    auto it = db->get_iterator("prefix");
+	    it->lower_bound(stringify(k % num_keys));
+	    for (int i = 0; i < 32 && it->valid(); i++) {
+	      it->next();
+	    }
+	    ++s;
+	  } else {
+	    bufferlist bl;
+	    db->get("prefix", stringify(k % num_keys), &bl);
+	    ++n;
+	  }
+	}
+	reads += n;
+	scans += s;
+      });
+    }
+    threads.emplace_back([&] {
+      uint64_t n = 0;
+      unsigned k = 0;
+      while (!stop) {
+	KeyValueDB::Transaction t = db->get_transaction();
+	for (int i = 0; i < 16; i++) {
+	  k = k * 1103515245 + 12345;
+	  if (k % 4 == 0) {
+	    t->rmkey("prefix", stringify(k % num_keys));
+	  } else {
+	    t->set("prefix", stringify(k % num_keys), value);
+	  }
+	}
+	db->submit_transaction(t);
+	++n;
+      }
+      writes += n;
+    });
+    usleep(seconds * 1000000);
+    stop = true;
+    for (auto& t : threads) {
+      t.join();
+    }
+
+    cout << "memdb_index=" << index
+	 << ": " << (reads / seconds) << " gets/s, "
+	 << (scans / seconds) << " scans/s, "
+	 << (writes / seconds) << " txns/s with " << num_readers
+	 << " readers and 1 writer; "
+	 << ((rss_after - rss_before) / (double)num_keys)
+	 << " bytes/key (rss)" << std::endl;
+    fini();
+  }
+  g_conf().rm_val("memdb_index");
+  g_conf().apply_changes(nullptr);
+}
+
 TEST_P(KVTest, RMRange) {
   ASSERT_EQ(0, db->create_and_open(cout));
   bufferlist value;
@@ -312,6 +510,95 @@ TEST_P(KVTest, RMRange) {
   fini();
 }
 
+TEST_P(KVTest, RocksDBTombstoneCompaction) {
+  if(string(GetParam()) != "rocksdb")
+    GTEST_SKIP();
+
+  g_conf().set_val("rocksdb_tombstone_compact", "true");
+  g_conf().set_val("rocksdb_tombstone_compact_trigger", "100");
+  g_conf().set_val("rocksdb_tombstone_compact_interval", "0");
+  g_conf().apply_changes(nullptr);
+  ASSERT_EQ(0, db->create_and_open(cout));
+  PerfCounters *logger = db->get_perf_counters();
+  bufferlist value;
+  value.append("value");
+  // two "objects": keys share their first 16 bytes
+  string hot(16, 'h'), cold(16, 'c');
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (int i = 0; i < 500; i++) {
+      t->set("prefix", hot + stringify(i), value);
+      t->set("prefix", cold + stringify(i), value);
+    }
+    db->submit_transaction_sync(t);
+  }
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (int i = 0; i < 50; i++) {
+      t->rmkey("prefix", cold + stringify(i));
+    }
+    db->submit_transaction_sync(t);
+  }
+  ASSERT_EQ(0u, logger->get(l_rocksdb_tombstone_compact));
+  ASSERT_EQ(1u, logger->get(l_rocksdb_tombstone_ranges));
+
+  // tombstones an iterator over the hot keys steps over
+  auto skipped_in_hot = [&]() {
+    rocksdb::SetPerfLevel(rocksdb::PerfLevel::kEnableCount);
+    rocksdb::get_perf_context()->Reset();
+    int count = 0;
+    auto it = db->get_iterator("prefix");
+    for (it->lower_bound(hot);
+	 it->valid() && it->key().compare(0, hot.size(), hot) == 0;
+	 it->next()) {
+      ++count;
+    }
+    uint64_t skipped = rocksdb::get_perf_context()->internal_delete_skipped_count;
+    rocksdb::SetPerfLevel(rocksdb::PerfLevel::kDisable);
+    return std::make_pair(count, skipped);
+  };
+
+  // split over two transactions: the range accumulates
+  for (int j = 0; j < 2; j++) {
+    KeyValueDB::Transaction t = db->get_transaction();
+    for (int i = j * 100; i < j * 100 + 60; i++) {
+      t->rmkey("prefix", hot + stringify(i));
+    }
+    db->submit_transaction_sync(t);
+    if (j == 0) {
+      // below the trigger: the tombstones are still there
+      auto [count, skipped] = skipped_in_hot();
+      ASSERT_EQ(500 - 60, count);
+      ASSERT_GE(skipped, 60u);
+    }
+  }
+  for (int i = 0; i < 100 && logger->get(l_rocksdb_tombstone_compact) == 0; i++) {
+    usleep(100000);
+  }
+  ASSERT_EQ(1u, logger->get(l_rocksdb_tombstone_compact));
+  // the compaction dropped the hot range's tombstones
+  {
+    auto [count, skipped] = skipped_in_hot();
+    ASSERT_EQ(500 - 120, count);
+    ASSERT_EQ(0u, skipped);
+  }
+  // only the cold range is left waiting
+  ASSERT_EQ(1u, logger->get(l_rocksdb_tombstone_ranges));
+
+  int count = 0;
+  auto it = db->get_iterator("prefix");
+  for (it->seek_to_first(); it->valid(); it->next()) {
+    ++count;
+  }
+  ASSERT_EQ(1000 - 50 - 120, count);
+
+  fini();
+  g_conf().rm_val("rocksdb_tombstone_compact");
+  g_conf().rm_val("rocksdb_tombstone_compact_trigger");
+  g_conf().rm_val("rocksdb_tombstone_compact_interval");
+  g_conf().apply_changes(nullptr);
+}
+
 TEST_P(KVTest, ShardingRMRange) {
   if(string(GetParam()) != "rocksdb")
     return;
@@ -640,6 +927,31 @@ TEST_P(KVTest, RocksDB_parse_sharding_def) {
   ASSERT_EQ(sharding_def[2].shard_cnt, 1);
 
 
+  text_def = "p(4,0-8.5) O(3,1-9.12)";
+  result = RocksDBStore::parse_sharding_def(text_def,
+					    sharding_def,
+					    &error_position,
+					    &error_msg);
+  ASSERT_EQ(result, true);
+  ASSERT_EQ(sharding_def.size(), 2);
+  ASSERT_EQ(sharding_def[0].hash_l, 0);
+  ASSERT_EQ(sharding_def[0].hash_h, 8);
+  ASSERT_EQ(sharding_def[0].hash_bits, 5);
+  ASSERT_EQ(sharding_def[1].hash_l, 1);
+  ASSERT_EQ(sharding_def[1].hash_h, 9);
+  ASSERT_EQ(sharding_def[1].hash_bits, 12);
+
+  text_def = "p(4,0-.5)";
+  result = RocksDBStore::parse_sharding_def(text_def,
+					    sharding_def,
+					    &error_position,
+					    &error_msg);
+  std::cout << text_def << std::endl;
+  if (error_position)
+    std::cout << std::string(error_position - text_def.begin(), ' ') << "^" << error_msg << std::endl;
+  ASSERT_EQ(result, false);
+  ASSERT_NE(error_position, nullptr);
+
   text_def = "A(10 B(6)=option C";
   result = RocksDBStore::parse_sharding_def(text_def,
 					    sharding_def,
@@ -1144,6 +1456,61 @@ TEST_F(RocksDBResharding, basic) {
   db->close();
 }
 
+static void encode_be(uint64_t v, int bytes, string *out)
+{
+  for (int i = bytes - 1; i >= 0; i--) {
+    out->push_back((char)(v >> (i * 8)));
+  }
+}
+
+TEST_F(RocksDBResharding, pg_aligned) {
+  // keys that start like per-pg omap keys: pool, bit-reversed hash, id
+  prefixes = {"p"};
+  data.clear();
+  for (uint64_t pool = 1; pool <= 3; pool++) {
+    for (uint32_t i = 0; i < 200; i++) {
+      string key;
+      encode_be(pool, 8, &key);
+      encode_be(i * 0x9e3779b9u, 4, &key);
+      encode_be(i, 8, &key);
+      key += ".omap";
+      data[RocksDBStore::combine_strings("p", key)] = stringify(i);
+    }
+  }
+  ASSERT_EQ(0, db->create_and_open(cout, ""));
+  data_to_db();
+  check_db();
+  db->close();
+  ASSERT_EQ(db->reshard("p(4,0-8.3)"), 0);
+  ASSERT_EQ(db->open(cout), 0);
+  check_db();
+  {
+    // one PG (of 8) of pool 2
+    string lower, upper;
+    encode_be(2, 8, &lower);
+    encode_be(0x20000000, 4, &lower);
+    encode_be(2, 8, &upper);
+    encode_be(0x40000000, 4, &upper);
+    int count = 0;
+    auto it = db->get_iterator("p", 0, KeyValueDB::IteratorBounds{lower, upper});
+    for (it->lower_bound(lower); it->valid() && it->key() < upper; it->next()) {
+      ++count;
+    }
+    int expected = 0;
+    for (auto& d : data) {
+      string prefix, key;
+      RocksDBStore::split_key(d.first, &prefix, &key);
+      expected += key >= lower && key < upper;
+    }
+    ASSERT_EQ(expected, count);
+  }
+  db->close();
+  ASSERT_EQ(db->reshard("p(3)"), 0);
+  ASSERT_EQ(db->open(cout), 0);
+  check_db();
+  db->close();
+}
+
 TEST_F(RocksDBResharding, all_to_shards) {
   ASSERT_EQ(0, db->create_and_open(cout, ""));
   generate_data();
@@ -0,0 +1,237 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "gtest/gtest.h"
+#include "common/perf_counters.h"
+#include "osd/ScrubReader.h"
+#include "osd/osd_perf_counters.h"
+#include "osd/osd_types.h"
+#include "../objectstore/store_test_fixture.h"
+
+using namespace std::chrono_literals;
+
+// counts on_ready calls and lets the test wait for them
+struct ReadyCounter {
+  std::mutex lock;
+  std::condition_variable cond;
+  unsigned calls = 0;
+
+  std::function<void()> callback() {
+    return [this] {
+      std::lock_guard l(lock);
+      ++calls;
+      cond.notify_all();
+    };
+  }
+  unsigned get() {
+    std::lock_guard l(lock);
+    return calls;
+  }
+  bool wait_for(unsigned n) {
+    std::unique_lock l(lock);
+    return cond.wait_for(l, 60s, [this, n] { return calls >= n; });
+  }
+};
+
+class ScrubReaderTest : public StoreTestFixture {
+public:
+  static constexpr uint64_t STRIDE = 65536;
+
+  coll_t cid;
+  PerfCounters *logger = nullptr;
+  std::unique_ptr<ScrubReadQueue> queue;
+
+  ScrubReaderTest() : StoreTestFixture("memstore") {}
+
+  void SetUp() override {
+    ASSERT_NO_FATAL_FAILURE(StoreTestFixture::SetUp());
+    cid = coll_t(spg_t(pg_t(0, 1)));
+    ch = store->create_new_collection(cid);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    ASSERT_EQ(0, store->queue_transaction(ch, std::move(t)));
+    logger = build_osd_logger(g_ceph_context);
+    queue = std::make_unique<ScrubReadQueue>(g_ceph_context);
+    queue->start(logger);
+  }
+
+  void TearDown() override {
+    if (queue) {
+      queue->stop();
+      queue.reset();
+    }
+    delete logger;
+    logger = nullptr;
+    ch.reset();
+    StoreTestFixture::TearDown();
+  }
+
+  ghobject_t make_object(const std::string& name, uint64_t size) {
+    ghobject_t oid(hobject_t(name, "", CEPH_NOSNAP, 0, 0, ""));
+    bufferlist bl;
+    for (uint64_t i = 0; i < size; ++i) {
+      bl.append((char)(i * 31 + name.size()));
+    }
+    ObjectStore::Transaction t;
+    t.touch(cid, oid);
+    t.write(cid, oid, 0, bl.length(), bl);
+    EXPECT_EQ(0, store->queue_transaction(ch, std::move(t)));
+    return oid;
+  }
+
+  // what be_deep_scrub() computes when it reads the object itself
+  ScrubReader::result_t read_sync(const ghobject_t& oid, uint64_t align) {
+    ScrubReader::result_t res;
+    bufferhash h(-1);
+    uint64_t pos = 0;
+    while (true) {
+      bufferlist bl;
+      int r = store->read(ch, oid, pos, STRIDE, bl, 0);
+      if (r < 0) {
+	res.r = r;
+	return res;
+      }
+      if (align && bl.length() % align) {
+	res.misaligned = true;
+	return res;
+      }
+      h << bl;
+      pos += r;
+      if ((uint64_t)r < STRIDE) {
+	break;
+      }
+    }
+    res.size = pos;
+    res.digest = h.digest();
+    return res;
+  }
+
+  // the way the backends use the reader: try, and on a miss (-EAGAIN)
+  // wait to be requeued by on_ready
+  void get(ScrubReader& reader, ReadyCounter& ready, unsigned *misses,
+	   size_t i, ScrubReader::result_t *res) {
+    if (reader.get(i, res)) {
+      return;
+    }
+    ++*misses;
+    ASSERT_TRUE(ready.wait_for(*misses));
+    ASSERT_TRUE(reader.get(i, res));
+  }
+
+  void check_against_sync(uint64_t align, const std::vector<uint64_t>& sizes,
+			  unsigned depth) {
+    std::vector<ghobject_t> objects;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+      objects.push_back(make_object("obj" + std::to_string(i), sizes[i]));
+    }
+    objects.push_back(ghobject_t(hobject_t("missing", "", CEPH_NOSNAP, 0, 0,
+					   "")));
+    std::vector<ghobject_t> to_read = objects;
+    ReadyCounter ready;
+    unsigned misses = 0;
+    ScrubReader reader(queue.get(), store.get(), ch, std::move(to_read),
+		       STRIDE, align, 0, depth, ready.callback());
+    for (size_t i = 0; i < objects.size(); ++i) {
+      ScrubReader::result_t res;
+      ASSERT_NO_FATAL_FAILURE(get(reader, ready, &misses, i, &res));
+      auto expected = read_sync(objects[i], align);
+      EXPECT_EQ(expected.r, res.r) << objects[i];
+      EXPECT_EQ(expected.misaligned, res.misaligned) << objects[i];
+      EXPECT_EQ(expected.size, res.size) << objects[i];
+      EXPECT_EQ(expected.digest, res.digest) << objects[i];
+    }
+    // once for every miss, never more
+    std::this_thread::sleep_for(100ms);
+    EXPECT_EQ(misses, ready.get());
+  }
+};
+
+TEST_F(ScrubReaderTest, MatchesSyncRead) {
+  ASSERT_NO_FATAL_FAILURE(check_against_sync(
+    0, {0, 1, 4095, STRIDE - 1, STRIDE, STRIDE + 1, 3 * STRIDE + 17,
+	1048576}, 3));
+}
+
+TEST_F(ScrubReaderTest, MatchesSyncReadEC) {
+  // EC shards are read in chunk size multiples; a short chunk is an error
+  ASSERT_NO_FATAL_FAILURE(check_against_sync(
+    4096, {0, 4096, STRIDE, 3 * STRIDE, 2 * 4096 + 100, 3 * STRIDE + 4096},
+    2));
+}
+
+TEST_F(ScrubReaderTest, SkipsEmptyEntries) {
+  ghobject_t a = make_object("a", 100);
+  ReadyCounter ready;
+  unsigned misses = 0;
+  ScrubReader reader(queue.get(), store.get(), ch,
+		     {ghobject_t(), a, ghobject_t()}, STRIDE, 0, 0, 1,
+		     ready.callback());
+  ScrubReader::result_t res;
+  ASSERT_TRUE(reader.get(0, &res));
+  EXPECT_EQ(0u, res.size);
+  ASSERT_NO_FATAL_FAILURE(get(reader, ready, &misses, 1, &res));
+  EXPECT_EQ(100u, res.size);
+  ASSERT_TRUE(reader.get(2, &res));
+}
+
+TEST_F(ScrubReaderTest, Throttle) {
+  std::vector<ghobject_t> objects;
+  for (unsigned i = 0; i < 8; ++i) {
+    objects.push_back(make_object("obj" + std::to_string(i), 4 * STRIDE));
+  }
+  // 2MB at 1MB/s
+  queue->set_limit(1048576);
+  auto start = ceph::mono_clock::now();
+  ReadyCounter ready;
+  unsigned misses = 0;
+  ScrubReader reader(queue.get(), store.get(), ch, std::move(objects),
+		     STRIDE, 0, 0, 4, ready.callback());
+  for (size_t i = 0; i < 8; ++i) {
+    ScrubReader::result_t res;
+    ASSERT_NO_FATAL_FAILURE(get(reader, ready, &misses, i, &res));
+    EXPECT_EQ(4 * STRIDE, res.size);
+  }
+  auto elapsed = ceph::mono_clock::now() - start;
+  EXPECT_GE(elapsed, 1s);
+  EXPECT_GT(logger->get(l_osd_scrub_read_throttled), 0u);
+  EXPECT_GE(logger->get(l_osd_scrub_read_bytes), 8 * 4 * STRIDE);
+  queue->set_limit(0);
+}
+
+TEST_F(ScrubReaderTest, CancelOnReset) {
+  std::vector<ghobject_t> objects;
+  for (unsigned i = 0; i < 4; ++i) {
+    objects.push_back(make_object("obj" + std::to_string(i), 2 * STRIDE));
+  }
+  // hold every read in the token bucket
+  queue->set_limit(1);
+  ReadyCounter ready;
+  // tells us when the reader's state, and with it every read, is gone
+  auto alive = std::make_shared<int>(0);
+  std::weak_ptr<int> alive_ref = alive;
+  auto on_ready = [cb = ready.callback(), alive = std::move(alive)] {
+    cb();
+  };
+  ScrubMapBuilder pos;
+  pos.reader = std::make_shared<ScrubReader>(
+    queue.get(), store.get(), ch, std::move(objects), STRIDE, 0, 0, 2,
+    std::move(on_ready));
+  ScrubReader::result_t res;
+  ASSERT_FALSE(pos.reader->get(0, &res));
+  pos.reset();
+  ASSERT_FALSE(pos.reader);
+
+  // let the held reads go; they find the reader gone
+  queue->set_limit(0);
+  auto until = ceph::mono_clock::now() + 60s;
+  while (!alive_ref.expired() && ceph::mono_clock::now() < until) {
+    std::this_thread::sleep_for(10ms);
+  }
+  ASSERT_TRUE(alive_ref.expired());
+  EXPECT_EQ(0u, ready.get());
+  EXPECT_EQ(0u, logger->get(l_osd_scrub_read_bytes));
+}
@@ -278,3 +278,122 @@ TEST(extentcache, write_write_overlap2)
 
   c.release_write_pin(pin3);
 }
+
+TEST(extentcache, retain)
+{
+  hobject_t oid;
+
+  ExtentCache c;
+  ExtentCache::write_pin pin;
+  c.open_write_pin(pin);
+
+  // write 1, nothing cached yet
+  auto to_write = iset_from_vector({{0, 10}, {20, 10}});
+  auto must_read = c.reserve_extents_for_rmw(
+    oid, pin, to_write, iset_from_vector({{20, 2}}));
+  ASSERT_EQ(must_read, iset_from_vector({{20, 2}}));
+  c.present_rmw_update(oid, pin, imap_from_iset(to_write));
+  c.release_write_pin(pin, 100);
+  ASSERT_EQ(c.get_retained_bytes(), 20u);
+
+  c.print(std::cerr);
+
+  // write 2 finds both stripes it reads in the cache
+  ExtentCache::write_pin pin2;
+  c.open_write_pin(pin2);
+  auto to_read2 = iset_from_vector({{4, 6}, {20, 4}});
+  auto to_write2 = iset_from_vector({{4, 6}, {20, 10}});
+  auto must_read2 = c.reserve_extents_for_rmw(
+    oid, pin2, to_write2, to_read2);
+  ASSERT_TRUE(must_read2.empty());
+  ASSERT_EQ(c.get_retained_bytes(), 4u);
+  auto pending2 = c.get_remaining_extents_for_rmw(
+    oid, pin2, to_read2);
+  ASSERT_EQ(pending2, imap_from_iset(to_read2));
+  c.present_rmw_update(oid, pin2, imap_from_iset(to_write2));
+
+  // only the newest 10 bytes stay
+  c.release_write_pin(pin2, 10);
+  ASSERT_EQ(c.get_retained_bytes(), 10u);
+
+  c.print(std::cerr);
+
+  ExtentCache::write_pin pin3;
+  c.open_write_pin(pin3);
+  auto to_read3 = iset_from_vector({{0, 10}, {20, 10}});
+  auto must_read3 = c.reserve_extents_for_rmw(
+    oid, pin3, to_read3, to_read3);
+  ASSERT_EQ(must_read3, iset_from_vector({{0, 10}}));
+  c.release_write_pin(pin3);
+  ASSERT_EQ(c.get_retained_bytes(), 0u);
+}
+
+TEST(extentcache, drop_retained)
+{
+  hobject_t oid, oid2;
+  oid2.pool = 1;
+
+  ExtentCache c;
+  ExtentCache::write_pin pin;
+  c.open_write_pin(pin);
+  auto to_write = iset_from_vector({{0, 10}});
+  c.reserve_extents_for_rmw(oid, pin, to_write, extent_set());
+  c.reserve_extents_for_rmw(oid2, pin, to_write, extent_set());
+  c.present_rmw_update(oid, pin, imap_from_iset(to_write));
+  c.present_rmw_update(oid2, pin, imap_from_iset(to_write));
+  c.release_write_pin(pin, 100);
+  ASSERT_EQ(c.get_retained_bytes(), 20u);
+
+  c.drop_retained(oid);
+  ASSERT_EQ(c.get_retained_bytes(), 10u);
+
+  ExtentCache::write_pin pin2;
+  c.open_write_pin(pin2);
+  ASSERT_EQ(
+    c.reserve_extents_for_rmw(oid, pin2, to_write, to_write),
+    to_write);
+  ASSERT_TRUE(
+    c.reserve_extents_for_rmw(oid2, pin2, to_write, to_write).empty());
+  c.release_write_pin(pin2);
+
+  c.drop_retained();
+  ASSERT_EQ(c.get_retained_bytes(), 0u);
+}
+
+TEST(extentcache, all_retained)
+{
+  hobject_t oid;
+  auto to_write = iset_from_vector({{0, 10}});
+  auto retain = [&](ExtentCache &c, uint64_t max) {
+    ExtentCache::write_pin pin;
+    c.open_write_pin(pin);
+    c.reserve_extents_for_rmw(oid, pin, to_write, extent_set());
+    c.present_rmw_update(oid, pin, imap_from_iset(to_write));
+    c.release_write_pin(pin, max);
+  };
+
+  unsigned caches = ExtentCache::get_num_caches();
+  uint64_t bytes = ExtentCache::get_all_retained_bytes();
+  {
+    ExtentCache c, c2;
+    ASSERT_EQ(ExtentCache::get_num_caches(), caches + 2);
+    retain(c, 100);
+    retain(c2, 100);
+    ASSERT_EQ(ExtentCache::get_all_retained_bytes(), bytes + 20);
+
+    // in-flight writes are not counted, only what is kept afterwards
+    ExtentCache::write_pin pin;
+    c.open_write_pin(pin);
+    c.reserve_extents_for_rmw(oid, pin, to_write, to_write);
+    ASSERT_EQ(ExtentCache::get_all_retained_bytes(), bytes + 10);
+    c.release_write_pin(pin, 0);
+    ASSERT_EQ(ExtentCache::get_all_retained_bytes(), bytes + 10);
+
+    c2.drop_retained();
+    ASSERT_EQ(ExtentCache::get_all_retained_bytes(), bytes);
+    retain(c2, 100);
+  }
+  // destroying a cache gives back what it kept
+  ASSERT_EQ(ExtentCache::get_num_caches(), caches);
+  ASSERT_EQ(ExtentCache::get_all_retained_bytes(), bytes);
+}
@@ -1326,6 +1326,32 @@ TEST(pg_missing_t, split_into)
   EXPECT_TRUE(missing.is_missing(oid2));
 }
 
+TEST(pg_history_t, merge_deep_scrub_verified)
+{
+  pg_history_t h;
+  h.last_deep_scrub_stamp = utime_t(10, 0);
+  h.deep_scrub_verified = eversion_t(5, 100);
+  h.deep_scrub_verified_interval = 5;
+  h.last_full_deep_scrub_stamp = utime_t(10, 0);
+
+  // an older deep scrub does not override ours
+  pg_history_t older = h;
+  older.last_deep_scrub_stamp = utime_t(5, 0);
+  older.deep_scrub_verified = eversion_t(5, 200);
+  EXPECT_FALSE(h.merge(older));
+  EXPECT_EQ(eversion_t(5, 100), h.deep_scrub_verified);
+
+  // a newer one that found errors resets it, even to a lower version
+  pg_history_t newer = h;
+  newer.last_deep_scrub_stamp = utime_t(20, 0);
+  newer.deep_scrub_verified = eversion_t();
+  newer.deep_scrub_verified_interval = 0;
+  EXPECT_TRUE(h.merge(newer));
+  EXPECT_EQ(eversion_t(), h.deep_scrub_verified);
+  EXPECT_EQ(0u, h.deep_scrub_verified_interval);
+  EXPECT_EQ(utime_t(10, 0), h.last_full_deep_scrub_stamp);
+}
+
 TEST(pg_pool_t_test, get_pg_num_divisor) {
   pg_pool_t p;
   p.set_pg_num(16);